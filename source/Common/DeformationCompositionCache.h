@@ -0,0 +1,254 @@
+#pragma once
+
+#include "itkImage.h"
+#include "Log.h"
+#include "ImageUtils.h"
+#include "TransformationUtils.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include <list>
+#include <map>
+#include <string>
+
+using namespace std;
+
+///cache for indirect deformations in multi-image propagation.
+///holds four kinds of entries under one memory budget, evicted least-recently-used first:
+/// - decoded deformation fields, keyed by filename
+/// - deformations resampled to the resolution of their target image, keyed by source>target
+/// - composed deformations, keyed by path source>intermediate>target
+/// - sampling plans, keyed by intermediate>target
+///composing intermediate->target with source->intermediate samples the source->intermediate field at x+u_{IT}(x).
+///those sample positions (as continuous indices into the intermediate grid) only depend on the intermediate->target field,
+///so they are computed once and reused for every source which is propagated over the same intermediate image.
+///all entries are only valid while the underlying deformations do not change, call clear() when they are updated (e.g. after each hop).
+///read(), resample() and compose() return the cached field itself, without copying. like the entries of the in-memory deformation cache of the propagation tools,
+///the result is shared and must be treated as read-only; callers which need to modify it have to duplicate it first.
+template<class ImageType, class CDisplacementPrecision=float>
+class DeformationCompositionCache{
+public:
+    static const unsigned int D=ImageType::ImageDimension;
+    typedef TransfUtils<ImageType,CDisplacementPrecision> TransfUtilsType;
+    typedef typename ImageType::Pointer ImagePointerType;
+    typedef typename TransfUtilsType::DisplacementType DisplacementType;
+    typedef typename TransfUtilsType::DeformationFieldType DeformationFieldType;
+    typedef typename DeformationFieldType::Pointer DeformationFieldPointerType;
+    typedef typename DeformationFieldType::IndexType IndexType;
+    typedef typename DeformationFieldType::PointType PointType;
+    typedef typename DeformationFieldType::SizeType SizeType;
+    typedef itk::Vector<float,D> SamplePositionType;
+    typedef itk::Image<SamplePositionType,D> SamplingPlanType;
+    typedef typename SamplingPlanType::Pointer SamplingPlanPointerType;
+    typedef itk::ContinuousIndex<double,D> ContinuousIndexType;
+
+private:
+    struct CacheEntry{
+        DeformationFieldPointerType field;
+        SamplingPlanPointerType plan;
+        ///geometry of the grids the plan was computed for: the grid it samples from (leftField) and the grid it is defined on (rightField)
+        DeformationFieldPointerType planLeftReference,planRightReference;
+        double bytes;
+        typename std::list<string>::iterator lruPosition;
+    };
+    std::map<string,CacheEntry> m_entries;
+    std::list<string> m_lru;
+    double m_budget;
+    double m_usedBytes;
+    int m_hits,m_misses;
+
+public:
+    DeformationCompositionCache(double budgetMB=2048.0){
+        m_budget=budgetMB*1024*1024;
+        m_usedBytes=0;
+        m_hits=0;m_misses=0;
+    }
+    void setMemoryBudget(double budgetMB){
+        m_budget=budgetMB*1024*1024;
+        evict();
+    }
+    void clear(){
+        m_entries.clear();
+        m_lru.clear();
+        m_usedBytes=0;
+    }
+    void printStatistics(){
+        LOGV(1)<<"Composition cache: "<<VAR(m_hits)<<" "<<VAR(m_misses)<<" "<<VAR(m_entries.size())<<" MB used: "<<m_usedBytes/(1024*1024)<<endl;
+    }
+
+    ///read a deformation field, decoding it only if it is not cached
+    DeformationFieldPointerType read(string filename){
+        string key="F:"+filename;
+        CacheEntry * entry=find(key);
+        if (entry){
+            ++m_hits;
+            return entry->field;
+        }
+        ++m_misses;
+        DeformationFieldPointerType def=ImageUtils<DeformationFieldType>::readImage(filename);
+        CacheEntry & newEntry=insert(key,fieldBytes(def));
+        newEntry.field=def;
+        evict();
+        return def;
+    }
+
+    ///deformation from sourceID to targetID, linearly resampled to the grid of reference. resampled once per pair and reused for all paths over it
+    DeformationFieldPointerType resample(string sourceID, string targetID, DeformationFieldPointerType def, ImagePointerType reference){
+        string key="R:"+sourceID+">"+targetID;
+        CacheEntry * entry=find(key);
+        if (entry){
+            ++m_hits;
+            return entry->field;
+        }
+        ++m_misses;
+        DeformationFieldPointerType result=TransfUtilsType::linearInterpolateDeformationField(def,reference);
+        CacheEntry & newEntry=insert(key,fieldBytes(result));
+        newEntry.field=result;
+        evict();
+        return result;
+    }
+
+    ///returns rightField o leftField, i.e. the deformation from source over intermediate to target
+    ///rightField: intermediate->target, leftField: source->intermediate
+    DeformationFieldPointerType compose(string sourceID, string intermediateID, string targetID, DeformationFieldPointerType rightField, DeformationFieldPointerType leftField){
+        string key="C:"+sourceID+">"+intermediateID+">"+targetID;
+        CacheEntry * entry=find(key);
+        if (entry){
+            ++m_hits;
+            return entry->field;
+        }
+        ++m_misses;
+        SamplingPlanPointerType plan=getSamplingPlan(intermediateID,targetID,rightField,leftField);
+        DeformationFieldPointerType result;
+        if (plan.IsNull()){
+            LOGV(3)<<"Geometry of "<<sourceID<<"->"<<intermediateID<<"->"<<targetID<<" does not match the cached sampling plan, composing directly"<<endl;
+            result=TransfUtilsType::composeDeformations(rightField,leftField);
+        }else{
+            result=applySamplingPlan(plan,rightField,leftField);
+        }
+        CacheEntry & newEntry=insert(key,fieldBytes(result));
+        newEntry.field=result;
+        evict();
+        return result;
+    }
+
+private:
+    CacheEntry * find(string key){
+        typename std::map<string,CacheEntry>::iterator it=m_entries.find(key);
+        if (it==m_entries.end())
+            return NULL;
+        //move to front of LRU list
+        m_lru.erase(it->second.lruPosition);
+        m_lru.push_front(key);
+        it->second.lruPosition=m_lru.begin();
+        return &(it->second);
+    }
+    CacheEntry & insert(string key, double bytes){
+        m_lru.push_front(key);
+        CacheEntry & entry=m_entries[key];
+        entry.bytes=bytes;
+        entry.lruPosition=m_lru.begin();
+        m_usedBytes+=bytes;
+        return entry;
+    }
+    ///evict least recently used entries until the budget is met. the most recent entry is always kept.
+    void evict(){
+        while (m_usedBytes>m_budget && m_lru.size()>1){
+            string key=m_lru.back();
+            m_lru.pop_back();
+            m_usedBytes-=m_entries[key].bytes;
+            m_entries.erase(key);
+        }
+    }
+    static double fieldBytes(DeformationFieldPointerType def){
+        return 1.0*def->GetLargestPossibleRegion().GetNumberOfPixels()*sizeof(DisplacementType);
+    }
+    static bool sameGeometry(DeformationFieldPointerType a, DeformationFieldPointerType b){
+        return a->GetLargestPossibleRegion()==b->GetLargestPossibleRegion()
+            && a->GetOrigin()==b->GetOrigin()
+            && a->GetSpacing()==b->GetSpacing()
+            && a->GetDirection()==b->GetDirection();
+    }
+
+    ///continuous indices into the grid of leftField for every voxel x of rightField at x+rightField(x), clamped to the grid (nearest neighbor extrapolation)
+    ///a cached plan is only reused if both fields have the geometry it was computed for, otherwise NULL is returned.
+    ///the same intermediate>target pair may be composed with the raw or with a resampled field, and a plan for a different grid would index out of bounds.
+    SamplingPlanPointerType getSamplingPlan(string intermediateID, string targetID, DeformationFieldPointerType rightField, DeformationFieldPointerType leftField){
+        string key="P:"+intermediateID+">"+targetID;
+        CacheEntry * entry=find(key);
+        if (entry){
+            if (!sameGeometry(entry->planLeftReference,leftField) || !sameGeometry(entry->planRightReference,rightField))
+                return NULL;
+            return entry->plan;
+        }
+        SamplingPlanPointerType plan=SamplingPlanType::New();
+        plan->SetRegions(rightField->GetLargestPossibleRegion());
+        plan->Allocate();
+        SizeType leftSize=leftField->GetLargestPossibleRegion().GetSize();
+        itk::ImageRegionConstIteratorWithIndex<DeformationFieldType> rightIt(rightField,rightField->GetLargestPossibleRegion());
+        itk::ImageRegionIterator<SamplingPlanType> planIt(plan,plan->GetLargestPossibleRegion());
+        for (rightIt.GoToBegin(),planIt.GoToBegin();!rightIt.IsAtEnd();++rightIt,++planIt){
+            PointType p;
+            rightField->TransformIndexToPhysicalPoint(rightIt.GetIndex(),p);
+            p+=rightIt.Get();
+            ContinuousIndexType idx;
+            leftField->TransformPhysicalPointToContinuousIndex(p,idx);
+            SamplePositionType pos;
+            for (unsigned int d=0;d<D;++d){
+                pos[d]=max(0.0,min(1.0*(leftSize[d]-1),idx[d]));
+            }
+            planIt.Set(pos);
+        }
+        DeformationFieldPointerType leftReference=DeformationFieldType::New();
+        leftReference->CopyInformation(leftField);
+        DeformationFieldPointerType rightReference=DeformationFieldType::New();
+        rightReference->CopyInformation(rightField);
+        CacheEntry & newEntry=insert(key,1.0*plan->GetLargestPossibleRegion().GetNumberOfPixels()*sizeof(SamplePositionType));
+        newEntry.plan=plan;
+        newEntry.planLeftReference=leftReference;
+        newEntry.planRightReference=rightReference;
+        return plan;
+    }
+
+    ///multilinear interpolation of leftField at the planned positions, added to rightField
+    DeformationFieldPointerType applySamplingPlan(SamplingPlanPointerType plan, DeformationFieldPointerType rightField, DeformationFieldPointerType leftField){
+        DeformationFieldPointerType result=ImageUtils<DeformationFieldType>::createEmpty((typename DeformationFieldType::ConstPointer)rightField);
+        SizeType leftSize=leftField->GetLargestPossibleRegion().GetSize();
+        const DisplacementType * leftBuffer=leftField->GetBufferPointer();
+        const DisplacementType * rightBuffer=rightField->GetBufferPointer();
+        const SamplePositionType * planBuffer=plan->GetBufferPointer();
+        DisplacementType * resultBuffer=result->GetBufferPointer();
+        long int strides[D];
+        strides[0]=1;
+        for (unsigned int d=1;d<D;++d) strides[d]=strides[d-1]*leftSize[d-1];
+        long int nPixels=result->GetLargestPossibleRegion().GetNumberOfPixels();
+        for (long int i=0;i<nPixels;++i){
+            const SamplePositionType & pos=planBuffer[i];
+            long int base=0;
+            long int steps[D];
+            double fractions[D];
+            for (unsigned int d=0;d<D;++d){
+                int lower=int(pos[d]);
+                fractions[d]=pos[d]-lower;
+                steps[d]=(lower+1<(int)leftSize[d])?strides[d]:0;
+                base+=lower*strides[d];
+            }
+            DisplacementType value;
+            value.Fill(0.0);
+            for (unsigned int corner=0;corner<(1u<<D);++corner){
+                double weight=1.0;
+                long int offset=base;
+                for (unsigned int d=0;d<D;++d){
+                    if (corner & (1u<<d)){
+                        weight*=fractions[d];
+                        offset+=steps[d];
+                    }else{
+                        weight*=1.0-fractions[d];
+                    }
+                }
+                if (weight>0.0)
+                    value+=leftBuffer[offset]*weight;
+            }
+            resultBuffer[i]=value+rightBuffer[i];
+        }
+        return result;
+    }
+};
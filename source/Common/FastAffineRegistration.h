@@ -0,0 +1,356 @@
+#pragma once
+
+#include "itkImage.h"
+#include "Log.h"
+#include "ImageUtils.h"
+#include "TransformationUtils.h"
+#include "ImagePyramid.h"
+#include "itkCenteredTransformInitializer.h"
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+
+///normalized cross correlation between a set of target samples and a linearly interpolated atlas, mapped by
+///y = A(x-c)+c+t, and its analytic gradient with respect to the D*D matrix entries (row major) and the D translations.
+///the sums over the samples are accumulated per thread (OpenMP, if enabled) and merged once per evaluation.
+///plain buffers only, so the same code runs on every pyramid level without touching ITK iterators.
+template<class PixelType, int D>
+class AffineNCCMetric{
+public:
+    static const int nParameters=D*D+D;
+private:
+    const PixelType * m_buffer;
+    long int m_size[D],m_strides[D];
+    double m_origin[D];
+    ///physical point to continuous index: idx=M(p-origin)
+    double m_M[D][D];
+    ///target samples: physical points [sample][D] and intensities
+    std::vector<double> m_points,m_values;
+    double m_center[D];
+    int m_validSamples;
+
+public:
+    void setAtlas(const PixelType * buffer, const long int * size, const double * origin, const double * physicalToIndex){
+        m_buffer=buffer;
+        for (int d=0;d<D;++d){
+            m_size[d]=size[d];
+            m_strides[d]=(d==0)?1:m_strides[d-1]*m_size[d-1];
+            m_origin[d]=origin[d];
+            for (int e=0;e<D;++e)
+                m_M[d][e]=physicalToIndex[d*D+e];
+        }
+    }
+    void setSamples(const std::vector<double> & points, const std::vector<double> & values){
+        m_points=points;
+        m_values=values;
+    }
+    void setCenter(const double * center){
+        for (int d=0;d<D;++d) m_center[d]=center[d];
+    }
+    int nSamples() const {return m_values.size();}
+    ///number of samples which mapped inside the atlas in the last evaluation
+    int validSamples() const {return m_validSamples;}
+
+    ///linear interpolation of the atlas at physical point p, with the gradient in physical coordinates.
+    ///returns false if p maps outside the atlas.
+    bool interpolate(const double * p, double & value, double * gradient) const {
+        double cidx[D],frac[D];
+        long int base[D];
+        for (int d=0;d<D;++d){
+            cidx[d]=0;
+            for (int e=0;e<D;++e)
+                cidx[d]+=m_M[d][e]*(p[e]-m_origin[e]);
+            if (!(cidx[d]>=0 && cidx[d]<=m_size[d]-1))
+                return false;
+            base[d]=std::min((long int)cidx[d],std::max(0L,m_size[d]-2));
+            frac[d]=cidx[d]-base[d];
+        }
+        double indexGradient[D];
+        value=0;
+        for (int d=0;d<D;++d) indexGradient[d]=0;
+        long int offset=0;
+        for (int d=0;d<D;++d) offset+=base[d]*m_strides[d];
+        for (int corner=0;corner<(1<<D);++corner){
+            long int cornerOffset=offset;
+            double weight=1.0;
+            bool valid=true;
+            for (int d=0;d<D;++d){
+                int bit=(corner>>d)&1;
+                if (bit && m_size[d]<2) {valid=false;break;}
+                cornerOffset+=bit*m_strides[d];
+                weight*=bit?frac[d]:1.0-frac[d];
+            }
+            if (!valid) continue;
+            double intensity=m_buffer[cornerOffset];
+            value+=weight*intensity;
+            for (int d=0;d<D;++d){
+                if (m_size[d]<2) continue;
+                //derivative of the weight along d
+                double w=1.0;
+                for (int e=0;e<D;++e){
+                    if (e==d) continue;
+                    w*=((corner>>e)&1)?frac[e]:1.0-frac[e];
+                }
+                indexGradient[d]+=(((corner>>d)&1)?w:-w)*intensity;
+            }
+        }
+        for (int e=0;e<D;++e){
+            gradient[e]=0;
+            for (int d=0;d<D;++d)
+                gradient[e]+=m_M[d][e]*indexGradient[d];
+        }
+        return true;
+    }
+
+    ///returns -NCC for the parameters (matrix row major, then translation), gradient may be NULL.
+    ///returns 0 (uncorrelated) if too few samples map into the atlas or either image is constant.
+    double evaluate(const double * parameters, double * gradient){
+        const int nSums=6+3*nParameters;
+        std::vector<double> sums(nSums,0.0);
+        long int nSamples=m_values.size();
+        bool computeGradient=gradient!=NULL;
+#pragma omp parallel
+        {
+            std::vector<double> local(nSums,0.0);
+            double * dSum=&local[6],* xdSum=&local[6+nParameters],* ydSum=&local[6+2*nParameters];
+            double dy[nParameters];
+#pragma omp for
+            for (long int s=0;s<nSamples;++s){
+                const double * x=&m_points[s*D];
+                double mapped[D],centered[D];
+                for (int d=0;d<D;++d)
+                    centered[d]=x[d]-m_center[d];
+                for (int j=0;j<D;++j){
+                    mapped[j]=m_center[j]+parameters[D*D+j];
+                    for (int k=0;k<D;++k)
+                        mapped[j]+=parameters[j*D+k]*centered[k];
+                }
+                double y,g[D];
+                if (!interpolate(mapped,y,g))
+                    continue;
+                double xv=m_values[s];
+                local[0]+=1;
+                local[1]+=xv; local[2]+=y;
+                local[3]+=xv*xv; local[4]+=y*y; local[5]+=xv*y;
+                if (computeGradient){
+                    for (int j=0;j<D;++j){
+                        for (int k=0;k<D;++k)
+                            dy[j*D+k]=g[j]*centered[k];
+                        dy[D*D+j]=g[j];
+                    }
+                    for (int i=0;i<nParameters;++i){
+                        dSum[i]+=dy[i];
+                        xdSum[i]+=xv*dy[i];
+                        ydSum[i]+=y*dy[i];
+                    }
+                }
+            }
+#pragma omp critical
+            {
+                for (int i=0;i<nSums;++i)
+                    sums[i]+=local[i];
+            }
+        }
+        if (computeGradient)
+            for (int i=0;i<nParameters;++i) gradient[i]=0;
+        double n=sums[0];
+        m_validSamples=n;
+        if (n<std::max(10.0,0.1*nSamples))
+            return 0;
+        double mx=sums[1]/n,my=sums[2]/n;
+        double cxx=sums[3]-n*mx*mx,cyy=sums[4]-n*my*my,cxy=sums[5]-n*mx*my;
+        if (cxx<=0 || cyy<=0)
+            return 0;
+        double norm=sqrt(cxx*cyy);
+        double ncc=cxy/norm;
+        if (computeGradient){
+            const double * dSum=&sums[6],* xdSum=&sums[6+nParameters],* ydSum=&sums[6+2*nParameters];
+            for (int i=0;i<nParameters;++i){
+                double dCxy=xdSum[i]-mx*dSum[i];
+                double dCyy=2*(ydSum[i]-my*dSum[i]);
+                gradient[i]=-(dCxy/norm-0.5*ncc*dCyy/cyy);
+            }
+        }
+        return -ncc;
+    }
+};
+
+///multiresolution affine registration of atlas to target, maximizing NCC on random subsets of target voxels.
+///the levels are taken from image pyramids, which are shared with the deformable registration, and optimized
+///coarse to fine with regular step gradient descent. step lengths are measured in physical units:
+///matrix entries are scaled by the radius of the target, so that a unit step moves the target boundary by about one mm.
+///the result maps target points to atlas points, like the bulk transforms read with TransfUtils::readAffine.
+template<class ImageType>
+class FastAffineRegistration{
+public:
+    static const int D=ImageType::ImageDimension;
+    typedef typename ImageType::PixelType PixelType;
+    typedef typename ImageType::ConstPointer ConstImagePointerType;
+    typedef typename ImageType::PointType PointType;
+    typedef typename ImageType::IndexType IndexType;
+    typedef typename TransfUtils<ImageType>::AffineTransformType AffineTransformType;
+    typedef typename TransfUtils<ImageType>::AffineTransformPointerType AffineTransformPointerType;
+    typedef ImagePyramid<ImageType> PyramidType;
+    typedef AffineNCCMetric<PixelType,D> MetricType;
+    static const int nParameters=MetricType::nParameters;
+
+private:
+    PyramidType * m_targetPyramid,* m_atlasPyramid;
+    std::vector<double> m_scales;
+    int m_iterations,m_samples;
+    bool m_initWithMoments;
+    double m_finalMetric;
+
+public:
+    FastAffineRegistration(){
+        m_targetPyramid=NULL;
+        m_atlasPyramid=NULL;
+        m_iterations=100;
+        m_samples=20000;
+        m_initWithMoments=false;
+        m_finalMetric=0;
+    }
+    void setTargetPyramid(PyramidType * pyramid){m_targetPyramid=pyramid;}
+    void setAtlasPyramid(PyramidType * pyramid){m_atlasPyramid=pyramid;}
+    ///scaling factors of the levels, coarse to fine
+    void setScales(const std::vector<double> & scales){m_scales=scales;}
+    void setIterations(int iterations){m_iterations=iterations;}
+    ///number of target voxels sampled per level, 0 to use all voxels
+    void setSamples(int samples){m_samples=samples;}
+    void setInitWithMoments(bool moments){m_initWithMoments=moments;}
+    ///NCC at the end of the finest level
+    double getFinalMetric(){return m_finalMetric;}
+
+    AffineTransformPointerType run(){
+        if (!m_targetPyramid || !m_atlasPyramid || m_scales.size()==0){
+            LOG<<"affine registration needs target and atlas pyramids and at least one level, aborting"<<std::endl;
+            exit(-1);
+        }
+        ConstImagePointerType target=m_targetPyramid->getImage();
+        ConstImagePointerType atlas=m_atlasPyramid->getImage();
+        double parameters[nParameters],center[D];
+        for (int i=0;i<nParameters;++i) parameters[i]=0;
+        for (int d=0;d<D;++d) parameters[d*D+d]=1.0;
+        if (m_initWithMoments){
+            typedef itk::CenteredTransformInitializer<AffineTransformType,ImageType,ImageType> TransformInitializerType;
+            typename TransformInitializerType::Pointer initializer=TransformInitializerType::New();
+            AffineTransformPointerType transform=AffineTransformType::New();
+            initializer->SetTransform(transform);
+            initializer->SetFixedImage(target);
+            initializer->SetMovingImage(atlas);
+            initializer->MomentsOn();
+            initializer->InitializeTransform();
+            for (int d=0;d<D;++d){
+                center[d]=transform->GetCenter()[d];
+                parameters[D*D+d]=transform->GetTranslation()[d];
+            }
+        }else{
+            itk::ContinuousIndex<double,D> centerIndex;
+            for (int d=0;d<D;++d)
+                centerIndex[d]=target->GetLargestPossibleRegion().GetIndex()[d]+0.5*(target->GetLargestPossibleRegion().GetSize()[d]-1);
+            PointType centerPoint;
+            target->TransformContinuousIndexToPhysicalPoint(centerIndex,centerPoint);
+            for (int d=0;d<D;++d) center[d]=centerPoint[d];
+        }
+        double radius=0;
+        for (int d=0;d<D;++d){
+            double extent=target->GetLargestPossibleRegion().GetSize()[d]*target->GetSpacing()[d];
+            radius+=extent*extent;
+        }
+        radius=std::max(1e-6,0.5*sqrt(radius));
+
+        srand(0);
+        for (unsigned int l=0;l<m_scales.size();++l){
+            ConstImagePointerType targetLevel=m_targetPyramid->getLevel(m_scales[l]);
+            ConstImagePointerType atlasLevel=m_atlasPyramid->getLevel(m_scales[l]);
+            MetricType metric;
+            setupMetric(metric,targetLevel,atlasLevel);
+            metric.setCenter(center);
+            double maxSpacing=0;
+            for (int d=0;d<D;++d) maxSpacing=std::max(maxSpacing,atlasLevel->GetSpacing()[d]);
+            int iterations=optimize(metric,parameters,radius,2.0*maxSpacing,0.05*maxSpacing);
+            LOGV(1)<<"affine level "<<l<<" scale "<<m_scales[l]<<" samples "<<metric.nSamples()<<" iterations "<<iterations<<" NCC "<<-m_finalMetric<<std::endl;
+        }
+        m_finalMetric=-m_finalMetric;
+
+        AffineTransformPointerType affine=AffineTransformType::New();
+        typename AffineTransformType::MatrixType matrix;
+        typename AffineTransformType::OutputVectorType translation;
+        PointType centerPoint;
+        for (int j=0;j<D;++j){
+            for (int k=0;k<D;++k)
+                matrix[j][k]=parameters[j*D+k];
+            translation[j]=parameters[D*D+j];
+            centerPoint[j]=center[j];
+        }
+        affine->SetCenter(centerPoint);
+        affine->SetMatrix(matrix);
+        affine->SetTranslation(translation);
+        LOGV(2)<<"affine registration result: "<<affine<<std::endl;
+        return affine;
+    }
+
+private:
+    void setupMetric(MetricType & metric, ConstImagePointerType targetLevel, ConstImagePointerType atlasLevel){
+        long int size[D];
+        double origin[D],physicalToIndex[D*D];
+        //p=origin+Direction*Spacing*idx
+        for (int d=0;d<D;++d){
+            size[d]=atlasLevel->GetLargestPossibleRegion().GetSize()[d];
+            origin[d]=atlasLevel->GetOrigin()[d];
+            for (int e=0;e<D;++e)
+                physicalToIndex[d*D+e]=atlasLevel->GetInverseDirection()[d][e]/atlasLevel->GetSpacing()[d];
+        }
+        metric.setAtlas(atlasLevel->GetBufferPointer(),size,origin,physicalToIndex);
+
+        //random subset of target voxels, drawn with replacement
+        long int nPixels=targetLevel->GetLargestPossibleRegion().GetNumberOfPixels();
+        long int nSamples=(m_samples<=0 || m_samples>=nPixels)?nPixels:m_samples;
+        std::vector<double> points(nSamples*D),values(nSamples);
+        const PixelType * buffer=targetLevel->GetBufferPointer();
+        for (long int s=0;s<nSamples;++s){
+            long int offset=(nSamples==nPixels)?s:(long int)((1.0*rand()/(RAND_MAX+1.0))*nPixels);
+            IndexType idx=targetLevel->ComputeIndex(offset);
+            PointType p;
+            targetLevel->TransformIndexToPhysicalPoint(idx,p);
+            for (int d=0;d<D;++d) points[s*D+d]=p[d];
+            values[s]=buffer[offset];
+        }
+        metric.setSamples(points,values);
+    }
+
+    ///regular step gradient descent on one level, steps are accepted if they decrease the cost, otherwise the step is halved.
+    ///returns the number of metric evaluations.
+    int optimize(MetricType & metric, double * parameters, double radius, double step, double minStep){
+        double gradient[nParameters],candidate[nParameters],candidateGradient[nParameters];
+        double cost=metric.evaluate(parameters,gradient);
+        int iteration=0;
+        for (;iteration<m_iterations && step>minStep;++iteration){
+            //gradient with respect to the scaled parameters (matrix entries times radius)
+            double norm=0;
+            for (int i=0;i<nParameters;++i){
+                double scaled=i<D*D?gradient[i]/radius:gradient[i];
+                norm+=scaled*scaled;
+            }
+            norm=sqrt(norm);
+            if (norm<=0)
+                break;
+            for (int i=0;i<nParameters;++i){
+                double scale=i<D*D?1.0/(radius*radius):1.0;
+                candidate[i]=parameters[i]-step*scale*gradient[i]/norm;
+            }
+            double candidateCost=metric.evaluate(candidate,candidateGradient);
+            LOGV(4)<<VAR(iteration)<<" "<<VAR(step)<<" "<<VAR(cost)<<" "<<VAR(candidateCost)<<std::endl;
+            if (candidateCost<cost){
+                cost=candidateCost;
+                std::copy(candidate,candidate+nParameters,parameters);
+                std::copy(candidateGradient,candidateGradient+nParameters,gradient);
+            }else{
+                step*=0.5;
+            }
+        }
+        m_finalMetric=cost;
+        return iteration;
+    }
+};
@@ -270,6 +270,16 @@ public:
 
 #ifdef ISOTROPIC_RESAMPLING
   
+    ///size and spacing of the image resampled with LinearResample(input,scale,...)
+    static void resamplingGeometry(ConstInputImagePointer input, double scale, typename InputImage::SizeType & size, typename InputImage::SpacingType & spacing){
+        typename InputImage::SizeType inputSize=input->GetLargestPossibleRegion().GetSize();
+        typename InputImage::SpacingType inputSpacing=input->GetSpacing();
+        for (uint d=0;d<InputImage::ImageDimension;++d){
+            size[d]=int(inputSize[d]*scale);
+            spacing[d]=inputSpacing[d]*(1.0*(inputSize[d]-1)/(size[d]-1));
+        }
+    }
+
     static OutputImagePointer LinearResample( ConstInputImagePointer input,  double scale, bool smooth,bool nnResample=false) {
         LinearInterpolatorPointerType interpol=LinearInterpolatorType::New();
         NNInterpolatorPointerType interpolNN=NNInterpolatorType::New();
@@ -280,17 +290,10 @@ public:
         else
             resampler->SetInterpolator(interpol);
         typename InputImage::SpacingType spacing,inputSpacing;
-        typename InputImage::SizeType size,inputSize;
-        typename InputImage::PointType origin,inputOrigin;
-        inputOrigin=input->GetOrigin();
-        inputSize=input->GetLargestPossibleRegion().GetSize();
+        typename InputImage::SizeType size;
         inputSpacing=input->GetSpacing();
-        for (uint d=0;d<InputImage::ImageDimension;++d){
-            size[d]=int(inputSize[d]*scale);
-            spacing[d]=inputSpacing[d]*(1.0*(inputSize[d]-1)/(size[d]-1));
-            origin[d]=inputOrigin[d];//+0.5*spacing[d]/inputSpacing[d];
-        }
-        resampler->SetOutputOrigin(origin);
+        resamplingGeometry(input,scale,size,spacing);
+        resampler->SetOutputOrigin(input->GetOrigin());
 		resampler->SetOutputSpacing ( spacing );
 		resampler->SetOutputDirection ( input->GetDirection() );
 		resampler->SetSize ( size );
@@ -310,23 +313,10 @@ public:
 #else
     //downscale to isotropic spacing defined by minspacing/scale
     //never upsample! unless scale>1.0
-    static OutputImagePointer LinearResample( ConstInputImagePointer input,  double scale, bool smooth, bool nnResample=false) {
-
-        if (scale == 1.0) return cast(ImageUtils<InputImage>::duplicateConst(input));
-        LinearInterpolatorPointerType interpol=LinearInterpolatorType::New();
-        NNInterpolatorPointerType interpolNN=NNInterpolatorType::New();
-        ResampleFilterPointerType resampler=ResampleFilterType::New();
-        LOGV(5)<<VAR(smooth)<<" "<<VAR(nnResample)<<std::endl;
-        if (nnResample)
-            resampler->SetInterpolator(interpolNN);
-        else
-            resampler->SetInterpolator(interpol);
-        typename InputImage::SpacingType spacing,inputSpacing;
-        typename InputImage::SizeType size,inputSize;
-        typename InputImage::PointType origin,inputOrigin;
-        inputOrigin=input->GetOrigin();
-        inputSize=input->GetLargestPossibleRegion().GetSize();
-        inputSpacing=input->GetSpacing();
+    ///size and spacing of the image resampled with LinearResample(input,scale,...)
+    static void resamplingGeometry(ConstInputImagePointer input, double scale, typename InputImage::SizeType & size, typename InputImage::SpacingType & spacing){
+        typename InputImage::SizeType inputSize=input->GetLargestPossibleRegion().GetSize();
+        typename InputImage::SpacingType inputSpacing=input->GetSpacing();
         double minSpacing=std::numeric_limits<double>::max();
         for (uint d=0;d<InputImage::ImageDimension;++d){
             if (inputSpacing[d]<minSpacing) minSpacing=inputSpacing[d];
@@ -346,9 +336,25 @@ public:
             //finalize spacing as a function of the new size
             spacing[d]=inputSpacing[d]*(1.0*(inputSize[d]-1)/(size[d]-1));
             //size[d]=int(inputSpacing[d]/spacing[d]*(inputSize[d]));
-
-            origin[d]=inputOrigin[d];//+0.5*spacing[d]/inputSpacing[d];
         }
+    }
+
+    static OutputImagePointer LinearResample( ConstInputImagePointer input,  double scale, bool smooth, bool nnResample=false) {
+
+        if (scale == 1.0) return cast(ImageUtils<InputImage>::duplicateConst(input));
+        LinearInterpolatorPointerType interpol=LinearInterpolatorType::New();
+        NNInterpolatorPointerType interpolNN=NNInterpolatorType::New();
+        ResampleFilterPointerType resampler=ResampleFilterType::New();
+        LOGV(5)<<VAR(smooth)<<" "<<VAR(nnResample)<<std::endl;
+        if (nnResample)
+            resampler->SetInterpolator(interpolNN);
+        else
+            resampler->SetInterpolator(interpol);
+        typename InputImage::SpacingType spacing,inputSpacing;
+        typename InputImage::SizeType size;
+        typename InputImage::PointType origin=input->GetOrigin();
+        inputSpacing=input->GetSpacing();
+        resamplingGeometry(input,scale,size,spacing);
         LOGV(7)<<"full parameters : "<<spacing<<" "<<size<<" "<<origin<<std::endl;
         LOGV(3)<<"Resampling to isotropic  spacing "<<spacing<<" with resolution "<<size<<std::endl;
         resampler->SetOutputOrigin(origin);
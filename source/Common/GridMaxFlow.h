@@ -0,0 +1,351 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <iostream>
+#include <cstdlib>
+
+///max-flow/min-cut for binary labeling problems on regular D-dimensional grids.
+///
+///drop-in replacement for the BK Graph<captype,captype,flowtype> on image grids (add_tweights, add_edge, maxflow, what_segment),
+///but the neighborhood is implicit: nodes are the linear image indices (first dimension fastest, as in ITK buffers),
+///and each node only stores one residual capacity per neighborhood direction (2*D for face, 3^D-1 for full connectivity).
+///there are no per-node pointers or adjacency lists, a 6-connected 3D grid with float capacities needs about 40 bytes per voxel.
+///
+///the flow is computed with a lock-free push-relabel (Hong 2008) which discharges blocks of nodes in parallel (OpenMP, if enabled),
+///combined with periodic global relabeling by a breadth first search from the sink.
+template<class captype=float, class flowtype=double>
+class GridMaxFlow{
+public:
+    typedef long int node_id;
+    enum termtype {SOURCE=0, SINK=1};
+
+private:
+    unsigned int m_dim;
+    node_id m_nNodes;
+    int m_nDirections;
+    std::vector<long int> m_size, m_strides;
+    ///linear and coordinate offsets of all neighborhood directions, and the index of the opposite direction
+    std::vector<long int> m_offsets;
+    std::vector<int> m_coordinateOffsets;
+    std::vector<int> m_reverse;
+    ///residual capacities [node][direction]
+    std::vector<captype> m_residual;
+    ///terminal capacities (source minus sink) before maxflow, excess during maxflow.
+    ///excess and capacities share one type, so every push either drains the excess or saturates the arc exactly.
+    std::vector<captype> m_excess;
+    std::vector<captype> m_sinkCapacity;
+    std::vector<long int> m_height;
+    ///blocks with active nodes. only read and written between the parallel sweeps, workers collect activations in their own lists
+    std::vector<char> m_blockActive;
+    node_id m_blockSize;
+    flowtype m_flow;
+    bool m_solved;
+
+public:
+    ///size can be any indexable container (e.g. itk::Size)
+    template<class SizeType>
+    GridMaxFlow(unsigned int dimension, const SizeType & size, bool fullConnectivity=false, node_id blockSize=256){
+        m_dim=dimension;
+        m_size.resize(m_dim);
+        m_strides.resize(m_dim);
+        m_nNodes=1;
+        for (unsigned int d=0;d<m_dim;++d){
+            m_size[d]=size[d];
+            m_strides[d]=m_nNodes;
+            m_nNodes*=m_size[d];
+        }
+        //enumerate neighborhood offsets in {-1,0,1}^D
+        int nCandidates=1;
+        for (unsigned int d=0;d<m_dim;++d) nCandidates*=3;
+        for (int c=0;c<nCandidates;++c){
+            std::vector<int> offset(m_dim);
+            int code=c,nonZero=0;
+            long int linear=0;
+            for (unsigned int d=0;d<m_dim;++d){
+                offset[d]=code%3-1;
+                code/=3;
+                nonZero+=(offset[d]!=0);
+                linear+=offset[d]*m_strides[d];
+            }
+            if (nonZero==0 || (!fullConnectivity && nonZero>1))
+                continue;
+            m_offsets.push_back(linear);
+            m_coordinateOffsets.insert(m_coordinateOffsets.end(),offset.begin(),offset.end());
+        }
+        m_nDirections=m_offsets.size();
+        m_reverse.resize(m_nDirections);
+        for (int k=0;k<m_nDirections;++k){
+            for (int k2=0;k2<m_nDirections;++k2){
+                bool opposite=true;
+                for (unsigned int d=0;d<m_dim;++d)
+                    opposite=opposite && (m_coordinateOffsets[k*m_dim+d]==-m_coordinateOffsets[k2*m_dim+d]);
+                if (opposite) m_reverse[k]=k2;
+            }
+        }
+        m_residual.assign(m_nNodes*m_nDirections,0);
+        m_excess.assign(m_nNodes,0);
+        m_blockSize=std::max((node_id)1,blockSize);
+        m_flow=0;
+        m_solved=false;
+    }
+
+    node_id nNodes() const {return m_nNodes;}
+    int nDirections() const {return m_nDirections;}
+
+    ///index of the direction which steps by sign (+1/-1) along one image dimension
+    int direction(unsigned int dimension, int sign) const {
+        for (int k=0;k<m_nDirections;++k){
+            bool match=true;
+            for (unsigned int d=0;d<m_dim;++d)
+                match=match && (m_coordinateOffsets[k*m_dim+d]==(d==dimension?sign:0));
+            if (match) return k;
+        }
+        return -1;
+    }
+
+    ///linear index of the neighbor of node in direction k, or -1 if it is outside of the grid
+    node_id neighbor(node_id node, int k) const {
+        node_id rest=node;
+        for (int d=m_dim-1;d>=0;--d){
+            long int coordinate=rest/m_strides[d]+m_coordinateOffsets[k*m_dim+d];
+            rest%=m_strides[d];
+            if (coordinate<0 || coordinate>=m_size[d])
+                return -1;
+        }
+        return node+m_offsets[k];
+    }
+
+    ///same semantics as Graph::add_tweights: adds capacities from the source and to the sink
+    void add_tweights(node_id node, captype capSource, captype capSink){
+        flowtype common=std::min(capSource,capSink);
+        m_flow+=common;
+        m_excess[node]+=capSource-capSink;
+    }
+
+    ///adds capacities node->neighbor(node,k) and back
+    void add_grid_edge(node_id node, int k, captype cap, captype revCap){
+        node_id other=node+m_offsets[k];
+        m_residual[node*m_nDirections+k]+=cap;
+        m_residual[other*m_nDirections+m_reverse[k]]+=revCap;
+    }
+
+    ///same semantics as Graph::add_edge. the nodes must be neighbors on the grid.
+    void add_edge(node_id i, node_id j, captype cap, captype revCap){
+        for (int k=0;k<m_nDirections;++k){
+            if (i+m_offsets[k]==j && neighbor(i,k)==j){
+                add_grid_edge(i,k,cap,revCap);
+                return;
+            }
+        }
+        std::cerr<<"GridMaxFlow: nodes "<<i<<" and "<<j<<" are not neighbors on the grid"<<std::endl;
+        exit(-1);
+    }
+
+    flowtype maxflow(){
+        m_sinkCapacity.assign(m_nNodes,0);
+        for (node_id n=0;n<m_nNodes;++n){
+            if (m_excess[n]<0){
+                m_sinkCapacity[n]=-m_excess[n];
+                m_excess[n]=0;
+            }
+        }
+        flowtype totalSinkCapacity=0;
+        for (node_id n=0;n<m_nNodes;++n) totalSinkCapacity+=m_sinkCapacity[n];
+        node_id nBlocks=(m_nNodes+m_blockSize-1)/m_blockSize;
+        m_blockActive.assign(nBlocks,0);
+        m_height.assign(m_nNodes,0);
+        globalRelabel();
+        //heights are exact and the active blocks rescanned, since the last global relabeling no node was discharged
+        bool exact=true;
+        long int relabelsSinceGlobal=0;
+        std::vector<node_id> activeBlocks;
+        while (true){
+            activeBlocks.clear();
+            for (node_id b=0;b<nBlocks;++b){
+                if (m_blockActive[b]){
+                    activeBlocks.push_back(b);
+                    m_blockActive[b]=0;
+                }
+            }
+            if (activeBlocks.empty()){
+                //nodes may still have excess below stale heights, converged only if a rescan with exact heights finds none
+                if (exact)
+                    break;
+                globalRelabel();
+                relabelsSinceGlobal=0;
+                exact=true;
+                continue;
+            }
+            exact=false;
+            long int relabels=0;
+            long int nActive=activeBlocks.size();
+#pragma omp parallel reduction(+:relabels)
+            {
+                std::vector<node_id> activated;
+#pragma omp for schedule(dynamic,1)
+                for (long int i=0;i<nActive;++i){
+                    relabels+=dischargeBlock(activeBlocks[i],activated);
+                }
+#pragma omp critical
+                for (size_t i=0;i<activated.size();++i){
+                    m_blockActive[activated[i]]=1;
+                }
+            }
+            relabelsSinceGlobal+=relabels;
+            if (relabelsSinceGlobal>0.3*m_nNodes){
+                globalRelabel();
+                relabelsSinceGlobal=0;
+                exact=true;
+            }
+        }
+        //the heights are exact, nodes which can still reach the sink in the residual graph form the sink side of the minimum cut
+        flowtype remainingSinkCapacity=0;
+        for (node_id n=0;n<m_nNodes;++n) remainingSinkCapacity+=m_sinkCapacity[n];
+        m_flow+=totalSinkCapacity-remainingSinkCapacity;
+        m_solved=true;
+        return m_flow;
+    }
+
+    termtype what_segment(node_id node) const {
+        return m_height[node]<m_nNodes?SINK:SOURCE;
+    }
+
+private:
+    ///discharges all active nodes of a block, including nodes of the block which become active on the way.
+    ///blocks of other nodes which become active are appended to activated, for the next round.
+    ///stops early (and appends the block itself) after 4*blockSize relabels.
+    long int dischargeBlock(node_id block, std::vector<node_id> & activated){
+        long int relabels=0;
+        std::vector<node_id> queue;
+        node_id end=std::min(m_nNodes,(block+1)*m_blockSize);
+        for (node_id n=block*m_blockSize;n<end;++n){
+            if (m_excess[n]>0)
+                queue.push_back(n);
+        }
+        while (!queue.empty()){
+            //limit the work per round, so that global relabeling keeps the distance labels exact
+            if (relabels>4*m_blockSize){
+                activated.push_back(block);
+                break;
+            }
+            node_id n=queue.back();
+            queue.pop_back();
+            relabels+=discharge(n,block,queue,activated);
+        }
+        return relabels;
+    }
+
+    ///push excess of node to lower neighbors (or the sink) and relabel, until the excess is gone or the node cannot reach the sink anymore.
+    ///concurrent discharges of other nodes only increase the excess and residual capacities read here, which keeps the pushes valid.
+    long int discharge(node_id node, node_id block, std::vector<node_id> & queue, std::vector<node_id> & activated){
+        long int relabels=0;
+        captype * residual=&m_residual[node*m_nDirections];
+        while (true){
+            captype excess;
+#pragma omp atomic read
+            excess=m_excess[node];
+            long int height;
+#pragma omp atomic read
+            height=m_height[node];
+            if (!(excess>0) || height>=m_nNodes)
+                break;
+            //find lowest residual neighbor, the sink has height 0
+            long int minHeight=m_nNodes;
+            int target=-2;
+            if (m_sinkCapacity[node]>0){
+                minHeight=0;
+                target=-1;
+            }
+            for (int k=0;k<m_nDirections && minHeight>0;++k){
+                captype r;
+#pragma omp atomic read
+                r=residual[k];
+                if (r>0){
+                    long int neighborHeight;
+#pragma omp atomic read
+                    neighborHeight=m_height[node+m_offsets[k]];
+                    if (neighborHeight<minHeight){
+                        minHeight=neighborHeight;
+                        target=k;
+                    }
+                }
+            }
+            if (target==-2){
+#pragma omp atomic write
+                m_height[node]=m_nNodes;
+                break;
+            }
+            if (height>minHeight){
+                if (target==-1){
+                    captype delta=std::min(excess,m_sinkCapacity[node]);
+                    m_sinkCapacity[node]-=delta;
+#pragma omp atomic
+                    m_excess[node]-=delta;
+                }else{
+                    node_id other=node+m_offsets[target];
+                    captype r;
+#pragma omp atomic read
+                    r=residual[target];
+                    captype pushed=std::min(excess,r);
+#pragma omp atomic
+                    residual[target]-=pushed;
+#pragma omp atomic
+                    m_residual[other*m_nDirections+m_reverse[target]]+=pushed;
+#pragma omp atomic
+                    m_excess[node]-=pushed;
+                    captype previousExcess;
+#pragma omp atomic capture
+                    {previousExcess=m_excess[other]; m_excess[other]+=pushed;}
+                    if (!(previousExcess>0)){
+                        //other became active
+                        if (other/m_blockSize==block)
+                            queue.push_back(other);
+                        else
+                            activated.push_back(other/m_blockSize);
+                    }
+                }
+            }else{
+#pragma omp atomic write
+                m_height[node]=minHeight+1;
+                ++relabels;
+            }
+        }
+        return relabels;
+    }
+
+    ///exact distance labels by breadth first search from the sink over residual arcs; unreachable nodes get height nNodes.
+    ///marks all blocks containing active nodes.
+    void globalRelabel(){
+        std::vector<node_id> queue;
+        queue.reserve(m_nNodes/4+1);
+        for (node_id n=0;n<m_nNodes;++n){
+            if (m_sinkCapacity[n]>0){
+                m_height[n]=1;
+                queue.push_back(n);
+            }else{
+                m_height[n]=m_nNodes;
+            }
+        }
+        for (size_t q=0;q<queue.size();++q){
+            node_id n=queue[q];
+            long int height=m_height[n]+1;
+            for (int k=0;k<m_nDirections;++k){
+                //arc from other to n in direction k
+                node_id other=n-m_offsets[k];
+                if (other<0 || other>=m_nNodes || m_height[other]<=height)
+                    continue;
+                if (m_residual[other*m_nDirections+k]>0){
+                    m_height[other]=height;
+                    queue.push_back(other);
+                }
+            }
+        }
+        std::fill(m_blockActive.begin(),m_blockActive.end(),0);
+        for (node_id n=0;n<m_nNodes;++n){
+            if (m_excess[n]>0 && m_height[n]<m_nNodes)
+                m_blockActive[n/m_blockSize]=1;
+        }
+    }
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "itkImage.h"
+#include "Log.h"
+#include "FilterUtils.hpp"
+#include <map>
+#include <vector>
+
+///multiresolution pyramid of one image, computed lazily and cached by scaling factor.
+///the levels have the geometry of FilterUtils::LinearResample(image,scale,true) (or NNResample for label images),
+///so consumers which resample the same image by the same factors (affine stage, registration potentials, segmentation grid)
+///share one pyramid instead of smoothing and resampling the full resolution input again at every level.
+///
+///if the scales which will be requested are announced with setScales, each smoothed level is computed from the next finer
+///level instead of the full resolution image: since gaussian variances add up, only the difference of the target spacings
+///has to be smoothed at the coarser level. nearest neighbor levels are always sampled directly from the input.
+template<class ImageType>
+class ImagePyramid{
+public:
+    typedef typename ImageType::Pointer ImagePointerType;
+    typedef typename ImageType::ConstPointer ConstImagePointerType;
+    typedef typename ImageType::SizeType SizeType;
+    typedef typename ImageType::SpacingType SpacingType;
+
+private:
+    ConstImagePointerType m_image;
+    bool m_nnResample;
+    std::vector<double> m_scales;
+    std::map<double,ConstImagePointerType> m_levels;
+
+public:
+    ImagePyramid(){
+        m_image=NULL;
+        m_nnResample=false;
+    }
+    ///nnResample: use nearest neighbor interpolation without smoothing, e.g. for masks and segmentations
+    void setImage(ConstImagePointerType img, bool nnResample=false){
+        if (img!=m_image || nnResample!=m_nnResample)
+            clear();
+        m_image=img;
+        m_nnResample=nnResample;
+    }
+    ConstImagePointerType getImage(){return m_image;}
+    ///scaling factors which will be requested, used to compute the levels from each other
+    void setScales(const std::vector<double> & scales){m_scales=scales;}
+    std::vector<double> getScales(){return m_scales;}
+    void clear(){
+        m_levels.clear();
+    }
+    ///level of the pyramid with the given scaling factor, the full resolution image is returned unchanged for scale 1
+    ConstImagePointerType getLevel(double scale){
+        if (m_image.IsNull()){
+            LOG<<"image pyramid queried before an image was set, aborting"<<std::endl;
+            exit(-1);
+        }
+        if (scale==1.0)
+            return m_image;
+        typename std::map<double,ConstImagePointerType>::iterator it=m_levels.find(scale);
+        if (it!=m_levels.end())
+            return it->second;
+        ConstImagePointerType level;
+        if (m_nnResample){
+            level=(ConstImagePointerType)FilterUtils<ImageType>::NNResample(m_image,scale,false);
+        }else if (scale>1.0){
+            level=(ConstImagePointerType)FilterUtils<ImageType>::LinearResample(m_image,scale,true);
+        }else{
+            //closest finer level, computing it first if it was announced
+            double finerScale=1.0;
+            for (unsigned int i=0;i<m_scales.size();++i){
+                if (m_scales[i]>scale && m_scales[i]<finerScale)
+                    finerScale=m_scales[i];
+            }
+            for (it=m_levels.begin();it!=m_levels.end();++it){
+                if (it->first>scale && it->first<finerScale)
+                    finerScale=it->first;
+            }
+            ConstImagePointerType finer=getLevel(finerScale);
+            level=resampleFrom(finer,scale);
+        }
+        LOGV(3)<<"computed pyramid level with scale "<<scale<<", size "<<level->GetLargestPossibleRegion().GetSize()<<std::endl;
+        m_levels[scale]=level;
+        return level;
+    }
+
+private:
+    ///smoothed linear resampling of a finer level to the geometry of the level with the given scale
+    ConstImagePointerType resampleFrom(ConstImagePointerType finer, double scale){
+        SizeType size;
+        SpacingType spacing;
+        FilterUtils<ImageType>::resamplingGeometry(m_image,scale,size,spacing);
+        ImagePointerType reference=ImageType::New();
+        typename ImageType::RegionType region;
+        region.SetSize(size);
+        reference->SetRegions(region);
+        reference->SetOrigin(m_image->GetOrigin());
+        reference->SetSpacing(spacing);
+        reference->SetDirection(m_image->GetDirection());
+        //same smoothing variance as LinearResample, minus what was already applied to the finer level
+        ConstImagePointerType smoothed=(ConstImagePointerType)FilterUtils<ImageType>::gaussian(finer,spacing-finer->GetSpacing());
+        return (ConstImagePointerType)FilterUtils<ImageType>::LinearResample(smoothed,(ConstImagePointerType)reference,false);
+    }
+};
@@ -0,0 +1,306 @@
+#pragma once
+
+#include "itkImage.h"
+#include "itkNumericTraits.h"
+#include "itkImportImageContainer.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <iostream>
+#include <limits>
+#include <cstring>
+#include <cstdio>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+///on-disk layout of an image store:
+///[ImageStoreHeader][page aligned raw pixel buffers ...][ImageStoreEntry * nEntries]
+///pixel buffers are stored uncompressed in ITK buffer order, so they can be handed to ITK images without copying.
+///images are indexed by a string key, which is the filename they were packed from.
+struct ImageStoreHeader{
+    char magic[8];
+    uint32_t version;
+    uint32_t nEntries;
+    uint64_t indexOffset;
+};
+
+struct ImageStoreEntry{
+    static const int maxKeyLength=1024;
+    static const int maxDimension=4;
+    char key[maxKeyLength];
+    uint32_t dimension;
+    uint32_t nComponents;
+    uint32_t componentBytes;
+    uint32_t componentFlags;
+    uint64_t size[maxDimension];
+    double origin[maxDimension];
+    double spacing[maxDimension];
+    double direction[maxDimension*maxDimension];
+    uint64_t dataOffset;
+    uint64_t dataBytes;
+};
+
+///encodes the component type of a pixel as sizeof + integer/signed flags
+template<class PixelType>
+struct ImageStorePixelTraits{
+    typedef typename itk::NumericTraits<PixelType>::ValueType ComponentType;
+    static uint32_t componentBytes(){return sizeof(ComponentType);}
+    static uint32_t nComponents(){return sizeof(PixelType)/sizeof(ComponentType);}
+    static uint32_t componentFlags(){
+        return (std::numeric_limits<ComponentType>::is_integer?1:0) | (std::numeric_limits<ComponentType>::is_signed?2:0);
+    }
+};
+
+///writes images sequentially into a store file. only the index is kept in memory, so arbitrarily large lists can be packed.
+///failures are reported and returned, the packing tool decides whether to abort.
+class ImageStoreWriter{
+private:
+    FILE * m_file;
+    uint64_t m_offset;
+    std::vector<ImageStoreEntry> m_entries;
+    std::string m_filename;
+public:
+    static const uint64_t pageSize=4096;
+
+    ImageStoreWriter(std::string filename){
+        m_filename=filename;
+        m_file=fopen(filename.c_str(),"wb");
+        if (!m_file){
+            std::cerr<<"could not open image store "<<filename<<" for writing"<<std::endl;
+            return;
+        }
+        ImageStoreHeader header;
+        memset(&header,0,sizeof(ImageStoreHeader));
+        fwrite(&header,sizeof(ImageStoreHeader),1,m_file);
+        m_offset=sizeof(ImageStoreHeader);
+    }
+    ~ImageStoreWriter(){
+        if (m_file)
+            close();
+    }
+
+    bool isOpen(){return m_file!=NULL;}
+
+    ///appends img under key, returns false if it could not be written
+    template<class ImageType>
+    bool add(std::string key, typename ImageType::Pointer img){
+        typedef typename ImageType::PixelType PixelType;
+        const unsigned int D=ImageType::ImageDimension;
+        if (!m_file)
+            return false;
+        if (key.size()>=(unsigned int)ImageStoreEntry::maxKeyLength || D>(unsigned int)ImageStoreEntry::maxDimension){
+            std::cerr<<"cannot store image with key "<<key<<" (key too long or dimension too high)"<<std::endl;
+            return false;
+        }
+        ImageStoreEntry entry;
+        memset(&entry,0,sizeof(ImageStoreEntry));
+        strncpy(entry.key,key.c_str(),ImageStoreEntry::maxKeyLength-1);
+        entry.dimension=D;
+        entry.nComponents=ImageStorePixelTraits<PixelType>::nComponents();
+        entry.componentBytes=ImageStorePixelTraits<PixelType>::componentBytes();
+        entry.componentFlags=ImageStorePixelTraits<PixelType>::componentFlags();
+        typename ImageType::SizeType size=img->GetBufferedRegion().GetSize();
+        for (unsigned int d=0;d<D;++d){
+            entry.size[d]=size[d];
+            entry.origin[d]=img->GetOrigin()[d];
+            entry.spacing[d]=img->GetSpacing()[d];
+            for (unsigned int d2=0;d2<D;++d2){
+                entry.direction[d*ImageStoreEntry::maxDimension+d2]=img->GetDirection()[d][d2];
+            }
+        }
+        entry.dataBytes=img->GetBufferedRegion().GetNumberOfPixels()*sizeof(PixelType);
+        //align buffer to page boundary so that it can be mapped directly
+        uint64_t padding=(pageSize-m_offset%pageSize)%pageSize;
+        if (padding){
+            std::vector<char> zeros(padding,0);
+            fwrite(&zeros[0],1,padding,m_file);
+            m_offset+=padding;
+        }
+        entry.dataOffset=m_offset;
+        if (fwrite(img->GetBufferPointer(),1,entry.dataBytes,m_file)!=entry.dataBytes){
+            std::cerr<<"failed writing "<<key<<" to image store "<<m_filename<<std::endl;
+            return false;
+        }
+        m_offset+=entry.dataBytes;
+        m_entries.push_back(entry);
+        return true;
+    }
+
+    ///write index and header, closes the file
+    void close(){
+        if (!m_file)
+            return;
+        ImageStoreHeader header;
+        memset(&header,0,sizeof(ImageStoreHeader));
+        memcpy(header.magic,"SRSSTORE",8);
+        header.version=1;
+        header.nEntries=m_entries.size();
+        header.indexOffset=m_offset;
+        if (m_entries.size())
+            fwrite(&m_entries[0],sizeof(ImageStoreEntry),m_entries.size(),m_file);
+        fseek(m_file,0,SEEK_SET);
+        fwrite(&header,sizeof(ImageStoreHeader),1,m_file);
+        fclose(m_file);
+        m_file=NULL;
+    }
+};
+
+///read-only view on an image store.
+///the file is mapped read-only and shares its pages with other processes reading the same store.
+///getImageView wraps the mapped pixels without copying; the view must not outlive the store, and writing to it is not possible.
+///getImage copies the stored buffer into a newly allocated image for callers which modify their images.
+///keys which are not stored, have a different pixel type than requested or a corrupt entry yield NULL, the caller then reads the file itself.
+class ImageStore{
+private:
+    char * m_data;
+    uint64_t m_length;
+    std::string m_filename;
+    std::map<std::string,const ImageStoreEntry *> m_index;
+
+public:
+    ImageStore(){
+        m_data=NULL;
+        m_length=0;
+    }
+    ~ImageStore(){
+        close();
+    }
+
+    ///process-wide store consulted by ImageUtils::readImage
+    static ImageStore & global(){
+        static ImageStore store;
+        return store;
+    }
+
+    bool isOpen(){return m_data!=NULL;}
+
+    bool open(std::string filename){
+        close();
+        int fd=::open(filename.c_str(),O_RDONLY);
+        if (fd<0){
+            std::cerr<<"could not open image store "<<filename<<std::endl;
+            return false;
+        }
+        struct stat st;
+        fstat(fd,&st);
+        m_length=st.st_size;
+        if (m_length<sizeof(ImageStoreHeader)){
+            std::cerr<<filename<<" is not a valid image store"<<std::endl;
+            ::close(fd);
+            return false;
+        }
+        void * mapping=mmap(NULL,m_length,PROT_READ,MAP_SHARED,fd,0);
+        ::close(fd);
+        if (mapping==MAP_FAILED){
+            std::cerr<<"could not map image store "<<filename<<std::endl;
+            return false;
+        }
+        m_data=(char*)mapping;
+        const ImageStoreHeader * header=(const ImageStoreHeader*)m_data;
+        if (strncmp(header->magic,"SRSSTORE",8) || header->version!=1 || header->indexOffset+header->nEntries*sizeof(ImageStoreEntry)>m_length){
+            std::cerr<<filename<<" is not a valid image store"<<std::endl;
+            close();
+            return false;
+        }
+        const ImageStoreEntry * entries=(const ImageStoreEntry*)(m_data+header->indexOffset);
+        for (unsigned int i=0;i<header->nEntries;++i){
+            m_index[std::string(entries[i].key)]=&entries[i];
+        }
+        m_filename=filename;
+        return true;
+    }
+
+    void close(){
+        if (m_data){
+            munmap(m_data,m_length);
+        }
+        m_data=NULL;
+        m_length=0;
+        m_index.clear();
+    }
+
+    int size(){return m_index.size();}
+
+    bool contains(std::string key){
+        return m_index.find(key)!=m_index.end();
+    }
+
+    ///zero-copy image on the mapped buffer of key, NULL if it is not available from the store
+    template<class ImageType>
+    typename ImageType::ConstPointer getImageView(std::string key){
+        return createView<ImageType>(key).GetPointer();
+    }
+
+    ///copy of a stored image, NULL if it is not available from the store
+    template<class ImageType>
+    typename ImageType::Pointer getImage(std::string key){
+        typename ImageType::Pointer view=createView<ImageType>(key);
+        if (view.IsNull())
+            return NULL;
+        typename ImageType::Pointer img=ImageType::New();
+        img->CopyInformation(view);
+        img->SetRegions(view->GetLargestPossibleRegion());
+        img->Allocate();
+        memcpy(img->GetBufferPointer(),view->GetBufferPointer(),view->GetLargestPossibleRegion().GetNumberOfPixels()*sizeof(typename ImageType::PixelType));
+        return img;
+    }
+
+private:
+    ///image whose pixel container imports the mapped buffer without taking ownership.
+    ///the mapping is read-only, so it is only handed out as const image (getImageView) or copied (getImage)
+    template<class ImageType>
+    typename ImageType::Pointer createView(std::string key){
+        typedef typename ImageType::PixelType PixelType;
+        const unsigned int D=ImageType::ImageDimension;
+        if (!m_data)
+            return NULL;
+        typename std::map<std::string,const ImageStoreEntry *>::iterator it=m_index.find(key);
+        if (it==m_index.end())
+            return NULL;
+        const ImageStoreEntry * entry=it->second;
+        if (entry->dimension!=D
+            || entry->nComponents!=ImageStorePixelTraits<PixelType>::nComponents()
+            || entry->componentBytes!=ImageStorePixelTraits<PixelType>::componentBytes()
+            || entry->componentFlags!=ImageStorePixelTraits<PixelType>::componentFlags()){
+            std::cerr<<"pixel type of "<<key<<" in image store "<<m_filename<<" does not match the type requested by the application ("
+                     <<entry->nComponents<<"x"<<entry->componentBytes<<" bytes stored, "
+                     <<ImageStorePixelTraits<PixelType>::nComponents()<<"x"<<ImageStorePixelTraits<PixelType>::componentBytes()<<" bytes requested), reading the file instead. repack the store with the matching -pixelType"<<std::endl;
+            return NULL;
+        }
+        typename ImageType::RegionType region;
+        typename ImageType::SizeType size;
+        typename ImageType::IndexType start;
+        typename ImageType::PointType origin;
+        typename ImageType::SpacingType spacing;
+        typename ImageType::DirectionType direction;
+        uint64_t nPixels=1;
+        for (unsigned int d=0;d<D;++d){
+            size[d]=entry->size[d];
+            start[d]=0;
+            origin[d]=entry->origin[d];
+            spacing[d]=entry->spacing[d];
+            for (unsigned int d2=0;d2<D;++d2){
+                direction[d][d2]=entry->direction[d*ImageStoreEntry::maxDimension+d2];
+            }
+            nPixels*=size[d];
+        }
+        if (entry->dataBytes!=nPixels*sizeof(PixelType) || entry->dataOffset+entry->dataBytes>m_length){
+            std::cerr<<"entry "<<key<<" in image store "<<m_filename<<" is corrupt, reading the file instead"<<std::endl;
+            return NULL;
+        }
+        region.SetSize(size);
+        region.SetIndex(start);
+        typename ImageType::Pointer img=ImageType::New();
+        img->SetRegions(region);
+        img->SetOrigin(origin);
+        img->SetSpacing(spacing);
+        img->SetDirection(direction);
+        typename ImageType::PixelContainerPointer container=ImageType::PixelContainer::New();
+        container->SetImportPointer((PixelType*)(m_data+entry->dataOffset),nPixels,false);
+        img->SetPixelContainer(container);
+        return img;
+    }
+};
@@ -25,6 +25,7 @@
 #include <ctime>
 #include <sys/time.h>
 #include <itkResampleImageFilter.h>
+#include "ImageStore.h"
 //#include "FilterUtils.hpp"
 template<class ImageType, class FloatPrecision=float>
 class ImageUtils {
@@ -112,8 +113,20 @@ private:
 public:
 
 
-	/* Read an itk image from a file */
+	/* Read an itk image from a file, or a zero-copy view on it from the global image store if it was packed there.
+	   for callers which do not modify the image, the view must not outlive the store */
+	static ConstImagePointerType readConstImage(std::string fileName) {
+        ConstImagePointerType stored=ImageStore::global().getImageView<ImageType>(fileName);
+        if (stored.IsNotNull())
+            return stored;
+        return (ConstImagePointerType)readImage(fileName);
+	}
+
+	/* Read an itk image from a file, or copy it from the global image store if it was packed there */
 	static ImagePointerType readImage(std::string fileName) {
+        ImagePointerType stored=ImageStore::global().getImage<ImageType>(fileName);
+        if (stored.IsNotNull())
+            return stored;
 		ReaderTypePointer reader = ReaderType::New();
 		reader->SetFileName( fileName  );
 		try{
@@ -5,6 +5,10 @@
 #include "itkLabelOverlapMeasuresImageFilter.h"
 #include "itkHausdorffDistanceImageFilter.h"
 #include "SegmentationMapper.hxx"
+#include <vector>
+#include <map>
+#include <limits>
+#include <cmath>
 template <class ImageType>
 class SegmentationTools{
 public:
@@ -18,7 +22,157 @@ public:
         double dice, MSD, HD,jaccard;
         int labelID;
     };
+    ///result of the single pass multilabel evaluation
+    struct MultilabelEvaluation{
+        ///all label values occurring in ground truth or segmentation, in increasing order
+        std::vector<PixelType> labels;
+        ///confusion[g*labels.size()+s] counts pixels with ground truth labels[g] and segmentation labels[s]
+        std::vector<long int> confusion;
+        ///scores of the evaluated labels
+        std::vector<OverlapScores> scores;
+    };
 private:
+    ///dense indices for label values in order of appearance, remembering the last lookup since labels come in long runs
+    class LabelIndexer{
+        std::map<PixelType,int> m_indices;
+        PixelType m_lastValue;
+        int m_lastIndex;
+    public:
+        LabelIndexer(){m_lastIndex=-1;}
+        int size() const {return m_indices.size();}
+        int operator()(PixelType value){
+            if (m_lastIndex>=0 && value==m_lastValue)
+                return m_lastIndex;
+            typename std::map<PixelType,int>::iterator it=m_indices.find(value);
+            if (it==m_indices.end())
+                it=m_indices.insert(std::make_pair(value,(int)m_indices.size())).first;
+            m_lastValue=value;
+            m_lastIndex=it->second;
+            return m_lastIndex;
+        }
+        ///index of a value, or -1 if it never occurred
+        int find(PixelType value) const {
+            typename std::map<PixelType,int>::const_iterator it=m_indices.find(value);
+            return it==m_indices.end()?-1:it->second;
+        }
+        const std::map<PixelType,int> & indices() const {return m_indices;}
+    };
+
+    ///1D squared distance transform of sampled function f (Felzenszwalb&Huttenlocher), using unit sample distance
+    static void distanceTransform1D(const double * f, int n, double * d, int * v, double * z){
+        int k=0;
+        v[0]=0;
+        z[0]=-std::numeric_limits<double>::max();
+        z[1]=std::numeric_limits<double>::max();
+        for (int q=1;q<n;++q){
+            double s=((f[q]+1.0*q*q)-(f[v[k]]+1.0*v[k]*v[k]))/(2.0*q-2.0*v[k]);
+            while (s<=z[k]){
+                --k;
+                s=((f[q]+1.0*q*q)-(f[v[k]]+1.0*v[k]*v[k]))/(2.0*q-2.0*v[k]);
+            }
+            ++k;
+            v[k]=q;
+            z[k]=s;
+            z[k+1]=std::numeric_limits<double>::max();
+        }
+        k=0;
+        for (int q=0;q<n;++q){
+            while (z[k+1]<q)
+                ++k;
+            d[q]=1.0*(q-v[k])*(q-v[k])+f[v[k]];
+        }
+    }
+
+    ///exact squared euclidean distance transform (in physical units) of a box, separable over the dimensions.
+    ///dist holds 0 at feature pixels and a large value elsewhere on input.
+    static void squaredDistanceTransform(std::vector<float> & dist, const long int * size, const double * spacing){
+        long int strides[D];
+        long int nPixels=1;
+        for (unsigned int d=0;d<D;++d){
+            strides[d]=nPixels;
+            nPixels*=size[d];
+        }
+        for (unsigned int d=0;d<D;++d){
+            int n=size[d];
+            long int nLines=nPixels/n;
+            double scale=spacing[d]*spacing[d];
+#pragma omp parallel
+            {
+                std::vector<double> f(n),result(n),z(n+1);
+                std::vector<int> v(n);
+#pragma omp for
+                for (long int line=0;line<nLines;++line){
+                    //first pixel of the line: split line number into the coordinates below and above dimension d
+                    long int start=(line%strides[d])+(line/strides[d])*strides[d]*n;
+                    for (int q=0;q<n;++q)
+                        f[q]=dist[start+q*strides[d]]/scale;
+                    distanceTransform1D(&f[0],n,&result[0],&v[0],&z[0]);
+                    for (int q=0;q<n;++q)
+                        dist[start+q*strides[d]]=result[q]*scale;
+                }
+            }
+        }
+    }
+
+    ///symmetric surface distances between two boundary point sets (linear image indices).
+    ///distances are computed only within the bounding box of both sets, which contains all nearest neighbors.
+    static void surfaceDistances(const std::vector<long int> & surface1, const std::vector<long int> & surface2, const long int * imageSize, const double * spacing, double & mean, double & hd){
+        if (surface1.empty() || surface2.empty()){
+            //undefined if only one of the labels is present
+            mean=hd=(surface1.empty() && surface2.empty())?0.0:-1.0;
+            return;
+        }
+        long int imageStrides[D],lower[D],upper[D],boxSize[D],boxStrides[D];
+        for (unsigned int d=0;d<D;++d){
+            imageStrides[d]=(d==0)?1:imageStrides[d-1]*imageSize[d-1];
+            lower[d]=imageSize[d];
+            upper[d]=-1;
+        }
+        const std::vector<long int> * surfaces[2]={&surface1,&surface2};
+        for (int s=0;s<2;++s){
+            for (size_t i=0;i<surfaces[s]->size();++i){
+                long int idx=(*surfaces[s])[i];
+                for (unsigned int d=0;d<D;++d){
+                    long int c=(idx/imageStrides[d])%imageSize[d];
+                    lower[d]=std::min(lower[d],c);
+                    upper[d]=std::max(upper[d],c);
+                }
+            }
+        }
+        long int boxPixels=1;
+        for (unsigned int d=0;d<D;++d){
+            boxSize[d]=upper[d]-lower[d]+1;
+            boxStrides[d]=boxPixels;
+            boxPixels*=boxSize[d];
+        }
+        std::vector<float> dist(boxPixels);
+        std::vector<long int> boxIndices[2];
+        for (int s=0;s<2;++s){
+            boxIndices[s].resize(surfaces[s]->size());
+            for (size_t i=0;i<surfaces[s]->size();++i){
+                long int idx=(*surfaces[s])[i],boxIdx=0;
+                for (unsigned int d=0;d<D;++d)
+                    boxIdx+=((idx/imageStrides[d])%imageSize[d]-lower[d])*boxStrides[d];
+                boxIndices[s][i]=boxIdx;
+            }
+        }
+        double sum=0.0;
+        hd=0.0;
+        for (int s=0;s<2;++s){
+            //distance transform of one surface, sampled at the other one
+            std::fill(dist.begin(),dist.end(),1e20f);
+            for (size_t i=0;i<boxIndices[s].size();++i)
+                dist[boxIndices[s][i]]=0.0f;
+            squaredDistanceTransform(dist,boxSize,spacing);
+            const std::vector<long int> & other=boxIndices[1-s];
+            for (size_t i=0;i<other.size();++i){
+                double distance=sqrt(dist[other[i]]);
+                sum+=distance;
+                hd=std::max(hd,distance);
+            }
+        }
+        mean=sum/(surface1.size()+surface2.size());
+    }
     
     static ImagePointerType selectLabel(ImagePointerType img, int l){
         ImagePointerType result=ImageUtils<ImageType>::createEmpty(img);
@@ -97,10 +251,184 @@ public:
         OverlapScores result;
         result.labelID=evalLabel>-1?evalLabel:1;
         computeOverlap(groundTruthImg,segmentedImg,result.dice,result.MSD,result.HD,evalLabel,evalDistance,connectedComponent);
+        result.jaccard=result.dice/(2.0-result.dice);
         return result;
     }
     
-    static std::vector<OverlapScores> computeOverlapMultilabel(ImagePointerType groundTruthImg, ImagePointerType segmentedImg,  bool evalDistance=false,bool connectedComponent=false){
+    ///evaluates all labels of a multilabel segmentation at once.
+    ///a single scan over both images accumulates the full confusion matrix and, if evalDistance is set, collects the boundary pixels of all labels
+    ///(pixels with a face neighbor of different label). mean surface distance (MSD) and hausdorff distance (HD) of each label are then computed from
+    ///exact distance transforms restricted to the bounding box of the label's boundaries, in physical units.
+    ///MSD/HD are -1 if a label is missing in one of the images.
+    ///evalLabels: label values to score, defaults to all nonzero labels of the ground truth.
+    static MultilabelEvaluation evaluateMultilabel(ImagePointerType groundTruthImg, ImagePointerType segmentedImg, bool evalDistance=false, std::vector<PixelType> evalLabels=std::vector<PixelType>()){
+        if (groundTruthImg->GetLargestPossibleRegion().GetSize()!=segmentedImg->GetLargestPossibleRegion().GetSize()
+            || groundTruthImg->GetSpacing()!=segmentedImg->GetSpacing()
+            || groundTruthImg->GetOrigin()!=segmentedImg->GetOrigin()){
+            groundTruthImg=FilterUtils<ImageType>::NNResample(groundTruthImg,segmentedImg,false);
+        }
+        SizeType size=segmentedImg->GetLargestPossibleRegion().GetSize();
+        long int imageSize[D],strides[D],coordinate[D];
+        double spacing[D];
+        long int nPixels=1;
+        for (unsigned int d=0;d<D;++d){
+            imageSize[d]=size[d];
+            strides[d]=nPixels;
+            nPixels*=imageSize[d];
+            spacing[d]=segmentedImg->GetSpacing()[d];
+            coordinate[d]=0;
+        }
+        const PixelType * gt=groundTruthImg->GetBufferPointer();
+        const PixelType * seg=segmentedImg->GetBufferPointer();
+
+        LabelIndexer gtIndexer,segIndexer,boundaryIndexer;
+        //confusion counts by appearance index, capacity grows with the number of labels
+        int capacity=8;
+        std::vector<long int> counts(capacity*capacity,0);
+        //boundary flags: bit 1 ground truth, bit 2 segmentation
+        std::vector<unsigned char> boundary(evalDistance?nPixels:0,0);
+        std::vector<std::vector<long int> > gtSurfaces,segSurfaces;
+        for (long int i=0;i<nPixels;++i){
+            int g=gtIndexer(gt[i]);
+            int s=segIndexer(seg[i]);
+            if (std::max(g,s)>=capacity){
+                int newCapacity=2*std::max(capacity,std::max(g,s));
+                std::vector<long int> newCounts(newCapacity*newCapacity,0);
+                for (int r=0;r<capacity;++r)
+                    std::copy(counts.begin()+r*capacity,counts.begin()+(r+1)*capacity,newCounts.begin()+r*newCapacity);
+                counts.swap(newCounts);
+                capacity=newCapacity;
+            }
+            ++counts[g*capacity+s];
+            if (evalDistance){
+                for (unsigned int d=0;d<D;++d){
+                    if (coordinate[d]+1<imageSize[d]){
+                        long int j=i+strides[d];
+                        if (gt[i]!=gt[j]){
+                            boundary[i]|=1;
+                            boundary[j]|=1;
+                        }
+                        if (seg[i]!=seg[j]){
+                            boundary[i]|=2;
+                            boundary[j]|=2;
+                        }
+                    }
+                }
+                //all neighbors before i have been visited, so the flags of i are final
+                if (boundary[i]){
+                    int l=boundaryIndexer((boundary[i]&1)?gt[i]:seg[i]);
+                    if (l>=(int)gtSurfaces.size()){
+                        gtSurfaces.resize(l+1);
+                        segSurfaces.resize(l+1);
+                    }
+                    if (boundary[i]&1)
+                        gtSurfaces[l].push_back(i);
+                    if (boundary[i]&2){
+                        int ls=((boundary[i]&1) && gt[i]!=seg[i])?boundaryIndexer(seg[i]):l;
+                        if (ls>=(int)segSurfaces.size()){
+                            gtSurfaces.resize(ls+1);
+                            segSurfaces.resize(ls+1);
+                        }
+                        segSurfaces[ls].push_back(i);
+                    }
+                }
+            }
+            for (unsigned int d=0;d<D;++d){
+                if (++coordinate[d]<imageSize[d])
+                    break;
+                coordinate[d]=0;
+            }
+        }
+
+        //sorted label list and confusion matrix
+        MultilabelEvaluation result;
+        std::map<PixelType,int> sortedIndices;
+        typename std::map<PixelType,int>::const_iterator it;
+        for (it=gtIndexer.indices().begin();it!=gtIndexer.indices().end();++it) sortedIndices[it->first]=0;
+        for (it=segIndexer.indices().begin();it!=segIndexer.indices().end();++it) sortedIndices[it->first]=0;
+        for (typename std::map<PixelType,int>::iterator sit=sortedIndices.begin();sit!=sortedIndices.end();++sit){
+            sit->second=result.labels.size();
+            result.labels.push_back(sit->first);
+        }
+        int nLabels=result.labels.size();
+        result.confusion.assign(nLabels*nLabels,0);
+        for (it=gtIndexer.indices().begin();it!=gtIndexer.indices().end();++it){
+            typename std::map<PixelType,int>::const_iterator it2;
+            for (it2=segIndexer.indices().begin();it2!=segIndexer.indices().end();++it2){
+                result.confusion[sortedIndices[it->first]*nLabels+sortedIndices[it2->first]]=counts[it->second*capacity+it2->second];
+            }
+        }
+
+        if (evalLabels.empty()){
+            for (it=gtIndexer.indices().begin();it!=gtIndexer.indices().end();++it){
+                if (it->first!=0)
+                    evalLabels.push_back(it->first);
+            }
+            std::sort(evalLabels.begin(),evalLabels.end());
+        }
+        std::vector<long int> empty;
+        for (size_t e=0;e<evalLabels.size();++e){
+            OverlapScores scores;
+            scores.labelID=evalLabels[e];
+            scores.MSD=scores.HD=0.0;
+            long int tp=0,gtCount=0,segCount=0;
+            typename std::map<PixelType,int>::iterator lit=sortedIndices.find(evalLabels[e]);
+            if (lit!=sortedIndices.end()){
+                int l=lit->second;
+                tp=result.confusion[l*nLabels+l];
+                for (int k=0;k<nLabels;++k){
+                    gtCount+=result.confusion[l*nLabels+k];
+                    segCount+=result.confusion[k*nLabels+l];
+                }
+            }
+            //labels absent from both images score 0
+            scores.dice=(gtCount+segCount)>0?2.0*tp/(gtCount+segCount):0.0;
+            scores.jaccard=(gtCount+segCount-tp)>0?1.0*tp/(gtCount+segCount-tp):0.0;
+            if (evalDistance){
+                int l=boundaryIndexer.find(evalLabels[e]);
+                surfaceDistances(l>=0?gtSurfaces[l]:empty,l>=0?segSurfaces[l]:empty,imageSize,spacing,scores.MSD,scores.HD);
+            }
+            result.scores.push_back(scores);
+        }
+        return result;
+    }
+
+    ///averages scores over labels. dice is averaged over all labels, MSD and HD only over the labels for which they are defined (not -1).
+    ///MSD and HD of the result are -1 if they are undefined for all labels.
+    static OverlapScores averageScores(const std::vector<OverlapScores> & scores){
+        OverlapScores result;
+        result.labelID=-1;
+        result.dice=result.jaccard=result.MSD=result.HD=0.0;
+        int nDistances=0;
+        for (unsigned int i=0;i<scores.size();++i){
+            result.dice+=scores[i].dice;
+            result.jaccard+=scores[i].jaccard;
+            if (scores[i].MSD>=0 && scores[i].HD>=0){
+                result.MSD+=scores[i].MSD;
+                result.HD+=scores[i].HD;
+                ++nDistances;
+            }
+        }
+        if (scores.size()){
+            result.dice/=scores.size();
+            result.jaccard/=scores.size();
+        }
+        if (nDistances){
+            result.MSD/=nDistances;
+            result.HD/=nDistances;
+        }else{
+            result.MSD=result.HD=-1.0;
+        }
+        return result;
+    }
+
+    ///scores of all ground truth labels, each evaluated with computeOverlap.
+    ///singlePass uses evaluateMultilabel instead (not with connectedComponent), which differs for labels missing from the segmentation:
+    ///MSD/HD are -1 there, use averageScores to average them.
+    static std::vector<OverlapScores> computeOverlapMultilabel(ImagePointerType groundTruthImg, ImagePointerType segmentedImg,  bool evalDistance=false,bool connectedComponent=false, bool singlePass=false){
+        if (singlePass && !connectedComponent){
+            return evaluateMultilabel(groundTruthImg,segmentedImg,evalDistance).scores;
+        }
         SegmentationMapper<ImageType> segmentationMapper;
         segmentationMapper.FindMap(groundTruthImg);
         int  labelsToEvaluate=segmentationMapper.getNumberOfLabels();
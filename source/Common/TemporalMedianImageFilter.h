@@ -4,122 +4,88 @@
 #include "ImageUtils.h"
 #include "FilterUtils.hpp"
 #include <vector>
+#include <algorithm>
 #include <itkImageAlgorithm.h>
 
 using namespace std;
 
+///pixelwise median (or other quantile) over a sequence of images.
+///
+///all samples are kept in one contiguous buffer, one image after the other. the quantile is computed tile by tile:
+///the samples of a tile of pixels are gathered into a [pixel][sample] block and selected with nth_element.
 template <class ImageType>
 class TemporalMedianImageFilter{
 
     typedef typename ImageType::Pointer ImagePointerType;
     typedef typename ImageType::PixelType PixelType;
     static const int D=ImageType::ImageDimension;
+    static const int TileSize=4096;
 
-    //typedef itk::Vector<PixelType,SequenceLength> MedianFilterPixelType;
-    typedef itk::VectorImage<float,D> MedianFilterImageType;
-    typedef typename MedianFilterImageType::PixelType  MedianFilterPixelType;
-
-    typedef typename MedianFilterImageType::Pointer MedianFilterImagePointerType;
-    
-    typedef typename ImageUtils<MedianFilterImageType>::ImageIteratorType MedianFilterImageIteratorType;
-    typedef typename ImageUtils<ImageType>::ImageIteratorType ImageIteratorType;
-    
-    
 private:
-    
-    MedianFilterImagePointerType m_medianFilterImage;
+
     int m_sequenceLength,m_sequenceCount;
-    MedianFilterImageIteratorType m_medianIterator;
+    long int m_nPixels;
+    ///samples [image][pixel]
+    std::vector<float> m_samples;
     ImagePointerType  m_medianImage;
-    
+
 public:
     TemporalMedianImageFilter(){}
     TemporalMedianImageFilter(ImagePointerType img, int sequenceLength){
         m_sequenceLength=sequenceLength;
-      
-        m_medianFilterImage=MedianFilterImageType::New();
-        m_medianFilterImage->SetRegions(img->GetLargestPossibleRegion());
-        m_medianFilterImage->SetOrigin(img->GetOrigin());
-        m_medianFilterImage->SetDirection(img->GetDirection());
-        m_medianFilterImage->SetSpacing(img->GetSpacing());
-        m_medianFilterImage->SetVectorLength(m_sequenceLength);
-        m_medianFilterImage->Allocate();
-      
-
         m_sequenceCount=0;
-
-
-        m_medianIterator=MedianFilterImageIteratorType(m_medianFilterImage,m_medianFilterImage->GetLargestPossibleRegion());
-
-        for (m_medianIterator.GoToBegin();!m_medianIterator.IsAtEnd();++m_medianIterator){
-            
-            MedianFilterPixelType  newVec=MedianFilterPixelType(m_sequenceLength);
-            newVec.Fill(-1);
-            m_medianIterator.Set(newVec);
-         
-        }
+        m_nPixels=img->GetLargestPossibleRegion().GetNumberOfPixels();
+        m_samples.resize(m_nPixels*m_sequenceLength);
         m_medianImage=ImageUtils<ImageType>::createEmpty(img);
     }
 
-    ~TemporalMedianImageFilter(){
-//         for (m_medianIterator.GoToBegin();!m_medianIterator.IsAtEnd();++m_medianIterator){
-//             delete m_medianIterator.Get();
-//         }
-//         delete m_medianIterator;
-//
-     }
-    
-
     void insertImage(ImagePointerType img){
         if (  m_sequenceCount>=m_sequenceLength){
             LOG<<"too many images inserted! "<<endl;
             exit(0);
         }
-        LOG<<VAR(m_medianFilterImage->GetLargestPossibleRegion().GetSize())<<endl;
-        ImageIteratorType imgIt(img,img->GetLargestPossibleRegion());
-        imgIt.GoToBegin();
-        
-        for (m_medianIterator.GoToBegin();!m_medianIterator.IsAtEnd();++m_medianIterator,++imgIt){
-
-            MedianFilterPixelType  px=m_medianIterator.Get();
-            insertValue(imgIt.Get(),px);
-            m_medianIterator.Set(px);
-            
-        }
+        const PixelType * buffer=img->GetBufferPointer();
+        std::copy(buffer,buffer+m_nPixels,m_samples.begin()+m_sequenceCount*m_nPixels);
         ++m_sequenceCount;
     }
 
     ImagePointerType getMedian(){
-        ImageIteratorType imgIt(m_medianImage,m_medianImage->GetLargestPossibleRegion());
-        imgIt.GoToBegin();
-        for (m_medianIterator.GoToBegin();!m_medianIterator.IsAtEnd();++m_medianIterator,++imgIt){
-            MedianFilterPixelType m=m_medianIterator.Get();
-
-            PixelType localMedian=m[ int((0.51+m_sequenceCount)/2)];
-            imgIt.Set(localMedian);
-        }
-        return m_medianImage;
+        return getQuantile(0.5);
     }
 
-    void insertValue(PixelType p,MedianFilterPixelType  & medianVector){
-        if (p<0){
-            LOG<<"ERROR, median filter is setup to only handle positive values!" <<endl;
+    ///pixelwise quantile of the inserted images, the sample at sorted position q*(n-1) (rounded down)
+    ImagePointerType getQuantile(double q){
+        if (!m_sequenceCount){
+            LOG<<"no images inserted into median filter!"<<endl;
+            exit(-1);
         }
-        //insertion sort :/
-        int i=0;
-        for (;i<m_sequenceLength;++i){
-            if (p>(medianVector)[i]){
-                break;
-            }
+        if (!(q>=0.0 && q<=1.0)){
+            LOG<<"median filter: quantile "<<q<<" is not in [0,1]"<<endl;
+            exit(-1);
         }
-        PixelType tmp=(medianVector)[i];
-        (medianVector)[i]=p;
-        for (int j=i+1;j<m_sequenceLength-1;++j){
-            PixelType tmp2=(medianVector)[j];
-            (medianVector)[j]=tmp;
-            tmp=tmp2;
+        PixelType * result=m_medianImage->GetBufferPointer();
+        int rank=int(q*(m_sequenceCount-1));
+        long int nTiles=(m_nPixels+TileSize-1)/TileSize;
+#pragma omp parallel
+        {
+            std::vector<float> tile(TileSize*m_sequenceCount);
+#pragma omp for
+            for (long int t=0;t<nTiles;++t){
+                long int start=t*TileSize;
+                long int end=std::min(m_nPixels,start+TileSize);
+                for (int s=0;s<m_sequenceCount;++s){
+                    const float * row=&m_samples[s*m_nPixels];
+                    for (long int p=start;p<end;++p)
+                        tile[(p-start)*m_sequenceCount+s]=row[p];
+                }
+                for (long int p=start;p<end;++p){
+                    float * samples=&tile[(p-start)*m_sequenceCount];
+                    std::nth_element(samples,samples+rank,samples+m_sequenceCount);
+                    result[p]=samples[rank];
+                }
+            }
         }
+        return m_medianImage;
     }
 
-
 };
@@ -0,0 +1,564 @@
+#pragma once
+
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkImageIOFactory.h"
+#include "itkImageAlgorithm.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkContinuousIndex.h"
+#include <itksys/SystemTools.hxx>
+#include "Log.h"
+#include "ImageUtils.h"
+#include "TransformationUtils.h"
+#include "Metrics.h"
+#include <vector>
+#include <string>
+#include <cmath>
+#include <limits>
+
+///out-of-core versions of warping, resampling, composition and local similarity for volumes which do not fit into memory.
+///
+///the output is processed in slabs along the last image dimension, as many slices at once as fit into a memory budget.
+///each slab only reads the parts of the inputs it depends on: the same region of the deformation, the bounding box of the
+///deformed slab in the moving image (or in the next field of a composition), or the slab grown by a halo for neighborhood
+///operations. the result of each slab is pasted into the output file.
+///reading and writing parts of a file needs a format which supports it (e.g. uncompressed .mha/.mhd), other files are
+///read completely once, and the output is assembled in memory before it is written.
+///tiles keep the index of their region in the full image, so all geometry computations are the same as without tiling.
+
+///reads regions of an image file
+template<class ImageType>
+class StreamedImageReader{
+public:
+    typedef typename ImageType::Pointer ImagePointerType;
+    typedef typename ImageType::ConstPointer ConstImagePointerType;
+    typedef typename ImageType::RegionType RegionType;
+    typedef itk::ImageFileReader<ImageType> ReaderType;
+    static const int D=ImageType::ImageDimension;
+
+private:
+    std::string m_filename;
+    ///geometry of the file, without pixel buffer
+    ImagePointerType m_information;
+    ///complete image, if the file cannot be read in parts
+    ImagePointerType m_image;
+    bool m_streaming;
+
+public:
+    StreamedImageReader(std::string filename){
+        m_filename=filename;
+        m_information=readInformation(filename,&m_streaming);
+        if (!m_streaming){
+            LOGV(1)<<filename<<" cannot be read in parts, reading the whole image"<<std::endl;
+            m_image=ImageUtils<ImageType>::readImage(filename);
+        }
+    }
+    ConstImagePointerType getInformation(){return (ConstImagePointerType)m_information;}
+    RegionType getLargestRegion(){return m_information->GetLargestPossibleRegion();}
+
+    ///reads a region of the file, the result has the geometry of the file and the region as largest possible region
+    ImagePointerType read(RegionType region){
+        if (!m_streaming)
+            return crop((ConstImagePointerType)m_image,region);
+        typename ReaderType::Pointer reader=ReaderType::New();
+        reader->SetFileName(m_filename);
+        try{
+            reader->UpdateOutputInformation();
+            reader->GetOutput()->SetRequestedRegion(region);
+            reader->Update();
+        }
+        catch( itk::ExceptionObject & err ){
+            LOG<<"Could not read region "<<region<<" from "<<m_filename<<", aborting"<<std::endl;
+            LOG<<err<<std::endl;
+            exit(-1);
+        }
+        //the reader may return a larger buffer than requested
+        return crop((ConstImagePointerType)reader->GetOutput(),region);
+    }
+
+    ///geometry of an image file without reading its pixels, streaming is set to whether the file can be read in parts
+    static ImagePointerType readInformation(std::string filename, bool * streaming=NULL){
+        typename ReaderType::Pointer reader=ReaderType::New();
+        reader->SetFileName(filename);
+        try{
+            reader->UpdateOutputInformation();
+        }
+        catch( itk::ExceptionObject & err ){
+            LOG<<"Could not read image information from "<<filename<<", aborting"<<std::endl;
+            LOG<<err<<std::endl;
+            exit(-1);
+        }
+        if (streaming)
+            *streaming=reader->GetImageIO()->CanStreamRead();
+        return createGeometry(reader->GetOutput());
+    }
+    ///image without pixel buffer with the largest possible region, origin, spacing and direction of geometry
+    static ImagePointerType createGeometry(const itk::ImageBase<D> * geometry){
+        ImagePointerType result=ImageType::New();
+        result->SetRegions(geometry->GetLargestPossibleRegion());
+        result->SetOrigin(geometry->GetOrigin());
+        result->SetSpacing(geometry->GetSpacing());
+        result->SetDirection(geometry->GetDirection());
+        return result;
+    }
+
+    ///copy of a region of an image, keeping the index of the region
+    static ImagePointerType crop(ConstImagePointerType image, RegionType region){
+        ImagePointerType result=ImageType::New();
+        result->CopyInformation(image);
+        result->SetRegions(region);
+        result->Allocate();
+        itk::ImageAlgorithm::Copy(image.GetPointer(),result.GetPointer(),region,region);
+        return result;
+    }
+};
+
+///writes an image file region by region
+template<class ImageType>
+class StreamedImageWriter{
+public:
+    typedef typename ImageType::Pointer ImagePointerType;
+    typedef typename ImageType::ConstPointer ConstImagePointerType;
+    typedef typename ImageType::RegionType RegionType;
+    typedef itk::ImageFileWriter<ImageType> WriterType;
+    static const int D=ImageType::ImageDimension;
+
+private:
+    std::string m_filename;
+    ImagePointerType m_information;
+    ///output assembled in memory, if the format cannot be written in parts
+    ImagePointerType m_image;
+    bool m_streaming;
+
+public:
+    ///geometry: image whose largest possible region, origin, spacing and direction the output gets
+    StreamedImageWriter(std::string filename, const itk::ImageBase<D> * geometry){
+        m_filename=filename;
+        m_information=StreamedImageReader<ImageType>::createGeometry(geometry);
+        itk::ImageIOBase::Pointer io=itk::ImageIOFactory::CreateImageIO(filename.c_str(),itk::ImageIOFactory::WriteMode);
+        m_streaming=io.IsNotNull() && io->CanStreamWrite();
+        if (m_streaming){
+            //regions can only be pasted into a file with the same geometry, so start from a new one
+            itksys::SystemTools::RemoveFile(filename.c_str());
+        }else{
+            LOGV(1)<<filename<<" cannot be written in parts, assembling the output in memory"<<std::endl;
+            m_image=ImageType::New();
+            m_image->CopyInformation(m_information);
+            m_image->SetRegions(m_information->GetLargestPossibleRegion());
+            m_image->Allocate();
+        }
+    }
+
+    ///writes the pixels of tile to region of the output, both have to be of the same size
+    void write(ConstImagePointerType tile, RegionType region){
+        ImagePointerType target=m_image;
+        if (m_streaming){
+            target=ImageType::New();
+            target->CopyInformation(m_information);
+            target->SetBufferedRegion(region);
+            target->SetRequestedRegion(region);
+            target->Allocate();
+        }
+        itk::ImageRegionConstIterator<ImageType> tileIt(tile,tile->GetLargestPossibleRegion());
+        itk::ImageRegionIterator<ImageType> targetIt(target,region);
+        for (tileIt.GoToBegin(),targetIt.GoToBegin();!targetIt.IsAtEnd();++tileIt,++targetIt){
+            targetIt.Set(tileIt.Get());
+        }
+        if (!m_streaming)
+            return;
+        itk::ImageIORegion ioRegion(D);
+        for (int d=0;d<D;++d){
+            ioRegion.SetIndex(d,region.GetIndex()[d]);
+            ioRegion.SetSize(d,region.GetSize()[d]);
+        }
+        typename WriterType::Pointer writer=WriterType::New();
+        writer->SetFileName(m_filename);
+        writer->SetInput(target);
+        writer->SetIORegion(ioRegion);
+        try{
+            writer->Update();
+        }
+        catch( itk::ExceptionObject & err ){
+            LOG<<"Could not write region "<<region<<" to "<<m_filename<<", aborting"<<std::endl;
+            LOG<<err<<std::endl;
+            exit(-1);
+        }
+    }
+    ///writes the output if it was assembled in memory
+    void finish(){
+        if (!m_streaming)
+            ImageUtils<ImageType>::writeImage(m_filename,m_image);
+    }
+};
+
+///tiled warping, resampling and composition of deformations, see above
+template<class ImageType, class CDisplacementPrecision=float>
+class TiledImageUtils{
+public:
+    typedef typename ImageType::Pointer ImagePointerType;
+    typedef typename ImageType::ConstPointer ConstImagePointerType;
+    typedef typename ImageType::PixelType PixelType;
+    typedef typename ImageType::RegionType RegionType;
+    typedef typename ImageType::IndexType IndexType;
+    typedef typename ImageType::SizeType SizeType;
+    typedef typename ImageType::PointType PointType;
+    static const int D=ImageType::ImageDimension;
+    typedef itk::ContinuousIndex<double,D> ContinuousIndexType;
+
+    typedef TransfUtils<ImageType,CDisplacementPrecision> TransfUtilsType;
+    typedef typename TransfUtilsType::DisplacementType DisplacementType;
+    typedef typename TransfUtilsType::DeformationFieldType DeformationFieldType;
+    typedef typename DeformationFieldType::Pointer DeformationFieldPointerType;
+    typedef typename DeformationFieldType::ConstPointer DeformationFieldConstPointerType;
+
+    typedef StreamedImageReader<ImageType> ReaderType;
+    typedef StreamedImageWriter<ImageType> WriterType;
+    typedef StreamedImageReader<DeformationFieldType> DeformationReaderType;
+    typedef StreamedImageWriter<DeformationFieldType> DeformationWriterType;
+
+    ///margin in coarse voxels around a slab when interpolating a deformation with bsplines.
+    ///the bspline coefficients are computed from the cropped field, its boundary effect has decayed within the margin.
+    static const int BSplineMargin=8;
+
+    ///continuous index bounds of a set of points in an image
+    class IndexBounds{
+        double m_lower[D],m_upper[D];
+        bool m_empty;
+    public:
+        IndexBounds(){
+            m_empty=true;
+            for (int d=0;d<D;++d){
+                m_lower[d]=std::numeric_limits<double>::max();
+                m_upper[d]=-std::numeric_limits<double>::max();
+            }
+        }
+        void add(const ContinuousIndexType & idx){
+            m_empty=false;
+            for (int d=0;d<D;++d){
+                m_lower[d]=std::min(m_lower[d],idx[d]);
+                m_upper[d]=std::max(m_upper[d],idx[d]);
+            }
+        }
+        ///integer bounding box grown by margin voxels, clamped to bounds.
+        ///points outside of bounds are moved onto its border, so the box contains the voxels used by nearest neighbor extrapolation.
+        RegionType region(RegionType bounds, int margin){
+            IndexType start;
+            SizeType size;
+            for (int d=0;d<D;++d){
+                double first=bounds.GetIndex()[d];
+                double last=first+bounds.GetSize()[d]-1;
+                double lower=m_empty?first:std::min(last,std::max(first,std::floor(m_lower[d])-margin));
+                double upper=m_empty?first:std::max(first,std::min(last,std::ceil(m_upper[d])+margin));
+                start[d]=(long int)lower;
+                size[d]=(long int)(upper-lower)+1;
+            }
+            return RegionType(start,size);
+        }
+    };
+
+    ///splits region into slabs along the last dimension, with as many slices as fit into the memory budget.
+    ///bytesPerVoxel: memory needed per output voxel, halo: slices which are additionally read on each side of a slab
+    static std::vector<RegionType> slabs(RegionType region, double bytesPerVoxel, double memoryBudgetMB, int halo=0){
+        SizeType size=region.GetSize();
+        double sliceBytes=bytesPerVoxel;
+        for (int d=0;d<D-1;++d)
+            sliceBytes*=size[d];
+        long int slices=size[D-1];
+        if (memoryBudgetMB>0){
+            slices=std::min(slices,(long int)(memoryBudgetMB*1024*1024/sliceBytes)-2*halo);
+            if (slices<1){
+                LOG<<"memory budget of "<<memoryBudgetMB<<"MB is too small for a single slice, processing one slice at a time"<<std::endl;
+                slices=1;
+            }
+        }
+        std::vector<RegionType> result;
+        for (long int first=0;first<(long int)size[D-1];first+=slices){
+            RegionType slab=region;
+            slab.SetIndex(D-1,region.GetIndex()[D-1]+first);
+            slab.SetSize(D-1,std::min(slices,(long int)size[D-1]-first));
+            result.push_back(slab);
+        }
+        LOGV(1)<<"processing "<<size<<" voxels in "<<result.size()<<" slabs of up to "<<slices<<" slices"<<std::endl;
+        return result;
+    }
+
+    ///moves the region of an image to start at index, keeping its physical position
+    template<class TImage>
+    static void moveRegion(TImage * image, IndexType index){
+        RegionType region=image->GetLargestPossibleRegion();
+        PointType start;
+        image->TransformIndexToPhysicalPoint(region.GetIndex(),start);
+        PointType origin;
+        for (int i=0;i<D;++i){
+            origin[i]=start[i];
+            for (int j=0;j<D;++j)
+                origin[i]-=image->GetDirection()[i][j]*image->GetSpacing()[j]*index[j];
+        }
+        region.SetIndex(index);
+        image->SetRegions(region);
+        image->SetOrigin(origin);
+    }
+
+    ///minimum of an image file, used as fill value for warping, like TransfUtils::warpImage does with the full image
+    static PixelType getMin(ReaderType & reader, double memoryBudgetMB){
+        PixelType result=std::numeric_limits<PixelType>::max();
+        std::vector<RegionType> tiles=slabs(reader.getLargestRegion(),sizeof(PixelType),memoryBudgetMB);
+        for (unsigned int t=0;t<tiles.size();++t){
+            ImagePointerType tile=reader.read(tiles[t]);
+            itk::ImageRegionConstIterator<ImageType> it(tile,tiles[t]);
+            for (it.GoToBegin();!it.IsAtEnd();++it)
+                result=std::min(result,it.Get());
+        }
+        return result;
+    }
+
+    ///deformation on region of target, interpolated from a field with different geometry if necessary
+    static DeformationFieldPointerType readDeformation(DeformationReaderType & deformation, ConstImagePointerType target, RegionType region, bool linear){
+        DeformationFieldConstPointerType coarseInformation=deformation.getInformation();
+        if (coarseInformation->GetLargestPossibleRegion()==target->GetLargestPossibleRegion() && coarseInformation->GetSpacing()==target->GetSpacing() && coarseInformation->GetOrigin()==target->GetOrigin()){
+            DeformationFieldPointerType result=deformation.read(region);
+            result->SetDirection(target->GetDirection());
+            return result;
+        }
+        //slab as standalone reference image
+        ImagePointerType reference=ImageType::New();
+        reference->CopyInformation(target);
+        reference->SetRegions(region);
+        IndexType zero;
+        zero.Fill(0);
+        moveRegion(reference.GetPointer(),zero);
+        //coarse voxels the slab depends on, the deformation is assumed to have the direction of the target
+        DeformationFieldPointerType coarseGeometry=DeformationFieldType::New();
+        coarseGeometry->CopyInformation(coarseInformation);
+        coarseGeometry->SetDirection(target->GetDirection());
+        //corners of the slab are sufficient, since the mapping between the grids is affine
+        IndexBounds bounds;
+        for (int c=0;c<(1<<D);++c){
+            IndexType corner=region.GetIndex();
+            for (int d=0;d<D;++d){
+                if (c&(1<<d))
+                    corner[d]+=region.GetSize()[d]-1;
+            }
+            PointType p;
+            target->TransformIndexToPhysicalPoint(corner,p);
+            ContinuousIndexType idx;
+            coarseGeometry->TransformPhysicalPointToContinuousIndex(p,idx);
+            bounds.add(idx);
+        }
+        DeformationFieldPointerType coarse=deformation.read(bounds.region(coarseInformation->GetLargestPossibleRegion(),linear?1:BSplineMargin));
+        coarse->SetDirection(target->GetDirection());
+        moveRegion(coarse.GetPointer(),zero);
+        DeformationFieldPointerType result;
+        if (linear){
+            result=TransfUtilsType::linearInterpolateDeformationField(coarse,(ConstImagePointerType)reference);
+        }else{
+            result=TransfUtilsType::bSplineInterpolateDeformationField(coarse,(ConstImagePointerType)reference);
+        }
+        result->SetRegions(region);
+        result->SetOrigin(target->GetOrigin());
+        return result;
+    }
+
+    ///warps moving with a tile of a deformation, reading only the bounding box of the deformed tile.
+    ///points outside of the moving image get fillValue, which should be the minimum of the whole image.
+    static ImagePointerType warpTile(ReaderType & moving, DeformationFieldPointerType deformation, PixelType fillValue, bool nnInterpol){
+        ConstImagePointerType information=moving.getInformation();
+        IndexBounds bounds;
+        itk::ImageRegionConstIteratorWithIndex<DeformationFieldType> it(deformation,deformation->GetLargestPossibleRegion());
+        for (it.GoToBegin();!it.IsAtEnd();++it){
+            PointType p;
+            deformation->TransformIndexToPhysicalPoint(it.GetIndex(),p);
+            p+=it.Get();
+            ContinuousIndexType idx;
+            information->TransformPhysicalPointToContinuousIndex(p,idx);
+            bounds.add(idx);
+        }
+        ImagePointerType movingTile=moving.read(bounds.region(moving.getLargestRegion(),1));
+        std::pair<ImagePointerType,ImagePointerType> warped=TransfUtilsType::warpImageWithMask(movingTile,deformation,nnInterpol);
+        //the fill value used by warpImageWithMask is the minimum of the tile
+        itk::ImageRegionIterator<ImageType> imageIt(warped.first,warped.first->GetLargestPossibleRegion());
+        itk::ImageRegionConstIterator<ImageType> maskIt(warped.second,warped.second->GetLargestPossibleRegion());
+        for (imageIt.GoToBegin(),maskIt.GoToBegin();!imageIt.IsAtEnd();++imageIt,++maskIt){
+            if (!maskIt.Get())
+                imageIt.Set(fillValue);
+        }
+        return warped.first;
+    }
+
+    ///tiled TransfUtils::warpImage of files.
+    ///if targetFile is given, the deformation is interpolated to its geometry (linearly or with bsplines) like in DeformImage3D
+    static void warpImage(std::string movingFile, std::string deformationFile, std::string outputFile, double memoryBudgetMB, bool nnInterpol=false, std::string targetFile="", bool linearDeformation=false){
+        ReaderType moving(movingFile);
+        DeformationReaderType deformation(deformationFile);
+        ConstImagePointerType target;
+        if (targetFile!=""){
+            target=(ConstImagePointerType)ReaderType::readInformation(targetFile);
+        }else{
+            target=(ConstImagePointerType)ReaderType::createGeometry(deformation.getInformation().GetPointer());
+        }
+        PixelType fillValue=getMin(moving,memoryBudgetMB);
+        WriterType writer(outputFile,target.GetPointer());
+        std::vector<RegionType> tiles=slabs(target->GetLargestPossibleRegion(),3*sizeof(PixelType)+3*sizeof(DisplacementType),memoryBudgetMB);
+        for (unsigned int t=0;t<tiles.size();++t){
+            LOGV(2)<<"warping slab "<<t+1<<"/"<<tiles.size()<<std::endl;
+            DeformationFieldPointerType deformationTile=readDeformation(deformation,target,tiles[t],linearDeformation);
+            writer.write((ConstImagePointerType)warpTile(moving,deformationTile,fillValue,nnInterpol),tiles[t]);
+        }
+        writer.finish();
+    }
+
+    ///tiled resampling of an image to the geometry of a reference image
+    static void resampleImage(std::string inputFile, std::string referenceFile, std::string outputFile, double memoryBudgetMB, bool nnInterpol=false){
+        ReaderType input(inputFile);
+        ConstImagePointerType reference=(ConstImagePointerType)ReaderType::readInformation(referenceFile);
+        PixelType fillValue=getMin(input,memoryBudgetMB);
+        WriterType writer(outputFile,reference.GetPointer());
+        std::vector<RegionType> tiles=slabs(reference->GetLargestPossibleRegion(),3*sizeof(PixelType)+sizeof(DisplacementType),memoryBudgetMB);
+        for (unsigned int t=0;t<tiles.size();++t){
+            DeformationFieldPointerType identity=DeformationReaderType::createGeometry(reference.GetPointer());
+            identity->SetRegions(tiles[t]);
+            identity->Allocate();
+            DisplacementType zero;
+            zero.Fill(0.0);
+            identity->FillBuffer(zero);
+            writer.write((ConstImagePointerType)warpTile(input,identity,fillValue,nnInterpol),tiles[t]);
+        }
+        writer.finish();
+    }
+
+    ///composition of the first k+1 fields on region of the grid of field k
+    static DeformationFieldPointerType composeRegion(std::vector<DeformationReaderType*> & fields, int k, RegionType region){
+        DeformationFieldPointerType right=fields[k]->read(region);
+        if (k==0)
+            return right;
+        DeformationFieldConstPointerType leftInformation=fields[k-1]->getInformation();
+        IndexBounds bounds;
+        itk::ImageRegionConstIteratorWithIndex<DeformationFieldType> it(right,region);
+        for (it.GoToBegin();!it.IsAtEnd();++it){
+            PointType p;
+            right->TransformIndexToPhysicalPoint(it.GetIndex(),p);
+            p+=it.Get();
+            ContinuousIndexType idx;
+            leftInformation->TransformPhysicalPointToContinuousIndex(p,idx);
+            bounds.add(idx);
+        }
+        DeformationFieldPointerType left=composeRegion(fields,k-1,bounds.region(leftInformation->GetLargestPossibleRegion(),1));
+        return TransfUtilsType::composeDeformations(right,left);
+    }
+
+    ///tiled composition of deformation files: field i is composed with the composition of the previous ones,
+    ///the result is on the grid of the last field. for two fields this is TransfUtils::composeDeformations(fields[1],fields[0])
+    static void composeDeformations(std::vector<std::string> fieldFiles, std::string outputFile, double memoryBudgetMB){
+        std::vector<DeformationReaderType*> fields;
+        for (unsigned int i=0;i<fieldFiles.size();++i)
+            fields.push_back(new DeformationReaderType(fieldFiles[i]));
+        int last=fields.size()-1;
+        DeformationWriterType writer(outputFile,fields[last]->getInformation().GetPointer());
+        std::vector<RegionType> tiles=slabs(fields[last]->getLargestRegion(),3*sizeof(DisplacementType)*fields.size(),memoryBudgetMB);
+        for (unsigned int t=0;t<tiles.size();++t){
+            LOGV(2)<<"composing slab "<<t+1<<"/"<<tiles.size()<<std::endl;
+            writer.write((DeformationFieldConstPointerType)composeRegion(fields,last,tiles[t]),tiles[t]);
+        }
+        writer.finish();
+        for (unsigned int i=0;i<fields.size();++i)
+            delete fields[i];
+    }
+};
+
+///tiled local similarity maps (Metrics::efficientLNCC, LSSDNorm, LSADNorm).
+///the gaussian windows are truncated at HaloSigmas standard deviations: each slab is computed with a halo of that width,
+///so the result differs from the untiled computation only by the tail of the recursive gaussian at inner slab borders.
+template<class ImageType, class FloatImageType>
+class TiledMetrics{
+public:
+    typedef typename ImageType::Pointer ImagePointerType;
+    typedef typename ImageType::ConstPointer ConstImagePointerType;
+    typedef typename ImageType::RegionType RegionType;
+    typedef typename FloatImageType::Pointer FloatImagePointerType;
+    typedef typename FloatImageType::ConstPointer ConstFloatImagePointerType;
+    static const int D=ImageType::ImageDimension;
+    typedef TiledImageUtils<ImageType> TiledUtilsType;
+    typedef typename TiledUtilsType::ReaderType ReaderType;
+    typedef typename TiledUtilsType::DeformationReaderType DeformationReaderType;
+    typedef typename TiledUtilsType::DeformationFieldPointerType DeformationFieldPointerType;
+    typedef Metrics<ImageType,FloatImageType> MetricsType;
+    enum LocalMetricType {LNCC,LSSD,LSAD};
+    static const int HaloSigmas=4;
+
+private:
+    ///tile of the second image, warped with the deformation if there is one
+    static ImagePointerType readMoving(ReaderType & image, DeformationReaderType * deformation, ConstImagePointerType target, RegionType region, typename ImageType::PixelType fillValue){
+        if (!deformation)
+            return image.read(region);
+        DeformationFieldPointerType deformationTile=TiledUtilsType::readDeformation(*deformation,target,region,false);
+        return TiledUtilsType::warpTile(image,deformationTile,fillValue,false);
+    }
+
+public:
+    ///local similarity of image2 (warped with deformationFile if not empty) and image1, written to outputFile.
+    ///sigma: width of the local window in mm, gamma: metric specific scaling as in Metrics.
+    ///LSSD and LSAD derive the scaling from the whole image if gamma is 0, which is done in a first pass over all slabs.
+    static void localSimilarity(std::string image1File, std::string image2File, std::string deformationFile, std::string outputFile,
+                                LocalMetricType metric, double sigma, double gamma, double memoryBudgetMB){
+        ReaderType image1(image1File);
+        ReaderType image2(image2File);
+        ConstImagePointerType target=image1.getInformation();
+        DeformationReaderType * deformation=NULL;
+        typename ImageType::PixelType fillValue=0;
+        if (deformationFile!=""){
+            deformation=new DeformationReaderType(deformationFile);
+            fillValue=TiledUtilsType::getMin(image2,memoryBudgetMB);
+        }
+        RegionType largest=target->GetLargestPossibleRegion();
+        typename RegionType::SizeType halo;
+        for (int d=0;d<D;++d)
+            halo[d]=(long int)std::ceil(HaloSigmas*std::max(sigma,0.001)/target->GetSpacing()[d]);
+        double bytesPerVoxel=12*sizeof(float)+4*sizeof(typename ImageType::PixelType);
+
+        if (gamma==0.0 && metric!=LNCC){
+            //global statistic of the differences, as computed by LSSDNorm and LSADNorm for the whole image
+            std::vector<RegionType> tiles=TiledUtilsType::slabs(largest,bytesPerVoxel,memoryBudgetMB);
+            double maxSquare=0.0,sumAbs=0.0;
+            for (unsigned int t=0;t<tiles.size();++t){
+                ImagePointerType tile1=image1.read(tiles[t]);
+                ImagePointerType tile2=readMoving(image2,deformation,target,tiles[t],fillValue);
+                itk::ImageRegionConstIterator<ImageType> it1(tile1,tiles[t]),it2(tile2,tiles[t]);
+                for (it1.GoToBegin(),it2.GoToBegin();!it1.IsAtEnd();++it1,++it2){
+                    double d=1.0*it1.Get()-it2.Get();
+                    maxSquare=std::max(maxSquare,d*d);
+                    sumAbs+=fabs(d);
+                }
+            }
+            gamma=(metric==LSSD)?sqrt(-0.005*maxSquare/log(0.1)):sumAbs/largest.GetNumberOfPixels();
+            LOGV(1)<<"global metric scaling "<<VAR(gamma)<<std::endl;
+        }
+
+        StreamedImageWriter<FloatImageType> writer(outputFile,target.GetPointer());
+        std::vector<RegionType> tiles=TiledUtilsType::slabs(largest,bytesPerVoxel,memoryBudgetMB,halo[D-1]);
+        for (unsigned int t=0;t<tiles.size();++t){
+            LOGV(2)<<"computing local similarity of slab "<<t+1<<"/"<<tiles.size()<<std::endl;
+            RegionType grown=tiles[t];
+            grown.PadByRadius(halo);
+            grown.Crop(largest);
+            ImagePointerType tile1=image1.read(grown);
+            ImagePointerType tile2=readMoving(image2,deformation,target,grown,fillValue);
+            FloatImagePointerType result;
+            switch(metric){
+            case LSSD:
+                result=MetricsType::LSSDNorm(tile2,tile1,sigma,gamma);
+                break;
+            case LSAD:
+                result=MetricsType::LSADNorm(tile2,tile1,sigma,gamma);
+                break;
+            default:
+                result=MetricsType::efficientLNCC(tile2,tile1,sigma,gamma);
+            }
+            writer.write((ConstFloatImagePointerType)StreamedImageReader<FloatImageType>::crop((ConstFloatImagePointerType)result,tiles[t]),tiles[t]);
+        }
+        writer.finish();
+        if (deformation)
+            delete deformation;
+    }
+};
@@ -2,6 +2,8 @@
 
 
 #include <limits.h>
+#include <vector>
+#include <algorithm>
 #include "itkImage.h"
 #include "itkImageRegion.h"
 #include "itkImageRegionIteratorWithIndex.h"
@@ -544,6 +546,176 @@ public:
   
 
     
+};//class
+
+///weighted mean and variance of a set of deformation hypotheses, optionally refined by local mean shift.
+///
+///addImage accumulates the weights and the weighted first and second moments of each pixel in one pass over the hypothesis (in parallel if OpenMP is enabled),
+///so memory does not grow with the number of hypotheses. finalize() then computes mean and variance from the running sums.
+///only if mean shift is enabled (setMeanShift has to be called before the first addImage) the hypotheses and their weights are kept:
+///mean shift iterations (same kernel as LocalVectorMeanShift, times the hypothesis weights) start from the weighted mean
+///and run per pixel, until the L1 norm of the shift of that pixel is below the convergence criterion.
+///
+///interface of GaussianEstimatorVectorImage. with weights the variance is the weighted variance around the weighted mean,
+///without any weights it is sum(x^2)/(count-1)-mean^2, the same normalization GaussianEstimatorVectorImage uses.
+template<class ImageType,class FloatPrecision=float>
+class FusedGaussianEstimatorVectorImage{
+
+public:
+    typedef TransfUtils<ImageType, float,double,FloatPrecision> TransfUtilsType;
+    typedef typename TransfUtilsType::DisplacementType DeformationType;
+    typedef typename TransfUtilsType::DeformationFieldType DeformationFieldType;
+    typedef typename DeformationFieldType::Pointer DeformationFieldPointerType;
+    typedef typename ImageUtils<ImageType,FloatPrecision>::FloatImageType FloatImageType;
+    typedef typename FloatImageType::Pointer FloatImagePointerType;
+    static const int D=ImageType::ImageDimension;
+    static const int TileSize=1024;
+
+private:
+    ///only filled if mean shift is enabled
+    std::vector<DeformationFieldPointerType> m_hypotheses;
+    std::vector<FloatImagePointerType> m_weights;
+    ///running sums per pixel: weights, weighted displacements and weighted squared displacements (D per pixel)
+    std::vector<double> m_sumWeights,m_sums,m_sumSquares;
+    DeformationFieldPointerType m_reference;
+    int m_count;
+    bool m_weighted;
+    DeformationFieldPointerType m_mean,m_variance;
+    double m_sigma,m_convergenceCriterion;
+    int m_maxIterations;
+public:
+    FusedGaussianEstimatorVectorImage(){
+        m_sigma=0.0;
+        m_maxIterations=0;
+        m_convergenceCriterion=0.1;
+        m_count=0;
+        m_weighted=false;
+    }
+    ///enables mean shift with a gaussian kernel of variance sigma (in squared displacement units)
+    void setMeanShift(double sigma, int maxIterations=20, double convergenceCriterion=0.1){
+        if (m_count){
+            LOG<<"mean shift has to be enabled before the first hypothesis is added, aborting"<<endl;
+            exit(-1);
+        }
+        m_sigma=sigma;
+        m_maxIterations=sigma>0.0?maxIterations:0;
+        m_convergenceCriterion=convergenceCriterion;
+    }
+    ///hypotheses without weights are weighted with 1
+    void addImage(DeformationFieldPointerType img,FloatImagePointerType weights=NULL){
+        long int nPixels=img->GetLargestPossibleRegion().GetNumberOfPixels();
+        if (m_count==0){
+            m_reference=img;
+            m_sumWeights.assign(nPixels,0.0);
+            m_sums.assign(nPixels*D,0.0);
+            m_sumSquares.assign(nPixels*D,0.0);
+        }else if ((long int)m_sumWeights.size()!=nPixels){
+            LOG<<"deformation hypotheses have different sizes, aborting"<<endl;
+            exit(-1);
+        }
+        const DeformationType * def=img->GetBufferPointer();
+        const FloatPrecision * w=weights.IsNotNull()?weights->GetBufferPointer():NULL;
+        m_weighted=m_weighted || w;
+#pragma omp parallel for schedule(static,TileSize)
+        for (long int p=0;p<nPixels;++p){
+            double weight=w?w[p]:1.0;
+            m_sumWeights[p]+=weight;
+            for (int d=0;d<D;++d){
+                double x=def[p][d];
+                m_sums[p*D+d]+=weight*x;
+                m_sumSquares[p*D+d]+=weight*x*x;
+            }
+        }
+        if (m_maxIterations){
+            m_hypotheses.push_back(img);
+            m_weights.push_back(weights);
+        }
+        ++m_count;
+    }
+    int getCount(){return m_count;}
+
+    void finalize(){
+        if (m_count==0){
+            LOG<<"no deformations to compute statistics of..." <<endl;
+            return;
+        }
+        if (!m_weighted && m_count==1){
+            LOGV(2)<<"Warning, only one observation in gauss estimator, variance estimator will not be usefull"<<endl;
+        }
+        m_mean=TransfUtilsType::createEmpty(m_reference);
+        m_variance=TransfUtilsType::createEmpty(m_reference);
+        long int nPixels=m_sumWeights.size();
+        int nHypotheses=m_hypotheses.size();
+        std::vector<const DeformationType *> hypotheses(nHypotheses);
+        std::vector<const FloatPrecision *> weights(nHypotheses);
+        for (int h=0;h<nHypotheses;++h){
+            hypotheses[h]=m_hypotheses[h]->GetBufferPointer();
+            weights[h]=m_weights[h].IsNotNull()?m_weights[h]->GetBufferPointer():NULL;
+        }
+        //unweighted second moments are normalized like in GaussianEstimatorVectorImage
+        double squareNormalization=(!m_weighted && m_count>1)?1.0*m_count/(m_count-1):1.0;
+        DeformationType * meanBuffer=m_mean->GetBufferPointer();
+        DeformationType * varianceBuffer=m_variance->GetBufferPointer();
+        long int totalIterations=0;
+#pragma omp parallel for schedule(dynamic,TileSize) reduction(+:totalIterations)
+        for (long int p=0;p<nPixels;++p){
+            DeformationType mean,variance;
+            mean.Fill(0.0);
+            variance.Fill(0.0);
+            if (m_sumWeights[p]>0.0){
+                for (int d=0;d<D;++d){
+                    double m=m_sums[p*D+d]/m_sumWeights[p];
+                    mean[d]=m;
+                    variance[d]=std::max(0.0,squareNormalization*m_sumSquares[p*D+d]/m_sumWeights[p]-m*m);
+                }
+                if (nHypotheses)
+                    totalIterations+=meanShift(mean,hypotheses,weights,p);
+            }
+            meanBuffer[p]=mean;
+            varianceBuffer[p]=variance;
+        }
+        if (m_maxIterations){
+            LOGV(2)<<"Mean shift: average iterations per pixel "<<1.0*totalIterations/nPixels<<endl;
+        }
+    }
+
+    DeformationFieldPointerType getMean(){return m_mean;}
+    DeformationFieldPointerType getVariance(){return m_variance;}
+    DeformationFieldPointerType getStdDev(){return TransfUtilsType::localSqrt(m_variance);}
+
+private:
+    ///mean shift of one pixel, starting at mean. returns the number of iterations.
+    int meanShift(DeformationType & mean, const std::vector<const DeformationType *> & hypotheses, const std::vector<const FloatPrecision *> & weights, long int pixel){
+        int iter=0;
+        for (;iter<m_maxIterations;++iter){
+            double sumWeights=0.0;
+            double sums[D];
+            for (int d=0;d<D;++d) sums[d]=0.0;
+            for (size_t h=0;h<hypotheses.size();++h){
+                const DeformationType & x=hypotheses[h][pixel];
+                double dist=0.0;
+                for (int d=0;d<D;++d)
+                    dist+=(x[d]-mean[d])*(x[d]-mean[d]);
+                double weight=exp(-0.5*dist/m_sigma)*(weights[h]?weights[h][pixel]:1.0);
+                sumWeights+=weight;
+                for (int d=0;d<D;++d)
+                    sums[d]+=weight*x[d];
+            }
+            if (!(sumWeights>0.0))
+                break;
+            double shift=0.0;
+            for (int d=0;d<D;++d){
+                double m=sums[d]/sumWeights;
+                shift+=fabs(m-mean[d]);
+                mean[d]=m;
+            }
+            if (shift<m_convergenceCriterion){
+                ++iter;
+                break;
+            }
+        }
+        return iter;
+    }
 };//class
   
 template<class DeformationType>
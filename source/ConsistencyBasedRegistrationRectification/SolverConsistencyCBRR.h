@@ -2081,13 +2081,11 @@ public:
                             typedef typename SegmentationTools<ImageType>::OverlapScores OverlapScores;
                             std::vector<OverlapScores> scores=SegmentationTools<ImageType>::computeOverlapMultilabel((m_groundTruthSegmentations)[targetID],deformedSeg);
                             LOGV(1)<<VAR(sourceID)<<" "<<VAR(targetID)<<" ";
-                            dice=0.0;
                             for (int s=0;s<scores.size();++s){
                                 if (mylog.getVerbosity()>1){std::cout<<" "<<VAR(scores[s].labelID)<<" "<<scores[s].dice;}
-                                dice+=scores[s].dice;
                             }
                             if (mylog.getVerbosity()>1){                                std::cout<<endl;}
-                            dice=dice/(scores.size());
+                            dice=SegmentationTools<ImageType>::averageScores(scores).dice;
                             LOGV(1)<<"AverageDice : "<<dice<<endl;
                             
                             m_dice+=dice;
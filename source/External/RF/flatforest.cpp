@@ -0,0 +1,124 @@
+#include "flatforest.h"
+#include <boost/foreach.hpp>
+#include <algorithm>
+
+// number of samples which traverse a tree before the next tree is evaluated
+const long int FLAT_FOREST_BLOCK_SIZE = 256;
+
+FlatForest::FlatForest() : m_numClasses(0), m_useSoftVoting(false)
+{
+}
+
+void FlatForest::clear()
+{
+    m_nodes.clear();
+    m_features.clear();
+    m_weights.clear();
+    m_leafConf.clear();
+    m_roots.clear();
+}
+
+void FlatForest::build(const std::vector<Tree>& trees, const HyperParameters &hp)
+{
+    clear();
+    m_numClasses = hp.numClasses;
+    m_useSoftVoting = hp.useSoftVoting;
+
+    BOOST_FOREACH(const Tree& t, trees)
+    {
+        m_roots.push_back(addNode(t.rootNode()));
+    }
+}
+
+int FlatForest::addNode(Node::Ptr node)
+{
+    int index = m_nodes.size();
+    m_nodes.push_back(FlatNode());
+    FlatNode flat;
+    flat.rightChild = -1;
+    flat.numFeatures = 0;
+    flat.label = 0;
+    flat.threshold = 0.0f;
+
+    if (node->isLeaf())
+    {
+        flat.label = node->nodeLabel();
+        std::vector<float> conf = node->nodeConf();
+        conf.resize(m_numClasses, 0.0f);
+        flat.offset = m_leafConf.size();
+        m_leafConf.insert(m_leafConf.end(), conf.begin(), conf.end());
+    }
+    else
+    {
+        std::vector<int> features = node->bestFeature();
+        std::vector<float> weights = node->bestWeight();
+        flat.offset = m_features.size();
+        flat.numFeatures = features.size();
+        flat.threshold = node->bestThreshold();
+        m_features.insert(m_features.end(), features.begin(), features.end());
+        m_weights.insert(m_weights.end(), weights.begin(), weights.end());
+
+        // depth first: the left subtree directly follows its parent
+        addNode(node->leftChildNode());
+        flat.rightChild = addNode(node->rightChildNode());
+    }
+    m_nodes[index] = flat;
+    return index;
+}
+
+void FlatForest::evalBlock(const float *data, const int numFeatures, const long int begin, const long int end,
+                           matrix<float>& confidences) const
+{
+    BOOST_FOREACH(int root, m_roots)
+    {
+        for (long int nSamp = begin; nSamp < end; nSamp++)
+        {
+            const float *sample = data + nSamp * numFeatures;
+            int current = root;
+            while (m_nodes[current].rightChild >= 0)
+            {
+                const FlatNode& node = m_nodes[current];
+                float response = 0.0f;
+                for (int f = 0; f < node.numFeatures; f++)
+                {
+                    response += sample[m_features[node.offset + f]] * m_weights[node.offset + f];
+                }
+                current = (response > node.threshold) ? node.rightChild : current + 1;
+            }
+
+            const FlatNode& leaf = m_nodes[current];
+            if (m_useSoftVoting)
+            {
+                for (int nClass = 0; nClass < m_numClasses; nClass++)
+                {
+                    confidences(nSamp, nClass) += m_leafConf[leaf.offset + nClass];
+                }
+            }
+            else
+            {
+                confidences(nSamp, leaf.label)++;
+            }
+        }
+    }
+}
+
+void FlatForest::eval(const matrix<float>& data, matrix<float>& confidences) const
+{
+    const long int numSamples = data.size1();
+    const int numFeatures = data.size2();
+    if (numSamples == 0)
+    {
+        return;
+    }
+    // ublas matrices are row major, so every sample is one contiguous row
+    const float *rows = &data.data()[0];
+    const long int numBlocks = (numSamples + FLAT_FOREST_BLOCK_SIZE - 1) / FLAT_FOREST_BLOCK_SIZE;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (long int nBlock = 0; nBlock < numBlocks; nBlock++)
+    {
+        long int begin = nBlock * FLAT_FOREST_BLOCK_SIZE;
+        long int end = std::min(begin + FLAT_FOREST_BLOCK_SIZE, numSamples);
+        evalBlock(rows, numFeatures, begin, end, confidences);
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef FLAT_FOREST_H_
+#define FLAT_FOREST_H_
+
+#include "tree.h"
+#include "hyperparameters.h"
+#include <vector>
+#include <boost/numeric/ublas/matrix.hpp>
+using namespace boost::numeric::ublas;
+
+// Read-only copy of trained trees for inference. The nodes of all trees are stored in one
+// contiguous array in depth first order, so the left child of a split node directly follows it.
+// Every split is a hyperplane test (axis aligned splits are hyperplanes with one feature of
+// weight 1), which is what NodeGini, NodeInfoGain and NodeHyperPlane evaluate.
+class FlatForest
+{
+public:
+    FlatForest();
+
+    void build(const std::vector<Tree>& trees, const HyperParameters &hp);
+    void clear();
+    inline bool empty() const { return m_roots.empty(); };
+    inline int numTrees() const { return m_roots.size(); };
+
+    // Accumulates the votes of all trees for the samples in rows [begin,end) of data into
+    // confidences, without normalization. Samples are processed in blocks, so that the nodes
+    // of a tree stay in cache while they are traversed by all samples of the block, and the
+    // blocks are distributed over threads.
+    void eval(const matrix<float>& data, matrix<float>& confidences) const;
+
+private:
+    struct FlatNode
+    {
+        int rightChild;     // index of the right child, -1 for leaves
+        int offset;         // first entry in m_features/m_weights, or in m_leafConf for leaves
+        int numFeatures;    // number of features of the split, 0 for leaves
+        int label;          // leaf prediction
+        float threshold;    // samples with a response > threshold go to the right child
+    };
+
+    int addNode(Node::Ptr node);
+    void evalBlock(const float *data, const int numFeatures, const long int begin, const long int end,
+                   matrix<float>& confidences) const;
+
+    std::vector<FlatNode> m_nodes;
+    std::vector<int> m_features;
+    std::vector<float> m_weights;
+    std::vector<float> m_leafConf;
+    std::vector<int> m_roots;
+    int m_numClasses;
+    bool m_useSoftVoting;
+};
+
+#endif /* FLAT_FOREST_H_ */
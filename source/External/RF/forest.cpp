@@ -158,6 +158,7 @@ void Forest::save(const std::string &name)
 
 void Forest::load(const std::string &name)
 {
+    m_flatForest.clear();
     std::string loadName;
     loadName = (name == "default") ? m_hp.loadName : name;
 
@@ -286,16 +287,38 @@ void Forest::trainByCPU(const matrix<float>& data, const std::vector<int>& label
     }
 
     m_trees.clear();
-    for (int i = 0; i < m_hp.numTrees; i++)
+    m_flatForest.clear();
+    int numTrained = 0;
+    // trees are trained in parallel, each thread accumulates the votes of its trees
+    // and merges them into the forest when it is done
+    #pragma omp parallel
     {
-        if (m_hp.verbose && !(10*i%m_hp.numTrees))
+        matrix<float> confidences(m_confidences.size1(), m_confidences.size2());
+        matrix<float> threadOutOfBagConfidences(outOfBagConfidences.size1(), outOfBagConfidences.size2());
+        confidences.clear();
+        threadOutOfBagConfidences.clear();
+        std::vector<int> threadOutOfBagVoteCount(outOfBagVoteCount.size(), 0);
+        std::vector<Tree> trees;
+
+        #pragma omp for schedule(dynamic)
+        for (int i = 0; i < m_hp.numTrees; i++)
         {
-            cout << 100*i/m_hp.numTrees << "% " << flush;
+            Tree t(tmpHP,i);
+            t.train(data,labels, confidences, threadOutOfBagConfidences, threadOutOfBagVoteCount);
+            trees.push_back(t);
+            reportTrainingProgress(numTrained);
         }
 
-        Tree t(tmpHP,i);
-        t.train(data,labels, m_confidences, outOfBagConfidences, outOfBagVoteCount);
-        m_trees.push_back(t);
+        #pragma omp critical
+        {
+            m_confidences += confidences;
+            outOfBagConfidences += threadOutOfBagConfidences;
+            for (unsigned int n = 0; n < outOfBagVoteCount.size(); n++)
+            {
+                outOfBagVoteCount[n] += threadOutOfBagVoteCount[n];
+            }
+            m_trees.insert(m_trees.end(), trees.begin(), trees.end());
+        }
     }
 
     if (m_hp.verbose)
@@ -435,16 +458,38 @@ void Forest::trainByCPU(const matrix<float>& data, const std::vector<int>& label
     }
 
     m_trees.clear();
-    for (int i = 0; i < m_hp.numTrees; i++)
+    m_flatForest.clear();
+    int numTrained = 0;
+    // trees are trained in parallel, each thread accumulates the votes of its trees
+    // and merges them into the forest when it is done
+    #pragma omp parallel
     {
-        if (m_hp.verbose && !(10*i%m_hp.numTrees))
+        matrix<float> confidences(m_confidences.size1(), m_confidences.size2());
+        matrix<float> threadOutOfBagConfidences(outOfBagConfidences.size1(), outOfBagConfidences.size2());
+        confidences.clear();
+        threadOutOfBagConfidences.clear();
+        std::vector<int> threadOutOfBagVoteCount(outOfBagVoteCount.size(), 0);
+        std::vector<Tree> trees;
+
+        #pragma omp for schedule(dynamic)
+        for (int i = 0; i < m_hp.numTrees; i++)
         {
-            cout << 100*i/m_hp.numTrees << "% " << flush;
+            Tree t(tmpHP,i);
+            t.train(data,labels, weights, confidences, threadOutOfBagConfidences, threadOutOfBagVoteCount);
+            trees.push_back(t);
+            reportTrainingProgress(numTrained);
         }
 
-        Tree t(tmpHP,i);
-        t.train(data,labels, weights, m_confidences, outOfBagConfidences, outOfBagVoteCount);
-        m_trees.push_back(t);
+        #pragma omp critical
+        {
+            m_confidences += confidences;
+            outOfBagConfidences += threadOutOfBagConfidences;
+            for (unsigned int n = 0; n < outOfBagVoteCount.size(); n++)
+            {
+                outOfBagVoteCount[n] += threadOutOfBagVoteCount[n];
+            }
+            m_trees.insert(m_trees.end(), trees.begin(), trees.end());
+        }
     }
     if (m_hp.verbose)
     {
@@ -468,9 +513,12 @@ void Forest::evalByCPU(const matrix<float>& data, const std::vector<int>& labels
     // Initialize
     initialize(data.size1());
 
-    BOOST_FOREACH(Tree t, m_trees) {
-      t.eval(data, labels, m_confidences);
+    // trees are evaluated from their flattened copy, in blocks of samples on all threads
+    if (m_flatForest.numTrees() != (int) m_trees.size())
+    {
+        m_flatForest.build(m_trees, m_hp);
     }
+    m_flatForest.eval(data, m_confidences);
 //    clock_t trees = clock();
 
     // divide confidences by number of trees
@@ -661,6 +709,22 @@ void Forest::evalByGPU(const matrix<float>& data, const std::vector<int>& labels
 #endif
 }
 
+void Forest::reportTrainingProgress(int& numTrained)
+{
+    if (!m_hp.verbose)
+    {
+        return;
+    }
+    #pragma omp critical (forestProgress)
+    {
+        if (!(10*numTrained%m_hp.numTrees))
+        {
+            cout << 100*numTrained/m_hp.numTrees << "% " << flush;
+        }
+        numTrained++;
+    }
+}
+
 void Forest::writeError(const std::string& fileName, double error)
 {
     std::ofstream myfile;
@@ -2,6 +2,7 @@
 #define FOREST_H_
 
 #include "tree.h"
+#include "flatforest.h"
 #include "data.h"
 #include <iostream>
 #include "hyperparameters.h"
@@ -60,6 +61,8 @@ public:
 
  protected:
     std::vector<Tree> m_trees;
+    // inference copy of m_trees, rebuilt on the first evaluation after training or loading
+    FlatForest m_flatForest;
 
 #ifdef USE_CUDA
     Cuda::Array<float,2> *m_forest_d;
@@ -71,6 +74,7 @@ public:
     std::vector<int> m_predictions;
 
     void writeError(const std::string& dataFileName, double error);
+    void reportTrainingProgress(int& numTrained);
 
     void initialize(const long int numSamples);
 
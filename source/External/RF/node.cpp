@@ -2,7 +2,7 @@
 #include "utilities.h"
 #include <boost/foreach.hpp>
 
-int Node::m_numNodes;
+RF_THREAD_LOCAL int Node::m_numNodes;
 
 Node::Node(const HyperParameters &hp, int depth) : m_hp(hp), m_depth( depth )
 {
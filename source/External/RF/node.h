@@ -86,7 +86,8 @@ protected:
     int m_depth;
     int m_nodeLabel;
     int m_nodeIndex;
-    static int m_numNodes;
+    // counts the nodes of the tree which is trained by the current thread
+    static RF_THREAD_LOCAL int m_numNodes;
     std::vector<float> m_nodeConf;
     float m_totalWeights;
 };
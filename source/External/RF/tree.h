@@ -49,6 +49,7 @@ public:
     inline std::vector<int> getOutOfBagSamples() const { return m_outOfBagSamples; };
     inline matrix<float> getConfidences() const { return m_confidences; };
     inline int getNumNodes() const { return m_rootNode->numNodes(); };
+    inline Node::Ptr rootNode() const { return m_rootNode; };
 
     void setInBagSamples(const std::vector<int>& inBagSamples) { m_inBagSamples = inBagSamples; };
     void setOutOfBagSamples(const std::vector<int>& outOfBagSamples) { m_outOfBagSamples = outOfBagSamples; };
@@ -15,6 +15,10 @@
 #include <sys/time.h>
 #endif
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #if WIN32
 #define snprintf sprintf_s
 #endif
@@ -76,6 +80,7 @@ double timeIt(int reset) {
 
 double _rand(int i)
 {
+#ifdef WIN32
     static bool didSeeding = false;
 
     if (false && i>-1){
@@ -83,7 +88,6 @@ double _rand(int i)
         didSeeding=true;
     }
 
-#ifdef WIN32
     if (!didSeeding) {
         unsigned int seedNum = (unsigned int) time(NULL);
         srand(seedNum);
@@ -91,6 +95,10 @@ double _rand(int i)
     }
     return rand()/( RAND_MAX + 1.0 );
 #else
+    // every thread has its own generator state, so that trees can be trained in parallel
+    static RF_THREAD_LOCAL bool didSeeding = false;
+    static RF_THREAD_LOCAL unsigned int seedState;
+
     if (!didSeeding) {
         unsigned int seedNum;
         struct timeval TV;
@@ -99,13 +107,14 @@ double _rand(int i)
         gettimeofday(&TV, NULL);
         curTime = (unsigned int) TV.tv_usec;
         seedNum = (unsigned int) time(NULL) + curTime + getpid() + getDevRandom();
+#ifdef _OPENMP
+        seedNum += 7919u * (unsigned int) omp_get_thread_num();
+#endif
 
-        
-        srand(seedNum);
-      
+        seedState = seedNum;
         didSeeding = true;
     }
-    return random()/( RAND_MAX + 1.0 );
+    return rand_r(&seedState)/( RAND_MAX + 1.0 );
 #endif
 }
 
@@ -133,11 +142,7 @@ int randomNumber( int limit )
 
 double randomDouble( double limit )
 {
-#ifdef WIN32
-    return static_cast<double>( limit ) * rand() / ( RAND_MAX + 1.0 );
-#else
-    return static_cast<double>( limit ) * random() / ( RAND_MAX + 1.0 );
-#endif
+    return static_cast<double>( limit ) * _rand();
 }
 
 vector<int> subSampleWithReplacement(const int numSamples) {
@@ -9,6 +9,13 @@
 using namespace boost::numeric;
 using namespace std;
 
+// thread local storage, for state which is used while trees are trained in parallel
+#ifdef WIN32
+#define RF_THREAD_LOCAL __declspec(thread)
+#else
+#define RF_THREAD_LOCAL __thread
+#endif
+
 unsigned int getDevRandom();
 double _rand(int i=-1);
 int randomNumber(int min, int max);
@@ -12,9 +12,14 @@
 
 
 #include <limits.h>
+#include <limits>
+#include <algorithm>
 #include "itkImage.h"
 #include "itkImageRegion.h"
 #include "itkImageRegionIteratorWithIndex.h"
+#include "itkRegionOfInterestImageFilter.h"
+#include "itkConnectedComponentImageFilter.h"
+#include "itkDisplacementFieldJacobianDeterminantFilter.h"
 #include "ImageUtils.h"
 #include "TransformationUtils.h"
 #include "itkGaussianImage.h"
@@ -57,6 +62,9 @@ namespace MRegFuse{
   typedef typename itk::ImageRegionIterator<ImageType> ImageIteratorType;
   typedef typename itk::ImageRegionIterator<DeformationFieldType> DeformationImageIteratorType;
   static const int D=ImageType::ImageDimension;
+  ///component labels of the folding regions, wide enough for any number of components
+  typedef itk::Image<unsigned int,D> ComponentImageType;
+  typedef typename ComponentImageType::Pointer ComponentImagePointerType;
   typedef TypeGeneral TRWType;
   typedef MRFEnergy<TRWType> MRFType;
   typedef typename TRWType::REAL Real;
@@ -76,6 +84,11 @@ namespace MRegFuse{
   bool m_anisotropicSmoothing;
   GaussianEstimatorScalarImage<FloatImageType> m_smoothingEstimator;
   ImagePointerType m_mask,m_labelImage;
+  ///hypotheses in node-major layout, see buildHypothesisTable
+  std::vector<FloatPrecision> m_hypotheses;
+  int m_hypothesisLabels;
+  ///memory used for edge tables before they are handed to TRW-S
+  double m_edgeBufferMB;
   public:
   MRFRegistrationFuser(){
     m_gridSpacing=8;
@@ -86,6 +99,8 @@ namespace MRegFuse{
     m_alpha=1.0;
     m_anisotropicSmoothing=false;
     m_mask=NULL;
+    m_hypothesisLabels=-1;
+    m_edgeBufferMB=256;
   }
   void setPairwiseWeight(double w){m_pairwiseWeight=w;}
   void setAlpha(double a){m_alpha=a;}
@@ -93,6 +108,7 @@ namespace MRegFuse{
   void setHardConstraints(bool b){m_hardConstraints=b;}
   void setAnisoSmoothing(bool a){m_anisotropicSmoothing=a;}
   void setMask(ImagePointerType mask){m_mask=mask;}
+  void setEdgeBufferMB(double mb){m_edgeBufferMB=mb;}
 
     
   //add deformation (with optinal weights)
@@ -118,6 +134,7 @@ namespace MRegFuse{
     if (def->GetLargestPossibleRegion().GetSize()!=m_gridImage->GetLargestPossibleRegion().GetSize())
       def=TransfUtils<FloatImageType>::bSplineInterpolateDeformationField(img,m_gridImage);
     m_lowResDeformations.push_back(def);
+    invalidateHypothesisTable();
     //m_lowResDeformations.push_back(TransfUtils<FloatImageType>::computeBSplineTransformFromDeformationField(img,m_gridImage));
     //m_lowResDeformations.push_back(TransfUtils<FloatImageType>::computeBSplineTransformFromDeformationField(img,m_gridImage));
     ++m_count;
@@ -136,6 +153,7 @@ namespace MRegFuse{
         
     DeformationFieldPointerType def=TransfUtils<FloatImageType>::bSplineInterpolateDeformationField(img,m_gridImage);
     m_lowResDeformations[0]=(def);
+    invalidateHypothesisTable();
      
     if (weights.IsNotNull()){
       m_lowResLocalWeights[0]=(FilterUtils<FloatImageType>::LinearResample(weights,m_gridImage,false));
@@ -147,6 +165,7 @@ namespace MRegFuse{
         
     DeformationFieldPointerType def=TransfUtils<FloatImageType>::bSplineInterpolateDeformationField(img,m_gridImage);
     m_lowResDeformations[m_count-1]=(def);
+    invalidateHypothesisTable();
      
     if (weights.IsNotNull()){
       m_lowResLocalWeights[m_count-1]=(FilterUtils<FloatImageType>::LinearResample(weights,m_gridImage,false));
@@ -252,91 +271,37 @@ namespace MRegFuse{
     LOGV(1)<<VAR(countInside)<<" "<<VAR(countFringe)<<endl;
      
     //iterate coarse grid for pairwises
-    gridIt.GoToBegin();
-    if (m_mask.IsNotNull()){
-      maskIt.GoToBegin();
-    }
-    for (int d=0;!gridIt.IsAtEnd();++gridIt,++d){
-      bool insideMask=maskIt.Get()>0;
-      ++maskIt;
-      if (!insideMask)
-	continue;
-      int nRegLabelsNode1=nRegLabels;//maskIt.Get()!=2?nRegLabels:1;
-
-      IndexType idx=gridIt.GetIndex();
-      //LOGV(1)<<VAR(idx)<<endl;
-      std::vector<DeformationType> displacements(nRegLabels);
-      for (int l1=0;l1<nRegLabels;++l1){
-	if (l1<m_lowResLocalWeights.size()){
-	  displacements[l1]=m_lowResDeformations[l1]->GetPixel(idx);
+    //edge tables are computed in parallel for slabs of nodes from the contiguous hypothesis table,
+    //and then added to TRW-S sequentially in the same order as they would be added node by node
+    buildHypothesisTable(nRegLabels);
+    const PixelType * maskBuffer=m_mask->GetBufferPointer();
+    const FloatPrecision * anisoBuffer=anisoSmoothingWeights.IsNotNull()?anisoSmoothingWeights->GetBufferPointer():NULL;
+    long int strides[D];
+    double distanceNormalizers[D];
+    computeGridGeometry(strides,distanceNormalizers);
+    long int edgeTableSize=nRegLabels*nRegLabels;
+    long int slabNodes=max(1l,(long int)(m_edgeBufferMB*1024*1024/(sizeof(Real)*D*edgeTableSize)));
+    slabNodes=min(slabNodes,(long int)nRegNodes);
+    std::vector<Real> edgeBuffer(slabNodes*D*edgeTableSize);
+    for (long int slabStart=0;slabStart<nRegNodes;slabStart+=slabNodes){
+      long int slabEnd=min(slabStart+slabNodes,(long int)nRegNodes);
+#pragma omp parallel for schedule(static)
+      for (long int n=slabStart;n<slabEnd;++n){
+	if (!(maskBuffer[n]>0))
+	  continue;
+	double normalizer=anisoBuffer?anisoBuffer[n]:-1.0;
+	for (int i=0;i<D;++i){
+	  if (hasEdge(n,i,strides,size,maskBuffer))
+	    computeEdgeTable(n,n+strides[i],nRegLabels,distanceNormalizers[i],normalizer,&edgeBuffer[((n-slabStart)*D+i)*edgeTableSize]);
 	}
       }
-      PointType point,neighborPoint;
-      m_gridImage->TransformIndexToPhysicalPoint(idx,point);
-      d=ImageUtils<ImageType>::ImageIndexToLinearIndex(idx,size,buff);
-      double normalizer=-1.0;
-      if (anisoSmoothingWeights.IsNotNull()){
-	normalizer=anisoSmoothingWeights->GetPixel(idx);
-      }
-            
-      for (int i=0;i<D;++i){
-	OffsetType off;
-	off.Fill(0);
-	off[i]=1;
-	IndexType neighborIndex=idx+off;
-	//LOGV(2)<<m_mask->GetLargestPossibleRegion().GetSize()<<" "<<VAR(neighborIndex)<<" "<<(m_mask->GetPixel(neighborIndex)>0)<<" "<<m_mask->GetPixel(neighborIndex)<<" "<<m_mask->GetPixel(idx)<<" "<<VAR((m_mask->GetPixel(idx)>0))<<endl;
-	if (!(m_mask->GetPixel(neighborIndex)>0)){
-	  //skip edges where neighbor pixel is outside mask, if mask is available
+      for (long int n=slabStart;n<slabEnd;++n){
+	if (!(maskBuffer[n]>0))
 	  continue;
+	for (int i=0;i<D;++i){
+	  if (hasEdge(n,i,strides,size,maskBuffer))
+	    m_optimizer->AddEdge(regNodes[n], regNodes[n+strides[i]], TRWType::EdgeData(TRWType::GENERAL,&edgeBuffer[((n-slabStart)*D+i)*edgeTableSize]));
 	}
-	if (m_gridImage->GetLargestPossibleRegion().IsInside(neighborIndex)){
-	  //LOGV(1)<<VAR(neighborIndex)<<endl;
-                    
-	  int nRegLabelsNode2=nRegLabels;//m_mask->GetPixel(idx)!=2?nRegLabels:1;
-                    
-                    
-	  TRWType::REAL Vreg[nRegLabelsNode1*nRegLabelsNode2];
-
-	  for (int l1=0;l1<nRegLabelsNode1;++l1){
-	    int label1=l1;//nRegLabelsNode1!=1?l1:m_labelImage->GetPixel(idx);
-	    for (int l2=0;l2<nRegLabelsNode2;++l2){
-	      int label2=l2;//nRegLabelsNode2!=1?l2:m_labelImage->GetPixel(neighborIndex);
-	      double weight=0.0;
-	      DeformationType neighborDisplacement=m_lowResDeformations[label2]->GetPixel(neighborIndex);
-	      m_gridImage->TransformIndexToPhysicalPoint(neighborIndex,neighborPoint);
-	      double distanceNormalizer=(point-neighborPoint).GetNorm();
-	      DeformationType displacementDifference=(displacements[label1]-neighborDisplacement);
-	      if (label1<m_count && label2<m_count){
-                                
-                         
-		{
-                                  
-           
-		  weight=(1.0-m_alpha)*(displacementDifference.GetSquaredNorm()/(distanceNormalizer)) + (m_alpha)*(label1!=label2);
-                                
-		
-		}
-                         
-	      }else if (label1<m_count || label2<m_count){
-		weight=0;
-	      }else{
-		//do not allow aux labels next to each other? or should one?
-		weight=0;//1000000;
-	      }
-	      if (normalizer>0){
-		weight=(weight*distanceNormalizer- (normalizer*normalizer));
-		weight*=weight;
-                                         
-	      }
-	      //label1=nRegLabelsNode1>1?label1:0;
-	      //                            label2=nRegLabelsNode2>1?label2:0;
-	      Vreg[label1+label2*nRegLabelsNode1]=m_pairwiseWeight*weight;
-                           
-	    }
-	  }
-	  int d2=ImageUtils<ImageType>::ImageIndexToLinearIndex(neighborIndex,size,buff);
-	  m_optimizer->AddEdge(regNodes[d], regNodes[d2], TRWType::EdgeData(TRWType::GENERAL,Vreg));
-	}         
       }
     }
 
@@ -381,6 +346,118 @@ namespace MRegFuse{
     return energy;
   }
 
+  ///gathers all hypotheses into one contiguous node-major table [node][component][label],
+  ///so that the displacements of all labels of a node are adjacent in memory. aux labels get zero displacement.
+  void buildHypothesisTable(int nRegLabels){
+    if (m_hypothesisLabels==nRegLabels)
+      return;
+    long int nNodes=m_gridImage->GetLargestPossibleRegion().GetNumberOfPixels();
+    m_hypotheses.assign(nNodes*D*nRegLabels,0.0);
+    for (int l=0;l<m_count;++l){
+      const DeformationType * buffer=m_lowResDeformations[l]->GetBufferPointer();
+      for (long int n=0;n<nNodes;++n){
+	FloatPrecision * nodeTable=&m_hypotheses[n*D*nRegLabels];
+	for (int d=0;d<D;++d){
+	  nodeTable[d*nRegLabels+l]=buffer[n][d];
+	}
+      }
+    }
+    m_hypothesisLabels=nRegLabels;
+  }
+  void invalidateHypothesisTable(){m_hypothesisLabels=-1;}
+
+  ///linear index strides of the grid and physical distance between neighbors in each direction
+  void computeGridGeometry(long int * strides, double * distanceNormalizers){
+    SizeType size=m_gridImage->GetLargestPossibleRegion().GetSize();
+    IndexType firstIndex=m_gridImage->GetLargestPossibleRegion().GetIndex();
+    PointType point,neighborPoint;
+    m_gridImage->TransformIndexToPhysicalPoint(firstIndex,point);
+    for (int i=0;i<D;++i){
+      strides[i]=(i==0)?1:strides[i-1]*size[i-1];
+      OffsetType off;
+      off.Fill(0);
+      off[i]=1;
+      m_gridImage->TransformIndexToPhysicalPoint(firstIndex+off,neighborPoint);
+      distanceNormalizers[i]=(point-neighborPoint).GetNorm();
+    }
+  }
+
+  ///jacobian determinants of the current solution on the grid. if the coarse test is positive, the high resolution deformation is tested and its jacobians are min-resampled to the grid
+  FloatImagePointerType computeGridJacobians(double & minJac){
+    FloatImagePointerType jacDets=TransfUtils<ImageType,float,double,double>::getJacDets(m_lowResResult);
+    minJac=FilterUtils<FloatImageType>::getMin(jacDets);
+    if (minJac>0.0){
+      LOGV(2)<<"MinJac of coarse test was positive ("<<minJac<<"); now testing high resolution deformation.."<<endl;
+      jacDets=computeHighResGridJacobians(minJac);
+    }
+    return jacDets;
+  }
+
+  ///jacobian determinants of the high resolution deformation, min-resampled to the grid
+  FloatImagePointerType computeHighResGridJacobians(double & minJac){
+    FloatImagePointerType jacDets=TransfUtils<ImageType,float,double,double>::getJacDets(TransfUtils<FloatImageType>::bSplineInterpolateDeformationField(m_lowResResult,m_highResGridImage));
+    LOGI(3,ImageUtils<ImageType>::writeImage("highResNegJac.nii",FilterUtils<FloatImageType,ImageType>::binaryThresholdingHigh(jacDets,0.0)));
+    minJac=FilterUtils<FloatImageType>::getMin(jacDets);
+    if (jacDets->GetSpacing()!=m_gridImage->GetSpacing()){
+      jacDets=FilterUtils<FloatImageType>::minimumResample(jacDets,m_gridImage,m_gridImage->GetSpacing()[0]/jacDets->GetSpacing()[0]);
+    }
+    return jacDets;
+  }
+
+  ///true if node n has a neighbor in positive direction i which is inside the grid and the mask
+  bool hasEdge(long int n, int i, const long int * strides, const SizeType & size, const PixelType * maskBuffer){
+    long int coordinate=(n/strides[i])%size[i];
+    return coordinate+1<(long int)size[i] && maskBuffer[n+strides[i]]>0;
+  }
+
+  ///dense pairwise table Vreg[l1+l2*nRegLabels] between two nodes.
+  ///squared displacement differences are accumulated per component over contiguous label rows
+  void computeEdgeTable(long int node, long int neighbor, int nRegLabels, double distanceNormalizer, double normalizer, Real * Vreg){
+    const FloatPrecision * displacements=&m_hypotheses[node*D*nRegLabels];
+    const FloatPrecision * neighborDisplacements=&m_hypotheses[neighbor*D*nRegLabels];
+    for (int l2=0;l2<nRegLabels;++l2){
+      Real * column=Vreg+l2*nRegLabels;
+      for (int l1=0;l1<nRegLabels;++l1)
+	column[l1]=0.0;
+      for (int d=0;d<D;++d){
+	const FloatPrecision * row=displacements+d*nRegLabels;
+	Real neighborDisplacement=neighborDisplacements[d*nRegLabels+l2];
+	for (int l1=0;l1<nRegLabels;++l1){
+	  Real diff=row[l1]-neighborDisplacement;
+	  column[l1]+=diff*diff;
+	}
+      }
+      for (int l1=0;l1<nRegLabels;++l1){
+	column[l1]=pairwiseCost(column[l1],l1,l2,distanceNormalizer,normalizer);
+      }
+    }
+  }
+
+  ///single entry Vreg[l1+l2*nRegLabels] of the table computed by computeEdgeTable
+  Real computeEdgeCost(long int node, long int neighbor, int l1, int l2, int nRegLabels, double distanceNormalizer, double normalizer){
+    const FloatPrecision * displacements=&m_hypotheses[node*D*nRegLabels];
+    const FloatPrecision * neighborDisplacements=&m_hypotheses[neighbor*D*nRegLabels];
+    Real squaredDifference=0.0;
+    for (int d=0;d<D;++d){
+      Real diff=displacements[d*nRegLabels+l1]-neighborDisplacements[d*nRegLabels+l2];
+      squaredDifference+=diff*diff;
+    }
+    return pairwiseCost(squaredDifference,l1,l2,distanceNormalizer,normalizer);
+  }
+
+  ///pairwise cost of labels l1 and l2 at an edge, given the squared difference of their displacements
+  Real pairwiseCost(Real squaredDifference, int l1, int l2, double distanceNormalizer, double normalizer){
+    double weight=0.0;
+    if (l1<m_count && l2<m_count){
+      weight=(1.0-m_alpha)*(squaredDifference/distanceNormalizer) + (m_alpha)*(l1!=l2);
+    }
+    if (normalizer>0){
+      weight=(weight*distanceNormalizer- (normalizer*normalizer));
+      weight*=weight;
+    }
+    return m_pairwiseWeight*weight;
+  }
+
   DeformationFieldPointerType getMean(){
     m_result=TransfUtils<FloatImageType>::bSplineInterpolateDeformationField(m_lowResResult,m_highResGridImage);
     return m_result;
@@ -412,17 +489,7 @@ namespace MRegFuse{
 
     for (;iter<maxIter;++iter){
           
-      FloatImagePointerType jacDets=TransfUtils<ImageType,float,double,double>::getJacDets(m_lowResResult);
-      minJac=FilterUtils<FloatImageType>::getMin(jacDets);
-      if (minJac>0.0){
-	LOGV(2)<<"MinJac of coarse test was positive ("<<minJac<<"); now testing high resolution deformation.."<<endl;
-	jacDets=TransfUtils<ImageType,float,double,double>::getJacDets(TransfUtils<FloatImageType>::bSplineInterpolateDeformationField(m_lowResResult,m_highResGridImage));
-	LOGI(3,ImageUtils<ImageType>::writeImage("highResNegJac.nii",FilterUtils<FloatImageType,ImageType>::binaryThresholdingHigh(jacDets,0.0)));
-	minJac=FilterUtils<FloatImageType>::getMin(jacDets);
-	if (jacDets->GetSpacing()!=m_gridImage->GetSpacing()){
-	  jacDets=FilterUtils<FloatImageType>::minimumResample(jacDets,m_gridImage,m_gridImage->GetSpacing()[0]/jacDets->GetSpacing()[0]);
-	}
-      }
+      FloatImagePointerType jacDets=computeGridJacobians(minJac);
            
       double negJacFrac=FilterUtils<FloatImageType>::sum(FilterUtils<FloatImageType>::binaryThresholdingHigh(jacDets,0.0));
             
@@ -525,6 +592,289 @@ namespace MRegFuse{
         
 
   }
+
+  ///incremental variant of solveUntilPosJacDet.
+  ///instead of re-solving the whole grid with a mask, every connected region of non-positive jacobians is dilated locally (as in computeLocallyDilatedMask),
+  ///and a small MRF is solved over the dilated region only. the labels of all grid neighbors outside of the region are fixed and enter the sub-MRF as unary terms.
+  ///the grid jacobians are computed once and afterwards only updated inside the re-solved regions, and the folding regions are only searched there,
+  ///so the cost of an iteration is proportional to the size of the folding regions, not to the size of the grid.
+  ///only if the coarse test is positive everywhere the high resolution deformation is tested on the whole grid, as in computeGridJacobians.
+  ///returns the energy of the final labeling of the whole grid, with the pairwise weight of the last iteration.
+  double solveLocallyUntilPosJacDet(int maxIter,double increaseSmoothing,FloatImagePointerType localDilationRadii){
+    double minJac=-1;
+    finalize();
+    double mmJac=0;
+    int iter=0;
+    if (localDilationRadii->GetSpacing()!=m_gridImage->GetSpacing()){
+      localDilationRadii=FilterUtils<FloatImageType>::maximumResample(localDilationRadii,m_gridImage,m_gridImage->GetSpacing()[0]/localDilationRadii->GetSpacing()[0]);
+    }
+    FloatImagePointerType anisoSmoothingWeights;
+    if (m_anisotropicSmoothing){
+      m_smoothingEstimator.finalize();
+      anisoSmoothingWeights=m_smoothingEstimator.getMean();
+    }
+    buildHypothesisTable(m_count);
+    long int strides[D];
+    double distanceNormalizers[D];
+    computeGridGeometry(strides,distanceNormalizers);
+    SizeType size=m_gridImage->GetLargestPossibleRegion().GetSize();
+    long int nNodes=m_gridImage->GetLargestPossibleRegion().GetNumberOfPixels();
+    const FloatPrecision * radiusBuffer=localDilationRadii->GetBufferPointer();
+
+    //coarse jacobians of the current solution, updated only inside the regions re-solved in the previous iteration
+    FloatImagePointerType jacDets=TransfUtils<ImageType,float,double,double>::getJacDets(m_lowResResult);
+    std::vector<typename ImageType::RegionType> updatedRegions;
+    //component labels of the folding nodes, only the labels of the current iteration are set
+    ComponentImagePointerType components=ComponentImageType::New();
+    components->SetRegions(m_gridImage->GetLargestPossibleRegion());
+    components->SetOrigin(m_gridImage->GetOrigin());
+    components->SetSpacing(m_gridImage->GetSpacing());
+    components->SetDirection(m_gridImage->GetDirection());
+    components->Allocate();
+    components->FillBuffer(0);
+    unsigned int * componentBuffer=components->GetBufferPointer();
+
+    for (;iter<maxIter;++iter){
+      std::vector<long int> folding;
+      minJac=std::numeric_limits<double>::max();
+      if (iter==0){
+	collectFoldingNodes(jacDets,jacDets->GetLargestPossibleRegion(),mmJac,folding,minJac);
+      }else{
+	//outside of the re-solved regions nothing changed, and all folding nodes of the previous iteration were inside of them
+	for (unsigned int r=0;r<updatedRegions.size();++r){
+	  updateGridJacobians(jacDets,updatedRegions[r]);
+	  collectFoldingNodes(jacDets,updatedRegions[r],mmJac,folding,minJac);
+	}
+	std::sort(folding.begin(),folding.end());
+	folding.erase(std::unique(folding.begin(),folding.end()),folding.end());
+      }
+      if (folding.empty()){
+	LOGV(2)<<"MinJac of coarse test was positive ("<<minJac<<"); now testing high resolution deformation.."<<endl;
+	FloatImagePointerType highResJacDets=computeHighResGridJacobians(minJac);
+	if (minJac<=mmJac)
+	  collectFoldingNodes(highResJacDets,highResJacDets->GetLargestPossibleRegion(),mmJac,folding,minJac);
+      }
+      LOGV(2)<<VAR(iter)<<" "<<VAR(minJac)<<endl;
+      if (minJac>mmJac)
+	break;
+      if (iter>0)
+	m_pairwiseWeight*=increaseSmoothing;
+
+      //connected components of the folding nodes (face connectivity, as itk::ConnectedComponentImageFilter),
+      //with bounding box and dilation radius of each component
+      std::vector<IndexType> lower,upper;
+      std::vector<double> maxSigmaPerComp;
+      for (unsigned int f=0;f<folding.size();++f)
+	componentBuffer[folding[f]]=std::numeric_limits<unsigned int>::max();
+      for (unsigned int f=0;f<folding.size();++f){
+	if (componentBuffer[folding[f]]!=std::numeric_limits<unsigned int>::max())
+	  continue;
+	unsigned int comp=lower.size()+1;
+	IndexType seed=components->ComputeIndex(folding[f]);
+	lower.push_back(seed);
+	upper.push_back(seed);
+	maxSigmaPerComp.push_back(0.0);
+	std::vector<long int> queue(1,folding[f]);
+	componentBuffer[folding[f]]=comp;
+	for (unsigned int q=0;q<queue.size();++q){
+	  long int n=queue[q];
+	  IndexType idx=components->ComputeIndex(n);
+	  for (int d=0;d<D;++d){
+	    lower[comp-1][d]=min(lower[comp-1][d],idx[d]);
+	    upper[comp-1][d]=max(upper[comp-1][d],idx[d]);
+	    if (idx[d]>0 && componentBuffer[n-strides[d]]==std::numeric_limits<unsigned int>::max()){
+	      componentBuffer[n-strides[d]]=comp;
+	      queue.push_back(n-strides[d]);
+	    }
+	    if (idx[d]+1<(long int)size[d] && componentBuffer[n+strides[d]]==std::numeric_limits<unsigned int>::max()){
+	      componentBuffer[n+strides[d]]=comp;
+	      queue.push_back(n+strides[d]);
+	    }
+	  }
+	  maxSigmaPerComp[comp-1]=max(maxSigmaPerComp[comp-1],(double)radiusBuffer[n]);
+	}
+      }
+      int nComponents=lower.size();
+
+      updatedRegions.clear();
+      long int nSolvedNodes=0;
+      for (int c=0;c<nComponents;++c){
+	if (maxSigmaPerComp[c]<1) maxSigmaPerComp[c]=16;
+	int dilation=max(1.0,ceil(maxSigmaPerComp[c]/m_gridSpacings[0]));
+	typename ImageType::RegionType region,updatedRegion;
+	IndexType start,updatedStart;
+	SizeType regionSize,updatedSize;
+	for (int d=0;d<D;++d){
+	  start[d]=max(0l,(long int)lower[c][d]-dilation);
+	  regionSize[d]=min((long int)size[d]-1,(long int)upper[c][d]+dilation)-start[d]+1;
+	  //jacobians depend on the direct neighbors, so they change up to one node outside of the re-solved region
+	  updatedStart[d]=max(0l,start[d]-1);
+	  updatedSize[d]=min((long int)size[d]-1,start[d]+(long int)regionSize[d])-updatedStart[d]+1;
+	}
+	region.SetIndex(start);
+	region.SetSize(regionSize);
+	updatedRegion.SetIndex(updatedStart);
+	updatedRegion.SetSize(updatedSize);
+
+	typedef itk::RegionOfInterestImageFilter<ComponentImageType,ComponentImageType> ROIFilterType;
+	typename ROIFilterType::Pointer roiFilter=ROIFilterType::New();
+	roiFilter->SetInput(components);
+	roiFilter->SetRegionOfInterest(region);
+	roiFilter->Update();
+	ComponentImagePointerType localMask=FilterUtils<ComponentImageType>::dilation(roiFilter->GetOutput(),dilation,c+1);
+	LOGV(3)<<VAR(c)<<" "<<VAR(maxSigmaPerComp[c])<<" "<<VAR(dilation)<<" "<<VAR(region)<<endl;
+	solveRegion(region,localMask,c+1,anisoSmoothingWeights,nSolvedNodes);
+	updatedRegions.push_back(updatedRegion);
+      }
+      for (unsigned int f=0;f<folding.size();++f)
+	componentBuffer[folding[f]]=0;
+      LOGV(2)<<"Re-solved "<<nComponents<<" folding regions with a total of "<<nSolvedNodes<<" of "<<nNodes<<" nodes"<<endl;
+    }
+    LOGV(1)<<"SSR iterations :"<<iter<<endl;
+    return computeLabelingEnergy(anisoSmoothingWeights);
+  }
+
+  ///appends the index of every node in region of jacDets with a jacobian of at most threshold to folding, and lowers minJac to the minimum over region
+  void collectFoldingNodes(FloatImagePointerType jacDets, typename ImageType::RegionType region, double threshold, std::vector<long int> & folding, double & minJac){
+    itk::ImageRegionConstIteratorWithIndex<FloatImageType> it(jacDets,region);
+    for (it.GoToBegin();!it.IsAtEnd();++it){
+      double jac=it.Get();
+      minJac=min(minJac,jac);
+      if (jac<=threshold)
+	folding.push_back(jacDets->ComputeOffset(it.GetIndex()));
+    }
+  }
+
+  ///recomputes the grid jacobians of the current solution inside region only
+  void updateGridJacobians(FloatImagePointerType jacDets, typename ImageType::RegionType region){
+    typedef itk::DisplacementFieldJacobianDeterminantFilter<DeformationFieldType,double,FloatImageType> JacobianFilterType;
+    typename JacobianFilterType::Pointer jacobianFilter=JacobianFilterType::New();
+    jacobianFilter->SetInput(m_lowResResult);
+    jacobianFilter->SetUseImageSpacingOn();
+    jacobianFilter->UpdateOutputInformation();
+    jacobianFilter->GetOutput()->SetRequestedRegion(region);
+    jacobianFilter->Update();
+    itk::ImageRegionConstIterator<FloatImageType> localIt(jacobianFilter->GetOutput(),region);
+    FloatImageIteratorType jacIt(jacDets,region);
+    for (localIt.GoToBegin(),jacIt.GoToBegin();!jacIt.IsAtEnd();++localIt,++jacIt){
+      jacIt.Set(localIt.Get());
+    }
+  }
+
+  ///energy of the current labeling of the whole grid: unaries plus the pairwise terms of all grid edges
+  double computeLabelingEnergy(FloatImagePointerType anisoSmoothingWeights){
+    long int strides[D];
+    double distanceNormalizers[D];
+    computeGridGeometry(strides,distanceNormalizers);
+    SizeType size=m_gridImage->GetLargestPossibleRegion().GetSize();
+    long int nNodes=m_gridImage->GetLargestPossibleRegion().GetNumberOfPixels();
+    const PixelType * labelBuffer=m_labelImage->GetBufferPointer();
+    const FloatPrecision * anisoBuffer=anisoSmoothingWeights.IsNotNull()?anisoSmoothingWeights->GetBufferPointer():NULL;
+    double energy=0.0;
+#pragma omp parallel for schedule(static) reduction(+:energy)
+    for (long int n=0;n<nNodes;++n){
+      int label=labelBuffer[n];
+      energy+=1.0-(m_lowResLocalWeights[label]->GetBufferPointer()[n]);
+      for (int d=0;d<D;++d){
+	long int coordinate=(n/strides[d])%size[d];
+	if (coordinate+1<(long int)size[d])
+	  energy+=computeEdgeCost(n,n+strides[d],label,labelBuffer[n+strides[d]],m_count,distanceNormalizers[d],anisoBuffer?anisoBuffer[n]:-1.0);
+      }
+    }
+    return energy;
+  }
+
+  ///solves the sub-MRF over all nodes of region for which localMask (which is aligned with region) equals value.
+  ///labels outside of these nodes are taken from the current solution and kept fixed. the solution is written back into the current result.
+  double solveRegion(typename ImageType::RegionType region, ComponentImagePointerType localMask, unsigned int value, FloatImagePointerType anisoSmoothingWeights, long int & nSolvedNodes){
+    int nRegLabels=m_count;
+    long int strides[D];
+    double distanceNormalizers[D];
+    computeGridGeometry(strides,distanceNormalizers);
+    SizeType size=m_gridImage->GetLargestPossibleRegion().GetSize();
+    IndexType start=region.GetIndex();
+    const PixelType * labelBuffer=m_labelImage->GetBufferPointer();
+    const FloatPrecision * anisoBuffer=anisoSmoothingWeights.IsNotNull()?anisoSmoothingWeights->GetBufferPointer():NULL;
+
+    //collect nodes of the sub-MRF
+    std::vector<long int> nodes;
+    std::map<long int,int> localIDs;
+    itk::ImageRegionIteratorWithIndex<ComponentImageType> it(localMask,localMask->GetLargestPossibleRegion());
+    for (it.GoToBegin();!it.IsAtEnd();++it){
+      if (it.Get()==value){
+	IndexType idx=it.GetIndex();
+	long int n=0;
+	for (int d=0;d<D;++d) n+=(idx[d]+start[d])*strides[d];
+	localIDs[n]=nodes.size();
+	nodes.push_back(n);
+      }
+    }
+    if (nodes.size()==0)
+      return 0.0;
+    nSolvedNodes+=nodes.size();
+
+    MRFType * optimizer= new MRFType(TRWType::GlobalSize());
+    std::vector<NodeType> regNodes(nodes.size(),NULL);
+    std::vector<Real> D1(nRegLabels);
+    std::vector<Real> Vreg(nRegLabels*nRegLabels);
+    for (unsigned int i=0;i<nodes.size();++i){
+      long int n=nodes[i];
+      for (int l=0;l<nRegLabels;++l){
+	D1[l]=1.0-(m_lowResLocalWeights[l]->GetBufferPointer()[n]);
+      }
+      //boundary conditions: pairwise terms to fixed neighbors outside of the sub-MRF
+      for (int d=0;d<D;++d){
+	long int coordinate=(n/strides[d])%size[d];
+	if (coordinate+1<(long int)size[d] && localIDs.find(n+strides[d])==localIDs.end()){
+	  long int neighbor=n+strides[d];
+	  int fixedLabel=labelBuffer[neighbor];
+	  computeEdgeTable(n,neighbor,nRegLabels,distanceNormalizers[d],anisoBuffer?anisoBuffer[n]:-1.0,&Vreg[0]);
+	  for (int l=0;l<nRegLabels;++l) D1[l]+=Vreg[l+fixedLabel*nRegLabels];
+	}
+	if (coordinate>0 && localIDs.find(n-strides[d])==localIDs.end()){
+	  long int neighbor=n-strides[d];
+	  int fixedLabel=labelBuffer[neighbor];
+	  computeEdgeTable(neighbor,n,nRegLabels,distanceNormalizers[d],anisoBuffer?anisoBuffer[neighbor]:-1.0,&Vreg[0]);
+	  for (int l=0;l<nRegLabels;++l) D1[l]+=Vreg[fixedLabel+l*nRegLabels];
+	}
+      }
+      regNodes[i]=optimizer->AddNode(TRWType::LocalSize(nRegLabels), TRWType::NodeData(&D1[0]));
+    }
+    for (unsigned int i=0;i<nodes.size();++i){
+      long int n=nodes[i];
+      for (int d=0;d<D;++d){
+	long int coordinate=(n/strides[d])%size[d];
+	if (coordinate+1>=(long int)size[d])
+	  continue;
+	typename std::map<long int,int>::iterator neighborIt=localIDs.find(n+strides[d]);
+	if (neighborIt!=localIDs.end()){
+	  computeEdgeTable(n,n+strides[d],nRegLabels,distanceNormalizers[d],anisoBuffer?anisoBuffer[n]:-1.0,&Vreg[0]);
+	  optimizer->AddEdge(regNodes[i], regNodes[neighborIt->second], TRWType::EdgeData(TRWType::GENERAL,&Vreg[0]));
+	}
+      }
+    }
+
+    MRFEnergy<TRWType>::Options options;
+    options.m_iterMax = 1000;
+    options.m_printMinIter=1000;
+    options.m_printIter=1000;
+    options.m_eps=1e-7;
+    TRWType::REAL energy=-1, lowerBound=-1;
+    optimizer->Minimize_TRW_S(options, lowerBound, energy);
+    LOGV(3)<<"Solved "<<nodes.size()<<" nodes, energy "<<energy<<" with lower bound "<<lowerBound<<endl;
+
+    DeformationType * resultBuffer=m_lowResResult->GetBufferPointer();
+    PixelType * labelOutBuffer=m_labelImage->GetBufferPointer();
+    for (unsigned int i=0;i<nodes.size();++i){
+      long int n=nodes[i];
+      int label=optimizer->GetSolution(regNodes[i]);
+      labelOutBuffer[n]=label;
+      resultBuffer[n]=m_lowResDeformations[label]->GetBufferPointer()[n];
+    }
+    delete optimizer;
+    return energy;
+  }
+
 #else
   double solveUntilPosJacDet(int maxIter,double increaseSmoothing,bool useJacMask, double ballRadius, ImagePointerType mask=NULL){
     double energy;
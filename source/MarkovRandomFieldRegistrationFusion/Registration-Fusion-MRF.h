@@ -72,6 +72,7 @@ namespace MRegFuse{
     typedef typename  ImageNeighborhoodIteratorType::RadiusType RadiusType;
 
     typedef MRFRegistrationFuser<ImageType,double> RegistrationFuserType;
+    typedef FusedGaussianEstimatorVectorImage<ImageType,double> MeanEstimatorType;
     typedef typename itk::DisplacementFieldJacobianDeterminantFilter<DeformationFieldType,double> DisplacementFieldJacobianDeterminantFilterType;
 
     typedef typename itk::AddImageFilter<DeformationFieldType,DeformationFieldType,DeformationFieldType> DeformationAddFilterType;
@@ -114,9 +115,12 @@ namespace MRegFuse{
       int nKernels=20;
       double smoothIncrease=1.2;
       bool useMaskForSSR=false;
+      bool localSSR=false;
+      double meanShiftSigma=0.0;
       //as->parameter ("A",atlasSegmentationFileList , "list of atlas segmentations <id> <file>", true);
       as->option ("MRF", estimateMRF, "use MRF fusion");
       as->option ("mean", estimateMean, "use (local) mean fusion. Can be used in addition to MRF or stand-alone.");
+      as->parameter ("meanShiftSigma", meanShiftSigma, "refine the (local) mean fusion by local mean shift with this kernel variance. 0 disables mean shift.",false);
       as->parameter ("T", inputDeformationFilenames, "list of deformations (comma separated)", true);
       as->parameter ("t", targetFileName, " target image filename", true);
       as->parameter ("s", sourceFileName, " source image filename", true);
@@ -140,6 +144,7 @@ namespace MRegFuse{
       as->parameter ("refineSeamIter", refineSeamIter,"refine MRF solution at seams by smoothing the result and fusing it with the original solution.",false);
       as->parameter ("smoothIncrease", smoothIncrease,"factor to increase smoothing with per iteration for SSR.",false);
       as->option ("useMask", useMaskForSSR,"only update pixels with negative jac dets (or in the vincinity of those) when using SSR.");
+      as->option ("localSSR", localSSR,"with -useMask, re-solve only small sub-MRFs around each region with negative jac dets, keeping all other labels fixed.");
       as->parameter ("O", outputDir,"outputdirectory (will be created + no overwrite checks!)",false);
       as->parameter ("maxHops", maxHops,"maximum number of hops",false);
       as->parameter ("alpha", alpha,"pairwise balancing weight (deformation (alpha=0) vs label smoothness (alpha=1))",false);
@@ -149,6 +154,8 @@ namespace MRegFuse{
       
       //        as->option ("graphCut", graphCut,"use graph cuts to generate final segmentations instead of locally maximizing");
       //as->parameter ("smoothness", smoothness,"smoothness parameter of graph cut optimizer",false);
+      string storeFilename="";
+      as->parameter ("store", storeFilename,"image store created with PackImageStore; images and deformations packed in it are copied from the mapped store instead of decoded from disk, the store has to be packed with the pixel type of this application",false);
       as->parameter ("verbose", verbose,"get verbose output",false);
       as->help();
       as->parse(); 
@@ -164,6 +171,9 @@ namespace MRegFuse{
       mkdir(outputDir.c_str(),0755);
       logSetStage("IO");
       logSetVerbosity(verbose);
+      if (storeFilename!="" && ImageStore::global().open(storeFilename)){
+          LOG<<"Mapped image store "<<storeFilename<<" with "<<ImageStore::global().size()<<" images"<<endl;
+      }
         
       MetricType metric;
      if (metricName=="MSD")
@@ -228,7 +238,8 @@ namespace MRegFuse{
       estimator.setGridSpacing(controlGridSpacingFactor);
       estimator.setHardConstraints(useHardConstraints);
       estimator.setAnisoSmoothing(anisoSmoothing);
-      GaussianEstimatorVectorImage<ImageType,double> meanEstimator;
+      MeanEstimatorType meanEstimator;
+      meanEstimator.setMeanShift(meanShiftSigma);
       DeformationFieldPointerType result;
       for (int i=0;i<nDeformations;++i){
 	DeformationFieldPointerType def=ImageUtils<DeformationFieldType>::readImage(inputDeformationFilenameList[i]);
@@ -358,7 +369,10 @@ namespace MRegFuse{
 	    seamEstimator.setPairwiseWeight(m_pairwiseWeight);
 	    seamEstimator.finalize();
 #ifdef USELOCALSIGMASFORDILATION
-	    energy=seamEstimator.solveUntilPosJacDet(refineSeamIter,smoothIncrease,useMaskForSSR,localKernelWidths);
+	    if (useMaskForSSR && localSSR)
+	        energy=seamEstimator.solveLocallyUntilPosJacDet(refineSeamIter,smoothIncrease,localKernelWidths);
+	    else
+	        energy=seamEstimator.solveUntilPosJacDet(refineSeamIter,smoothIncrease,useMaskForSSR,localKernelWidths);
 #else
 	    energy=seamEstimator.solveUntilPosJacDet(refineSeamIter,smoothIncrease,useMaskForSSR,50);
 #endif
@@ -491,7 +505,7 @@ namespace MRegFuse{
     }//run
   protected:
    
-    FloatImagePointerType addImage(string weighting, MetricType metric,RegistrationFuserType & estimator,  GaussianEstimatorVectorImage<ImageType,double> & meanEstimator, ImagePointerType targetImage, ImagePointerType sourceImage, DeformationFieldPointerType def, bool estimateMean, bool estimateMRF, double radius, double m_gamma){
+    FloatImagePointerType addImage(string weighting, MetricType metric,RegistrationFuserType & estimator,  MeanEstimatorType & meanEstimator, ImagePointerType targetImage, ImagePointerType sourceImage, DeformationFieldPointerType def, bool estimateMean, bool estimateMRF, double radius, double m_gamma){
         
       FloatImagePointerType metricImage;
       if (weighting=="global" || weighting=="local" || weighting=="globallocal"){
@@ -550,7 +564,7 @@ namespace MRegFuse{
       return metricImage;
     }
     
-    FloatImagePointerType replaceFirstImage(string weighting, MetricType metric,RegistrationFuserType & estimator,  GaussianEstimatorVectorImage<ImageType,double> & meanEstimator, ImagePointerType targetImage, ImagePointerType sourceImage, DeformationFieldPointerType def, bool estimateMean, bool estimateMRF, double radius, double m_gamma){
+    FloatImagePointerType replaceFirstImage(string weighting, MetricType metric,RegistrationFuserType & estimator,  MeanEstimatorType & meanEstimator, ImagePointerType targetImage, ImagePointerType sourceImage, DeformationFieldPointerType def, bool estimateMean, bool estimateMRF, double radius, double m_gamma){
         
       FloatImagePointerType metricImage;
       if (weighting=="global" || weighting=="local" || weighting=="globallocal"){
@@ -39,6 +39,7 @@
 #include "MRFRegistrationFuser.h"
 #include <itkDisplacementFieldJacobianDeterminantFilter.h>
 #include "SegmentationMapper.hxx"
+#include "DeformationCompositionCache.h"
 
 
 namespace MRegFuse{
@@ -71,6 +72,7 @@ public:
     typedef typename  ImageNeighborhoodIteratorType::RadiusType RadiusType;
 
     typedef MRFRegistrationFuser<ImageType,double> RegistrationFuserType;
+    typedef FusedGaussianEstimatorVectorImage<ImageType,double> MeanEstimatorType;
     typedef typename itk::DisplacementFieldJacobianDeterminantFilter<DeformationFieldType,double> DisplacementFieldJacobianDeterminantFilterType;
 
     typedef typename itk::AddImageFilter<DeformationFieldType,DeformationFieldType,DeformationFieldType> DeformationAddFilterType;
@@ -107,9 +109,13 @@ public:
         int refineSeamIter=0;
         double smoothIncrease=1.2;
         bool useMaskForSSR=false;
+        bool localSSR=false;
+        double compositionCacheMB=2048;
+        double meanShiftSigma=0.0;
         //as->parameter ("A",atlasSegmentationFileList , "list of atlas segmentations <id> <file>", true);
         as->option ("MRF", estimateMRF, "use MRF fusion");
         as->option ("mean", estimateMean, "use (local) mean fusion. Can be used in addition to MRF or stand-alone.");
+        as->parameter ("meanShiftSigma", meanShiftSigma, "refine the (local) mean fusion by local mean shift with this kernel variance. 0 disables mean shift.",false);
         as->parameter ("T", deformationFileList, " list of deformations", true);
         as->parameter ("i", imageFileList, " list of  images", true);
         as->parameter ("true", trueDefListFilename, " list of TRUE deformations", false);
@@ -136,8 +142,12 @@ public:
         as->parameter ("refineSeamIter", refineSeamIter,"refine MRF solution at seams by smoothing the result and fusing it with the original solution.",false);
         as->parameter ("smoothIncrease", smoothIncrease,"factor to increase smoothing with per iteration for SSR.",false);
         as->option ("useMask", useMaskForSSR,"only update pixels with negative jac dets (or in the vincinity of those) when using SSR.");
+        as->option ("localSSR", localSSR,"with -useMask, re-solve only small sub-MRFs around each region with negative jac dets, keeping all other labels fixed.");
+        as->parameter ("compositionCacheMB", compositionCacheMB,"memory budget (MB) for caching decoded and composed indirect deformations within a hop",false);
         //        as->option ("graphCut", graphCut,"use graph cuts to generate final segmentations instead of locally maximizing");
         //as->parameter ("smoothness", smoothness,"smoothness parameter of graph cut optimizer",false);
+        string storeFilename="";
+        as->parameter ("store", storeFilename,"image store created with PackImageStore; images and deformations packed in it are copied from the mapped store instead of decoded from disk, the store has to be packed with the pixel type of this application",false);
         as->parameter ("verbose", verbose,"get verbose output",false);
         as->help();
         as->parse();
@@ -156,6 +166,9 @@ public:
         mkdir(outputDir.c_str(),0755);
         logSetStage("IO");
         logSetVerbosity(verbose);
+        if (storeFilename!="" && ImageStore::global().open(storeFilename)){
+            LOG<<"Mapped image store "<<storeFilename<<" with "<<ImageStore::global().size()<<" images"<<endl;
+        }
         
         MetricType metric;
         if (metricName=="MSD")
@@ -300,7 +313,10 @@ public:
         double m_oldSimilarity=std::numeric_limits<double>::max();
         logSetStage("Zero Hop");
         LOGV(1)<<"Computing"<<std::endl;
+        DeformationCompositionCache<ImageType> compositionCache(compositionCacheMB);
         for (iter=1;iter<maxHops+1;++iter){
+            //deformations are updated after each hop, so cached compositions become invalid
+            compositionCache.clear();
             map< string, map <string, DeformationFieldPointerType> > TMPdeformationCache;
             double m_dice=0.0;
             double m_volumeWeightedDice=0.0;
@@ -326,7 +342,7 @@ public:
                         DeformationFieldPointerType result;
                         DeformationFieldPointerType deformationSourceTarget;
                         if (dontCacheDeformations){
-                            deformationSourceTarget = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[sourceID][targetID]);
+                            deformationSourceTarget = compositionCache.read(deformationFilenames[sourceID][targetID]);
                         }else{
                             deformationSourceTarget = deformationCache[sourceID][targetID];
                         }
@@ -354,7 +370,8 @@ public:
                             estimator.setGridSpacing(controlGridSpacingFactor);
                             estimator.setHardConstraints(useHardConstraints);
                        
-                            GaussianEstimatorVectorImage<ImageType,double> meanEstimator;
+                            MeanEstimatorType meanEstimator;
+                            meanEstimator.setMeanShift(meanShiftSigma);
                             FloatImagePointerType weightImage=addImage(weightingName,metric,estimator,meanEstimator,targetImageIterator->second,sourceImageIterator->second,deformationSourceTarget,estimateMean,estimateMRF,radius,m_gamma);
                             if (weightImage.IsNotNull() && outputDir!=""){
                                 ostringstream oss;
@@ -368,14 +385,14 @@ public:
                                     DeformationFieldPointerType deformationSourceIntermed;
                                     DeformationFieldPointerType deformationIntermedTarget;
                                     if (dontCacheDeformations){
-                                        deformationSourceIntermed = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[sourceID][intermediateID]);
-                                        deformationIntermedTarget = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[intermediateID][targetID]);
+                                        deformationSourceIntermed = compositionCache.read(deformationFilenames[sourceID][intermediateID]);
+                                        deformationIntermedTarget = compositionCache.read(deformationFilenames[intermediateID][targetID]);
                                     }else{
                                         deformationSourceIntermed = deformationCache[sourceID][intermediateID];
                                         deformationIntermedTarget = deformationCache[intermediateID][targetID];
                                     }
                                     LOGV(3)<<"Adding "<<VAR(sourceID)<<" "<<VAR(targetID)<<" "<<VAR(intermediateID)<<endl;
-                                    DeformationFieldPointerType indirectDef = TransfUtils<ImageType>::composeDeformations(deformationIntermedTarget,deformationSourceIntermed);
+                                    DeformationFieldPointerType indirectDef = compositionCache.compose(sourceID,intermediateID,targetID,deformationIntermedTarget,deformationSourceIntermed);
                                     FloatImagePointerType weightImage=addImage(weightingName,metric,estimator,meanEstimator,targetImageIterator->second,sourceImageIterator->second,indirectDef,estimateMean,estimateMRF,radius,m_gamma);
                                     if (weightImage.IsNotNull() && outputDir!=""){
                                         ostringstream oss;
@@ -497,7 +514,10 @@ public:
                                     seamEstimator.setPairwiseWeight(m_pairwiseWeight);
                                     seamEstimator.finalize();
 #ifdef USELOCALSIGMASFORDILATION
-                                    energy=seamEstimator.solveUntilPosJacDet(refineSeamIter,smoothIncrease,useMaskForSSR,localKernelWidths);
+                                    if (useMaskForSSR && localSSR)
+                                        energy=seamEstimator.solveLocallyUntilPosJacDet(refineSeamIter,smoothIncrease,localKernelWidths);
+                                    else
+                                        energy=seamEstimator.solveUntilPosJacDet(refineSeamIter,smoothIncrease,useMaskForSSR,localKernelWidths);
 #else
                                     energy=seamEstimator.solveUntilPosJacDet(refineSeamIter,smoothIncrease,useMaskForSSR,50);
 #endif
@@ -635,6 +655,7 @@ public:
                 }//target images
               
             }//source images
+            compositionCache.printStatistics();
             m_dice/=count;
             m_volumeWeightedDice/=count;
             m_TRE/=count;
@@ -699,7 +720,7 @@ protected:
         return result;
     }        
   
-    FloatImagePointerType addImage(string weighting, MetricType metric,RegistrationFuserType & estimator,  GaussianEstimatorVectorImage<ImageType,double> & meanEstimator, ImagePointerType targetImage, ImagePointerType sourceImage, DeformationFieldPointerType def, bool estimateMean, bool estimateMRF, double radius, double m_gamma){
+    FloatImagePointerType addImage(string weighting, MetricType metric,RegistrationFuserType & estimator,  MeanEstimatorType & meanEstimator, ImagePointerType targetImage, ImagePointerType sourceImage, DeformationFieldPointerType def, bool estimateMean, bool estimateMRF, double radius, double m_gamma){
         FloatImagePointerType metricImage;
 
         if (weighting=="global" || weighting=="local" || weighting=="globallocal"){
@@ -758,7 +779,7 @@ protected:
     }
     
     
-    FloatImagePointerType replaceFirstImage(string weighting, MetricType metric,RegistrationFuserType & estimator,  GaussianEstimatorVectorImage<ImageType,double> & meanEstimator, ImagePointerType targetImage, ImagePointerType sourceImage, DeformationFieldPointerType def, bool estimateMean, bool estimateMRF, double radius, double m_gamma){
+    FloatImagePointerType replaceFirstImage(string weighting, MetricType metric,RegistrationFuserType & estimator,  MeanEstimatorType & meanEstimator, ImagePointerType targetImage, ImagePointerType sourceImage, DeformationFieldPointerType def, bool estimateMean, bool estimateMRF, double radius, double m_gamma){
         
         FloatImagePointerType metricImage;
         if (weighting=="global" || weighting=="local" || weighting=="globallocal"){
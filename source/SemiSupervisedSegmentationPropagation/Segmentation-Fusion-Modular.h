@@ -24,6 +24,7 @@
 #include "itkImageRegionIterator.h"
 #include "TransformationUtils.h"
 #include "ImageUtils.h"
+#include "GridMaxFlow.h"
 #include "FilterUtils.hpp"
 #include <sstream>
 #include "ArgumentParser.h"
@@ -121,6 +122,8 @@ namespace SSSP{
       as->option ("dontCacheDeformations", dontCacheDeformations,"read deformations only when needed to save memory. higher IO load!");
       as->option ("graphCut", graphCut,"use graph cuts to generate final segmentations instead of locally maximizing");
       as->parameter ("smoothness", smoothness,"smoothness parameter of graph cut optimizer",false);
+      std::string storeFilename="";
+      as->parameter ("store", storeFilename,"image store created with PackImageStore; images and deformations packed in it are copied from the mapped store instead of decoded from disk, the store has to be packed with the pixel type of this application",false);
       as->parameter ("verbose", verbose,"get verbose output",false);
       as->help();
       as->parse();
@@ -143,6 +146,9 @@ namespace SSSP{
       mkdir(outputDir.c_str(),0755);
       logSetStage("IO");
       logSetVerbosity(verbose);
+      if (storeFilename!="" && ImageStore::global().open(storeFilename)){
+          LOG<<"Mapped image store "<<storeFilename<<" with "<<ImageStore::global().size()<<" images"<<endl;
+      }
         
       MetricType metric;
       if (metricName=="NONE")
@@ -417,7 +423,6 @@ namespace SSSP{
       return result;
     }
 
-#ifdef WITH_GCO
     ImagePointerType probSegmentationToSegmentationGraphcut( ProbabilisticVectorImagePointerType img, double smooth){
       ImagePointerType result=ImageType::New();
       result->SetOrigin(img->GetOrigin());
@@ -425,16 +430,10 @@ namespace SSSP{
       result->SetDirection(img->GetDirection());
       result->SetRegions(img->GetLargestPossibleRegion());
       result->Allocate();
-      typedef Graph<float,float,double> MRFType;
-      typedef MRFType::node_id NodeType;
-      MRFType* optimizer;
+      //binary cut on the implicit 6-neighborhood (3D) of the image grid, no adjacency lists are built
+      typedef GridMaxFlow<float,double> MRFType;
       SizeType size=img->GetLargestPossibleRegion().GetSize();
-      int nNodes=1;
-      for (unsigned int d=0;d<D;++d) {nNodes*=size[d];}
-      int nEdges=D*nNodes;
-      for (unsigned int d=0;d<D;++d) {nEdges-=size[d];}
-      optimizer = new MRFType(nNodes,nEdges);
-      optimizer->add_node(nNodes);
+      MRFType optimizer(D,size);
       ProbImageIteratorType probIt(img,img->GetLargestPossibleRegion());
       int i=0;
       for (probIt.GoToBegin();!probIt.IsAtEnd();++probIt,++i){
@@ -450,7 +449,7 @@ namespace SSSP{
 	  }
 	}
 	LOGV(7)<<VAR(i)<<" "<<VAR(energies)<<endl;
-	optimizer->add_tweights(i,energies[0],energies[1]);
+	optimizer.add_tweights(i,energies[0],energies[1]);
 	for (unsigned  int d=0;d<D;++d){
 	  OffsetType off;
 	  off.Fill(0);
@@ -459,15 +458,15 @@ namespace SSSP{
 	  bool inside2;
 	  int withinImageIndex2=ImageUtils<ImageType>::ImageIndexToLinearIndex(neighborIndex,size,inside2);
 	  if (inside2){
-	    optimizer -> add_edge(i,withinImageIndex2,smooth,smooth);
+	    optimizer.add_edge(i,withinImageIndex2,smooth,smooth);
 	  }
 	}
       }
-      optimizer->maxflow();
+      optimizer.maxflow();
       ImageIteratorType imgIt(result,result->GetLargestPossibleRegion());
       i=0;
       for (imgIt.GoToBegin();!imgIt.IsAtEnd();++imgIt,++i){
-	int maxLabel=optimizer->what_segment(i)== MRFType::SOURCE ;
+	int maxLabel=optimizer.what_segment(i)== MRFType::SOURCE ;
 	if (D==2){
 	  imgIt.Set(1.0*std::numeric_limits<PixelType>::max()*maxLabel/(nSegmentationLabels-1));
 	}else{
@@ -476,7 +475,6 @@ namespace SSSP{
       }
       return result;
     }
-#endif
 
     ///normalize probabilities in prob image by sum(p)
     ProbabilisticVectorImagePointerType normalizeProbs(ProbabilisticVectorImagePointerType img){
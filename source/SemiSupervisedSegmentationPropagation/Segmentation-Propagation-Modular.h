@@ -10,6 +10,7 @@
 #include "itkImageRegionIterator.h"
 #include "TransformationUtils.h"
 #include "ImageUtils.h"
+#include "GridMaxFlow.h"
 #include "FilterUtils.hpp"
 #include "bgraph.h"
 #include <sstream>
@@ -27,6 +28,7 @@
 #include <itkLabelOverlapMeasuresImageFilter.h>
 #include "Metrics.h"
 #include "SegmentationMapper.hxx"
+#include "DeformationCompositionCache.h"
 using namespace std;
 
 template <class ImageType, int nSegmentationLabels>
@@ -88,6 +90,7 @@ public:
         int useNTargets=1000000;
         double globalOneHopWeight=1.0;
         bool AREG= false;
+        double compositionCacheMB=2048;
         m_sigma=30;
         as->parameter ("A",atlasSegmentationFileList , "list of atlas segmentations <id> <file>", true);
         as->parameter ("T", deformationFileList, " list of deformations", true);
@@ -106,10 +109,13 @@ public:
         as->parameter ("useNTargets", useNTargets,"use the first N targets as intermediate images",false);
         as->parameter ("globalOneHopWeight", globalOneHopWeight,"global weight for one hop segmentations (vs. zero hop)",false);
         as->option ("AREG", AREG,"use AREG to select intermediate targets");
+        as->parameter ("compositionCacheMB", compositionCacheMB,"memory budget (MB) for caching decoded, resampled and composed indirect deformations",false);
         as->option ("lateFusion", lateFusion,"fuse segmentations late. maxHops=1");
         as->option ("dontCacheDeformations", dontCacheDeformations,"read deformations only when needed to save memory. higher IO load!");
         as->option ("graphCut", graphCut,"use graph cuts to generate final segmentations instead of locally maximizing");
         as->parameter ("smoothness", smoothness,"smoothness parameter of graph cut optimizer",false);
+        string storeFilename="";
+        as->parameter ("store", storeFilename,"image store created with PackImageStore; images and deformations packed in it are copied from the mapped store instead of decoded from disk, the store has to be packed with the pixel type of this application",false);
         as->parameter ("verbose", verbose,"get verbose output",false);
         as->help();
         as->parse();
@@ -132,6 +138,9 @@ public:
         mkdir(outputDir.c_str(),0755);
         logSetStage("IO");
         logSetVerbosity(verbose);
+        if (storeFilename!="" && ImageStore::global().open(storeFilename)){
+            LOG<<"Mapped image store "<<storeFilename<<" with "<<ImageStore::global().size()<<" images"<<endl;
+        }
         
         MetricType metric;
         if (metricName=="NONE")
@@ -263,6 +272,8 @@ public:
             }
         }
     
+        DeformationCompositionCache<ImageType,double> compositionCache(compositionCacheMB);
+
         logSetStage("Zero Hop");
         LOG<<"Computing"<<std::endl;
         map<string,ProbabilisticVectorImagePointerType> probabilisticSegmentations;
@@ -311,14 +322,14 @@ public:
                         //todo accumulate atlas segmentations
                         DeformationFieldPointerType firstDeformation,secondDeformation,deformation;
                         if (dontCacheDeformations){
-                            firstDeformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[atlasID][targetID]);
-                            secondDeformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[targetID][atlasID]);
+                            firstDeformation = compositionCache.read(deformationFilenames[atlasID][targetID]);
+                            secondDeformation = compositionCache.read(deformationFilenames[targetID][atlasID]);
                         }else{
                             firstDeformation = deformationCache[atlasID][targetID];
                             secondDeformation = deformationCache[targetID][atlasID];
                         }
                         
-                        deformation = TransfUtilsType::composeDeformations(secondDeformation,firstDeformation);
+                        deformation = compositionCache.compose(atlasID,targetID,atlasID,secondDeformation,firstDeformation);
                         ProbabilisticVectorImagePointerType probSeg=probabilisticSegmentations[atlasID];
                         double weight = 1.0;
                         updateProbabilisticSegmentationLocalMetricNew(probAtlasSeg,probSeg,weight,targetImageIterator->second,(*atlasImages)[(*atlasIDMap)[atlasID]].second,deformation,metric);
@@ -354,14 +365,14 @@ public:
                     //todo accumulate atlas segmentations
                     DeformationFieldPointerType firstDeformation,secondDeformation,deformation;
                     if (dontCacheDeformations){
-                        firstDeformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[atlasID][targetID]);
-                        secondDeformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[targetID][atlasID]);
+                        firstDeformation = compositionCache.read(deformationFilenames[atlasID][targetID]);
+                        secondDeformation = compositionCache.read(deformationFilenames[targetID][atlasID]);
                     }else{
                         firstDeformation = deformationCache[atlasID][targetID];
                         secondDeformation = deformationCache[targetID][atlasID];
                     }
                         
-                    deformation = TransfUtilsType::composeDeformations(secondDeformation,firstDeformation);
+                    deformation = compositionCache.compose(atlasID,targetID,atlasID,secondDeformation,firstDeformation);
                     ProbabilisticVectorImagePointerType probSeg=probabilisticSegmentations[atlasID];
                     double weight = 1.0;
                     updateProbabilisticSegmentationLocalMetricNew(probabilisticAtlasSelfSegmentations[atlasID],probSeg,weight,tmp,(*atlasImages)[(*atlasIDMap)[atlasID]].second,deformation,metric);
@@ -386,7 +397,7 @@ public:
                         LOGV(4)<<VAR(atlasID)<<" "<<VAR(targetID)<<endl;
                         DeformationFieldPointerType deformation;
                         if (dontCacheDeformations){
-                            deformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[atlasID][targetID]);
+                            deformation = compositionCache.read(deformationFilenames[atlasID][targetID]);
                         }else{
                             deformation = deformationCache[atlasID][targetID];
                         }
@@ -469,7 +480,7 @@ public:
                             if (intermediateID != atlasID){
                                 if (dontCacheDeformations){
                                     LOGV(3)<<VAR(atlasID)<<" "<<VAR(intermediateID)<<" "<<VAR(deformationFilenames[atlasID][intermediateID])<<endl;
-                                    firstDeformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[atlasID][intermediateID]);
+                                    firstDeformation = compositionCache.read(deformationFilenames[atlasID][intermediateID]);
                                 }else{
                                     LOGV(3)<<VAR(atlasID)<<" "<<VAR(intermediateID)<<endl;
                                     firstDeformation = deformationCache[atlasID][intermediateID];
@@ -491,7 +502,7 @@ public:
                                     DeformationFieldPointerType secondDeformation,deformation;
                                     if (dontCacheDeformations){
                                         LOGV(3)<<VAR(targetID)<<" "<<VAR(intermediateID)<<" "<<VAR(deformationFilenames[intermediateID][targetID])<<endl<<endl;
-                                        secondDeformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[intermediateID][targetID]);
+                                        secondDeformation = compositionCache.read(deformationFilenames[intermediateID][targetID]);
                                     }else{
                                         LOGV(3)<<VAR(targetID)<<" "<<VAR(intermediateID)<<endl<<endl;
                                         secondDeformation = deformationCache[intermediateID][targetID];
@@ -502,7 +513,7 @@ public:
                                         if ( intermediateID == atlasID ){
                                             deformation = secondDeformation;
                                         }else{
-                                            deformation = TransfUtilsType::composeDeformations(secondDeformation,firstDeformation);
+                                            deformation = compositionCache.compose(atlasID,intermediateID,targetID,secondDeformation,firstDeformation);
                                             weight*=globalWeights[atlasID][intermediateID];
                                         }
                                         probSeg = probabilisticSegmentations[atlasID];
@@ -689,16 +700,10 @@ protected:
         result->SetDirection(img->GetDirection());
         result->SetRegions(img->GetLargestPossibleRegion());
         result->Allocate();
-        typedef Graph<float,float,double> MRFType;
-        typedef MRFType::node_id NodeType;
-        MRFType* optimizer;
+        //binary cut on the implicit 6-neighborhood (3D) of the image grid, no adjacency lists are built
+        typedef GridMaxFlow<float,double> MRFType;
         SizeType size=img->GetLargestPossibleRegion().GetSize();
-        int nNodes=1;
-        for (unsigned int d=0;d<D;++d) {nNodes*=size[d];}
-        int nEdges=D*nNodes;
-        for (unsigned int d=0;d<D;++d) {nEdges-=size[d];}
-        optimizer = new MRFType(nNodes,nEdges);
-        optimizer->add_node(nNodes);
+        MRFType optimizer(D,size);
         ProbImageIteratorType probIt(img,img->GetLargestPossibleRegion());
         int i=0;
         for (probIt.GoToBegin();!probIt.IsAtEnd();++probIt,++i){
@@ -714,7 +719,7 @@ protected:
                 }
             }
             LOGV(7)<<VAR(i)<<" "<<VAR(energies)<<endl;
-            optimizer->add_tweights(i,energies[0],energies[1]);
+            optimizer.add_tweights(i,energies[0],energies[1]);
             for (unsigned  int d=0;d<D;++d){
                 OffsetType off;
                 off.Fill(0);
@@ -723,15 +728,15 @@ protected:
                 bool inside2;
                 int withinImageIndex2=ImageUtils<ImageType>::ImageIndexToLinearIndex(neighborIndex,size,inside2);
                 if (inside2){
-                    optimizer -> add_edge(i,withinImageIndex2,smooth,smooth);
+                    optimizer.add_edge(i,withinImageIndex2,smooth,smooth);
                 }
             }
         }
-        optimizer->maxflow();
+        optimizer.maxflow();
         ImageIteratorType imgIt(result,result->GetLargestPossibleRegion());
         i=0;
         for (imgIt.GoToBegin();!imgIt.IsAtEnd();++imgIt,++i){
-            int maxLabel=optimizer->what_segment(i)== MRFType::SOURCE ;
+            int maxLabel=optimizer.what_segment(i)== MRFType::SOURCE ;
             if (D==2){
                 imgIt.Set(1.0*std::numeric_limits<PixelType>::max()*maxLabel/(nSegmentationLabels-1));
             }else{
@@ -23,6 +23,7 @@
 #include "itkImageRegionIterator.h"
 #include "TransformationUtils.h"
 #include "ImageUtils.h"
+#include "GridMaxFlow.h"
 #include "FilterUtils.hpp"
 #include <sstream>
 #include "ArgumentParser.h"
@@ -39,6 +40,7 @@
 #include <itkLabelOverlapMeasuresImageFilter.h>
 #include "Metrics.h"
 #include "SegmentationMapper.hxx"
+#include "DeformationCompositionCache.h"
 
 namespace SSSP{
   /**
@@ -102,6 +104,7 @@ public:
         int useNTargets=1000000;
         double globalOneHopWeight=1.0;
         bool AREG= false;
+        double compositionCacheMB=2048;
         string singleTarget="";
         m_sigma=30;
         as->parameter ("A",atlasSegmentationFileList , "list of atlas segmentations <id> <file>", true);
@@ -122,10 +125,13 @@ public:
         as->parameter ("globalOneHopWeight", globalOneHopWeight,"global weight for one hop segmentations (vs. zero hop)",false);
         as->parameter ("singleTarget", singleTarget,"only compute propagated segmentations for a specific target (maxhops = 1)",false);
         as->option ("AREG", AREG,"use AREG to select intermediate targets");
+        as->parameter ("compositionCacheMB", compositionCacheMB,"memory budget (MB) for caching decoded, resampled and composed indirect deformations",false);
         as->option ("lateFusion", lateFusion,"fuse segmentations late. maxHops=1");
         as->option ("dontCacheDeformations", dontCacheDeformations,"read deformations only when needed to save memory. higher IO load!");
         as->option ("graphCut", graphCut,"use graph cuts to generate final segmentations instead of locally maximizing");
         as->parameter ("smoothness", smoothness,"smoothness parameter of graph cut optimizer",false);
+        string storeFilename="";
+        as->parameter ("store", storeFilename,"image store created with PackImageStore; images and deformations packed in it are copied from the mapped store instead of decoded from disk, the store has to be packed with the pixel type of this application",false);
         as->parameter ("verbose", verbose,"get verbose output",false);
         as->help();
         as->parse();
@@ -151,6 +157,9 @@ public:
         mkdir(outputDir.c_str(),0755);
         logSetStage("IO");
         logSetVerbosity(verbose);
+        if (storeFilename!="" && ImageStore::global().open(storeFilename)){
+            LOG<<"Mapped image store "<<storeFilename<<" with "<<ImageStore::global().size()<<" images"<<endl;
+        }
         
         MetricType metric;
         if (metricName=="NONE")
@@ -284,6 +293,8 @@ public:
             }
         }
     
+        DeformationCompositionCache<ImageType,double> compositionCache(compositionCacheMB);
+
         logSetStage("Zero Hop");
         LOG<<"Computing"<<std::endl;
         map<string,ProbabilisticVectorImagePointerType> probabilisticSegmentations;
@@ -331,14 +342,14 @@ public:
                             //todo accumulate atlas segmentations
                             DeformationFieldPointerType firstDeformation,secondDeformation,deformation;
                             if (dontCacheDeformations){
-                                firstDeformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[atlasID][targetID]);
-                                secondDeformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[targetID][atlasID]);
+                                firstDeformation = compositionCache.read(deformationFilenames[atlasID][targetID]);
+                                secondDeformation = compositionCache.read(deformationFilenames[targetID][atlasID]);
                             }else{
                                 firstDeformation = deformationCache[atlasID][targetID];
                                 secondDeformation = deformationCache[targetID][atlasID];
                             }
                         
-                            deformation = TransfUtilsType::composeDeformations(secondDeformation,firstDeformation);
+                            deformation = compositionCache.compose(atlasID,targetID,atlasID,secondDeformation,firstDeformation);
                             ProbabilisticVectorImagePointerType probSeg=probabilisticSegmentations[atlasID];
                             double weight = 1.0;
                             updateProbabilisticSegmentationLocalMetricNew(probAtlasSeg,probSeg,weight,targetImageIterator->second,(*atlasImages)[(*atlasIDMap)[atlasID]].second,deformation,metric);
@@ -373,14 +384,14 @@ public:
                     //todo accumulate atlas segmentations
                     DeformationFieldPointerType firstDeformation,secondDeformation,deformation;
                     if (dontCacheDeformations){
-                        firstDeformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[atlasID][targetID]);
-                        secondDeformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[targetID][atlasID]);
+                        firstDeformation = compositionCache.read(deformationFilenames[atlasID][targetID]);
+                        secondDeformation = compositionCache.read(deformationFilenames[targetID][atlasID]);
                     }else{
                         firstDeformation = deformationCache[atlasID][targetID];
                         secondDeformation = deformationCache[targetID][atlasID];
                     }
                         
-                    deformation = TransfUtilsType::composeDeformations(secondDeformation,firstDeformation);
+                    deformation = compositionCache.compose(atlasID,targetID,atlasID,secondDeformation,firstDeformation);
                     ProbabilisticVectorImagePointerType probSeg=probabilisticSegmentations[atlasID];
                     double weight = 1.0;
                     updateProbabilisticSegmentationLocalMetricNew(probabilisticAtlasSelfSegmentations[atlasID],probSeg,weight,tmp,(*atlasImages)[(*atlasIDMap)[atlasID]].second,deformation,metric);
@@ -410,7 +421,7 @@ public:
                             ProbabilisticVectorImagePointerType probAtlasSegmentation=segmentationToProbabilisticVector(atlasSegmentation);
                             DeformationFieldPointerType atlasTargetDeformation;
                             if (dontCacheDeformations){
-                                atlasTargetDeformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[atlasID][targetID]);
+                                atlasTargetDeformation = compositionCache.read(deformationFilenames[atlasID][targetID]);
                             }else{
                                 atlasTargetDeformation = deformationCache[atlasID][targetID];
                             }
@@ -441,23 +452,23 @@ public:
                                     ++intermediateN;
                                     DeformationFieldPointerType deformation;
                                     if (dontCacheDeformations){
-                                        deformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[intermediateID][targetID]);
+                                        deformation = compositionCache.read(deformationFilenames[intermediateID][targetID]);
                                     }else{
                                         deformation = deformationCache[intermediateID][targetID];
                                     }
-                                    deformation=TransfUtils<ImageType,double>::linearInterpolateDeformationField(deformation, targetImage);
+                                    deformation=compositionCache.resample(intermediateID,targetID,deformation, targetImage);
                                     DeformationFieldPointerType firstDeformation;
                                     if (dontCacheDeformations){
                                         LOGV(3)<<VAR(atlasID)<<" "<<VAR(intermediateID)<<" "<<VAR(deformationFilenames[atlasID][intermediateID])<<endl;
-                                        firstDeformation = ImageUtils<DeformationFieldType>::readImage(deformationFilenames[atlasID][intermediateID]);
+                                        firstDeformation = compositionCache.read(deformationFilenames[atlasID][intermediateID]);
                                     }else{
                                         LOGV(3)<<VAR(atlasID)<<" "<<VAR(intermediateID)<<endl;
                                         firstDeformation = deformationCache[atlasID][intermediateID];
                                     }
-                                    firstDeformation=TransfUtils<ImageType,double>::linearInterpolateDeformationField(firstDeformation, intermediateImageIterator->second);
+                                    firstDeformation=compositionCache.resample(atlasID,intermediateID,firstDeformation, intermediateImageIterator->second);
 
                                 
-                                    DeformationFieldPointerType fullDeformation=TransfUtilsType::composeDeformations(deformation,firstDeformation);
+                                    DeformationFieldPointerType fullDeformation=compositionCache.compose(atlasID,intermediateID,targetID,deformation,firstDeformation);
                                     //update
                                     if (weighting==UNIFORM || metric == NONE ){
                                         updateProbabilisticSegmentationUniform(probabilisticTargetSegmentation,probAtlasSegmentation,weight,fullDeformation);
@@ -608,17 +619,10 @@ protected:
         result->SetDirection(img->GetDirection());
         result->SetRegions(img->GetLargestPossibleRegion());
         result->Allocate();
-#ifdef WITH_GCO
-        typedef Graph<float,float,double> MRFType;
-        typedef MRFType::node_id NodeType;
-        MRFType* optimizer;
+        //binary cut on the implicit 6-neighborhood (3D) of the image grid, no adjacency lists are built
+        typedef GridMaxFlow<float,double> MRFType;
         SizeType size=img->GetLargestPossibleRegion().GetSize();
-        int nNodes=1;
-        for (unsigned int d=0;d<D;++d) {nNodes*=size[d];}
-        int nEdges=D*nNodes;
-        for (unsigned int d=0;d<D;++d) {nEdges-=size[d];}
-        optimizer = new MRFType(nNodes,nEdges);
-        optimizer->add_node(nNodes);
+        MRFType optimizer(D,size);
         ProbImageIteratorType probIt(img,img->GetLargestPossibleRegion());
         int i=0;
         for (probIt.GoToBegin();!probIt.IsAtEnd();++probIt,++i){
@@ -634,7 +638,7 @@ protected:
                 }
             }
             LOGV(7)<<VAR(i)<<" "<<VAR(energies)<<endl;
-            optimizer->add_tweights(i,energies[0],energies[1]);
+            optimizer.add_tweights(i,energies[0],energies[1]);
             for (unsigned  int d=0;d<D;++d){
                 OffsetType off;
                 off.Fill(0);
@@ -643,24 +647,21 @@ protected:
                 bool inside2;
                 int withinImageIndex2=ImageUtils<ImageType>::ImageIndexToLinearIndex(neighborIndex,size,inside2);
                 if (inside2){
-                    optimizer -> add_edge(i,withinImageIndex2,smooth,smooth);
+                    optimizer.add_edge(i,withinImageIndex2,smooth,smooth);
                 }
             }
         }
-        optimizer->maxflow();
+        optimizer.maxflow();
         ImageIteratorType imgIt(result,result->GetLargestPossibleRegion());
         i=0;
         for (imgIt.GoToBegin();!imgIt.IsAtEnd();++imgIt,++i){
-            int maxLabel=optimizer->what_segment(i)== MRFType::SOURCE ;
+            int maxLabel=optimizer.what_segment(i)== MRFType::SOURCE ;
             if (D==2){
                 imgIt.Set(1.0*std::numeric_limits<PixelType>::max()*maxLabel/(nSegmentationLabels-1));
             }else{
                 imgIt.Set(maxLabel);
             }
         }
-#else
-	LOG<<"GCO not available, result will be empty (and broken)."<<endl;
-#endif
         return result;
     }
     ProbabilisticVectorImagePointerType normalizeProbs(ProbabilisticVectorImagePointerType img){
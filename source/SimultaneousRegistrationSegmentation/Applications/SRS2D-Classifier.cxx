@@ -90,9 +90,23 @@ int main(int argc, char ** argv)
     logSetStage("Instantiate Potentials");
     
 
-    RegistrationUnaryPotentialType::Pointer unaryRegistrationPot=RegistrationUnaryPotentialType::New();
+    RegistrationUnaryPotentialType::Pointer unaryRegistrationPot;
+    if (filterConfig.registrationMetric=="LocalMI"){
+        FastUnaryPotentialRegistrationLocalMI<ImageType>::Pointer localMI=FastUnaryPotentialRegistrationLocalMI<ImageType>::New();
+        localMI->setNumberOfBins(filterConfig.localMIBins);
+        unaryRegistrationPot=localMI.GetPointer();
+    }else{
+        unaryRegistrationPot=RegistrationUnaryPotentialType::New();
+    }
     SegmentationUnaryPotentialType::Pointer unarySegmentationPot=SegmentationUnaryPotentialType::New();
-    RegistrationPairwisePotentialType::Pointer pairwiseRegistrationPot=RegistrationPairwisePotentialType::New();
+    RegistrationPairwisePotentialType::Pointer pairwiseRegistrationPot;
+    if (filterConfig.pairwiseRegistrationNorm=="L1"){
+        pairwiseRegistrationPot=PairwisePotentialRegistrationL1<ImageType>::New().GetPointer();
+    }else if (filterConfig.pairwiseRegistrationNorm=="SquaredL2"){
+        pairwiseRegistrationPot=PairwisePotentialRegistrationSquaredL2<ImageType>::New().GetPointer();
+    }else{
+        pairwiseRegistrationPot=RegistrationPairwisePotentialType::New();
+    }
     SegmentationPairwisePotentialType::Pointer pairwiseSegmentationPot=SegmentationPairwisePotentialType::New();
     CoherencePairwisePotentialType::Pointer pairwiseCoherencePot=CoherencePairwisePotentialType::New();
 #ifdef POTENTIALINHERITANCE
@@ -220,8 +234,14 @@ int main(int argc, char ** argv)
     filter->setTargetGradient(targetGradient);
     filter->setAtlasImage(atlasImage);
     filter->setAtlasMaskImage(atlasMaskImage);
+    if (filterConfig.ROIFilename!=""){
+        filter->setTargetROI(ImageUtils<ImageType>::readImage(filterConfig.ROIFilename));
+    }
     filter->setAtlasGradient(atlasGradient);
     filter->setAtlasSegmentation(atlasSegmentation);
+    if (filterConfig.groundTruthSegmentationFilename!=""){
+        filter->setGroundTruthSegmentation(ImageUtils<ImageType>::readImage(filterConfig.groundTruthSegmentationFilename));
+    }
     if (filterConfig.useTargetAnatomyPrior){
         filter->setTargetAnatomyPrior(targetAnatomyPrior);
     }
@@ -237,7 +257,7 @@ int main(int argc, char ** argv)
     }
     else if (filterConfig.bulkTransformationField!=""){
         filter->setBulkTransform(ImageUtils<DeformationFieldType>::readImage(filterConfig.bulkTransformationField));
-    }else if (filterConfig.initWithMoments){
+    }else if (filterConfig.initWithMoments && !filterConfig.affineRegistration){
         //LOG<<" NOT NOT NOT Computing transform to move image centers on top of each other.."<<std::endl;
         LOG<<"initializing deformation using moments.."<<std::endl;
         DeformationFieldPointerType transf=TransfUtils<ImageType>::computeCenteringTransform(originalTargetImage,originalAtlasImage);
@@ -17,8 +17,9 @@ namespace SRS{
              class TPairwiseRegistrationFunction= PairwisePotentialRegistration<TImage>,
              class TUnarySegmentationFunction=UnaryPotentialSegmentation<TImage>,
              class TPairwiseSegmentationFunction=PairwisePotentialSegmentation<TImage>,
-             class TPairwiseCoherenceFunction=PairwisePotentialCoherence<TImage> >
-    class FastGraphModel: public GraphModel<TImage,TUnaryRegistrationFunction,TPairwiseRegistrationFunction,TUnarySegmentationFunction,TPairwiseSegmentationFunction,TPairwiseCoherenceFunction>
+             class TPairwiseCoherenceFunction=PairwisePotentialCoherence<TImage>,
+             class TPrecision=DefaultPotentialPrecision >
+    class FastGraphModel: public GraphModel<TImage,TUnaryRegistrationFunction,TPairwiseRegistrationFunction,TUnarySegmentationFunction,TPairwiseSegmentationFunction,TPairwiseCoherenceFunction,TPrecision>
     {
     public:
         typedef FastGraphModel Self;
@@ -39,6 +40,7 @@ namespace SRS{
         typedef typename TransfUtils<ImageType>::DisplacementType RegistrationLabelType;
     public:
          void Init(){
+            this->freeCoherencePotentials();
             //#define moarcaching
             this->m_unaryRegFunction->setCoarseImage(this->m_coarseGraphImage);
             TIME(this->m_unaryRegFunction->initCaching());
@@ -75,6 +77,76 @@ namespace SRS{
 
         }
 
+        ///registration unaries of all nodes and labels in node-major order, block[node*nRegLabels()+label].
+        ///the block is loaded from the persistent potential cache if it contains the unaries of the current level, iteration and label sets
+        void getUnaryRegistrationBlock(std::vector<float> & block){
+            int nNodes=this->nRegNodes();
+            int nLabels=this->nRegLabels();
+            std::vector<RegistrationLabelType> displacements(nLabels);
+            for (int l=0;l<nLabels;++l)
+                displacements[l]=this->m_labelMapper->scaleDisplacement(this->m_labelMapper->getLabel(l),this->getDisplacementFactor());
+            std::vector<float> nodeScales=this->getRegistrationNodeLabelScales();
+            PotentialCache::HashType key=PotentialCache::hashString("registrationUnaries",this->m_potentialCache.getKey());
+            key=PotentialCache::hashValue(nNodes,key);
+            key=PotentialCache::hashVector(displacements,key);
+            key=PotentialCache::hashVector(nodeScales,key);
+            if (this->m_reducedRegNodes) key=PotentialCache::hashVector(this->m_mapRegIdxRev,key);
+            //metadata: normalization state of the unary function after computing the block, and whether the node label scales were dropped
+            std::vector<double> meta;
+            if (this->m_potentialCache.load("registrationUnaries",key,block,meta) && block.size()==(size_t)nNodes*nLabels && meta.size()==2){
+                LOGV(1)<<"Loaded registration unaries from "<<this->m_potentialCache.filename("registrationUnaries",key)<<std::endl;
+                this->m_unaryRegFunction->setNormalizationState(meta[0]);
+                if (meta[1]!=0.0){
+                    LOG<<"WARNING: the registration unary potential cannot be evaluated node by node, ignoring the adaptive label sets"<<std::endl;
+                    this->setNodeLabelScales(std::vector<float>());
+                }
+            }else{
+                bool droppedScales=!computeUnaryRegistrationBlock(displacements,nodeScales,block);
+                meta.resize(2);
+                meta[0]=this->m_unaryRegFunction->getNormalizationState();
+                meta[1]=droppedScales;
+                this->m_potentialCache.store("registrationUnaries",key,block,meta);
+            }
+            this->measureUnaryAmbiguity(block);
+        }
+
+    protected:
+        ///the unary function evaluates all labels of a node at once if it supports it,
+        ///otherwise the potentials are cached label by label, starting with the zero displacement label.
+        ///per node label sets (setNodeLabelScales) need the node-wise evaluation, returns false if they had to be dropped
+        bool computeUnaryRegistrationBlock(const std::vector<RegistrationLabelType> & displacements, const std::vector<float> & nodeScales, std::vector<float> & block){
+            int nNodes=this->nRegNodes();
+            int nLabels=this->nRegLabels();
+            std::vector<IndexType> indices(nNodes);
+            for (int n=0;n<nNodes;++n)
+                indices[n]=this->getGraphIndex(n);
+            if (this->m_unaryRegFunction->computePotentialBlock(indices,displacements,nodeScales,block)){
+                LOGV(2)<<"Computed node-major registration unaries for "<<nNodes<<" nodes and "<<nLabels<<" labels"<<endl;
+                for (int n=0;n<nNodes;++n){
+                    for (int l=0;l<nLabels;++l){
+                        double result=block[(size_t)n*nLabels+l];
+                        if (this->m_normalizePotentials) result/=this->m_nRegistrationNodes;
+                        block[(size_t)n*nLabels+l]=result;
+                    }
+                }
+                return true;
+            }
+            bool keptScales=true;
+            if (!nodeScales.empty()){
+                LOG<<"WARNING: the registration unary potential cannot be evaluated node by node, ignoring the adaptive label sets"<<std::endl;
+                this->setNodeLabelScales(std::vector<float>());
+                keptScales=false;
+            }
+            block.resize((size_t)nNodes*nLabels);
+            int zeroLabel=nLabels/2;
+            for (int i=0;i<nLabels;++i){
+                int l=(i==0)?zeroLabel:(i<=zeroLabel?i-1:i);
+                cacheRegistrationPotentials(l);
+                for (int n=0;n<nNodes;++n)
+                    block[(size_t)n*nLabels+l]=getUnaryRegistrationPotential(n,l);
+            }
+            return keptScales;
+        }
 
     };
 }
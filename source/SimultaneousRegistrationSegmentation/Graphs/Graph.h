@@ -13,6 +13,8 @@
 #include <assert.h>
 #include "itkConstNeighborhoodIterator.h"
 #include <limits>
+#include <algorithm>
+#include <cmath>
 #include "SRSConfig.h"
 #include "Log.h"
 #include "TransformationUtils.h"
@@ -22,6 +24,8 @@
 #include "Potential-Segmentation-Pairwise.h"
 #include "Potential-Coherence-Pairwise.h"
 #include "BaseLabel.h"
+#include "PotentialCache.h"
+#include "PotentialPrecision.h"
 
 
 
@@ -37,7 +41,8 @@ namespace SRS{
     class TPairwiseRegistrationFunction= PairwisePotentialRegistration<TImage>,
     class TUnarySegmentationFunction=UnaryPotentialSegmentation<TImage>,
     class TPairwiseSegmentationFunction=PairwisePotentialSegmentation<TImage>,
-    class TPairwiseCoherenceFunction=PairwisePotentialCoherence<TImage> >
+    class TPairwiseCoherenceFunction=PairwisePotentialCoherence<TImage>,
+    class TPrecision=DefaultPotentialPrecision >
     class GraphModel: public itk::Object{
   public:
   typedef GraphModel Self;
@@ -71,6 +76,10 @@ namespace SRS{
 
   typedef TPairwiseCoherenceFunction PairwiseCoherenceFunctionType;
   typedef typename PairwiseCoherenceFunctionType::Pointer PairwiseCoherenceFunctionPointerType;
+
+  ///storage precision of tabulated potentials, used by the graph and the solvers
+  typedef TPrecision PrecisionType;
+  typedef PotentialTable<TPrecision> PotentialTableType;
     
   typedef typename TransfUtils<ImageType>::DisplacementType RegistrationLabelType;
   typedef BaseLabelMapper<ImageType,RegistrationLabelType> LabelMapperType;
@@ -122,6 +131,28 @@ namespace SRS{
   bool m_reducedSegNodes;
   double m_coherenceThresh;
 
+  ///coherence potentials of each segmentation node and its registration neighbour, [(segNode*nRegLabels+regLabel)*nSegLabels+segLabel]
+  PotentialTableType m_coherenceTable;
+  std::vector<int> m_coherenceTableRegNode;
+
+  ///persistent cache of unary tables, and the segmentation unaries [segNode*nSegLabels+segLabel] if cacheSegmentationUnaries was called
+  PotentialCache m_potentialCache;
+  PotentialTableType m_segmentationUnaryTable;
+
+  ///active region (ROI/narrow band) at target image resolution, and the labels of the fixed segmentation nodes outside of it
+  ImagePointerType m_activeRegion,m_fixedSegmentation;
+  ///coarse grid nodes which are part of the graph
+  ImagePointerType m_activeRegNodes;
+  ///maps between consecutive registration node indices and coarse grid integer indices
+  std::vector<int> m_mapRegIdx,m_mapRegIdxRev;
+  bool m_reducedRegNodes;
+  ///per active node, the neighbors outside of the active region, whose labels are fixed
+  std::vector<std::vector<IndexType> > m_fixedRegNeighbors,m_fixedSegNeighbors;
+  ///adaptive labeling: per coarse grid node (integer grid index) scale of the displacement label set, empty for one global label set
+  std::vector<float> m_labelScales;
+  ///ambiguity of the last registration unaries per registration node, see measureUnaryAmbiguity
+  std::vector<float> m_unaryAmbiguity;
+
   public:
   int getMaxRegSegNeighbors(){return m_maxRegSegNeighbors;}
   GraphModel(){
@@ -133,6 +164,7 @@ namespace SRS{
     m_DisplacementScalingFactor=1.0;
     m_normalizePotentials=false;
     m_reducedSegNodes=false;
+    m_reducedRegNodes=false;
     m_labelMapper=NULL;
   };
   ~GraphModel(){
@@ -145,6 +177,8 @@ namespace SRS{
   void setTargetImage(ConstImagePointerType targetImage){
     m_targetImage=targetImage;
   }
+  ///key and directory of the persistent unary cache for the current level and iteration
+  void setPotentialCache(const PotentialCache & cache){m_potentialCache=cache;}
   LabelMapperType * getLabelMapper(){return m_labelMapper;}
   void setLabelMapper( LabelMapperType * lm){m_labelMapper=lm;}
         
@@ -166,6 +200,16 @@ namespace SRS{
     m_nSegmentationNodes=1;
     m_nRegistrationNodes=1;
     m_DisplacementScalingFactor=1.0;
+    //a new grid is built, so a previous active region does not apply any more
+    m_reducedSegNodes=false;
+    m_reducedRegNodes=false;
+    m_borderOfSegmentationROI=NULL;
+    freeSegmentationUnaries();
+    m_activeRegion=NULL;
+    m_activeRegNodes=NULL;
+    m_labelScales.clear();
+    m_unaryAmbiguity.clear();
+    if (m_unaryRegFunction.IsNotNull()) m_unaryRegFunction->setActiveCoarseNodes(NULL);
                         
     //calculate graph spacing
     setSpacing(nGraphNodesPerEdge);
@@ -247,35 +291,53 @@ namespace SRS{
     logResetStage;
   }
   ///can be used to initialize stuff right before potentials are called
-  void Init(){};
-  ///set coarse graph size/resolution/spacing based on target image and desired number of nodes on the shortest edge
-  void setSpacing(int shortestN){
-    assert(m_targetImage);
-    this->m_coarseGraphImage=ImageType::New();
-            
+  void Init(){freeCoherencePotentials();};
+  ///coarse grid size and spacing for an image, with shortestN nodes on the shortest image edge
+  static void computeGridGeometry(SizeType imageSize, SpacingType imageSpacing, int shortestN, SizeType & gridSize, SpacingType & gridSpacing){
     unsigned int minDim=999999;
     unsigned int minSize=999999;
-    LOGV(8)<<"original image spacing "<<m_imageSpacing<<endl;
+    LOGV(8)<<"original image spacing "<<imageSpacing<<endl;
     //get shortest image edge
     for (int d=0;d<ImageType::ImageDimension;++d){
-      if(m_imageSize[d]<minSize) {minSize=m_imageSize[d]; minDim=d;}
+      if(imageSize[d]<minSize) {minSize=imageSize[d]; minDim=d;}
     }
-    LOGV(8)<<"shortest edge has size :"<<minSize<<" in dimension :"<<minDim<<" which has spacing :"<<m_imageSpacing[minDim]<<endl;
+    LOGV(8)<<"shortest edge has size :"<<minSize<<" in dimension :"<<minDim<<" which has spacing :"<<imageSpacing[minDim]<<endl;
 
     //calculate spacing for resizing the shortest edge to shortestN
-    double minSpacing=m_imageSpacing[minDim]*(m_imageSize[minDim]-1)/(shortestN-1);
+    double minSpacing=imageSpacing[minDim]*(imageSize[minDim]-1)/(shortestN-1);
     minSpacing=minSpacing>=1?minSpacing:1.0;
     LOGV(8)<<"spacing for resampling this edge to "<<shortestN<<" pixels :"<<minSpacing<<endl;
 
     //calculate spacingq and size for all image dimensions using
     for (int d=0;d<ImageType::ImageDimension;++d){
 
-      int div= (1.0*m_imageSpacing[d]/minSpacing*(m_imageSize[d]-1))+1 ;
-      m_gridSpacing[d]=1.0*m_imageSpacing[d]*(m_imageSize[d]-1)/(div-1);
-      //m_gridPixelSpacing[d]= (m_imageSize[d]-1)/(div-1);
-      LOGV(8)<<d<<" "<<div<<" "<< m_gridSpacing[d] <<" "<< m_gridPixelSpacing[d]<<" "<<m_imageSpacing[d]<<endl;
-      m_gridSize[d]=div;
+      int div= (1.0*imageSpacing[d]/minSpacing*(imageSize[d]-1))+1 ;
+      gridSpacing[d]=1.0*imageSpacing[d]*(imageSize[d]-1)/(div-1);
+      LOGV(8)<<d<<" "<<div<<" "<< gridSpacing[d] <<" "<<imageSpacing[d]<<endl;
+      gridSize[d]=div;
     }
+  }
+  ///unallocated image with the geometry of the coarse grid initGraph(shortestN) would build for targetImage,
+  ///without initializing a graph
+  static ImagePointerType computeCoarseGridImage(ConstImagePointerType targetImage, int shortestN){
+    SizeType gridSize;
+    SpacingType gridSpacing;
+    computeGridGeometry(targetImage->GetLargestPossibleRegion().GetSize(),targetImage->GetSpacing(),shortestN,gridSize,gridSpacing);
+    ImagePointerType gridImage=ImageType::New();
+    typename ImageType::RegionType region;
+    region.SetSize(gridSize);
+    gridImage->SetRegions(region);
+    gridImage->SetOrigin(targetImage->GetOrigin());
+    gridImage->SetSpacing(gridSpacing);
+    gridImage->SetDirection(targetImage->GetDirection());
+    return gridImage;
+  }
+  ///set coarse graph size/resolution/spacing based on target image and desired number of nodes on the shortest edge
+  void setSpacing(int shortestN){
+    assert(m_targetImage);
+    this->m_coarseGraphImage=ImageType::New();
+            
+    computeGridGeometry(m_imageSize,m_imageSpacing,shortestN,m_gridSize,m_gridSpacing);
 
     this->m_coarseGraphImage->SetSpacing(m_gridSpacing);
     typename ImageType::RegionType region;
@@ -318,6 +380,7 @@ namespace SRS{
   ///reduces the nodes for which segmentation labels are computed, based on the coherence potential
   void ReduceSegmentationNodesByCoherencePotential(double thresh){
     m_coherenceThresh=thresh;
+    freeSegmentationUnaries();
     LOGV(1)<<"Removing all segmentation nodes with coherence potential larger "<<thresh<<" for all non-aux labels."<<endl;
 
     //get distance transform potential for neutral deformation
@@ -363,10 +426,145 @@ namespace SRS{
     m_reducedSegNodes=true;
 
   }
+
+  ///restricts the graph to the nonzero region of mask (e.g. a dilated ROI or a narrow band around the deformed atlas segmentation).
+  ///segmentation nodes outside of the region keep their label from fixedSegmentation, registration nodes outside keep a zero displacement update.
+  ///a registration node is active if it is a corner of a grid cell containing an active pixel, so every active pixel keeps its registration neighbors.
+  ///the potentials of edges between active and fixed nodes are added to the unary potentials of the active nodes.
+  ///has to be called after initGraph and, if used, after ReduceSegmentationNodesByCoherencePotential, whose node set is intersected with the region.
+  void setActiveRegion(ConstImagePointerType mask, ConstImagePointerType fixedSegmentation){
+    freeSegmentationUnaries();
+    m_activeRegion=FilterUtils<ImageType>::NNResample(mask,m_targetImage,false);
+    if (fixedSegmentation.IsNotNull()){
+      m_fixedSegmentation=FilterUtils<ImageType>::NNResample(fixedSegmentation,m_targetImage,false);
+    }else{
+      m_fixedSegmentation=FilterUtils<ImageType>::createEmpty(m_targetImage);
+      m_fixedSegmentation->FillBuffer(0);
+    }
+    //coherence based reduction of this iteration, if any
+    bool coherenceReduced=m_reducedSegNodes && m_borderOfSegmentationROI.IsNotNull();
+    std::vector<int> coherenceMap;
+    if (coherenceReduced) coherenceMap=m_mapIdx1;
+    m_reducedSegNodes=false;
+    m_reducedRegNodes=false;
+
+    //segmentation nodes
+    int nPixels=m_targetImage->GetLargestPossibleRegion().GetNumberOfPixels();
+    m_mapIdx1=std::vector<int>(nPixels,-1);
+    m_mapIdx1Rev=std::vector<int>(nPixels,-1);
+    m_activeRegNodes=FilterUtils<ImageType>::createEmpty(m_coarseGraphImage);
+    m_activeRegNodes->FillBuffer(0);
+    int nSeg=0;
+    for (int i=0;i<nPixels;++i){
+      IndexType position=getImageIndex(i);
+      if (!m_activeRegion->GetPixel(position) || (coherenceReduced && coherenceMap[i]<0))
+        continue;
+      m_mapIdx1[i]=nSeg;
+      m_mapIdx1Rev[nSeg]=i;
+      ++nSeg;
+      //corners of the enclosing grid cell
+      IndexType lower=getLowerGraphIndex(position);
+      for (int c=0;c<(1<<m_dim);++c){
+        IndexType corner=lower;
+        for (unsigned int d=0;d<m_dim;++d){
+          corner[d]+=(c>>d)&1;
+          if (corner[d]>=(int)m_gridSize[d]) corner[d]=m_gridSize[d]-1;
+        }
+        m_activeRegNodes->SetPixel(corner,1);
+      }
+      //the closest node may not be a corner when the index to point conversion rounds
+      m_activeRegNodes->SetPixel(getClosestGraphIndex(position),1);
+    }
+    m_mapIdx1Rev.resize(nSeg);
+
+    //registration nodes
+    int nGridNodes=m_coarseGraphImage->GetLargestPossibleRegion().GetNumberOfPixels();
+    m_mapRegIdx=std::vector<int>(nGridNodes,-1);
+    m_mapRegIdxRev.clear();
+    for (int i=0;i<nGridNodes;++i){
+      if (m_activeRegNodes->GetPixel(getGraphIndex(i))){
+        m_mapRegIdx[i]=m_mapRegIdxRev.size();
+        m_mapRegIdxRev.push_back(i);
+      }
+    }
+
+    //fixed neighbors of active nodes
+    m_fixedRegNeighbors=std::vector<std::vector<IndexType> >(m_mapRegIdxRev.size());
+    for (unsigned int n=0;n<m_mapRegIdxRev.size();++n){
+      IndexType position=getGraphIndex(m_mapRegIdxRev[n]);
+      for (unsigned int d=0;d<m_dim;++d){
+        for (int sign=-1;sign<=1;sign+=2){
+          IndexType neighbor=position;
+          neighbor[d]+=sign;
+          if (neighbor[d]>=0 && neighbor[d]<(int)m_gridSize[d] && !m_activeRegNodes->GetPixel(neighbor))
+            m_fixedRegNeighbors[n].push_back(neighbor);
+        }
+      }
+    }
+    m_fixedSegNeighbors=std::vector<std::vector<IndexType> >(nSeg);
+    for (int n=0;n<nSeg;++n){
+      IndexType position=getImageIndex(m_mapIdx1Rev[n]);
+      for (unsigned int d=0;d<m_dim;++d){
+        for (int sign=-1;sign<=1;sign+=2){
+          IndexType neighbor=position;
+          neighbor[d]+=sign;
+          //only pixels outside of the region are fixed, pixels removed by the coherence reduction are left out as before
+          if (neighbor[d]>=0 && neighbor[d]<(int)m_imageSize[d] && !m_activeRegion->GetPixel(neighbor))
+            m_fixedSegNeighbors[n].push_back(neighbor);
+        }
+      }
+    }
+
+    LOG<<"Active region: "<<100.0*nSeg/nPixels<<"% of the segmentation nodes ("<<nSeg<<"), "
+       <<100.0*m_mapRegIdxRev.size()/nGridNodes<<"% of the registration nodes ("<<m_mapRegIdxRev.size()<<")"<<endl;
+    LOGI(6,ImageUtils<ImageType>::writeImage("activeRegion.nii",m_activeRegion));
+    m_nSegmentationNodes=nSeg;
+    m_nRegistrationNodes=m_mapRegIdxRev.size();
+    m_reducedSegNodes=true;
+    m_reducedRegNodes=true;
+    if (m_unaryRegFunction.IsNotNull()) m_unaryRegFunction->setActiveCoarseNodes(m_activeRegNodes);
+  }
+  bool hasActiveRegion(){return m_reducedRegNodes;}
+
+  ///summed potential of the edges between an active registration node and its fixed neighbors, which keep a zero displacement update.
+  ///these are pairwise terms: solvers add them to the node's unaries scaled by the pairwise registration weight, they are not part of getUnaryRegistrationPotential
+  inline double getFixedNeighborsRegistrationPotential(int nodeIndex, int labelIndex){
+    if (!m_reducedRegNodes || m_fixedRegNeighbors[nodeIndex].empty())
+      return 0.0;
+    PointType pt1,pt2;
+    this->m_coarseGraphImage->TransformIndexToPhysicalPoint(getGraphIndex(nodeIndex),pt1);
+    RegistrationLabelType l1=getNodeDisplacement(nodeIndex,labelIndex);
+    RegistrationLabelType l2=this->m_labelMapper->getZeroDisplacement();
+    double result=0.0;
+    for (unsigned int n=0;n<m_fixedRegNeighbors[nodeIndex].size();++n){
+      this->m_coarseGraphImage->TransformIndexToPhysicalPoint(m_fixedRegNeighbors[nodeIndex][n],pt2);
+      result+=m_pairwiseRegFunction->getPotential(pt1,pt2,l1,l2);
+    }
+    if (m_normalizePotentials) result/=m_nRegEdges;
+    return result;
+  }
+
+  ///summed potential of the edges between an active segmentation node and its fixed neighbors outside of the active region.
+  ///these are pairwise terms: solvers add them to the node's unaries scaled by the pairwise segmentation weight, they are not part of getUnarySegmentationPotential
+  inline double getFixedNeighborsSegmentationPotential(int nodeIndex, int labelIndex){
+    if (m_activeRegion.IsNull() || m_fixedSegNeighbors[nodeIndex].empty())
+      return 0.0;
+    IndexType imageIndex=getImageIndex(nodeIndex);
+    double result=0.0;
+    for (unsigned int n=0;n<m_fixedSegNeighbors[nodeIndex].size();++n){
+      IndexType neighbor=m_fixedSegNeighbors[nodeIndex][n];
+      result+=m_pairwiseSegFunction->getPotential(imageIndex,neighbor,labelIndex,m_fixedSegmentation->GetPixel(neighbor));
+    }
+    if (m_normalizePotentials) result/=m_nSegEdges;
+    return result;
+  }
      
   ///return position index in coarse graph from coarse graph node index
   inline  IndexType  getGraphIndex(int nodeIndex){
     IndexType position;
+    if (m_reducedRegNodes) {
+      nodeIndex=m_mapRegIdxRev[nodeIndex];
+    }
     for ( int d=m_dim-1;d>=0;--d){
       //position[d] is now the index in the coarse graph (image)
       position[d]=nodeIndex/m_graphLevelDivisors[d];
@@ -379,6 +577,9 @@ namespace SRS{
   inline IndexType  getImageIndexFromCoarseGraphIndex(int idx){
     IndexType position;
 #ifdef MANUALCONVERSION
+    if (m_reducedRegNodes) {
+      idx=m_mapRegIdxRev[idx];
+    }
     for ( int d=m_dim-1;d>=0;--d){
       //position[d] is now the index in the coarse graph (image)
       position[d]=idx/m_graphLevelDivisors[d];
@@ -432,6 +633,9 @@ namespace SRS{
     for (unsigned int d=0;d<m_dim;++d){
       i+=gridIndex[d]*m_graphLevelDivisors[d];
     }
+    if (m_reducedRegNodes) {
+      i=m_mapRegIdx[i];
+    }
     return i;
   }
 
@@ -467,8 +671,7 @@ namespace SRS{
    */
   inline double getUnaryRegistrationPotential(int nodeIndex,int labelIndex){
     IndexType imageIndex=getImageIndexFromCoarseGraphIndex(nodeIndex);
-    RegistrationLabelType l=this->m_labelMapper->getLabel(labelIndex);
-    l=this->m_labelMapper->scaleDisplacement(l,getDisplacementFactor());
+    RegistrationLabelType l=getNodeDisplacement(nodeIndex,labelIndex);
     double result=m_unaryRegFunction->getPotential(imageIndex,l);
     if (m_normalizePotentials) result/=m_nRegistrationNodes;
     return result;//m_nRegistrationNodes;
@@ -487,7 +690,7 @@ namespace SRS{
     }
 
     /// return a large potential if segmentation nodes are reduced and the current node/label combination has a coherence potential larger than m_coherenceThresh
-    if ( m_reducedSegNodes ){
+    if ( m_reducedSegNodes && m_borderOfSegmentationROI.IsNotNull() ){
       if (sqrt(2*m_pairwiseSegRegFunction->getPotential(imageIndex,IndexType(),this->m_labelMapper->getZeroDisplacement(),labelIndex))>m_coherenceThresh)
 	//inelegant solution! This returns a large magic number to the optimizer in case the pixel is _outside_ of the ROI, and a slightly smaller if inside.
 	if (this->m_borderOfSegmentationROI->GetPixel(imageIndex)){
@@ -500,7 +703,12 @@ namespace SRS{
 
 
     //Segmentation:labelIndex==segmentationlabel
-    double result=m_unarySegFunction->getPotential(imageIndex,labelIndex);// /m_nSegmentationNodes;
+    double result;
+    if (!m_segmentationUnaryTable.empty()){
+      result=m_segmentationUnaryTable[(size_t)nodeIndex*m_nSegmentationLabels+labelIndex];
+    }else{
+      result=m_unarySegFunction->getPotential(imageIndex,labelIndex);// /m_nSegmentationNodes;
+    }
     if (result<0){
       LOG<<"unary segmentation potential <0"<<std::endl;
       LOG<<imageIndex<<" " <<result<<std::endl;
@@ -510,6 +718,38 @@ namespace SRS{
     return result;
   };
 
+  /**
+   * Tabulate the output of the unary segmentation function for all nodes and labels, loading it from the persistent cache if possible.
+   * getUnarySegmentationPotential reads the table until freeSegmentationUnaries is called or the graph changes.
+   * Target segmentation, coherence based node reduction and fixed neighbors are still applied on top of the table.
+   */
+  void cacheSegmentationUnaries(){
+    freeSegmentationUnaries();
+    int nNodes=m_nSegmentationNodes, nLabels=m_nSegmentationLabels;
+    PotentialCache::HashType key=PotentialCache::hashString("segmentationUnaries",m_potentialCache.getKey());
+    key=PotentialCache::hashValue(nNodes,key);
+    key=PotentialCache::hashValue(nLabels,key);
+    if (m_reducedSegNodes) key=PotentialCache::hashVector(m_mapIdx1Rev,key);
+    std::vector<float> table;
+    std::vector<double> meta;
+    if (m_potentialCache.load("segmentationUnaries",key,table,meta) && table.size()==(size_t)nNodes*nLabels){
+      LOGV(1)<<"Loaded segmentation unaries from "<<m_potentialCache.filename("segmentationUnaries",key)<<std::endl;
+    }else{
+      table.resize((size_t)nNodes*nLabels);
+      for (int n=0;n<nNodes;++n){
+        IndexType imageIndex=getImageIndex(n);
+        for (int l=0;l<nLabels;++l){
+          table[(size_t)n*nLabels+l]=m_unarySegFunction->getPotential(imageIndex,l);
+        }
+      }
+      m_potentialCache.store("segmentationUnaries",key,table,meta);
+    }
+    m_segmentationUnaryTable.assign(table);
+  }
+  void freeSegmentationUnaries(){
+    m_segmentationUnaryTable.clear();
+  }
+
   /**
    * Get pairwise registration potential for node/label,node/label combination
    */
@@ -523,10 +763,8 @@ namespace SRS{
     this->m_coarseGraphImage->TransformIndexToPhysicalPoint(graphIndex1,pt1);
     this->m_coarseGraphImage->TransformIndexToPhysicalPoint(graphIndex2,pt2);
     /// get displacement vectors
-    RegistrationLabelType l2=this->m_labelMapper->getLabel(labelIndex2);
-    l2=this->m_labelMapper->scaleDisplacement(l2,getDisplacementFactor());
-    RegistrationLabelType l1=this->m_labelMapper->getLabel(labelIndex1);
-    l1=this->m_labelMapper->scaleDisplacement(l1,getDisplacementFactor());
+    RegistrationLabelType l2=getNodeDisplacement(nodeIndex2,labelIndex2);
+    RegistrationLabelType l1=getNodeDisplacement(nodeIndex1,labelIndex1);
     //return m_pairwiseRegFunction->getPotential(graphIndex1, graphIndex2, l1,l2);//m_nRegEdges;
     double result=m_pairwiseRegFunction->getPotential(pt1, pt2, l1,l2);
     if (m_normalizePotentials) result/=m_nRegEdges;
@@ -547,8 +785,7 @@ namespace SRS{
     }
     double weight=1;//exp(-dist/2);
     if (weight<0){ LOG<<"weight smaller zero!! :"<<weight<<std::endl; weight=0;}
-    RegistrationLabelType registrationLabel=this->m_labelMapper->getLabel(labelIndex1);
-    registrationLabel=this->m_labelMapper->scaleDisplacement(registrationLabel,getDisplacementFactor());
+    RegistrationLabelType registrationLabel=getNodeDisplacement(nodeIndex1,labelIndex1);
     double result=m_pairwiseSegRegFunction->getPotential(imageIndex,imageIndex,registrationLabel,segmentationLabel);//m_nSegRegEdges;
     if (m_normalizePotentials) result/=m_nSegRegEdges;
     return result;
@@ -561,7 +798,9 @@ namespace SRS{
    * Get pairwise coherence potential for reg node/label, seg node/label combination
    */
   inline double getPairwiseRegSegPotential(int nodeIndex1, int nodeIndex2, int labelIndex1, int segmentationLabel){
-    
+    if (!m_coherenceTable.empty() && m_coherenceTableRegNode[nodeIndex2]==nodeIndex1){
+      return m_coherenceTable[((size_t)nodeIndex2*m_nDisplacementLabels+labelIndex1)*m_nSegmentationLabels+segmentationLabel];
+    }
     IndexType imageIndex=getImageIndex(nodeIndex2);
     if (m_targetSegmentationImage.IsNotNull()){
       segmentationLabel=m_targetSegmentationImage->GetPixel(imageIndex);
@@ -583,8 +822,7 @@ namespace SRS{
     weight=dist;
 #endif
     //        if (true){ LOG<<graphIndex<<" "<<imageIndex<<" "<<m_gridPixelSpacing<<" "<<weight<<std::endl;}
-    RegistrationLabelType registrationLabel=this->m_labelMapper->getLabel(labelIndex1);
-    registrationLabel=this->m_labelMapper->scaleDisplacement(registrationLabel,getDisplacementFactor());
+    RegistrationLabelType registrationLabel=getNodeDisplacement(nodeIndex1,labelIndex1);
     double result = weight*m_pairwiseSegRegFunction->getPotential(imageIndex,imageIndex,registrationLabel,segmentationLabel);//m_nSegRegEdges;
     //        return m_pairwiseSegRegFunction->getPotential(graphIndex,imageIndex,registrationLabel,segmentationLabel)/m_nSegRegEdges;
     if (m_normalizePotentials) result/=m_nSegRegEdges;
@@ -596,7 +834,9 @@ namespace SRS{
    * simplified calculation when NN interpolation is used and the segmentationnode can be directly inferred from the registration node (closest)
    */
   inline double getPairwiseRegSegPotential(int nodeIndex2, int labelIndex1, int segmentationLabel){
-    
+    if (!m_coherenceTable.empty() && m_coherenceTableRegNode[nodeIndex2]>=0){
+      return m_coherenceTable[((size_t)nodeIndex2*m_nDisplacementLabels+labelIndex1)*m_nSegmentationLabels+segmentationLabel];
+    }
     IndexType imageIndex=getImageIndex(nodeIndex2);
     if (m_targetSegmentationImage.IsNotNull()){
       segmentationLabel=m_targetSegmentationImage->GetPixel(imageIndex);
@@ -619,13 +859,67 @@ namespace SRS{
 #endif
     //        if (true){ LOG<<graphIndex<<" "<<imageIndex<<" "<<m_gridPixelSpacing<<" "<<weight<<std::endl;}
     RegistrationLabelType registrationLabel=this->m_labelMapper->getLabel(labelIndex1);
-    registrationLabel=this->m_labelMapper->scaleDisplacement(registrationLabel,getDisplacementFactor());
+    //the registration node is the grid node closest to the segmentation node
+    registrationLabel=this->m_labelMapper->scaleDisplacement(registrationLabel,getDisplacementFactor()*getGridLabelScale(getClosestGraphIndex(imageIndex)));
     double result =  weight*m_pairwiseSegRegFunction->getPotential(imageIndex,imageIndex,registrationLabel,segmentationLabel);//m_nSegRegEdges;
     //        return m_pairwiseSegRegFunction->getPotential(graphIndex,imageIndex,registrationLabel,segmentationLabel)/m_nSegRegEdges;
     if (m_normalizePotentials) result/=m_nSegRegEdges;
     return result;
   }
         
+   /**
+   * Tabulate the coherence potentials of all registration and segmentation labels of the edge between each segmentation node
+   * and its closest registration node. The deformed atlas segmentation is looked up once per node and displacement,
+   * getPairwiseRegSegPotential reads the table afterwards. The table depends on the current atlas deformation, Init() discards it.
+   * If the table would exceed coherenceCacheMB it is not built, and the potentials are computed on the fly.
+   */
+  void cacheCoherencePotentials(){
+    freeCoherencePotentials();
+#ifndef MULTISEGREGNEIGHBORS
+    int nSegNodes=m_nSegmentationNodes, nRegLabels=m_nDisplacementLabels, nSegLabels=m_nSegmentationLabels;
+    //the table is computed in float before it is converted to the storage precision
+    double tableMB=1.0/(1024*1024)*nSegNodes*nRegLabels*nSegLabels*sizeof(float);
+    LOGV(1)<<"Approximate size of coherence table: "<<tableMB<<" mb."<<std::endl;
+    if (tableMB>m_config.coherenceCacheMB){
+      LOGV(1)<<"Coherence table exceeds the limit of "<<m_config.coherenceCacheMB<<" mb, computing coherence potentials on the fly."<<std::endl;
+      return;
+    }
+    m_coherenceTableRegNode.resize(nSegNodes);
+    std::vector<float> coherenceTable((size_t)nSegNodes*nRegLabels*nSegLabels);
+#pragma omp parallel
+    {
+      std::vector<RegistrationLabelType> displacements(nRegLabels);
+#pragma omp for schedule(dynamic,64)
+      for (int d=0;d<nSegNodes;++d){
+        IndexType imageIndex=getImageIndex(d);
+        int regNode=getGraphIntegerIndex(getClosestGraphIndex(imageIndex));
+        m_coherenceTableRegNode[d]=regNode;
+        if (regNode<0) continue;
+        for (int l=0;l<nRegLabels;++l)
+          displacements[l]=getNodeDisplacement(regNode,l);
+        float * table=&coherenceTable[(size_t)d*nRegLabels*nSegLabels];
+        m_pairwiseSegRegFunction->getPotentials(imageIndex,displacements,nSegLabels,table);
+        for (int l=0;l<nRegLabels;++l){
+          float * row=table+l*nSegLabels;
+          if (m_targetSegmentationImage.IsNotNull()){
+            //fixed target segmentation, see getPairwiseRegSegPotential
+            std::fill(row,row+nSegLabels,row[int(m_targetSegmentationImage->GetPixel(imageIndex))]);
+          }
+          if (m_normalizePotentials){
+            for (int s=0;s<nSegLabels;++s) row[s]/=m_nSegRegEdges;
+          }
+        }
+      }
+    }
+    m_coherenceTable.assign(coherenceTable);
+    LOGV(1)<<"Cached coherence potentials, "<<1.0/(1024*1024)*m_coherenceTable.bytes()<<" mb ("<<TPrecision::name()<<", max error "<<m_coherenceTable.maxError()<<")."<<std::endl;
+#endif
+  }
+  void freeCoherencePotentials(){
+    m_coherenceTable.clear();
+    std::vector<int>().swap(m_coherenceTableRegNode);
+  }
+
    /**
    * Get pairwise segmentation potential for seg node/label, seg node/label combination
    */
@@ -671,7 +965,8 @@ namespace SRS{
       off.Fill(0);
       if ((int)position[d]<(int)m_gridSize[d]-1){
 	off[d]+=1;
-	neighbours.push_back(getGraphIntegerIndex(position+off));
+	int idx=getGraphIntegerIndex(position+off);
+	if (idx>=0) neighbours.push_back(idx);
       }
     }
     return neighbours;
@@ -690,7 +985,7 @@ namespace SRS{
       if ((int)position[d]<(int)m_imageSize[d]-1){
 	off[d]+=1;
 	int idx=getImageIntegerIndex(position+off);
-	if (idx>0)neighbours.push_back(idx);
+	if (idx>=0)neighbours.push_back(idx);
       }
     }
     return neighbours;
@@ -707,7 +1002,7 @@ namespace SRS{
       IndexType idx=m_targetNeighborhoodIterator.GetIndex(i);
       if (m_targetImage->GetLargestPossibleRegion().IsInside(idx)){
 	int inIdx=getImageIntegerIndex(idx);
-	if (inIdx>0) neighbours.push_back(inIdx);
+	if (inIdx>=0) neighbours.push_back(inIdx);
       }
     }
     return neighbours;
@@ -754,7 +1049,8 @@ namespace SRS{
     IndexType idx=getImageIndex(index);
     /// standard NN interpolation, only one neighbor
     IndexType position=getClosestGraphIndex(idx);
-    neighbours.push_back(getGraphIntegerIndex(position));
+    int regIdx=getGraphIntegerIndex(position);
+    if (regIdx>=0) neighbours.push_back(regIdx);
  
 #endif
     return neighbours;
@@ -773,12 +1069,16 @@ namespace SRS{
     typename itk::ImageRegionIterator<RegistrationLabelImageType> it(result,region);
     unsigned int i=0;
     for (it.GoToBegin();!it.IsAtEnd();++it,++i){
-      assert(i<labels.size());
-      RegistrationLabelType l=this->m_labelMapper->getLabel(labels[i]);
-      l=this->m_labelMapper->scaleDisplacement(l,getDisplacementFactor());
-      it.Set(l);
+      int idx=m_reducedRegNodes?m_mapRegIdx[i]:i;
+      if (idx<0){
+        //fixed node outside of the active region
+        it.Set(this->m_labelMapper->getZeroDisplacement());
+        continue;
+      }
+      assert(idx<(int)labels.size());
+      it.Set(getNodeDisplacement(idx,labels[idx]));
     }
-    assert(i==(labels.size()));
+    assert(m_reducedRegNodes || i==(labels.size()));
     //LOGV(8)<<"git "<<labels.size()<<" registration labels which were transformed into a deformation field with parameters : "<<result<<endl;
     return result;
   }
@@ -834,6 +1134,8 @@ namespace SRS{
 	  if (idx>-1){
 	    it.Set(labels[idx]);
 	  }
+	  else if (m_activeRegion.IsNotNull() && !m_activeRegion->GetPixel(it.GetIndex()))
+	    it.Set(m_fixedSegmentation->GetPixel(it.GetIndex()));
 	  else
 	    it.Set(0);
 	}else{
@@ -891,6 +1193,124 @@ namespace SRS{
     return maxSpacing*m_DisplacementScalingFactor;
   }
   SpacingType getDisplacementFactor(){return m_labelSpacing*m_DisplacementScalingFactor;}
+
+  ///adaptive labeling: the label set of each node is the global displacement set scaled by a per node factor in (0,1],
+  ///centered on the current displacement of the node (the base deformation). scales are indexed by the integer coarse grid index
+  ///and are reset by initGraph; an empty vector uses the global label set for all nodes
+  void setNodeLabelScales(const std::vector<float> & scales){
+    assert(scales.empty() || (int)scales.size()==(int)m_coarseGraphImage->GetLargestPossibleRegion().GetNumberOfPixels());
+    m_labelScales=scales;
+  }
+  std::vector<float> getNodeLabelScales(){return m_labelScales;}
+  bool hasNodeLabelScales(){return !m_labelScales.empty();}
+  inline float getGridLabelScale(const IndexType & graphIndex){
+    if (m_labelScales.empty())
+      return 1.0;
+    int idx=0;
+    for (unsigned int d=0;d<m_dim;++d)
+      idx+=graphIndex[d]*m_graphLevelDivisors[d];
+    return m_labelScales[idx];
+  }
+  ///label set scale of a registration node
+  inline float getNodeLabelScale(int nodeIndex){
+    if (m_labelScales.empty())
+      return 1.0;
+    return m_labelScales[m_reducedRegNodes?m_mapRegIdxRev[nodeIndex]:nodeIndex];
+  }
+  ///label scales of all registration nodes, in node order
+  std::vector<float> getRegistrationNodeLabelScales(){
+    if (m_labelScales.empty())
+      return std::vector<float>();
+    std::vector<float> result(m_nRegistrationNodes);
+    for (int n=0;n<m_nRegistrationNodes;++n)
+      result[n]=getNodeLabelScale(n);
+    return result;
+  }
+  ///displacement of label labelIndex in the label set of registration node nodeIndex
+  inline RegistrationLabelType getNodeDisplacement(int nodeIndex, int labelIndex){
+    RegistrationLabelType l=this->m_labelMapper->getLabel(labelIndex);
+    return this->m_labelMapper->scaleDisplacement(l,getDisplacementFactor()*getNodeLabelScale(nodeIndex));
+  }
+
+  ///describes the registration pairwise potential if it is weight*min(distance(l1-l2),truncation) of the integer label vectors l1,l2
+  ///for all edges, with the distance measured in mm using labelSpacing per axis (see PairwisePotentialRegistration::DistanceType).
+  ///this holds for the dense label grid without per node label sets, if the potential only depends on the displacement difference.
+  ///returns false otherwise
+  bool getRegularRegistrationPairwise(int & distanceType, SpacingType & labelSpacing, double & weight, double & truncation){
+    distanceType=m_pairwiseRegFunction->getDistanceType();
+    if (distanceType==PairwiseRegistrationFunctionType::DIST_NONE || !m_labelScales.empty())
+      return false;
+    int nSamples=this->m_nDisplacementSamplesPerAxis;
+    if (this->m_nDisplacementLabels!=(int)pow(2.0*nSamples+1,(double)m_dim))
+      return false;
+    labelSpacing=getDisplacementFactor();
+    weight=m_normalizePotentials?1.0/m_nRegEdges:1.0;
+    truncation=m_pairwiseRegFunction->getTruncation();
+    return true;
+  }
+
+  ///ambiguity of node-major registration unaries (block[node*nRegLabels()+label]) per node, stored for updateNodeLabelScales:
+  ///the fraction of the non-optimal labels whose potential is within 10% of the node's potential range above its minimum.
+  ///a flat landscape (no range) is fully ambiguous
+  void measureUnaryAmbiguity(const std::vector<float> & block){
+    int nNodes=nRegNodes();
+    int nLabels=nRegLabels();
+    m_unaryAmbiguity.resize(nNodes);
+    if (nLabels<2){
+      std::fill(m_unaryAmbiguity.begin(),m_unaryAmbiguity.end(),1.0f);
+      return;
+    }
+#pragma omp parallel for
+    for (int n=0;n<nNodes;++n){
+      const float * unaries=&block[(size_t)n*nLabels];
+      float minPot=unaries[0],maxPot=unaries[0];
+      for (int l=1;l<nLabels;++l){
+        minPot=std::min(minPot,unaries[l]);
+        maxPot=std::max(maxPot,unaries[l]);
+      }
+      float range=maxPot-minPot;
+      if (range<=std::numeric_limits<float>::epsilon()*std::max(1.0f,std::fabs(maxPot))){
+        m_unaryAmbiguity[n]=1.0;
+        continue;
+      }
+      int nClose=0;
+      for (int l=0;l<nLabels;++l){
+        if (unaries[l]<=minPot+0.1*range) ++nClose;
+      }
+      m_unaryAmbiguity[n]=1.0*(nClose-1)/(nLabels-1);
+    }
+  }
+
+  ///adapt the label set scales to the solution of the current iteration: nodes whose unaries were sharp (ambiguity<=maxAmbiguity)
+  ///and whose solution is not at the border of their label set shrink their label set by the factor shrink, down to minScale.
+  ///nodes which moved to the border of their label set, or whose unaries are ambiguous, get the full label set again.
+  ///returns the number of nodes with a shrunk label set
+  int updateNodeLabelScales(const std::vector<int> & labels, double shrink, double minScale, double maxAmbiguity){
+    int nGridNodes=m_coarseGraphImage->GetLargestPossibleRegion().GetNumberOfPixels();
+    if (m_labelScales.empty())
+      m_labelScales=std::vector<float>(nGridNodes,1.0);
+    if ((int)m_unaryAmbiguity.size()!=m_nRegistrationNodes){
+      LOGV(1)<<"No registration unaries were measured in this iteration, keeping the label set scales"<<endl;
+      return 0;
+    }
+    int nSamples=this->m_nDisplacementSamplesPerAxis;
+    for (int n=0;n<m_nRegistrationNodes;++n){
+      int gridIdx=m_reducedRegNodes?m_mapRegIdxRev[n]:n;
+      RegistrationLabelType l=this->m_labelMapper->getLabel(labels[n]);
+      bool atBorder=false;
+      for (unsigned int d=0;d<m_dim;++d)
+        atBorder=atBorder || (int)fabs(l[d])>=nSamples;
+      if (atBorder || m_unaryAmbiguity[n]>maxAmbiguity)
+        m_labelScales[gridIdx]=1.0;
+      else
+        m_labelScales[gridIdx]=std::max(minScale,shrink*m_labelScales[gridIdx]);
+    }
+    int nShrunk=0;
+    for (int i=0;i<nGridNodes;++i)
+      nShrunk+=(m_labelScales[i]<1.0);
+    m_unaryAmbiguity.clear();
+    return nShrunk;
+  }
   SpacingType getSpacing(){return m_gridSpacing;}	
   //SpacingType getPixelSpacing(){return m_gridPixelSpacing;}
   PointType getOrigin(){return m_origin;}
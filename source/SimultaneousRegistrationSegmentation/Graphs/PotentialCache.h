@@ -0,0 +1,151 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+#include <cstdio>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace SRS{
+
+    ///on-disk layout of a cached potential table:
+    ///[PotentialCacheHeader][double metadata * nMeta][page aligned float table * nValues]
+    ///the table is stored raw in native byte order, so the files can be mapped directly.
+    struct PotentialCacheHeader{
+        char magic[8];
+        uint32_t version;
+        uint32_t nMeta;
+        uint64_t key;
+        uint64_t nValues;
+        uint64_t dataOffset;
+    };
+
+    ///\brief persistent store of potential tables (e.g. unaries), one file per table name and key.
+    ///The key is a hash over everything the table depends on (input images, configuration, multi-resolution level, and for registration unaries
+    ///the iteration and the current deformation), so runs which differ only in the weights of the pairwise terms find the unaries of previous runs.
+    ///Segmentation unaries and classifier probability images do not depend on the deformation and are also found again within a run.
+    ///Tables are written to a temporary file and renamed, concurrent runs sharing a cache directory never see partial tables.
+    class PotentialCache{
+    public:
+        typedef uint64_t HashType;
+        ///version 2: registration unaries no longer contain the pairwise terms to fixed neighbors of an active region
+        static const uint32_t version=2;
+        static const uint64_t pageSize=4096;
+    protected:
+        std::string m_directory;
+        HashType m_key;
+    public:
+        PotentialCache(){m_key=initialHash();}
+        void setDirectory(std::string directory){m_directory=directory;}
+        bool enabled() const {return m_directory!="";}
+        void setKey(HashType key){m_key=key;}
+        HashType getKey() const {return m_key;}
+
+        ///64 bit FNV-1a
+        static HashType initialHash(){return 14695981039346656037ULL;}
+        static HashType hash(const void * data, size_t n, HashType h){
+            const unsigned char * bytes=(const unsigned char *)data;
+            for (size_t i=0;i<n;++i){
+                h^=bytes[i];
+                h*=1099511628211ULL;
+            }
+            return h;
+        }
+        template<class T>
+        static HashType hashValue(const T & value, HashType h){return hash(&value,sizeof(T),h);}
+        static HashType hashString(const std::string & s, HashType h){return hash(s.c_str(),s.size()+1,h);}
+        template<class T>
+        static HashType hashVector(const std::vector<T> & v, HashType h){
+            h=hashValue((uint64_t)v.size(),h);
+            return v.size()?hash(&v[0],v.size()*sizeof(T),h):h;
+        }
+
+        std::string filename(std::string name, HashType key) const{
+            std::ostringstream s;
+            s<<m_directory<<"/"<<name<<"-"<<std::hex<<std::setw(16)<<std::setfill('0')<<key<<".srspc";
+            return s.str();
+        }
+
+        ///loads table name for key, returns false if it is not cached or the file is invalid. meta receives the stored metadata
+        bool load(std::string name, HashType key, std::vector<float> & table, std::vector<double> & meta) const{
+            if (!enabled())
+                return false;
+            std::string file=filename(name,key);
+            int fd=::open(file.c_str(),O_RDONLY);
+            if (fd<0)
+                return false;
+            struct stat st;
+            fstat(fd,&st);
+            uint64_t length=st.st_size;
+            if (length<sizeof(PotentialCacheHeader)){
+                ::close(fd);
+                return false;
+            }
+            void * mapping=mmap(NULL,length,PROT_READ,MAP_PRIVATE,fd,0);
+            ::close(fd);
+            if (mapping==MAP_FAILED)
+                return false;
+            const char * data=(const char*)mapping;
+            const PotentialCacheHeader * header=(const PotentialCacheHeader*)data;
+            bool valid=!strncmp(header->magic,"SRSPCACH",8) && header->version==version && header->key==key
+                && sizeof(PotentialCacheHeader)+header->nMeta*sizeof(double)<=header->dataOffset
+                && header->dataOffset+header->nValues*sizeof(float)<=length;
+            if (valid){
+                const double * storedMeta=(const double*)(data+sizeof(PotentialCacheHeader));
+                meta.assign(storedMeta,storedMeta+header->nMeta);
+                const float * values=(const float*)(data+header->dataOffset);
+                table.assign(values,values+header->nValues);
+            }else{
+                std::cerr<<file<<" is not a valid potential cache file, ignoring it"<<std::endl;
+            }
+            munmap(mapping,length);
+            return valid;
+        }
+
+        ///stores table name for key, failures to write are reported but not fatal
+        void store(std::string name, HashType key, const std::vector<float> & table, const std::vector<double> & meta) const{
+            if (!enabled())
+                return;
+            std::string file=filename(name,key);
+            std::ostringstream tmp;
+            tmp<<file<<".tmp"<<getpid();
+            FILE * f=fopen(tmp.str().c_str(),"wb");
+            if (!f){
+                std::cerr<<"could not open potential cache file "<<tmp.str()<<" for writing"<<std::endl;
+                return;
+            }
+            PotentialCacheHeader header;
+            memset(&header,0,sizeof(PotentialCacheHeader));
+            memcpy(header.magic,"SRSPCACH",8);
+            header.version=version;
+            header.nMeta=meta.size();
+            header.key=key;
+            header.nValues=table.size();
+            uint64_t offset=sizeof(PotentialCacheHeader)+meta.size()*sizeof(double);
+            //align table to page boundary so that it can be mapped directly
+            uint64_t padding=(pageSize-offset%pageSize)%pageSize;
+            header.dataOffset=offset+padding;
+            bool ok=fwrite(&header,sizeof(PotentialCacheHeader),1,f)==1;
+            if (meta.size())
+                ok=ok && fwrite(&meta[0],sizeof(double),meta.size(),f)==meta.size();
+            std::vector<char> zeros(padding,0);
+            if (padding)
+                ok=ok && fwrite(&zeros[0],1,padding,f)==padding;
+            if (table.size())
+                ok=ok && fwrite(&table[0],sizeof(float),table.size(),f)==table.size();
+            ok=(fclose(f)==0) && ok;
+            if (!ok || rename(tmp.str().c_str(),file.c_str())!=0){
+                std::cerr<<"failed writing potential cache file "<<file<<std::endl;
+                remove(tmp.str().c_str());
+            }
+        }
+    };
+
+}//namespace
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <limits>
+#include "Log.h"
+
+namespace SRS{
+
+    ///potentials are stored as 32 bit floats
+    struct FloatPotentialPrecision{
+        typedef float StorageType;
+        static const bool quantized=false;
+        static const char * name(){return "float";}
+        ///magnitudes from this value on are not representable and are saturated, they do not count for the step
+        static float saturation(){return std::numeric_limits<float>::infinity();}
+        ///quantization step for a table whose largest finite magnitude is maxAbs
+        static float step(float maxAbs){return 1.0f;}
+        static inline StorageType encode(float value, float step){return value;}
+        static inline float decode(StorageType value, float step){return value;}
+    };
+
+    ///potentials are quantized to 16 bit integers, with one quantization step per table chosen such that the largest finite magnitude fits in +-32766.
+    ///prohibitive costs (infinity, or sentinels like the 99999999999 of the coherence potential) get the reserved code +-32767, so they do not coarsen
+    ///the step of the other values, and decode to +-prohibitive() independent of the step
+    struct Int16PotentialPrecision{
+        typedef int16_t StorageType;
+        static const bool quantized=true;
+        static const StorageType infiniteCode=32767;
+        static const char * name(){return "int16";}
+        static float saturation(){return 1e6f;}
+        ///decoded value of the reserved code, the coherence sentinel which float tables pass to the solvers as well
+        static float prohibitive(){return 99999999999.0f;}
+        static float step(float maxAbs){return maxAbs>0?maxAbs/32766.0f:1.0f;}
+        static inline StorageType encode(float value, float step){
+            if (!(fabs(value)<saturation()))
+                return value<0?-infiniteCode:infiniteCode;
+            float q=floor(value/step+0.5f);
+            return (StorageType)std::max(-32766.0f,std::min(32766.0f,q));
+        }
+        static inline float decode(StorageType value, float step){
+            if (value==infiniteCode || value==-infiniteCode)
+                return value>0?prohibitive():-prohibitive();
+            return value*step;
+        }
+    };
+
+    ///storage precision of the tabulated potentials of graph and solvers, selected at compile time with USE_INT16_POTENTIALS
+#ifdef SRS_INT16_POTENTIALS
+    typedef Int16PotentialPrecision DefaultPotentialPrecision;
+#else
+    typedef FloatPotentialPrecision DefaultPotentialPrecision;
+#endif
+
+    ///heap array aligned to cache lines, replaces stack arrays whose size depends on the number of labels
+    template<class T>
+    class AlignedArray{
+    public:
+        static const size_t alignment=64;
+    protected:
+        T * m_data;
+        size_t m_size;
+    public:
+        AlignedArray():m_data(NULL),m_size(0){}
+        explicit AlignedArray(size_t n):m_data(NULL),m_size(0){resize(n);}
+        AlignedArray(const AlignedArray & other):m_data(NULL),m_size(0){
+            resize(other.m_size);
+            if (m_size) memcpy(m_data,other.m_data,m_size*sizeof(T));
+        }
+        AlignedArray & operator=(const AlignedArray & other){
+            if (this!=&other){
+                resize(other.m_size);
+                if (m_size) memcpy(m_data,other.m_data,m_size*sizeof(T));
+            }
+            return *this;
+        }
+        ~AlignedArray(){free(m_data);}
+        ///contents are not preserved
+        void resize(size_t n){
+            if (n==m_size)
+                return;
+            free(m_data);
+            m_data=NULL;
+            m_size=0;
+            if (n==0)
+                return;
+            void * p=NULL;
+            if (posix_memalign(&p,alignment,n*sizeof(T))!=0){
+                LOG<<"ERROR: could not allocate "<<n*sizeof(T)<<" bytes for a potential table, aborting"<<std::endl;
+                exit(0);
+            }
+            m_data=(T*)p;
+            m_size=n;
+        }
+        void fill(const T & value){std::fill(m_data,m_data+m_size,value);}
+        void swap(AlignedArray & other){
+            std::swap(m_data,other.m_data);
+            std::swap(m_size,other.m_size);
+        }
+        void clear(){resize(0);}
+        size_t size() const {return m_size;}
+        bool empty() const {return m_size==0;}
+        T * data(){return m_data;}
+        const T * data() const {return m_data;}
+        inline T & operator[](size_t i){return m_data[i];}
+        inline const T & operator[](size_t i) const {return m_data[i];}
+    };
+
+    ///read-only table of potentials in the storage type of TPrecision, filled at once from float values
+    template<class TPrecision>
+    class PotentialTable{
+    public:
+        typedef TPrecision PrecisionType;
+        typedef typename TPrecision::StorageType StorageType;
+    protected:
+        AlignedArray<StorageType> m_values;
+        float m_step;
+    public:
+        PotentialTable():m_step(1.0f){}
+        void assign(const float * values, size_t n){
+            float maxAbs=0.0f;
+            for (size_t i=0;i<n;++i){
+                float a=fabs(values[i]);
+                if (a<TPrecision::saturation()) maxAbs=std::max(maxAbs,a);
+            }
+            m_step=TPrecision::step(maxAbs);
+            m_values.resize(n);
+            for (size_t i=0;i<n;++i) m_values[i]=TPrecision::encode(values[i],m_step);
+        }
+        void assign(const std::vector<float> & values){assign(values.empty()?NULL:&values[0],values.size());}
+        inline float operator[](size_t i) const {return TPrecision::decode(m_values[i],m_step);}
+        ///decodes n values starting at offset into out
+        inline void get(size_t offset, size_t n, float * out) const {
+            const StorageType * v=m_values.data()+offset;
+            for (size_t i=0;i<n;++i) out[i]=TPrecision::decode(v[i],m_step);
+        }
+        ///largest absolute error of the stored values below TPrecision::saturation(), 0 without quantization
+        float maxError() const {return TPrecision::quantized?0.5f*m_step:0.0f;}
+        size_t size() const {return m_values.size();}
+        bool empty() const {return m_values.empty();}
+        size_t bytes() const {return m_values.size()*sizeof(StorageType);}
+        void clear(){m_values.clear();}
+        void swap(PotentialTable & other){
+            m_values.swap(other.m_values);
+            std::swap(m_step,other.m_step);
+        }
+    };
+
+}//namespace
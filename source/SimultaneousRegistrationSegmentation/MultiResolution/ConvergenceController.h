@@ -0,0 +1,106 @@
+/**
+ * @file   ConvergenceController.h
+ *
+ * @brief  Early termination of solver steps and of the inner SRS iterations of a multi-resolution level.
+ *
+ */
+
+#ifndef CONVERGENCECONTROLLER_H_
+#define CONVERGENCECONTROLLER_H_
+#include <cmath>
+#include <cfloat>
+#include "Log.h"
+#include "SRSConfig.h"
+
+namespace SRS{
+
+  /** \brief
+   * Decides when to stop the solver steps of one SRS iteration and the inner iterations of a level, and logs every decision with its reason.
+   *
+   * Solver steps stop on the solver's own criterion, if the relative gap between energy and lower bound (TRWS and PTRWS, the solvers which report a lower bound)
+   * falls below lowerBoundGapTolerance, or if fewer than stepLabelChangeTolerance of all labels changed in the last step.
+   * Inner iterations stop if the relative energy change falls below iterationEnergyTolerance (the previous fixed criterion),
+   * or if the largest displacement update is below displacementUpdateTolerance and fewer than segmentationChangeTolerance of the segmentation labels changed
+   * (of those which are active and known). The segmentation change of the first iteration is not measured, so with segmentationChangeTolerance
+   * the update criteria apply from the second iteration on.
+   * A tolerance of 0 disables the respective criterion.
+   */
+  class ConvergenceController{
+  protected:
+    double m_energyTolerance,m_gapTolerance,m_stepLabelChangeTolerance,m_segmentationChangeTolerance,m_displacementTolerance;
+  public:
+    ConvergenceController(){
+      m_energyTolerance=1e-4;
+      m_gapTolerance=0.0;
+      m_stepLabelChangeTolerance=0.0;
+      m_segmentationChangeTolerance=0.0;
+      m_displacementTolerance=0.0;
+    }
+    void setConfig(const SRSConfig & c){
+      m_energyTolerance=c.iterationEnergyTolerance;
+      m_gapTolerance=c.lowerBoundGapTolerance;
+      m_stepLabelChangeTolerance=c.stepLabelChangeTolerance;
+      m_segmentationChangeTolerance=c.segmentationChangeTolerance;
+      m_displacementTolerance=c.displacementUpdateTolerance;
+    }
+    ///the solver has to be run step by step if a criterion on its steps is active
+    bool controlsSolverSteps() const {return m_gapTolerance>0 || m_stepLabelChangeTolerance>0;}
+
+    static double relativeGap(double energy, double lowerBound){
+      return fabs(energy-lowerBound)/(fabs(energy)+DBL_EPSILON);
+    }
+
+    ///decision after solver step. labelChange is the fraction of labels changed by the step, negative if unknown
+    bool stepConverged(int step, double energy, bool hasLowerBound, double lowerBound, double labelChange, bool solverConverged) const {
+      if (hasLowerBound){
+        LOGV(2)<<"Solver step "<<step<<": "<<VAR(energy)<<" "<<VAR(lowerBound)<<" relative gap "<<relativeGap(energy,lowerBound)<<std::endl;
+      }
+      if (solverConverged){
+        LOGV(1)<<"Solver step "<<step<<": stopping, converged by the solver criterion"<<std::endl;
+        return true;
+      }
+      if (m_gapTolerance>0 && hasLowerBound && relativeGap(energy,lowerBound)<m_gapTolerance){
+        LOGV(1)<<"Solver step "<<step<<": stopping, relative gap "<<relativeGap(energy,lowerBound)<<" below "<<m_gapTolerance<<std::endl;
+        return true;
+      }
+      if (m_stepLabelChangeTolerance>0 && labelChange>=0 && labelChange<m_stepLabelChangeTolerance){
+        LOGV(1)<<"Solver step "<<step<<": stopping, "<<100.0*labelChange<<"% of the labels changed, below "<<100.0*m_stepLabelChangeTolerance<<"%"<<std::endl;
+        return true;
+      }
+      return false;
+    }
+
+    ///decision after inner iteration i. labelChange is the fraction of segmentation labels changed by the iteration and
+    ///displacementUpdate the largest norm of the displacement update of the iteration, both negative if unknown
+    bool iterationConverged(int i, double oldEnergy, double newEnergy, double labelChange, double displacementUpdate) const {
+      LOGV(1)<<"Convergence ratio " <<100.0-100.0*fabs(newEnergy-oldEnergy)/fabs(oldEnergy+DBL_EPSILON)<<"%"<<std::endl;
+      if (labelChange>=0){
+        LOGV(1)<<"Segmentation labels changed in iteration "<<i<<": "<<100.0*labelChange<<"%"<<std::endl;
+      }
+      if (displacementUpdate>=0){
+        LOGV(1)<<"Largest displacement update in iteration "<<i<<": "<<displacementUpdate<<std::endl;
+      }
+      if (i>0 && m_energyTolerance>0 && fabs(oldEnergy-newEnergy)/(oldEnergy+DBL_EPSILON) < m_energyTolerance){
+        LOGV(1)<<"Iteration "<<i<<": stopping, relative energy change below "<<m_energyTolerance<<std::endl;
+        return true;
+      }
+      //the update criteria stop only if all of the active ones are met, not before the segmentation change can be evaluated
+      if (i==0 && m_segmentationChangeTolerance>0){
+        LOGV(2)<<"Iteration "<<i<<": continuing"<<std::endl;
+        return false;
+      }
+      bool checkDisplacement=m_displacementTolerance>0 && displacementUpdate>=0;
+      bool checkLabels=m_segmentationChangeTolerance>0 && labelChange>=0;
+      if ((checkDisplacement || checkLabels)
+          && (!checkDisplacement || displacementUpdate<m_displacementTolerance)
+          && (!checkLabels || labelChange<m_segmentationChangeTolerance)){
+        LOGV(1)<<"Iteration "<<i<<": stopping, updates below tolerance ("<<VAR(displacementUpdate)<<" "<<VAR(labelChange)<<")"<<std::endl;
+        return true;
+      }
+      LOGV(2)<<"Iteration "<<i<<": continuing"<<std::endl;
+      return false;
+    }
+  };
+
+}//namespace
+#endif /* CONVERGENCECONTROLLER_H_ */
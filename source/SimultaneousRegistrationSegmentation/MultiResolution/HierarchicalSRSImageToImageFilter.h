@@ -33,6 +33,11 @@
 #ifdef WITH_GC
 #include "MRF-GC.h"
 #endif
+#include "MRF-GridGC.h"
+#include "MRF-GridTRW-S.h"
+#include "MRF-TRW-DT.h"
+#include "MRF-PTRW-S.h"
+#include "ConvergenceController.h"
 #include <boost/lexical_cast.hpp>
 #include <itkNearestNeighborInterpolateImageFunction.h>
 #include <itkLinearInterpolateImageFunction.h>
@@ -69,7 +74,11 @@
 #include "itkHausdorffDistanceImageFilter.h"
 #include <float.h>
 #include "TransformationUtils.h"    
+#include "SegmentationTools.hxx"
+#include "ImagePyramid.h"
+#include "FastAffineRegistration.h"
 #include <algorithm>
+#include <typeinfo>
 
 namespace SRS{
     template<class TGraph>
@@ -148,6 +157,11 @@ namespace SRS{
         ConstImagePointerType m_targetGradientImage;
         ConstImagePointerType m_atlasGradientImage;
         ConstImagePointerType m_targetSegmentationImage;
+        ImagePointerType m_groundTruthSegmentation;
+        ///groundtruth resampled to the grid of the evaluated segmentations, computed once
+        ImagePointerType m_resampledGroundTruthSegmentation;
+        ImagePointerType m_targetROI,m_dilatedTargetROI;
+        ImagePyramid<ImageType> m_targetPyramid,m_atlasPyramid;
         UnaryRegistrationPotentialPointerType m_unaryRegistrationPot;
         UnarySegmentationPotentialPointerType m_unarySegmentationPot;
         PairwiseSegmentationPotentialPointerType m_pairwiseSegmentationPot;
@@ -159,6 +173,10 @@ namespace SRS{
             this->SetNumberOfRequiredInputs(5);
             m_useBulkTransform=false;
             m_targetSegmentationImage=NULL;
+            m_groundTruthSegmentation=NULL;
+            m_resampledGroundTruthSegmentation=NULL;
+            m_targetROI=NULL;
+            m_dilatedTargetROI=NULL;
             //instantiate potentials
             m_unaryRegistrationPot=UnaryRegistrationPotentialType::New();
             m_unarySegmentationPot=UnarySegmentationPotentialType::New();
@@ -199,9 +217,208 @@ namespace SRS{
         void setTargetSegmentation(ImagePointerType seg){
             m_targetSegmentationImage=seg;
         }
-        DeformationFieldPointerType affineRegistration(ConstImagePointerType m_targetImage, ConstImagePointerType m_atlasImage){
+        ///groundtruth segmentation of the target, only used to evaluate the segmentation estimate
+        void setGroundTruthSegmentation(ImagePointerType seg){
+            m_groundTruthSegmentation=seg;
+            m_resampledGroundTruthSegmentation=NULL;
+        }
+        ///only nodes inside the (nonzero) target ROI are optimized, see SRSConfig::roiDilation
+        void setTargetROI(ImagePointerType roi){
+            m_targetROI=roi;
+            m_dilatedTargetROI=NULL;
+        }
+        ///adds geometry and voxel values of an image to a potential cache key, NULL images only add a marker
+        template<class TImage>
+        static PotentialCache::HashType hashImage(const TImage * img, PotentialCache::HashType h){
+            h=PotentialCache::hashValue(img!=NULL,h);
+            if (!img)
+                return h;
+            typename TImage::SizeType size=img->GetLargestPossibleRegion().GetSize();
+            h=PotentialCache::hashValue(size,h);
+            h=PotentialCache::hashValue(img->GetSpacing(),h);
+            h=PotentialCache::hashValue(img->GetOrigin(),h);
+            return PotentialCache::hash(img->GetBufferPointer(),img->GetLargestPossibleRegion().GetNumberOfPixels()*sizeof(typename TImage::PixelType),h);
+        }
+        ///key of the persistent potential cache for this run: input images, the configuration the unaries depend on, and the potential types.
+        ///the potential weights are not part of it, the solvers apply them to the cached unaries.
+        PotentialCache::HashType potentialCacheKey(){
+            PotentialCache::HashType h=PotentialCache::initialHash();
+            h=PotentialCache::hashValue(PotentialCache::version,h);
+            h=hashImage(m_targetImage.GetPointer(),h);
+            h=hashImage(m_atlasImage.GetPointer(),h);
+            h=hashImage(m_atlasMaskImage.GetPointer(),h);
+            h=hashImage(m_atlasSegmentationImage.GetPointer(),h);
+            h=hashImage(m_targetGradientImage.GetPointer(),h);
+            h=hashImage(m_atlasGradientImage.GetPointer(),h);
+            h=hashImage(m_targetSegmentationImage.GetPointer(),h);
+            h=hashImage(m_targetROI.GetPointer(),h);
+            if (m_useBulkTransform) h=hashImage(m_bulkTransform.GetPointer(),h);
+            h=PotentialCache::hashString(typeid(GraphModelType).name(),h);
+            //the applications may choose derived registration potentials at runtime (registrationMetric, pairwiseRegistrationNorm)
+            h=PotentialCache::hashString(typeid(*m_unaryRegistrationPot.GetPointer()).name(),h);
+            h=PotentialCache::hashString(typeid(UnarySegmentationPotentialType).name(),h);
+            h=PotentialCache::hashString(typeid(*m_pairwiseRegistrationPot.GetPointer()).name(),h);
+            h=PotentialCache::hashString(typeid(PairwiseCoherencePotentialType).name(),h);
+            //configuration
+            h=PotentialCache::hashValue(m_config->regist,h);
+            h=PotentialCache::hashValue(m_config->segment,h);
+            h=PotentialCache::hashValue(m_config->coherence,h);
+            h=PotentialCache::hashValue(m_config->nSegmentations,h);
+            h=PotentialCache::hashValue(m_config->nLevels,h);
+            h=PotentialCache::hashValue(m_config->imageLevels,h);
+            h=PotentialCache::hashValue(m_config->nSegmentationLevels,h);
+            h=PotentialCache::hash(m_config->levels,m_config->nLevels*sizeof(int),h);
+            h=PotentialCache::hashVector(m_config->nRegSamples,h);
+            h=PotentialCache::hashVector(m_config->resamplingFactors,h);
+            h=PotentialCache::hashValue(m_config->scale,h);
+            h=PotentialCache::hashValue(m_config->displacementScaling,h);
+            h=PotentialCache::hashValue(m_config->displacementRescalingFactor,h);
+            h=PotentialCache::hashValue(m_config->segmentationScalingFactor,h);
+            h=PotentialCache::hashValue(m_config->thresh_UnaryReg,h);
+            h=PotentialCache::hashValue(m_config->log_UnaryReg,h);
+            h=PotentialCache::hashValue(m_config->thresh_PairwiseReg,h);
+            h=PotentialCache::hashValue(m_config->fullRegPairwise,h);
+            h=PotentialCache::hashValue(m_config->penalizeOutside,h);
+            h=PotentialCache::hashValue(m_config->normalizeImages,h);
+            h=PotentialCache::hashValue(m_config->normalizePotentials,h);
+            h=PotentialCache::hashValue(m_config->dontNormalizeRegUnaries,h);
+            h=PotentialCache::hashValue(m_config->alpha,h);
+            h=PotentialCache::hashValue(m_config->theta,h);
+            h=PotentialCache::hashValue(m_config->localMIBins,h);
+            h=PotentialCache::hashValue(m_config->affineRegistration,h);
+            h=PotentialCache::hashValue(m_config->useTargetAnatomyPrior,h);
+            h=PotentialCache::hashValue(m_config->train,h);
+            h=PotentialCache::hashValue(m_config->segDistThresh,h);
+            h=PotentialCache::hashValue(m_config->narrowBand,h);
+            h=PotentialCache::hashValue(m_config->roiDilation,h);
+            h=PotentialCache::hashValue(m_config->adaptiveLabels,h);
+            h=PotentialCache::hashValue(m_config->adaptiveMinScale,h);
+            h=PotentialCache::hashValue(m_config->adaptiveAmbiguity,h);
+            h=PotentialCache::hashString(m_config->atlasLandmarkFilename,h);
+            h=PotentialCache::hashString(m_config->targetLandmarkFilename,h);
+            h=PotentialCache::hashString(m_config->segmentationProbsFilename,h);
+            h=PotentialCache::hashString(m_config->segmentationUnaryProbFilename,h);
+            h=PotentialCache::hashString(m_config->targetRGBImageFilename,h);
+            h=PotentialCache::hashString(m_config->atlasRGBImageFilename,h);
+            return h;
+        }
+        ///key of the cached classifier probability images of the segmentation unary potential: the training and target images, the number of labels and the potential type,
+        ///which fixes the classifier and its configuration. the registration configuration and the deformation are not part of it
+        PotentialCache::HashType classifierCacheKey(){
+            PotentialCache::HashType h=PotentialCache::initialHash();
+            h=PotentialCache::hashValue(PotentialCache::version,h);
+            h=hashImage(m_targetImage.GetPointer(),h);
+            h=hashImage(m_targetGradientImage.GetPointer(),h);
+            h=hashImage(m_atlasImage.GetPointer(),h);
+            h=hashImage(m_atlasGradientImage.GetPointer(),h);
+            h=hashImage(m_atlasSegmentationImage.GetPointer(),h);
+            h=PotentialCache::hashString(typeid(*m_unarySegmentationPot.GetPointer()).name(),h);
+            h=PotentialCache::hashValue(m_config->nSegmentations,h);
+            h=PotentialCache::hashValue(m_config->useTargetAnatomyPrior,h);
+            h=PotentialCache::hashString(m_config->targetRGBImageFilename,h);
+            h=PotentialCache::hashString(m_config->atlasRGBImageFilename,h);
+            return h;
+        }
+        ///mask of the graph nodes which are optimized in the current iteration, NULL if the graph is not restricted.
+        ///it is the target ROI dilated by roiDilation mm, intersected with a band of narrowBand mm around the boundary of the atlas segmentation deformed by the current estimate.
+        ///the deformed atlas segmentation is returned as labeling of the fixed segmentation nodes.
+        ImagePointerType computeActiveRegion(DeformationFieldPointerType deformation, ImagePointerType & fixedSegmentation){
+            fixedSegmentation=NULL;
+            bool band=m_config->narrowBand>0 && m_atlasSegmentationImage.IsNotNull();
+            if (m_targetROI.IsNull() && !band)
+                return NULL;
+            if (m_targetROI.IsNotNull() && m_dilatedTargetROI.IsNull()){
+                m_dilatedTargetROI=FilterUtils<ImageType>::binaryThresholdingLow(m_targetROI,1);
+                if (m_config->roiDilation>0){
+                    FloatImagePointerType dist=FilterUtils<ImageType,FloatImageType>::distanceMapBySignedMaurer(m_dilatedTargetROI,1);
+                    m_dilatedTargetROI=FilterUtils<FloatImageType,ImageType>::binaryThresholdingHigh(dist,m_config->roiDilation);
+                }
+            }
+            if (deformation.IsNotNull() && m_atlasSegmentationImage.IsNotNull()){
+                DeformationFieldPointerType scaledDeformation=TransfUtils<ImageType>::bSplineInterpolateDeformationField(deformation,m_targetImage,false);
+                fixedSegmentation=TransfUtils<ImageType>::warpImage(m_atlasSegmentationImage,scaledDeformation,true);
+            }else if (m_atlasSegmentationImage.IsNotNull()){
+                fixedSegmentation=FilterUtils<ImageType>::NNResample(m_atlasSegmentationImage,m_targetImage,false);
+            }
+            if (!band)
+                return m_dilatedTargetROI;
+            ImagePointerType foreground=FilterUtils<ImageType>::binaryThresholdingLow(fixedSegmentation,1);
+            FloatImagePointerType dist=FilterUtils<ImageType,FloatImageType>::distanceMapBySignedMaurer(foreground,1);
+            ImagePointerType region=FilterUtils<FloatImageType,ImageType>::binaryThresholding(dist,-m_config->narrowBand,m_config->narrowBand);
+            if (m_dilatedTargetROI.IsNotNull()){
+                ImagePointerType roi=FilterUtils<ImageType>::NNResample(m_dilatedTargetROI,(ConstImagePointerType)region,false);
+                typename ImageUtils<ImageType>::ImageIteratorType it(region,region->GetLargestPossibleRegion());
+                typename ImageUtils<ImageType>::ImageIteratorType roiIt(roi,roi->GetLargestPossibleRegion());
+                for (it.GoToBegin(),roiIt.GoToBegin();!it.IsAtEnd();++it,++roiIt){
+                    if (!roiIt.Get()) it.Set(0);
+                }
+            }
+            return region;
+        }
+        ///affine pre-alignment of atlas to target, computed on the levels of the shared image pyramids.
+        ///runs on the first affineLevels entries of resamplingFactors, starting with the last of them. a scale that a deformable level also uses is resampled only once, since both read it from the shared pyramid.
+        DeformationFieldPointerType affineRegistration(){
+            logSetStage("Affine registration");
+            FastAffineRegistration<ImageType> registration;
+            registration.setTargetPyramid(&m_targetPyramid);
+            registration.setAtlasPyramid(&m_atlasPyramid);
+            std::vector<double> scales;
+            int nLevels=std::min(m_config->affineLevels,(int)m_config->resamplingFactors.size());
+            for (int l=std::max(1,nLevels)-1;l>=0;--l){
+                scales.push_back(m_config->resamplingFactors[l]);
+            }
+            registration.setScales(scales);
+            registration.setIterations(m_config->affineIterations);
+            registration.setSamples(m_config->affineSamples);
+            registration.setInitWithMoments(m_config->initWithMoments);
+            clock_t start = clock();
+            typename TransfUtils<ImageType>::AffineTransformPointerType affine=registration.run();
+            float t = (float) ((double)(clock() - start) / CLOCKS_PER_SEC);
+            LOG<<"Affine registration finished after "<<t<<" seconds, NCC="<<registration.getFinalMetric()<<std::endl;
+            logResetStage;
+            return TransfUtils<ImageType>::affineToDisplacementField(affine,const_cast<ImageType*>(m_targetImage.GetPointer()));
+        }
+
+        ///announces all scales at which target and atlas will be resampled, so that the pyramids compute each level from the next finer one
+        void setPyramidScales(){
+            std::vector<double> targetScales,atlasScales;
+            if (m_config->regist || m_config->coherence){
+                for (int l=0;l<m_config->nLevels;++l){
+                    atlasScales.push_back(m_config->resamplingFactors[max(0,m_config->imageLevels-l-1)]);
+                }
+            }
+            if (m_config->affineRegistration){
+                for (int l=0;l<m_config->affineLevels && l<(int)m_config->resamplingFactors.size();++l){
+                    atlasScales.push_back(m_config->resamplingFactors[l]);
+                }
+            }
+            targetScales=atlasScales;
+            if (m_config->segmentationScalingFactor != 0.0 && m_config->nSegmentationLevels>1){
+                for (int l=0;l<m_config->nLevels;++l){
+                    targetScales.push_back(pow(m_config->segmentationScalingFactor,m_config->nSegmentationLevels-l-1));
+                }
+            }
+            m_targetPyramid.setScales(targetScales);
+            m_atlasPyramid.setScales(atlasScales);
         }
 
+        ///logs dice and surface distances of all labels of the groundtruth, using the single pass evaluation of SegmentationTools
+        void evaluateSegmentation(ImagePointerType segmentation, std::string stage){
+            if (m_groundTruthSegmentation.IsNull() || segmentation.IsNull())
+                return;
+            //all evaluated segmentations live on the target grid, so the groundtruth is resampled only once
+            if (m_resampledGroundTruthSegmentation.IsNull()
+                || m_resampledGroundTruthSegmentation->GetLargestPossibleRegion().GetSize()!=segmentation->GetLargestPossibleRegion().GetSize()
+                || m_resampledGroundTruthSegmentation->GetSpacing()!=segmentation->GetSpacing()
+                || m_resampledGroundTruthSegmentation->GetOrigin()!=segmentation->GetOrigin()){
+                m_resampledGroundTruthSegmentation=FilterUtils<ImageType>::NNResample(m_groundTruthSegmentation,segmentation,false);
+            }
+            typedef typename SegmentationTools<ImageType>::OverlapScores OverlapScores;
+            std::vector<OverlapScores> scores=SegmentationTools<ImageType>::evaluateMultilabel(m_resampledGroundTruthSegmentation,segmentation,true).scores;
+            for (unsigned int i=0;i<scores.size();++i){
+                LOG<<stage<<" Label "<<scores[i].labelID<<" Dice "<<scores[i].dice<<" Mean "<<scores[i].MSD<<" MaxAbs "<<scores[i].HD<<std::endl;
+            }
+        }
         DeformationFieldPointerType getFinalDeformation(){
             return m_finalDeformation;
         }
@@ -244,6 +461,9 @@ namespace SRS{
             m_targetImage = this->GetInput(0);
             m_targetGradientImage = this->GetInput(3);
             m_atlasGradientImage=this->GetInput(4);
+            m_targetPyramid.setImage(m_targetImage);
+            m_atlasPyramid.setImage(m_atlasImage);
+            setPyramidScales();
 
           
 
@@ -257,6 +477,7 @@ namespace SRS{
                 //MOVED HERE, HOPE THIS DOES NOT BREAK ANYTHING
                 m_unaryRegistrationPot->SetTargetImage(m_targetImage);
                 m_unaryRegistrationPot->SetAtlasImage(m_atlasImage);
+                m_unaryRegistrationPot->SetImagePyramids(&m_targetPyramid,&m_atlasPyramid);
                 // /MOVED
                 m_pairwiseRegistrationPot->setThreshold(m_config->thresh_PairwiseReg);
                 m_pairwiseRegistrationPot->setFullRegularization(m_config->fullRegPairwise);
@@ -299,6 +520,12 @@ namespace SRS{
                 if (m_config->segmentationUnaryProbFilename!=""){
                     m_unarySegmentationPot->SetProbFile(m_config->segmentationUnaryProbFilename);
                 }
+                if (m_config->potentialCacheDirectory!=""){
+                    PotentialCache probabilityCache;
+                    probabilityCache.setDirectory(m_config->potentialCacheDirectory);
+                    probabilityCache.setKey(classifierCacheKey());
+                    m_unarySegmentationPot->SetProbabilityCache(probabilityCache);
+                }
                 m_unarySegmentationPot->Init();
             
                 m_pairwiseSegmentationPot->SetAtlasSegmentation(m_atlasSegmentationImage);
@@ -335,6 +562,9 @@ namespace SRS{
                 if (m_useBulkTransform){
                     LOGV(1)<<"Initializing with bulk transform." <<std::endl;
                     previousFullDeformation=m_bulkTransform;
+                }else if (m_config->affineRegistration){
+                    LOGV(1)<<"Initializing registration with affine pre-alignment." <<std::endl;
+                    previousFullDeformation=affineRegistration();
                 }else{
                     //allocate memory
                     previousFullDeformation=DeformationFieldType::New();
@@ -381,6 +611,14 @@ namespace SRS{
                 m_config->nLevels=1;
                 m_config->iterationsPerLevel=1;
             }
+            ConvergenceController convergence;
+            convergence.setConfig(*m_config);
+            PotentialCache potentialCache;
+            potentialCache.setDirectory(m_config->potentialCacheDirectory);
+            if (potentialCache.enabled()){
+                potentialCache.setKey(potentialCacheKey());
+                LOGV(1)<<"Using persistent potential cache in "<<m_config->potentialCacheDirectory<<std::endl;
+            }
             bool computeLowResolutionBsplineIfPossible=m_config->useLowResBSpline;
             LOGV(2)<<VAR(computeLowResolutionBsplineIfPossible)<<std::endl;
             typename GraphModelType::Pointer graph=GraphModelType::New();
@@ -400,6 +638,11 @@ namespace SRS{
 
             double tolerance=1000;
 
+            //per node label sets need the node-major registration unaries, which only the TRW-S (TRWS, TRWDT, PTRWS) and GCO solvers use
+            bool adaptiveLabels=m_config->adaptiveLabels && (regist || coherence) && (m_config->TRW || m_config->GCO || m_config->TRWDT || m_config->PTRWS);
+            if (m_config->adaptiveLabels && !adaptiveLabels){
+                LOG<<"WARNING: adaptive label sets are only supported for registration with the TRW-S and GCO solvers, using global label sets"<<std::endl;
+            }
             
             //START OF MULTI-RES Hierarchy
             //------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -431,25 +674,20 @@ namespace SRS{
                     segmentationScalingFactor=pow(m_config->segmentationScalingFactor,m_config->nSegmentationLevels-l-1);
                     //segmentationScalingFactor=max(m_config->segmentationScalingFactor,m_config->resamplingFactors[max(0,m_config->nSegmentationLevels-l-1)]);
                     LOGV(4)<<VAR(segmentationScalingFactor)<<std::endl;
-                    m_targetImage=FilterUtils<ImageType>::LinearResample(m_inputTargetImage,segmentationScalingFactor,true);
+                    m_targetImage=m_targetPyramid.getLevel(segmentationScalingFactor);
                 }else if (m_config->segmentationScalingFactor == 0.0){
                     LOG<<"Using same grid control point resolution for both registration and segmentation sub-graph!"<<std::endl;
                     logSetStage("segmentation grid size estimation");
                     //use same level of detail as used for the graph
-                    //first set up dummy graph from original target image
-                    graph->setConfig(*m_config);
-                    graph->setTargetImage(m_inputTargetImage);
-                    graph->setDisplacementFactor(labelScalingFactor);
-                    graph->initGraph(level);
-                    //use coarse graph image for resampling..
-                    LOGV(4)<<VAR(graph->getCoarseGraphImage()->GetSpacing())<<std::endl;
+                    //the coarse grid only depends on the geometry of the original target image
+                    ImagePointerType coarseGridImage=GraphModelType::computeCoarseGridImage(m_inputTargetImage,level);
+                    LOGV(4)<<VAR(coarseGridImage->GetSpacing())<<std::endl;
                     //quite crude method ;)
-                    segmentationScalingFactor = 1.0*graph->getCoarseGraphImage()->GetLargestPossibleRegion().GetSize()[0]/m_inputTargetImage->GetLargestPossibleRegion().GetSize()[0];
+                    segmentationScalingFactor = 1.0*coarseGridImage->GetLargestPossibleRegion().GetSize()[0]/m_inputTargetImage->GetLargestPossibleRegion().GetSize()[0];
                     LOGV(4)<<VAR(segmentationScalingFactor)<<std::endl;
 
-                    m_targetImage=FilterUtils<ImageType>::LinearResample(m_inputTargetImage,(ConstImagePointerType)graph->getCoarseGraphImage(),true);
+                    m_targetImage=FilterUtils<ImageType>::LinearResample(m_inputTargetImage,(ConstImagePointerType)coarseGridImage,true);
                     LOGV(4)<<"downsampled image" << endl;
-                    LOGV(4)<<VAR(graph->getCoarseGraphImage()->GetSpacing())<<std::endl;
                     logResetStage;
                 } else{
                     m_targetImage = m_inputTargetImage;
@@ -562,6 +800,8 @@ namespace SRS{
                 LOGV(4)<<"tolerance :"<<tol<<" "<<VAR(oldtolerance)<<std::endl;
                 //tolerance gets set only at levels to avoid that the energy changes during inner iterations. if tolerance would change within the inner iterations, convergence criteria based on energy would not be well-defined any more
                 m_pairwiseCoherencePot->SetTolerance(tol);
+                //GCO solver kept over the inner iterations of this level, it reuses its neighbor structure and the segmentation pairwise potentials
+                BaseMRFSolver<GraphModelType> * levelSolver=NULL;
 
                 //INNER ITERATIONS AT EACH LEVEL OF HIERARCHY
                 //---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -605,12 +845,57 @@ namespace SRS{
                     if (segment && coherence && m_config->segDistThresh!= -1){
                         graph->ReduceSegmentationNodesByCoherencePotential(m_config->segDistThresh);
                     }
+                    {
+                        ImagePointerType fixedSegmentation;
+                        ImagePointerType activeRegion=computeActiveRegion(previousFullDeformation,fixedSegmentation);
+                        if (activeRegion.IsNotNull()){
+                            graph->setActiveRegion((ConstImagePointerType)activeRegion,(ConstImagePointerType)fixedSegmentation);
+                        }
+                    }
+                    if (potentialCache.enabled()){
+                        //segmentation unaries only depend on the segmentation grid of the level, so they are found again in every iteration
+                        PotentialCache segmentationCache=potentialCache;
+                        segmentationCache.setKey(PotentialCache::hashValue(segmentationScalingFactor,potentialCache.getKey()));
+                        graph->setPotentialCache(segmentationCache);
+                        if (segment) TIME(graph->cacheSegmentationUnaries());
+                        //registration unaries depend on the deformation estimated so far. they are only found again if it is identical,
+                        //eg. in a run which differs from a previous one only in the weights of the pairwise terms
+                        PotentialCache iterationCache=potentialCache;
+                        PotentialCache::HashType key=PotentialCache::hashValue(l,potentialCache.getKey());
+                        key=PotentialCache::hashValue(i,key);
+                        key=PotentialCache::hashValue(labelScalingFactor,key);
+                        key=PotentialCache::hashValue(segmentationScalingFactor,key);
+                        if (regist || coherence) key=hashImage(previousFullDeformation.GetPointer(),key);
+                        iterationCache.setKey(key);
+                        graph->setPotentialCache(iterationCache);
+                    }
                     //	ok what now: create graph! solve graph! save result!Z
                  
                     //#define TRUNC
                     LOGV(5)<<VAR(coherence)<<" "<<VAR(segment)<<" "<<VAR(regist)<<std::endl;
                     logUpdateStage(":Optimization");
-                    if (m_config->solver=="GC" && m_config->nSegmentations == 2 && segment && !coherence && !regist){
+                    //segmentation of the previous iteration, for the convergence check
+                    std::vector<int> iterationSegLabels=segLabels;
+                    //the grid max-flow needs the full grid, restricted graphs use the adjacency list graph cut
+                    if (m_config->solver=="GC" && m_config->nSegmentations == 2 && segment && !coherence && !regist && !graph->hasActiveRegion()){
+                        typedef  GridGC_MRFSolverSeg<GraphModelType> SolverType;
+                        SolverType  *mrfSolverGC= new SolverType(graph, m_config->unarySegmentationWeight,
+                                                                 m_config->pairwiseSegmentationWeight,m_config->verbose);
+                        mrfSolverGC->createGraph();
+                        mrfSolverGC->optimize(1);
+                        segmentation=graph->getSegmentationImage(mrfSolverGC->getLabels());
+                        delete mrfSolverGC;
+                    }else if (m_config->solver=="GC" && m_config->nSegmentations > 2 && segment && !coherence && !regist && !graph->hasActiveRegion()){
+                        //multilabel segmentation on the full grid, red-black parallel TRW-S
+                        typedef  GridTRWS_MRFSolverSeg<GraphModelType> SolverType;
+                        SolverType  *mrfSolverGC= new SolverType(graph, m_config->unarySegmentationWeight,
+                                                                 m_config->pairwiseSegmentationWeight,m_config->verbose);
+                        TIME(mrfSolverGC->createGraph());
+                        TIME(newEnergy=mrfSolverGC->optimize(m_config->optIter));
+                        lastEnergy=newEnergy;
+                        segmentation=graph->getSegmentationImage(mrfSolverGC->getLabels());
+                        delete mrfSolverGC;
+                    }else if ((m_config->solver=="BKGC" || m_config->solver=="GC") && m_config->nSegmentations == 2 && segment && !coherence && !regist){
 #ifdef WITH_GC
 
                         typedef  GC_MRFSolverSeg<GraphModelType> SolverType;
@@ -648,16 +933,46 @@ namespace SRS{
 #ifdef WITH_GCO
 
                             typedef GCO_SRSMRFSolver<GraphModelType> MRFSolverType;
+                            //the graph topology only changes within a level if segmentation nodes are removed or the graph is restricted to an active region
+                            bool keepSolver=!graph->hasActiveRegion() && !(segment && coherence && m_config->segDistThresh!= -1);
+                            if (levelSolver && !keepSolver){
+                                delete static_cast<MRFSolverType * >(levelSolver);
+                                levelSolver=NULL;
+                            }
+                            if (levelSolver){
+                                mrfSolver=levelSolver;
+                            }else{
+                                mrfSolver = new MRFSolverType(graph,
+                                                              m_config->unaryRegistrationWeight,
+                                                              m_config->pairwiseRegistrationWeight, 
+                                                              m_config->unarySegmentationWeight,
+                                                              m_config->pairwiseSegmentationWeight,//*(segmentationScalingFactor),
+                                                              m_config->pairwiseCoherenceWeight,//*pow( m_config->coherenceMultiplier,l),
+                                                              m_config->verbose);
+                            }
+                            if (keepSolver)
+                                levelSolver=mrfSolver;
+#else
+                            LOG<<"OPTIMIZER NOT INCLUDED, ABORTING"<<std::endl;
+#endif
+                        }else if (m_config->TRWDT){
+                            typedef TRWDT_SRSMRFSolver<GraphModelType> MRFSolverType;
                             mrfSolver = new MRFSolverType(graph,
                                                           m_config->unaryRegistrationWeight,
                                                           m_config->pairwiseRegistrationWeight, 
                                                           m_config->unarySegmentationWeight,
-                                                          m_config->pairwiseSegmentationWeight,//*(segmentationScalingFactor),
-                                                          m_config->pairwiseCoherenceWeight,//*pow( m_config->coherenceMultiplier,l),
+                                                          m_config->pairwiseSegmentationWeight,
+                                                          m_config->pairwiseCoherenceWeight,
+                                                          m_config->verbose);
+                        }else if (m_config->PTRWS){
+                            typedef PTRWS_SRSMRFSolver<GraphModelType> MRFSolverType;
+                            mrfSolver = new MRFSolverType(graph,
+                                                          m_config->unaryRegistrationWeight,
+                                                          m_config->pairwiseRegistrationWeight, 
+                                                          m_config->unarySegmentationWeight,
+                                                          m_config->pairwiseSegmentationWeight,
+                                                          m_config->pairwiseCoherenceWeight,
                                                           m_config->verbose);
-#else
-                            LOG<<"OPTIMIZER NOT INCLUDED, ABORTING"<<std::endl;
-#endif
                         }else if (m_config->OPENGM){
 #ifdef WITH_OPENGM
 
@@ -681,9 +996,14 @@ namespace SRS{
                             exit(0);
                         }
 
-                        mrfSolver->setPotentialCaching(m_config->cachePotentials);
+                        //cached segmentation pairwise potentials are indexed by grid offsets, which are not valid for a restricted graph
+                        if (m_config->cachePotentials && graph->hasActiveRegion()){
+                            LOGV(1)<<"Pairwise potential caching is disabled for graphs restricted to an active region"<<std::endl;
+                        }
+                        mrfSolver->setPotentialCaching(m_config->cachePotentials && !graph->hasActiveRegion());
+                        mrfSolver->setEnergyTolerance(m_config->energyTolerance);
                         TIME(mrfSolver->createGraph());
-                        if (!m_config->evalContinuously){
+                        if (!m_config->evalContinuously && !convergence.controlsSolverSteps()){
                             TIME(newEnergy=mrfSolver->optimize(m_config->optIter));
                             defLabels=mrfSolver->getDeformationLabels();
                             segLabels=mrfSolver->getSegmentationLabels();
@@ -693,27 +1013,43 @@ namespace SRS{
                             for (int o=0;o<m_config->optIter && ! optimization_converged;++o){
                                 tmpOldEng=newEnergy;
                                 newEnergy=mrfSolver->optimizeOneStep(o, optimization_converged);
+                                //fraction of all labels changed by this step
+                                double changed=0.0,nLabelled=0.0;
                                 if (regist || coherence){
                                     oldDefLabels=defLabels;
                                     defLabels=mrfSolver->getDeformationLabels();
                                     if (o>0){
-                                        LOGV(2)<<"Deformation labels changed :"<<computeLabelChange(oldDefLabels,defLabels)<<" ";
+                                        double change=computeLabelChange(oldDefLabels,defLabels);
+                                        LOGV(2)<<"Deformation labels changed :"<<change<<" ";
+                                        changed+=change*defLabels.size();
+                                        nLabelled+=defLabels.size();
                                     }
                                 }
                                 if (segment || coherence){
                                     oldSegLabels=segLabels;
                                     segLabels=mrfSolver->getSegmentationLabels();
                                     if (o>0){
-                                        LOGV(2)<<" Segmentation labels changed :"<<computeLabelChange(oldSegLabels,segLabels)<<" ";
+                                        double change=computeLabelChange(oldSegLabels,segLabels);
+                                        LOGV(2)<<" Segmentation labels changed :"<<change<<" ";
+                                        changed+=change*segLabels.size();
+                                        nLabelled+=segLabels.size();
                                     }
                                 }
                                 LOGV(3)<<std::endl;
+                                double lowerBound=0.0;
+                                bool hasLowerBound=mrfSolver->getLowerBound(lowerBound);
+                                optimization_converged=convergence.stepConverged(o,newEnergy,hasLowerBound,lowerBound,nLabelled>0?changed/nLabelled:-1.0,optimization_converged);
                             }
                         }
                         lastEnergy=newEnergy;
                         if (regist || coherence){
                             deformation=graph->getDeformationImage(defLabels);
                         }
+                        if (adaptiveLabels && (regist || coherence)){
+                            //shrink the label sets of nodes with sharp unaries, the next iteration is centered on the new deformation
+                            int nShrunk=graph->updateNodeLabelScales(defLabels,m_config->displacementRescalingFactor,m_config->adaptiveMinScale,m_config->adaptiveAmbiguity);
+                            LOGV(1)<<"Adaptive labels: "<<nShrunk<<" nodes with reduced label sets"<<std::endl;
+                        }
                         if (segment || coherence){
                             segmentation=graph->getSegmentationImage(mrfSolver->getSegmentationLabels());
                         }
@@ -726,8 +1062,15 @@ namespace SRS{
                         }else if (m_config->GCO){
 #ifdef WITH_GCO
                             typedef GCO_SRSMRFSolver<GraphModelType> MRFSolverType;
-                            delete static_cast<MRFSolverType * >(mrfSolver);
+                            if (mrfSolver!=levelSolver)
+                                delete static_cast<MRFSolverType * >(mrfSolver);
 #endif
+                        }else if (m_config->TRWDT){
+                            typedef TRWDT_SRSMRFSolver<GraphModelType> MRFSolverType;
+                            delete static_cast<MRFSolverType * >(mrfSolver);
+                        }else if (m_config->PTRWS){
+                            typedef PTRWS_SRSMRFSolver<GraphModelType> MRFSolverType;
+                            delete static_cast<MRFSolverType * >(mrfSolver);
                         }else if (m_config->OPENGM){
 #ifdef WITH_OPENGM
                             typedef OPENGM_SRSMRFSolver<GraphModelType> MRFSolverType;
@@ -746,9 +1089,15 @@ namespace SRS{
                         oldWorseEnergy=newEnergy;
                         continue;
                     }
-                    //else converge if energy difference is lower than the threshold
-                    converged=(i>0) && (fabs(oldEnergy-newEnergy)/(oldEnergy+DBL_EPSILON) < 1e-4 ); 
-                    LOGV(1)<<"Convergence ratio " <<100.0-100.0*fabs(newEnergy-oldEnergy)/fabs(oldEnergy+DBL_EPSILON)<<"%"<<std::endl;
+                    //else converge if energy difference, displacement update or segmentation change are lower than the thresholds
+                    {
+                        double segmentationChange=-1.0,displacementUpdate=-1.0;
+                        if (segLabels.size() && segLabels.size()==iterationSegLabels.size())
+                            segmentationChange=computeLabelChange(iterationSegLabels,segLabels);
+                        if ((regist || coherence) && deformation.IsNotNull())
+                            displacementUpdate=maxDisplacementNorm(deformation);
+                        converged=convergence.iterationConverged(i,oldEnergy,newEnergy,segmentationChange,displacementUpdate);
+                    }
 
                     oldEnergy=newEnergy;
                     //initialise interpolator
@@ -767,12 +1116,19 @@ namespace SRS{
                     
 
                     previousFullDeformation=composedDeformation;
-                    labelScalingFactor*=m_config->displacementRescalingFactor;
+                    //with adaptive label sets, the label sets are rescaled per node instead
+                    if (!adaptiveLabels)
+                        labelScalingFactor*=m_config->displacementRescalingFactor;
                     if (segmentation.IsNotNull()&& segmentationScalingFactor<1.0){
                         LOGV(6)<<VAR(segmentation->GetLargestPossibleRegion().GetSize())<<std::endl;
                         segmentation = FilterUtils<ImageType>::BSplineResampleSegmentation(segmentation,m_targetImage);
                     }
                  
+                    if (m_config->evalContinuously && (segment || coherence)){
+                        ostringstream stage;
+                        stage<<"level "<<l<<" iteration "<<i;
+                        evaluateSegmentation(segmentation,stage.str());
+                    }
                     if (m_config->verbose>6){
                         DeformationFieldPointerType lowResDef;
                         if (!pixelGrid){
@@ -825,6 +1181,11 @@ namespace SRS{
                     logResetStage;//inner
                     logResetStage;//iter
                 }//iter
+#ifdef WITH_GCO
+                if (levelSolver){
+                    delete static_cast<GCO_SRSMRFSolver<GraphModelType> * >(levelSolver);
+                }
+#endif
                 logResetStage;//levels
                 if (pixelGrid){
                     m_config->displacementScaling*=0.5;
@@ -834,6 +1195,7 @@ namespace SRS{
                 segmentation=FilterUtils<ImageType>::fillHoles(segmentation);
             }
             m_finalSegmentation=(segmentation);
+            evaluateSegmentation(m_finalSegmentation,"final");
 
 	    m_finalDeformation=previousFullDeformation;
 
@@ -843,6 +1205,15 @@ namespace SRS{
        
         
       
+        ///largest norm of the displacements in a deformation field
+        double maxDisplacementNorm(DeformationFieldPointerType deformation){
+            double maxNorm=0.0;
+            itk::ImageRegionConstIterator<DeformationFieldType> it(deformation,deformation->GetLargestPossibleRegion());
+            for (it.GoToBegin();!it.IsAtEnd();++it){
+                maxNorm=std::max(maxNorm,(double)it.Get().GetNorm());
+            }
+            return maxNorm;
+        }
         double computeLabelChange(std::vector<int> & ref, std::vector<int> & comp){
             int countDiff=0;
             if (ref.size()==0 || comp.size()!=ref.size()){
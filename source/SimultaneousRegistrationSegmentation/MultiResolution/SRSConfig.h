@@ -47,6 +47,7 @@ namespace SRS{
     double scale,asymmetry;
     double segmentationScalingFactor;
     int optIter;
+    double iterationEnergyTolerance,lowerBoundGapTolerance,stepLabelChangeTolerance,segmentationChangeTolerance,displacementUpdateTolerance;
     double downScale;
     double pairwiseContrastWeight;
     int nSubsamples;
@@ -59,7 +60,7 @@ namespace SRS{
     bool log_UnaryReg,log_PairwiseReg;
     double displacementScaling;
     bool evalContinuously;
-    bool TRW,GCO,OPENGM;
+    bool TRW,GCO,OPENGM,TRWDT,PTRWS;
     bool fullRegPairwise;
     double coherenceMultiplier;
     bool dontNormalizeRegUnaries;
@@ -68,9 +69,17 @@ namespace SRS{
     double toleranceBase;
     bool penalizeOutside;
     bool initWithMoments;
+    bool affineRegistration;
+    int affineLevels,affineIterations,affineSamples;
     bool normalizePotentials;
     bool cachePotentials;
+    std::string potentialCacheDirectory;
+    double coherenceCacheMB;
+    double energyTolerance;
     double segDistThresh;
+    double narrowBand,roiDilation;
+    bool adaptiveLabels;
+    double adaptiveMinScale,adaptiveAmbiguity;
     double theta;
     bool linearDeformationInterpolation;
     bool histNorm;
@@ -81,6 +90,9 @@ namespace SRS{
     std::vector<double> resamplingFactors;
     int nSegmentationLevels;
     std::string solver;
+    std::string registrationMetric;
+    int localMIBins;
+    std::string pairwiseRegistrationNorm;
   private:
     ArgumentParser * as;
   public:
@@ -128,6 +140,11 @@ namespace SRS{
       regist=false;
       coherence=false;
       optIter=10;
+      iterationEnergyTolerance=1e-4;
+      lowerBoundGapTolerance=0.0;
+      stepLabelChangeTolerance=0.0;
+      segmentationChangeTolerance=0.0;
+      displacementUpdateTolerance=0.0;
       thresh_UnaryReg=std::numeric_limits<double>::max();
       thresh_PairwiseReg=std::numeric_limits<double>::max();;
       log_UnaryReg=false;
@@ -137,6 +154,8 @@ namespace SRS{
       logFileName="";
       TRW=false;
       GCO=false;
+      TRWDT=false;
+      PTRWS=false;
       fullRegPairwise=false;
       coherenceMultiplier=1.0;
       dontNormalizeRegUnaries=false;
@@ -146,9 +165,21 @@ namespace SRS{
       toleranceBase=2.0;
       penalizeOutside=false;
       initWithMoments=false;
+      affineRegistration=false;
+      affineLevels=3;
+      affineIterations=100;
+      affineSamples=20000;
       normalizePotentials=false;
       cachePotentials=false;
+      potentialCacheDirectory="";
+      coherenceCacheMB=2048.0;
+      energyTolerance=0.0;
       segDistThresh=-1.0;
+      narrowBand=0.0;
+      roiDilation=0.0;
+      adaptiveLabels=false;
+      adaptiveMinScale=0.1;
+      adaptiveAmbiguity=0.1;
       targetRGBImageFilename="";
       atlasRGBImageFilename="";
       segmentationUnaryProbFilename="";
@@ -157,6 +188,9 @@ namespace SRS{
       histNorm=false;
       nSegmentationLevels=1;
       solver="GCO";
+      registrationMetric="NCC";
+      localMIBins=32;
+      pairwiseRegistrationNorm="L2";
     }
     ~SRSConfig(){
       delete as;
@@ -199,6 +233,11 @@ namespace SRS{
       scale=c.scale;
       asymmetry=c.asymmetry;
       optIter=c.optIter;
+      iterationEnergyTolerance=c.iterationEnergyTolerance;
+      lowerBoundGapTolerance=c.lowerBoundGapTolerance;
+      stepLabelChangeTolerance=c.stepLabelChangeTolerance;
+      segmentationChangeTolerance=c.segmentationChangeTolerance;
+      displacementUpdateTolerance=c.displacementUpdateTolerance;
       downScale=c.downScale;
       pairwiseContrastWeight=c.pairwiseContrastWeight;
       nSubsamples=c.nSubsamples;
@@ -207,6 +246,22 @@ namespace SRS{
       useTargetAnatomyPrior=c.useTargetAnatomyPrior;
       thresh_UnaryReg=c.thresh_UnaryReg;
       thresh_PairwiseReg=c.thresh_PairwiseReg;
+      affineRegistration=c.affineRegistration;
+      affineLevels=c.affineLevels;
+      affineIterations=c.affineIterations;
+      affineSamples=c.affineSamples;
+      ROIFilename=c.ROIFilename;
+      narrowBand=c.narrowBand;
+      roiDilation=c.roiDilation;
+      adaptiveLabels=c.adaptiveLabels;
+      adaptiveMinScale=c.adaptiveMinScale;
+      adaptiveAmbiguity=c.adaptiveAmbiguity;
+      potentialCacheDirectory=c.potentialCacheDirectory;
+      coherenceCacheMB=c.coherenceCacheMB;
+      energyTolerance=c.energyTolerance;
+      registrationMetric=c.registrationMetric;
+      localMIBins=c.localMIBins;
+      pairwiseRegistrationNorm=c.pairwiseRegistrationNorm;
     }
     void parseFile(std::string filename){
       std::ostringstream streamm;
@@ -262,6 +317,10 @@ namespace SRS{
       as->parameter ("bulkTransformationFiled", bulkTransformationField, "bulk transformation field", false);
       as->option ("moments", initWithMoments, "initialize deformation with moments ");
       as->option ("center", centerImages, "initialize deformation with centeringTransfom ");
+      as->option ("affine", affineRegistration, "initialize deformation with an affine registration, computed on the (shared) image pyramid of the deformable levels.");
+      as->parameter ("affineLevels", affineLevels, "number of pyramid levels of the affine registration", false,optionalParameter);
+      as->parameter ("affineIterations", affineIterations, "maximal number of optimizer iterations per affine level", false,optionalParameter);
+      as->parameter ("affineSamples", affineSamples, "number of randomly sampled target voxels for the affine metric, 0 for all voxels", false,optionalParameter);
 
       as->parameter ("ta", outputDeformedFilename, "output image (file name)", false);
       as->parameter ("tsa", outputDeformedSegmentationFilename, "output image (file name)", false);
@@ -281,6 +340,9 @@ namespace SRS{
       as->option ("penalizeOutside",penalizeOutside ,"Penalize registrations falling outside of moving image.",optionalParameter);
       as->option ("normalizePotentials",normalizePotentials ,"divide all potentials by the total number of the respective potential. This balances forces in the two-layer SRS graph (somewhat).",optionalParameter);
       as->option ("cachePotentials"  ,cachePotentials,"Cache all potential function values before calling the optimizer. requires more memory, but will speed up things!.",optionalParameter);
+      as->parameter ("potentialCache", potentialCacheDirectory,"directory of a persistent potential cache. Classifier probabilities and segmentation unaries are stored per level, registration unaries per level, iteration and deformation. They are reused by later runs on the same images which only differ in the potential weights.", false,optionalParameter);
+      as->parameter ("coherenceCacheMB", coherenceCacheMB,"largest size of the table of coherence potentials which TRWS, PTRWS, GCO and OPENGM build when registering and segmenting with coherence, in MB (default 2048). larger tables are not built, the potentials are then computed on the fly.", false,optionalParameter);
+      as->parameter ("energyTolerance", energyTolerance,"quantization step of the weighted potentials if GCO is built with integer energies, the rounding error of a single potential is at most half of it. potentials above the largest integer energy term are saturated. 0 (default) chooses the step from the range of the potentials.", false,optionalParameter);
       as->option ("normalizeImages",normalizeImages ,"Normalize images to zero mean and unit variance. NO CHECK IF PIXELTYPE IS INTEGER!",optionalParameter);
       as->option ("useLowResBSpline",useLowResBSpline ,"Only upsample deformation field to the resolution used in registration unary computation. Speeds up the process a bit, looses some accuracy. DOES NOT WORK/HAVE ANY EFFECT WHEN SRS IS USED!",optionalParameter);
 
@@ -293,6 +355,8 @@ namespace SRS{
       as->parameter ("lru", log_UnaryReg,"negative log metric unary registration potential.", false,optionalParameter);
       as->parameter ("lrp", log_PairwiseReg,"negative log metric for pairwise registration potential.", false,optionalParameter);
       as->parameter ("tsc", segDistThresh,"if the distance to target segmentation label is greater than this threshold, the node is excluded from the segmentation graph. Only works in SRS, not in seg only currently.", false,optionalParameter);
+      as->parameter ("narrowBand", narrowBand,"if >0, only nodes closer than this distance (mm) to the boundary of the deformed atlas segmentation are optimized, all others keep their current labels.", false,optionalParameter);
+      as->parameter ("roiDilation", roiDilation,"dilation (mm) of the target ROI (-roi) before restricting the graph to it.", false,optionalParameter);
 
       //other params
       as->parameter ("max", maxDisplacement,"number of displacement samples per axis", false);
@@ -304,7 +368,15 @@ namespace SRS{
       as->parameter ("startlevel", startTiling,"start tiling", false);
       as->parameter ("iterationsPerLevel", iterationsPerLevel,"iterationsPerLevel", false);
       as->parameter ("optIter", optIter,"max iterations of optimizer", false);
+      as->parameter ("iterationEnergyTolerance", iterationEnergyTolerance,"stop the inner iterations of a level if the relative energy change is smaller (default 1e-4, 0 disables).", false,optionalParameter);
+      as->parameter ("gapTolerance", lowerBoundGapTolerance,"stop the optimizer if the relative gap between energy and lower bound is smaller (TRWS and PTRWS only, the other solvers report no lower bound. 0 (default) disables). The optimizer is then run step by step.", false,optionalParameter);
+      as->parameter ("stepLabelChangeTolerance", stepLabelChangeTolerance,"stop the optimizer if a step changes fewer of all labels than this fraction (0 (default) disables). The optimizer is then run step by step.", false,optionalParameter);
+      as->parameter ("segmentationChangeTolerance", segmentationChangeTolerance,"stop the inner iterations of a level if an iteration changes fewer segmentation labels than this fraction, together with displacementTolerance if that is set. Evaluated from the second iteration on (0 (default) disables).", false,optionalParameter);
+      as->parameter ("displacementTolerance", displacementUpdateTolerance,"stop the inner iterations of a level if the largest displacement update of an iteration is smaller, in mm (0 (default) disables).", false,optionalParameter);
       as->parameter ("r",displacementRescalingFactor,"displacementRescalingFactor", false);
+      as->option ("adaptiveLabels", adaptiveLabels,"per control point label sets: instead of rescaling all labels by displacementRescalingFactor after each iteration, only nodes with sharp registration unaries shrink their label set, ambiguous nodes keep the full capture range.");
+      as->parameter ("adaptiveMinScale",adaptiveMinScale,"smallest label set scale of a node relative to the label set of the level (adaptiveLabels)", false,optionalParameter);
+      as->parameter ("adaptiveAmbiguity",adaptiveAmbiguity,"fraction of near optimal labels up to which the unaries of a node count as sharp (adaptiveLabels)", false,optionalParameter);
       as->parameter ("asymmetry",asymmetry,"asymmetry in segreg potential", false,optionalParameter);
       as->parameter ("displacementScaling",displacementScaling,"Scaling of displacement labels relative to image spacing. WARNING: if set larger than 1, diffeomorphic registrations are no longer guaranteed!", false,optionalParameter);
       as->parameter ("toleranceBase",toleranceBase,"Base for computing the coherence tolerance at different l evels of the grid pyramid.", false,optionalParameter);
@@ -331,9 +403,12 @@ namespace SRS{
       as->parameter ("nSegmentations",nSegmentations ,"number of segmentation labels (>=2)", false);
       as->option ("computeMultilabelAtlasSegmentation",computeMultilabelAtlasSegmentation ,"compute multilabel atlas segmentation from original atlas segmentation. will overwrite nSegmentations.",optionalParameter);
 
-      as->option ("evalContinuously",evalContinuously ,"evaluate optimization at each step. slower, but also returns actual energy and changes in labellings during each iteration.,optionalParamete");
+      as->option ("evalContinuously",evalContinuously ,"evaluate optimization at each step. slower, but also returns actual energy and changes in labellings during each iteration. evaluates the segmentation after each iteration if a groundtruth is given.,optionalParamete");
       //as->option ("GCO",GCO ,"Use (alpha expansion) graph cuts instead of TRW-S for optimization.");
-      as->parameter ("solver",solver ,"choose solver for optimization (TRWS,GCO,OPENGM).",false);
+      as->parameter ("solver",solver ,"choose solver for optimization (TRWS,GCO,OPENGM,TRWDT,PTRWS). TRWDT is TRW-S for registration only, with distance transform messages for L1/L2 pairwise potentials. PTRWS is a built-in multithreaded TRW-S for the full registration/segmentation graph. GC solves binary segmentation-only problems with a grid max-flow (BKGC: BK max-flow), and multilabel segmentation-only problems with a multithreaded grid TRW-S.",false);
+      as->parameter ("registrationMetric",registrationMetric ,"local similarity of the registration unary potential (NCC,LocalMI). LocalMI is local mutual information of the node patches, for target and atlas of different modalities.",false,optionalParameter);
+      as->parameter ("localMIBins",localMIBins ,"number of intensity bins per image of the LocalMI registration potential (<=256)",false,optionalParameter);
+      as->parameter ("pairwiseRegistrationNorm",pairwiseRegistrationNorm ,"norm of the displacement difference in the registration pairwise potential (L2,L1,SquaredL2). with TRWDT, L1 and SquaredL2 messages take O(#labels) per edge, L2 messages O(#labels^2).",false,optionalParameter);
       as->option ("linearDeformationInterpolation",linearDeformationInterpolation ,"Use linear interpolation for deformation field upsampling.");
       as->option ("histNorm",histNorm ,"Use histogram normalization to adapt the atlas intensity distribution to the target.");
          
@@ -404,12 +479,24 @@ namespace SRS{
 	GCO=true;
       }else if (solver == "TRWS"){
 	TRW=true;
+      }else if (solver == "TRWDT"){
+	TRWDT=true;
+      }else if (solver == "PTRWS"){
+	PTRWS=true;
       }else if (solver == "OPENGM"){
 	OPENGM=true;
       }else{
 	LOG<<"Choosen solver is "<<solver<<", will default to OPENGM if "<<solver<<" is not applicable."<<std::endl;
 	OPENGM=true;
       }
+      if (registrationMetric!="NCC" && registrationMetric!="LocalMI"){
+	LOG<<"Unknown registration metric "<<registrationMetric<<", has to be one of NCC,LocalMI"<<std::endl;
+	exit(0);
+      }
+      if (pairwiseRegistrationNorm!="L2" && pairwiseRegistrationNorm!="L1" && pairwiseRegistrationNorm!="SquaredL2"){
+	LOG<<"Unknown pairwise registration norm "<<pairwiseRegistrationNorm<<", has to be one of L2,L1,SquaredL2"<<std::endl;
+	exit(0);
+      }
 
     }
   };
@@ -46,6 +46,11 @@ namespace SRS{
     virtual std::vector<int> getSegmentationLabels()=0;
     virtual double optimizeOneStep(int currentIter , bool & converged)=0;
     virtual void setPotentialCaching(bool b){} 
+    ///quantization step of the weighted potentials for solvers working with integer energies, the rounding error of a single potential is at most half of it.
+    ///0 chooses the step from the range of the potentials
+    virtual void setEnergyTolerance(double tolerance){}
+    ///lower bound of the energy after the last optimization step, returns false for solvers without lower bound
+    virtual bool getLowerBound(double & lowerBound){return false;}
 
   };//MRFSolver
 }//namespace
@@ -0,0 +1,185 @@
+/*
+ * LabelDistanceTransform.h
+ *
+ * min-convolution of label costs with a (truncated) distance on a regular label grid
+ */
+
+#ifndef LABELDISTANCETRANSFORM_H_
+#define LABELDISTANCETRANSFORM_H_
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+namespace SRS{
+
+  /**
+   * @brief generalized distance transforms for message passing with pairwise costs f(x_i-x_j)
+   *
+   * Labels are the points of the grid {-s..s}^D, indexed with the last axis running fastest (see BaseLabelMapper::getIndex).
+   * transform computes out(x_j)=min_{x_i} h(x_i)+min(f(x_i-x_j),truncation) where f is
+   * L1: sum_d c_d*|k_d|, SQUAREDL2: sum_d c_d*k_d^2 or L2: sqrt(sum_d (c_d*k_d)^2) of the label difference k.
+   * L1 and squared L2 are separable and computed with one pass per axis in O(#labels) (Felzenszwalb and Huttenlocher),
+   * the euclidean distance is not separable, it is computed in O(#labels^2) from a table of the truncated costs of all label differences.
+   */
+  class LabelDistanceTransform{
+  public:
+    ///same values as PairwisePotentialRegistration::DistanceType
+    enum DistanceType {NONE, L1, L2, SQUAREDL2};
+  protected:
+    int m_dim,m_width,m_nLabels;
+    int m_type;
+    std::vector<double> m_axisCost;
+    double m_truncation;
+    ///L2: position of each label in the difference table, and the table
+    std::vector<int> m_tablePosition;
+    std::vector<float> m_table;
+    int m_tableCenter;
+    ///1D envelope buffers
+    std::vector<float> m_line,m_lineResult,m_envelopeBounds;
+    std::vector<int> m_envelopeCenters;
+  public:
+    LabelDistanceTransform(){m_nLabels=0;m_type=NONE;}
+
+    ///samplesPerAxis s gives 2s+1 labels per axis. axisCost[d] is c_d, truncation is applied to the (weighted) cost
+    void init(int dim, int samplesPerAxis, const std::vector<double> & axisCost, int type, double truncation){
+      m_dim=dim;
+      m_width=2*samplesPerAxis+1;
+      m_nLabels=1;
+      for (int d=0;d<dim;++d) m_nLabels*=m_width;
+      m_type=type;
+      m_axisCost=axisCost;
+      m_truncation=truncation;
+      m_line.resize(m_width);
+      m_lineResult.resize(m_width);
+      m_envelopeCenters.resize(m_width);
+      m_envelopeBounds.resize(m_width+1);
+      if (m_type==L2){
+        //difference of two labels along axis d lies in [-(width-1),width-1]
+        int tableWidth=2*m_width-1;
+        int tableSize=1;
+        for (int d=0;d<dim;++d) tableSize*=tableWidth;
+        m_table.resize(tableSize);
+        for (int t=0;t<tableSize;++t){
+          int rest=t;
+          double dist=0.0;
+          for (int d=dim-1;d>=0;--d){
+            int k=rest%tableWidth-(m_width-1);
+            rest/=tableWidth;
+            dist+=(m_axisCost[d]*k)*(m_axisCost[d]*k);
+          }
+          m_table[t]=std::min(sqrt(dist),m_truncation);
+        }
+        m_tablePosition.resize(m_nLabels);
+        m_tableCenter=0;
+        for (int l=0;l<m_nLabels;++l){
+          int rest=l, factor=1, position=0;
+          for (int d=dim-1;d>=0;--d){
+            position+=(rest%m_width)*factor;
+            rest/=m_width;
+            factor*=tableWidth;
+          }
+          m_tablePosition[l]=position;
+          if (l==m_nLabels/2) m_tableCenter=position;
+        }
+        //the zero difference lies in the middle of the table, at twice the position of the center label
+        m_tableCenter*=2;
+      }
+    }
+    int nLabels() const {return m_nLabels;}
+
+    ///truncated cost of the label pair (i,j)
+    double cost(int i, int j) const{
+      double dist=0.0;
+      for (int d=m_dim-1;d>=0;--d){
+        int k=i%m_width-j%m_width;
+        i/=m_width;
+        j/=m_width;
+        if (m_type==L1) dist+=m_axisCost[d]*fabs(1.0*k);
+        else if (m_type==SQUAREDL2) dist+=m_axisCost[d]*k*k;
+        else dist+=(m_axisCost[d]*k)*(m_axisCost[d]*k);
+      }
+      if (m_type==L2) dist=sqrt(dist);
+      return std::min(dist,m_truncation);
+    }
+
+    ///out[j]=min_i h[i]+min(f(i-j),truncation), h and out must not overlap
+    void transform(const float * h, float * out){
+      float minH=*std::min_element(h,h+m_nLabels);
+      if (m_type==L2){
+        for (int j=0;j<m_nLabels;++j){
+          //index of the difference i-j in the table
+          const float * row=&m_table[m_tableCenter-m_tablePosition[j]];
+          float best=std::numeric_limits<float>::max();
+          for (int i=0;i<m_nLabels;++i){
+            best=std::min(best,h[i]+row[m_tablePosition[i]]);
+          }
+          out[j]=best;
+        }
+        return;
+      }
+      std::copy(h,h+m_nLabels,out);
+      int stride=1;
+      for (int d=m_dim-1;d>=0;--d){
+        int nLines=m_nLabels/m_width;
+        for (int line=0;line<nLines;++line){
+          //first label of the line: split the line number into the part below and above axis d
+          int start=(line/stride)*stride*m_width+line%stride;
+          for (int k=0;k<m_width;++k) m_line[k]=out[start+k*stride];
+          if (m_type==L1)
+            transformL1(m_axisCost[d]);
+          else
+            transformSquared(m_axisCost[d]);
+          for (int k=0;k<m_width;++k) out[start+k*stride]=m_lineResult[k];
+        }
+        stride*=m_width;
+      }
+      if (m_truncation<std::numeric_limits<double>::max()){
+        float truncated=minH+m_truncation;
+        for (int j=0;j<m_nLabels;++j) out[j]=std::min(out[j],truncated);
+      }
+    }
+
+  protected:
+    ///lower envelope of cones with slope c
+    void transformL1(double c){
+      for (int k=0;k<m_width;++k) m_lineResult[k]=m_line[k];
+      for (int k=1;k<m_width;++k) m_lineResult[k]=std::min(m_lineResult[k],(float)(m_lineResult[k-1]+c));
+      for (int k=m_width-2;k>=0;--k) m_lineResult[k]=std::min(m_lineResult[k],(float)(m_lineResult[k+1]+c));
+    }
+    ///lower envelope of parabolas c*(k-q)^2+line[q]
+    void transformSquared(double c){
+      if (c<=0.0){
+        float minLine=*std::min_element(m_line.begin(),m_line.end());
+        std::fill(m_lineResult.begin(),m_lineResult.end(),minLine);
+        return;
+      }
+      int n=0;
+      m_envelopeCenters[0]=0;
+      m_envelopeBounds[0]=-std::numeric_limits<float>::max();
+      m_envelopeBounds[1]=std::numeric_limits<float>::max();
+      for (int q=1;q<m_width;++q){
+        float s=intersection(q,m_envelopeCenters[n],c);
+        while (s<=m_envelopeBounds[n]){
+          --n;
+          s=intersection(q,m_envelopeCenters[n],c);
+        }
+        ++n;
+        m_envelopeCenters[n]=q;
+        m_envelopeBounds[n]=s;
+        m_envelopeBounds[n+1]=std::numeric_limits<float>::max();
+      }
+      n=0;
+      for (int q=0;q<m_width;++q){
+        while (m_envelopeBounds[n+1]<q) ++n;
+        int v=m_envelopeCenters[n];
+        m_lineResult[q]=c*(q-v)*(q-v)+m_line[v];
+      }
+    }
+    ///position where the parabolas centered at q and v intersect
+    inline float intersection(int q, int v, double c){
+      return ((m_line[q]+c*q*q)-(m_line[v]+c*v*v))/(2.0*c*(q-v));
+    }
+  };
+}//namespace
+#endif /* LABELDISTANCETRANSFORM_H_ */
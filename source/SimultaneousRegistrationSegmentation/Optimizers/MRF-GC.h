@@ -10,6 +10,7 @@
 #define GC_REGISTRATION_H_
 #include "graph.h"
 #include "BaseMRF.h"
+#include "PotentialPrecision.h"
 
 namespace SRS{
 template<class TGraphModel>
@@ -66,7 +67,7 @@ public:
 
 		clock_t start = clock();
 		//		traverse grid
-		float D[nLabels];
+		AlignedArray<float> D(nLabels);
 
 		for (int d=0;d<nNodes;++d){
 			//set up unary costs at current position
@@ -176,13 +177,15 @@ public:
 
 		clock_t start = clock();
 		//		traverse grid
-		float D[nLabels];
+		AlignedArray<float> D(nLabels);
 
 		for (int d=0;d<nNodes;++d){
 			//set up unary costs at current position
 			for (int l1=0;l1<nLabels;++l1)
 			{
 				D[l1]=m_multiplier*m_unaryWeight*graph->getUnarySegmentationPotential(d,l1);
+                //edges to fixed neighbors outside of the active region are folded into the unaries
+                D[l1]+=m_multiplier*m_pairwiseWeight*graph->getFixedNeighborsSegmentationPotential(d,l1);
                 LOGV(9)<<d<<" "<<l1<<" "<<D[l1]<<" "<<nLabels<<std::endl;
 			}
 			optimizer->add_tweights(d,D[0],D[1]);
@@ -6,8 +6,14 @@
 #include <map>
 //#include <google/heap-profiler.h>
 #include <limits.h>
+#include <limits>
+#include <cmath>
 #include <time.h>
 
+#ifndef GCO_MAX_ENERGYTERM
+#define GCO_MAX_ENERGYTERM 10000000
+#endif
+
 
 
 namespace SRS{
@@ -15,13 +21,18 @@ namespace SRS{
 
 /** \brief
    * Wrapper for Olga Vekslers Multilabel graph cut library
+   *
+   * If GCO is built with integer energies (USE_GCO_INTEGER_ENERGIES), all weighted potentials are multiplied by a scale
+   * which is chosen per graph (i.e. per level and iteration) from the range of the unaries and a sample of the pairwise potentials,
+   * or from the requested energy tolerance, and rounded. Terms beyond the largest integer term are saturated and counted.
    */
 template<class TGraphModel>
 class GCO_SRSMRFSolver :public BaseMRFSolver<TGraphModel>{
 public:
 
     //typedef short EnergyType;
-    typedef float EnergyType;
+    typedef GCoptimization::EnergyTermType EnergyType;
+    static const bool integerEnergies=std::numeric_limits<EnergyType>::is_integer;
 
     typedef GCO_SRSMRFSolver<TGraphModel> Self;
     typedef TGraphModel GraphModelType;
@@ -46,17 +57,26 @@ protected:
     std::vector<int> m_labelOrder;
     int m_zeroDisplacementLabel;
     bool m_deleteRegNeighb;
+    ///sizes the neighbor structure was allocated for, it is kept if the next graph has the same topology
+    int m_allocatedRegNodes,m_allocatedSegNodes;
+    bool m_allocatedCoherence;
     
 
     
     //ugly  static members because of GCO
-    static std::vector<std::vector<std::vector<std::map<int,float> > > > (*regPairwise);
-    static std::vector<std::vector<std::vector<float > > > *srsPairwise;
+    static std::vector<std::vector<std::vector<std::map<int,EnergyType> > > > (*regPairwise);
+    static std::vector<std::vector<std::vector<EnergyType > > > *srsPairwise;
+    ///weighted segmentation pairwise potentials, not scaled to energy units. they are kept within a level while the energy scale changes every iteration
     static std::vector<std::vector<std::vector<std::vector<float> > > > *segPairwise;
     static int S0,S1;
     static int GLOBALnRegNodes,GLOBALnSegNodes,GLOBALnSegLabels,GLOBALnRegLabels;
     static GraphModelPointerType m_GraphModel;
     static bool m_cachePotentials;
+    ///integer energies: potentials are multiplied by m_energyScale and rounded, terms are saturated at m_maxEnergyTerm.
+    ///m_energyTolerance is the quantization step 1/m_energyScale, 0 if it is chosen from the range of the potentials
+    static double m_energyScale,m_energyTolerance;
+    static EnergyType m_maxEnergyTerm;
+    static long int m_saturatedTerms;
    
     static int getRelativeNodeIndex(int idx1,int idx2, int S0, int S1=-1 ){
         //returns the neighbor direction. 
@@ -80,6 +100,20 @@ protected:
     EnergyType ** m_weights,*m_segWeights,*m_regWeights;
 
 public:
+    ///weighted potential in GCO energy units
+    static inline EnergyType quantize(double pot){
+        if (!integerEnergies)
+            return EnergyType(pot);
+        double q=floor(pot*m_energyScale+0.5);
+        if (fabs(q)>m_maxEnergyTerm){
+            ++m_saturatedTerms;
+            return q>0?m_maxEnergyTerm:-m_maxEnergyTerm;
+        }
+        return EnergyType(q);
+    }
+    ///cost of assigning a segmentation label to a registration node or vice versa
+    static inline EnergyType impossibleTerm(){return integerEnergies?m_maxEnergyTerm:EnergyType(100000);}
+
     static EnergyType GLOBALsmoothFunction(int node1, int node2, int label1, int label2){
         float pot=-1;
         if (node1>node2){
@@ -88,28 +122,29 @@ public:
         }
 
         if (m_cachePotentials){
+            //cached registration and coherence tables are already in energy units, segmentation pairwise potentials are quantized on lookup
             if (node1>=GLOBALnRegNodes && node2>=GLOBALnRegNodes){
                 //segmentation pairwise!
                 if ( (label1<GLOBALnRegLabels) || (label2<GLOBALnRegLabels) ){
-                    pot=0.0;
+                    return 0;
                 }else{
-                    pot=(*segPairwise)[label1-GLOBALnRegLabels][label2-GLOBALnRegLabels][node1-GLOBALnRegNodes][getRelativeNodeIndex(node1-GLOBALnRegNodes,node2-GLOBALnRegNodes,S0,S1)];
+                    return quantize((*segPairwise)[label1-GLOBALnRegLabels][label2-GLOBALnRegLabels][node1-GLOBALnRegNodes][getRelativeNodeIndex(node1-GLOBALnRegNodes,node2-GLOBALnRegNodes,S0,S1)]);
                 }
             }else if (node1<GLOBALnRegNodes && node2<GLOBALnRegNodes){
                 //registration pairwise!
                 if (label2>=GLOBALnRegLabels || label1>=GLOBALnRegLabels){
-                    pot=0.0;
+                    return 0;
                 }else{
-                    pot=(*regPairwise)[label1][label2][node1][node2];
+                    return (*regPairwise)[label1][label2][node1][node2];
 
                 }
             }else{
                 //srs pairwise
                 if (label2<GLOBALnRegLabels || label1>=GLOBALnRegLabels){
                     //impossible labelling, either regnode getting assigned a seglabel, or vice versa
-                    pot=100000;
+                    return impossibleTerm();
                 }else {
-                    pot=(*srsPairwise)[label2-GLOBALnRegLabels][label1][node2-GLOBALnRegNodes];
+                    return (*srsPairwise)[label2-GLOBALnRegLabels][label1][node2-GLOBALnRegNodes];
                 }
             }
 
@@ -135,7 +170,7 @@ public:
                 //srs pairwise
                 if (label2<GLOBALnRegLabels || label1>=GLOBALnRegLabels){
                     //impossible labelling, either regnode getting assigned a seglabel, or vice versa
-                    pot=100000;
+                    return impossibleTerm();
                 }else {
                     pot=m_pairwiseSegmentationRegistrationWeight*m_GraphModel->getPairwiseRegSegPotential(node2-GLOBALnRegNodes,label1,label2-GLOBALnRegLabels);
                 
@@ -143,7 +178,7 @@ public:
             }
         }
         //LOGV(10)<<VAR(EnergyType(MULTIPLIER*pot))<<endl;
-        return EnergyType(pot);
+        return quantize(pot);
     }
 
 public:
@@ -181,7 +216,12 @@ public:
         }
         srand ( time(NULL) );
         m_cachePotentials=false;
+        m_energyTolerance=0.0;
         m_deleteRegNeighb=false;
+        m_numberOfNeighborsofEachNode=NULL;
+        m_allocatedRegNodes=0;
+        m_allocatedSegNodes=0;
+        m_allocatedCoherence=false;
       
     }
     GCO_SRSMRFSolver()  {
@@ -191,45 +231,19 @@ public:
     { 
 
         LOGV(1)<<"Deleting GCO_MRF Sovler " << std::endl;
-        if (m_register) delete regPairwise;
-        if (m_segment) delete segPairwise;
-        if (m_coherence) delete srsPairwise;
-
-        if (m_numberOfNeighborsofEachNode){
-            delete [] m_numberOfNeighborsofEachNode;
-#ifdef ALLOCINDIVIDUAL
-            for (int i = 0;i< GLOBALnRegNodes+GLOBALnSegNodes; ++i){
-                if ( m_neighbourArray[i]!=NULL ) delete [] m_neighbourArray[i];
-                if ( m_weights[i] !=NULL)delete [] m_weights[i];
-            }
-#else
-            if (m_register){
-                if (m_deleteRegNeighb){
-                    for (int i = 0;i< GLOBALnRegNodes; ++i){
-                        delete [] m_neighbourArray[i];
-                        delete [] m_weights[i];
-                    }
-                }
-                else{
-                    delete [] m_regNeighbors;
-                    delete [] m_regWeights;
-
-                }
-            }
-            if (m_segment){
-                delete [] m_segNeighbors;
-                delete [] m_segWeights;
-            }
-
-#endif
-            delete [] m_neighbourArray;
-            delete [] m_weights;
-        }
+        delete regPairwise;
+        delete segPairwise;
+        delete srsPairwise;
+        regPairwise=NULL;
+        segPairwise=NULL;
+        srsPairwise=NULL;
+        freeNeighborhood();
         delete m_optimizer;
         
     }
 
     virtual void setPotentialCaching(bool enableCaching){m_cachePotentials=enableCaching;}
+    virtual void setEnergyTolerance(double tolerance){m_energyTolerance=tolerance;}
 
     virtual void createGraph(){
         clock_t start = clock();
@@ -259,6 +273,9 @@ public:
         m_register=((m_pairwiseSegmentationRegistrationWeight>0 || m_unaryRegistrationWeight>0 || m_pairwiseRegistrationWeight>0) && nRegLabels>1);
         m_segment=((m_pairwiseSegmentationRegistrationWeight>0 || m_unarySegmentationWeight>0 || m_pairwiseSegmentationWeight)  && nSegLabels>1);
         m_coherence=m_pairwiseSegmentationRegistrationWeight>0;
+        if (m_register && m_segment && m_coherence){
+          TIME(this->m_GraphModel->cacheCoherencePotentials());
+        }
         GLOBALnRegNodes= m_register*nRegNodes;
         GLOBALnSegNodes= m_segment*nSegNodes;
         GLOBALnRegLabels=m_register*nRegLabels;
@@ -274,103 +291,53 @@ public:
             S1=this->m_GraphModel->getImageSize()[1];
         }
 
-        //allocate neighbor structs
-        m_numberOfNeighborsofEachNode = new int[GLOBALnRegNodes+GLOBALnSegNodes];
-        memset(m_numberOfNeighborsofEachNode,0,(GLOBALnRegNodes+GLOBALnSegNodes)*sizeof(int));
-#ifdef ALLOCINDIVIDUAL
-        m_neighbourArray = new int *[GLOBALnRegNodes+GLOBALnSegNodes];
-        memset(m_neighbourArray,NULL,(GLOBALnRegNodes+GLOBALnSegNodes)*(sizeof(int*)));
-        m_weights= new EnergyType *[GLOBALnRegNodes+GLOBALnSegNodes];
-        memset(m_weights,NULL,(GLOBALnRegNodes+GLOBALnSegNodes)*(sizeof(EnergyType*)));
-#else
-        m_neighbourArray = new int *[GLOBALnRegNodes+GLOBALnSegNodes];
-        m_weights= new EnergyType *[GLOBALnRegNodes+GLOBALnSegNodes];
-        
-        if (m_register){
-            int nNeighbors=2*D+m_coherence*this->m_GraphModel->getMaxRegSegNeighbors();
-            LOGV(6)<<VAR(nNeighbors)<<" max neighbors per registration node" <<std::endl;
-            if (nNeighbors<10){
-                m_regNeighbors = new int[GLOBALnRegNodes*nNeighbors];      
-                memset(m_regNeighbors,0,GLOBALnRegNodes*nNeighbors*(sizeof(int)));
-                m_regWeights = new EnergyType[GLOBALnRegNodes*nNeighbors];
-                memset(m_regWeights,1,GLOBALnRegNodes*nNeighbors*(sizeof(EnergyType)));
-                
-                for (int i=0;i<GLOBALnRegNodes;++i){
-                    m_neighbourArray[i]=&m_regNeighbors[i*nNeighbors];
-                    m_weights[i]=&m_regWeights[i*nNeighbors];
-                }
-                LOGV(6)<<"memory for reg neighbors primary structure : "<<1.0*GLOBALnRegNodes*nNeighbors*sizeof(int*)/1024/1024 <<"MB"<<std::endl;
-            }else{
-                LOGV(6)<<"allocating memory for registration node adjacency matrix individually.."<<std::endl;
-                for (int i=0;i<GLOBALnRegNodes;++i){
-                    int nLocalNeighbors=2*D+this->m_GraphModel->getRegSegNeighbors(i).size();
-                    m_neighbourArray[i]=new int[nLocalNeighbors];
-                    m_weights[i]=new EnergyType[nLocalNeighbors];
-                }
-                m_deleteRegNeighb=true;
-            }
-
-        }
-        if (m_segment){
-            int nNeighbors=2*D+m_coherence*1;
-            m_segNeighbors = new int[GLOBALnSegNodes*nNeighbors];
-            m_segWeights = new EnergyType[GLOBALnSegNodes*nNeighbors];
-            memset(m_segNeighbors,0,GLOBALnSegNodes*nNeighbors*(sizeof(int)));
-            memset(m_segWeights,1,GLOBALnSegNodes*nNeighbors*(sizeof(EnergyType)));
-
-            for (int i=0;i<GLOBALnSegNodes;++i){
-                m_neighbourArray[i+GLOBALnRegNodes]=&m_segNeighbors[i*nNeighbors];
-                m_weights[i+GLOBALnRegNodes]=&m_segWeights[i*nNeighbors];
-            }
-            LOGV(6)<<"memory for seg neighbors primary structure : "<<1.0*GLOBALnSegNodes*nNeighbors*sizeof(int*)/1024/1024 <<"MB"<<std::endl;
+        //the neighbor structure only depends on the graph topology. A solver which is kept over the inner iterations of a level
+        //(the caller guarantees that the topology is unchanged) reuses it and only recomputes the potentials
+        bool reuseNeighborhood= m_numberOfNeighborsofEachNode!=NULL && m_allocatedRegNodes==GLOBALnRegNodes && m_allocatedSegNodes==GLOBALnSegNodes && m_allocatedCoherence==m_coherence;
+        if (reuseNeighborhood){
+            LOGV(1)<<"Reusing neighbor structure of the previous iteration"<<std::endl;
+        }else{
+            freeNeighborhood();
+            allocateNeighborhood();
         }
 
-#endif
-
         logSetStage("Potential Functions");
+        //weighted unaries are computed first, the energy scale depends on their range
+        clock_t startUnary = clock();
+        std::vector<float> regUnaries,segUnaries;
+        if (m_register && m_unaryRegistrationWeight>0)
+            getWeightedRegistrationUnaries(regUnaries);
+        if (m_segment)
+            getWeightedSegmentationUnaries(segUnaries);
+        chooseEnergyScale(regUnaries,segUnaries);
         //		traverse grid
         if ( m_register){
             //RegUnaries
-            clock_t startUnary = clock();
-            
             //now compute&set all potentials
             if (m_unaryRegistrationWeight>0){
-
-                //#pragma omp parallel for 
-                //theoretically, this computation could be parallelized
-                //however, the computation/caching of the registration potentials is not thread safe at the moment
+                //node-major unaries transposed into the sparse per label costs of GCO
+                std::vector<GCoptimization::SparseDataCost> costs(nRegNodes);
                 for (int l1=0;l1<nRegLabels;++l1)
                     {
                         int regLabel=m_labelOrder[l1];
-                        GCoptimization::SparseDataCost costs[nRegNodes];
-                        this->m_GraphModel->cacheRegistrationPotentials(regLabel);
                         for (int d=0;d<nRegNodes;++d){
                             costs[d].site=d;
-                            costs[d].cost=m_unaryRegistrationWeight*this->m_GraphModel->getUnaryRegistrationPotential(d,regLabel);
-                            if (m_coherence && !m_segment){
-                                //pretty inefficient as the reg neighbors are recomputed #registrationLabels times for each registration node.
-                                std::vector<int> regSegNeighbors=this->m_GraphModel->getRegSegNeighbors(d);
-                                int nNeighbours=regSegNeighbors.size();
-                                if (nNeighbours==0) {LOG<<"ERROR: node "<<d<<" seems to have no neighbors."<<std::endl;}
-                                for (int i=0;i<nNeighbours;++i){
-                                    double coherencePot=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(d,regSegNeighbors[i],regLabel,0);
-                                    LOGV(8)<<VAR(d)<<" "<<VAR(i)<<" "<<VAR(coherencePot)<<" "<<VAR(m_pairwiseSegmentationRegistrationWeight)<<std::endl;
-                                    costs[d].cost+=coherencePot;
-                                }
-                            }
+                            costs[d].cost=quantize(regUnaries[(size_t)d*nRegLabels+regLabel]);
                         }
-                        m_optimizer->setDataCost(regLabel,costs,nRegNodes);
+                        m_optimizer->setDataCost(regLabel,&costs[0],nRegNodes);
                     }
             }
 
-         
             clock_t endUnary = clock();
             double t = (float) ((double)(endUnary - startUnary) / CLOCKS_PER_SEC);
-            LOGV(1)<<"Registration Unaries took "<<t<<" seconds."<<std::endl;
+            LOGV(1)<<"Unaries took "<<t<<" seconds."<<std::endl;
             tUnary+=t;
             // Pairwise potentials
+            //registration pairwise potentials depend on the base displacement and are recomputed in every iteration
+            delete regPairwise;
+            regPairwise=NULL;
             if (m_cachePotentials)
-                regPairwise= new std::vector<std::vector<std::vector<std::map<int,float> > > > (nRegLabels,std::vector<std::vector<std::map<int,float> > >(nRegLabels,std::vector<std::map<int,float> > (nRegNodes) ) );
+                regPairwise= new std::vector<std::vector<std::vector<std::map<int,EnergyType> > > > (nRegLabels,std::vector<std::vector<std::map<int,EnergyType> > >(nRegLabels,std::vector<std::map<int,EnergyType> > (nRegNodes) ) );
             
             for (int d=0;d<nRegNodes;++d){
                 m_optimizer->setLabel(d,m_zeroDisplacementLabel);
@@ -381,12 +348,12 @@ public:
                     for (int i=0;i<nNeighbours;++i){
                         //LOG<<d<<" "<<regNodes[d]<<" "<<i<<" "<<neighbours[i]<<std::endl;
                         //m_optimizer->setNeighbors(d,neighbours[i],1);
-                        addNeighbor(d,neighbours[i],m_numberOfNeighborsofEachNode,m_neighbourArray,m_weights);
+                        if (!reuseNeighborhood) addNeighbor(d,neighbours[i],m_numberOfNeighborsofEachNode,m_neighbourArray,m_weights);
                         if (m_cachePotentials){
                             for (int l1=0;l1<nRegLabels;++l1){
                                 for (int l2=0;l2<nRegLabels;++l2){                                
                                     if (m_pairwiseRegistrationWeight>0)
-                                        (*regPairwise)[l1][l2][d][neighbours[i]] = m_pairwiseRegistrationWeight*this->m_GraphModel->getPairwiseRegistrationPotential(d,neighbours[i],l1,l2);
+                                        (*regPairwise)[l1][l2][d][neighbours[i]] = quantize(m_pairwiseRegistrationWeight*this->m_GraphModel->getPairwiseRegistrationPotential(d,neighbours[i],l1,l2));
                                     else
                                         (*regPairwise)[l1][l2][d][neighbours[i]] = 0.0;
                                 }
@@ -402,7 +369,7 @@ public:
          
             t = (float) ((double)(endPairwise-endUnary ) / CLOCKS_PER_SEC);
             LOGV(1)<<"Registration pairwise took "<<t<<" seconds."<<std::endl;
-            LOGV(1)<<"Approximate size of reg pairwise: "<<1.0/(1024*1024)*nRegNodes*nRegLabels*nRegLabels*sizeof(double)*m_cachePotentials<<" mb."<<std::endl;
+            LOGV(1)<<"Approximate size of reg pairwise: "<<1.0/(1024*1024)*nRegNodes*nRegLabels*nRegLabels*sizeof(EnergyType)*m_cachePotentials<<" mb."<<std::endl;
 
             tPairwise+=t;
         }
@@ -411,21 +378,13 @@ public:
             clock_t startUnary = clock();
             for (int l1=0;l1<nSegLabels;++l1)
                 {
-
-                    //LOGV(4)<<"Allocating seg unaries for label "<<l1<<", using "<<1.0*nSegNodes*sizeof( GCoptimization::SparseDataCost ) /(1024*1024)<<" mb memory"<<std::std::endl;
                     std::vector<GCoptimization::SparseDataCost> costas(nSegNodes);
                     int c=0;
                     for (int d=0;d<nSegNodes;++d){
-                        double unarySegCost=this->m_GraphModel->getUnarySegmentationPotential(d,l1);
-                        if ( unarySegCost<10000){
-                            costas[c].cost=m_unarySegmentationWeight*unarySegCost;
-                            LOGV(10)<<"node "<<d<<"; seg unary label: "<<l1<<" "<<m_unarySegmentationWeight*this->m_GraphModel->getUnarySegmentationPotential(d,l1)<<std::endl;
+                        float cost=segUnaries[(size_t)d*nSegLabels+l1];
+                        if (cost!=std::numeric_limits<float>::infinity()){
+                            costas[c].cost=quantize(cost);
                             costas[c].site=d+GLOBALnRegNodes;
-                            if (m_coherence && !m_register){
-                                double coherenceCost=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(d,0,l1);
-                                LOGV(8)<<VAR(d)<<" "<<VAR(coherenceCost)<<" "<<VAR(m_pairwiseSegmentationRegistrationWeight)<<std::endl;
-                                costas[c].cost+=coherenceCost;
-                            }
                             ++c;
                         }
                     }
@@ -437,13 +396,23 @@ public:
             clock_t endUnary = clock();
             double t = (float) ((double)(endUnary - startUnary) / CLOCKS_PER_SEC);
             LOGV(1)<<"Segmentation Unaries took "<<t<<" seconds."<<std::endl;
-            LOGV(1)<<"Approximate size of seg unaries: "<<1.0/(1024*1024)*nSegNodes*nSegLabels*sizeof(double)<<" mb."<<std::endl;
+            LOGV(1)<<"Approximate size of seg unaries: "<<1.0/(1024*1024)*nSegNodes*nSegLabels*sizeof(EnergyType)<<" mb."<<std::endl;
 
             int nSegEdges=0,nSegRegEdges=0;
             //Segmentation smoothness cache
+            //segmentation pairwise potentials only depend on the target image and are kept within a level, independent of the energy scale.
+            //coherence potentials depend on the deformation
+            bool reuseSegPairwise=reuseNeighborhood && m_cachePotentials && segPairwise!=NULL;
+            if (!reuseSegPairwise){
+                delete segPairwise;
+                segPairwise=NULL;
+            }
+            delete srsPairwise;
+            srsPairwise=NULL;
             if (m_cachePotentials){
-                segPairwise= new std::vector<std::vector<std::vector<std::vector<float> > > > (GLOBALnSegLabels,std::vector<std::vector<std::vector<float> > >(GLOBALnSegLabels,std::vector< std::vector<float> > (GLOBALnSegNodes,std::vector<float> (D)) ) );
-                srsPairwise= new std::vector<std::vector<std::vector<float > > > (GLOBALnSegLabels,std::vector<std::vector<float > >(GLOBALnRegLabels,std::vector<float>(GLOBALnSegNodes) ) );
+                if (!reuseSegPairwise)
+                    segPairwise= new std::vector<std::vector<std::vector<std::vector<float> > > > (GLOBALnSegLabels,std::vector<std::vector<std::vector<float> > >(GLOBALnSegLabels,std::vector< std::vector<float> > (GLOBALnSegNodes,std::vector<float> (D)) ) );
+                srsPairwise= new std::vector<std::vector<std::vector<EnergyType > > > (GLOBALnSegLabels,std::vector<std::vector<EnergyType > >(GLOBALnRegLabels,std::vector<EnergyType>(GLOBALnSegNodes) ) );
             }
 
             
@@ -457,10 +426,10 @@ public:
                 for (int i=0;i<nNeighbours;++i){
                     nSegEdges++;
                     //m_optimizer->setNeighbors(d+GLOBALnRegNodes,neighbours[i]+GLOBALnRegNodes,1);
-                    addNeighbor(d+GLOBALnRegNodes,neighbours[i]+GLOBALnRegNodes,m_numberOfNeighborsofEachNode,m_neighbourArray,m_weights);
+                    if (!reuseNeighborhood) addNeighbor(d+GLOBALnRegNodes,neighbours[i]+GLOBALnRegNodes,m_numberOfNeighborsofEachNode,m_neighbourArray,m_weights);
 
                     edgeCount++;
-                    if (m_cachePotentials){
+                    if (m_cachePotentials && !reuseSegPairwise){
                         for (int l1=0;l1<nSegLabels;++l1){
                             for (int l2=0;l2<nSegLabels;++l2){
                                 LOGV(25)<<VAR(d)<<" "<<VAR(l1)<<" "<<VAR(neighbours[i])<<" "<<l2<<std::endl;
@@ -481,7 +450,7 @@ public:
 
                     for (int i=0;i<nNeighbours;++i){
                         //m_optimizer->setNeighbors(d+GLOBALnRegNodes,segRegNeighbors[i],1);
-                        addNeighbor(d+GLOBALnRegNodes,segRegNeighbors[i],m_numberOfNeighborsofEachNode,m_neighbourArray,m_weights);
+                        if (!reuseNeighborhood) addNeighbor(d+GLOBALnRegNodes,segRegNeighbors[i],m_numberOfNeighborsofEachNode,m_neighbourArray,m_weights);
 
                         edgeCount++;
                         if (m_cachePotentials){
@@ -493,7 +462,7 @@ public:
                                     //forward
                                     LOGV(25)<<VAR(d)<<" "<<VAR(l1)<<" "<<VAR(segRegNeighbors[i])<<" "<<VAR(l2)<<std::endl;
                                     if (m_pairwiseSegmentationRegistrationWeight>0){
-                                        (*srsPairwise)[l1][l2][d]=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(segRegNeighbors[i],d,l2,l1);
+                                        (*srsPairwise)[l1][l2][d]=quantize(m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(segRegNeighbors[i],d,l2,l1));
                                     }else{
                                         (*srsPairwise)[l1][l2][d]=0.0;
                                     }
@@ -508,8 +477,8 @@ public:
             clock_t endPairwise = clock();
             t = (float) ((double)(endPairwise-endUnary ) / CLOCKS_PER_SEC);
             LOGV(1)<<"Segmentation + SRS pairwise took "<<t<<" seconds."<<std::endl;
-            LOGV(1)<<"Approximate size of seg pairwise: "<<1.0/(1024*1024)*nSegEdges*nSegLabels*nSegLabels*sizeof(double)*m_cachePotentials<<" mb."<<std::endl;
-            LOGV(1)<<"Approximate size of SRS pairwise: "<<1.0/(1024*1024)*nSegRegEdges*nSegLabels*nRegLabels*sizeof(double)*m_cachePotentials<<" mb."<<std::endl;
+            LOGV(1)<<"Approximate size of seg pairwise: "<<1.0/(1024*1024)*nSegEdges*nSegLabels*nSegLabels*sizeof(float)*m_cachePotentials<<" mb."<<std::endl;
+            LOGV(1)<<"Approximate size of SRS pairwise: "<<1.0/(1024*1024)*nSegRegEdges*nSegLabels*nRegLabels*sizeof(EnergyType)*m_cachePotentials<<" mb."<<std::endl;
             
         }
         m_optimizer->setSmoothCost(&GLOBALsmoothFunction);
@@ -520,7 +489,7 @@ public:
         LOGV(1)<<"Finished init after "<<t<<" seconds"<<std::endl;
         nEdges=edgeCount;
         logResetStage;
-        int order[GLOBALnRegLabels+GLOBALnSegLabels];
+        std::vector<int> order(GLOBALnRegLabels+GLOBALnSegLabels);
         for (int l=0;l<GLOBALnSegLabels;++l){
             order[l]=GLOBALnRegLabels+l;
         }
@@ -528,7 +497,7 @@ public:
             order[l+GLOBALnSegLabels]=l;
         }
 #if 1
-        m_optimizer->setLabelOrder(order,GLOBALnRegLabels+GLOBALnSegLabels);
+        m_optimizer->setLabelOrder(&order[0],GLOBALnRegLabels+GLOBALnSegLabels);
 #else
         bool random = true;
         m_optimizer->setLabelOrder(random);
@@ -554,7 +523,8 @@ public:
         }catch (GCException e){
             e.Report();
         }
-        energy=m_optimizer->compute_energy();
+        energy=m_optimizer->compute_energy()/m_energyScale;
+        reportSaturatedTerms();
         clock_t finish = clock();
         tOpt+=((double)(finish-opt_start)/CLOCKS_PER_SEC);
         float t = (float) ((double)(finish - m_start) / CLOCKS_PER_SEC);
@@ -573,7 +543,8 @@ public:
         }catch (GCException e){
             e.Report();
         }
-        energy=m_optimizer->compute_energy();
+        energy=m_optimizer->compute_energy()/m_energyScale;
+        reportSaturatedTerms();
         clock_t finish = clock();
         tOpt+=((double)(finish-opt_start)/CLOCKS_PER_SEC);
         float t = (float) ((double)(finish - m_start) / CLOCKS_PER_SEC);
@@ -583,7 +554,7 @@ public:
         }
         //misuse member variable for storing last energy
         this->m_lastLowerBound=energy;
-        return -1;
+        return energy;
 
     }
     virtual std::vector<int> getDeformationLabels(){
@@ -612,6 +583,210 @@ public:
         LOG<<"NYI"<<std::endl;
     }
 
+protected:
+    ///allocates the neighbor structure for the current graph sizes
+    void allocateNeighborhood(){
+        m_numberOfNeighborsofEachNode = new int[GLOBALnRegNodes+GLOBALnSegNodes];
+        memset(m_numberOfNeighborsofEachNode,0,(GLOBALnRegNodes+GLOBALnSegNodes)*sizeof(int));
+#ifdef ALLOCINDIVIDUAL
+        m_neighbourArray = new int *[GLOBALnRegNodes+GLOBALnSegNodes];
+        memset(m_neighbourArray,NULL,(GLOBALnRegNodes+GLOBALnSegNodes)*(sizeof(int*)));
+        m_weights= new EnergyType *[GLOBALnRegNodes+GLOBALnSegNodes];
+        memset(m_weights,NULL,(GLOBALnRegNodes+GLOBALnSegNodes)*(sizeof(EnergyType*)));
+#else
+        m_neighbourArray = new int *[GLOBALnRegNodes+GLOBALnSegNodes];
+        m_weights= new EnergyType *[GLOBALnRegNodes+GLOBALnSegNodes];
+        
+        if (m_register){
+            int nNeighbors=2*D+m_coherence*this->m_GraphModel->getMaxRegSegNeighbors();
+            LOGV(6)<<VAR(nNeighbors)<<" max neighbors per registration node" <<std::endl;
+            if (nNeighbors<10){
+                m_regNeighbors = new int[GLOBALnRegNodes*nNeighbors];      
+                memset(m_regNeighbors,0,GLOBALnRegNodes*nNeighbors*(sizeof(int)));
+                m_regWeights = new EnergyType[GLOBALnRegNodes*nNeighbors];
+                memset(m_regWeights,1,GLOBALnRegNodes*nNeighbors*(sizeof(EnergyType)));
+                
+                for (int i=0;i<GLOBALnRegNodes;++i){
+                    m_neighbourArray[i]=&m_regNeighbors[i*nNeighbors];
+                    m_weights[i]=&m_regWeights[i*nNeighbors];
+                }
+                LOGV(6)<<"memory for reg neighbors primary structure : "<<1.0*GLOBALnRegNodes*nNeighbors*sizeof(int*)/1024/1024 <<"MB"<<std::endl;
+            }else{
+                LOGV(6)<<"allocating memory for registration node adjacency matrix individually.."<<std::endl;
+                for (int i=0;i<GLOBALnRegNodes;++i){
+                    int nLocalNeighbors=2*D+this->m_GraphModel->getRegSegNeighbors(i).size();
+                    m_neighbourArray[i]=new int[nLocalNeighbors];
+                    m_weights[i]=new EnergyType[nLocalNeighbors];
+                }
+                m_deleteRegNeighb=true;
+            }
+
+        }
+        if (m_segment){
+            int nNeighbors=2*D+m_coherence*1;
+            m_segNeighbors = new int[GLOBALnSegNodes*nNeighbors];
+            m_segWeights = new EnergyType[GLOBALnSegNodes*nNeighbors];
+            memset(m_segNeighbors,0,GLOBALnSegNodes*nNeighbors*(sizeof(int)));
+            memset(m_segWeights,1,GLOBALnSegNodes*nNeighbors*(sizeof(EnergyType)));
+
+            for (int i=0;i<GLOBALnSegNodes;++i){
+                m_neighbourArray[i+GLOBALnRegNodes]=&m_segNeighbors[i*nNeighbors];
+                m_weights[i+GLOBALnRegNodes]=&m_segWeights[i*nNeighbors];
+            }
+            LOGV(6)<<"memory for seg neighbors primary structure : "<<1.0*GLOBALnSegNodes*nNeighbors*sizeof(int*)/1024/1024 <<"MB"<<std::endl;
+        }
+
+#endif
+        m_allocatedRegNodes=GLOBALnRegNodes;
+        m_allocatedSegNodes=GLOBALnSegNodes;
+        m_allocatedCoherence=m_coherence;
+    }
+    void freeNeighborhood(){
+        if (!m_numberOfNeighborsofEachNode)
+            return;
+        delete [] m_numberOfNeighborsofEachNode;
+#ifdef ALLOCINDIVIDUAL
+        for (int i = 0;i< m_allocatedRegNodes+m_allocatedSegNodes; ++i){
+            if ( m_neighbourArray[i]!=NULL ) delete [] m_neighbourArray[i];
+            if ( m_weights[i] !=NULL)delete [] m_weights[i];
+        }
+#else
+        if (m_allocatedRegNodes){
+            if (m_deleteRegNeighb){
+                for (int i = 0;i< m_allocatedRegNodes; ++i){
+                    delete [] m_neighbourArray[i];
+                    delete [] m_weights[i];
+                }
+            }
+            else{
+                delete [] m_regNeighbors;
+                delete [] m_regWeights;
+
+            }
+        }
+        if (m_allocatedSegNodes){
+            delete [] m_segNeighbors;
+            delete [] m_segWeights;
+        }
+
+#endif
+        delete [] m_neighbourArray;
+        delete [] m_weights;
+        m_numberOfNeighborsofEachNode=NULL;
+        m_deleteRegNeighb=false;
+        m_allocatedRegNodes=0;
+        m_allocatedSegNodes=0;
+    }
+    ///node-major weighted registration unaries, including the edges to fixed neighbors and the coherence potentials when the segmentation is not optimized
+    void getWeightedRegistrationUnaries(std::vector<float> & unaries){
+        this->m_GraphModel->getUnaryRegistrationBlock(unaries);
+        for (int d=0;d<nRegNodes;++d){
+            float * nodeUnaries=&unaries[(size_t)d*nRegLabels];
+            for (int l1=0;l1<nRegLabels;++l1)
+                nodeUnaries[l1]*=m_unaryRegistrationWeight;
+            if (m_pairwiseRegistrationWeight>0){
+                for (int l1=0;l1<nRegLabels;++l1)
+                    nodeUnaries[l1]+=m_pairwiseRegistrationWeight*this->m_GraphModel->getFixedNeighborsRegistrationPotential(d,l1);
+            }
+            if (m_coherence && !m_segment){
+                std::vector<int> regSegNeighbors=this->m_GraphModel->getRegSegNeighbors(d);
+                int nNeighbours=regSegNeighbors.size();
+                if (nNeighbours==0) {LOG<<"ERROR: node "<<d<<" seems to have no neighbors."<<std::endl;}
+                for (int l1=0;l1<nRegLabels;++l1){
+                    for (int i=0;i<nNeighbours;++i){
+                        double coherencePot=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(d,regSegNeighbors[i],l1,0);
+                        LOGV(8)<<VAR(d)<<" "<<VAR(i)<<" "<<VAR(coherencePot)<<" "<<VAR(m_pairwiseSegmentationRegistrationWeight)<<std::endl;
+                        nodeUnaries[l1]+=coherencePot;
+                    }
+                }
+            }
+        }
+    }
+    ///node-major weighted segmentation unaries, including the edges to fixed neighbors and the coherence potentials when the registration is not optimized.
+    ///labels which are impossible for a node (raw potential >=10000) are set to infinity and not passed to GCO
+    void getWeightedSegmentationUnaries(std::vector<float> & unaries){
+        unaries.resize((size_t)nSegNodes*nSegLabels);
+        for (int d=0;d<nSegNodes;++d){
+            for (int l1=0;l1<nSegLabels;++l1){
+                double unarySegCost=this->m_GraphModel->getUnarySegmentationPotential(d,l1);
+                float & cost=unaries[(size_t)d*nSegLabels+l1];
+                if ( unarySegCost<10000){
+                    cost=m_unarySegmentationWeight*unarySegCost;
+                    cost+=m_pairwiseSegmentationWeight*this->m_GraphModel->getFixedNeighborsSegmentationPotential(d,l1);
+                    LOGV(10)<<"node "<<d<<"; seg unary label: "<<l1<<" "<<cost<<std::endl;
+                    if (m_coherence && !m_register){
+                        double coherenceCost=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(d,0,l1);
+                        LOGV(8)<<VAR(d)<<" "<<VAR(coherenceCost)<<" "<<VAR(m_pairwiseSegmentationRegistrationWeight)<<std::endl;
+                        cost+=coherenceCost;
+                    }
+                }else{
+                    cost=std::numeric_limits<float>::infinity();
+                }
+            }
+        }
+    }
+    ///sets m_energyScale and m_maxEnergyTerm for integer energies.
+    ///the largest term is bounded such that the sum over the terms of a node and its edges cannot overflow,
+    ///the scale maps the largest weighted potential (unaries and a sample of the pairwise potentials) to it, or the requested tolerance to one.
+    void chooseEnergyScale(const std::vector<float> & regUnaries, const std::vector<float> & segUnaries){
+        m_saturatedTerms=0;
+        if (!integerEnergies){
+            m_energyScale=1.0;
+            return;
+        }
+        double maxAbs=0.0;
+        for (size_t i=0;i<regUnaries.size();++i)
+            maxAbs=std::max(maxAbs,(double)fabs(regUnaries[i]));
+        for (size_t i=0;i<segUnaries.size();++i)
+            if (segUnaries[i]!=std::numeric_limits<float>::infinity())
+                maxAbs=std::max(maxAbs,(double)fabs(segUnaries[i]));
+        //pairwise potentials are sampled at evenly spread nodes
+        int nSamples=32;
+        if (m_register && m_pairwiseRegistrationWeight>0){
+            for (int s=0;s<nSamples;++s){
+                int d=(int)((double)s*nRegNodes/nSamples);
+                std::vector<int> neighbours= this->m_GraphModel->getForwardRegistrationNeighbours(d);
+                for (unsigned int i=0;i<neighbours.size();++i)
+                    for (int l1=0;l1<nRegLabels;++l1)
+                        for (int l2=0;l2<nRegLabels;++l2)
+                            maxAbs=std::max(maxAbs,fabs(m_pairwiseRegistrationWeight*this->m_GraphModel->getPairwiseRegistrationPotential(d,neighbours[i],l1,l2)));
+            }
+        }
+        if (m_segment){
+            for (int s=0;s<nSamples;++s){
+                int d=(int)((double)s*nSegNodes/nSamples);
+                if (m_pairwiseSegmentationWeight>0){
+                    std::vector<int> neighbours= this->m_GraphModel->getForwardSegmentationNeighbours(d);
+                    for (unsigned int i=0;i<neighbours.size();++i)
+                        for (int l1=0;l1<nSegLabels;++l1)
+                            for (int l2=0;l2<nSegLabels;++l2)
+                                maxAbs=std::max(maxAbs,fabs(m_pairwiseSegmentationWeight*this->m_GraphModel->getPairwiseSegmentationPotential(d,neighbours[i],l1,l2)));
+                }
+                if (m_register && m_coherence){
+                    std::vector<int> segRegNeighbors=this->m_GraphModel->getSegRegNeighbors(d);
+                    for (unsigned int i=0;i<segRegNeighbors.size();++i)
+                        for (int l1=0;l1<nSegLabels;++l1)
+                            for (int l2=0;l2<nRegLabels;++l2)
+                                maxAbs=std::max(maxAbs,fabs(m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(segRegNeighbors[i],d,l2,l1)));
+                }
+            }
+        }
+        int maxDegree=2*D+m_coherence*this->m_GraphModel->getMaxRegSegNeighbors();
+        m_maxEnergyTerm=std::min((double)GCO_MAX_ENERGYTERM,(double)std::numeric_limits<EnergyType>::max()/(2*(maxDegree+1)));
+        if (m_energyTolerance>0)
+            m_energyScale=1.0/m_energyTolerance;
+        else
+            m_energyScale=maxAbs>0?m_maxEnergyTerm/maxAbs:1.0;
+        LOGV(1)<<"Integer energies: "<<VAR(maxAbs)<<" "<<VAR(m_maxEnergyTerm)<<" "<<VAR(m_energyScale)<<", quantization step "<<1.0/m_energyScale<<std::endl;
+        LOGV(1)<<"Largest error per term "<<0.5/m_energyScale<<", of the energy "<<0.5/m_energyScale*(nNodes+nEdges)<<std::endl;
+    }
+    void reportSaturatedTerms(){
+        if (integerEnergies && m_saturatedTerms>0){
+            LOG<<"WARNING: "<<m_saturatedTerms<<" potential evaluations exceeded the largest integer energy term "<<m_maxEnergyTerm<<" and were saturated, quantization step "<<1.0/m_energyScale<<std::endl;
+        }
+    }
+
+public:
     void addNeighbor(int id1, int id2, int * neighbCount, int **neighbors, EnergyType ** weights){
         
         LOGV(15)<<"Adding neighbors "<<id1<<" "<<id2<<" with counts "<<VAR(neighbCount[id1])<< " "<<VAR(neighbCount[id2])<<std::endl;
@@ -653,9 +828,9 @@ public:
     }
 };
 
-template<class T> std::vector<std::vector<std::vector<std::map<int,float> > > >  * GCO_SRSMRFSolver<T>::regPairwise = NULL;
+template<class T> std::vector<std::vector<std::vector<std::map<int,typename GCO_SRSMRFSolver<T>::EnergyType> > > >  * GCO_SRSMRFSolver<T>::regPairwise = NULL;
 template<class T> std::vector<std::vector<std::vector<std::vector<float> > > >   * GCO_SRSMRFSolver<T>::segPairwise = NULL;
-template<class T> std::vector<std::vector<std::vector<float > > >  * GCO_SRSMRFSolver<T>::srsPairwise = NULL;
+template<class T> std::vector<std::vector<std::vector<typename GCO_SRSMRFSolver<T>::EnergyType > > >  * GCO_SRSMRFSolver<T>::srsPairwise = NULL;
 template<class T>  typename GCO_SRSMRFSolver<T>::GraphModelPointerType   GCO_SRSMRFSolver<T>::m_GraphModel=NULL;
 
 template<class T> int  GCO_SRSMRFSolver<T>::S0=0;
@@ -668,5 +843,9 @@ template<class T>  double GCO_SRSMRFSolver<T>::m_pairwiseSegmentationRegistratio
 template<class T>  double GCO_SRSMRFSolver<T>::m_pairwiseSegmentationWeight=0;
 template<class T>  double GCO_SRSMRFSolver<T>::m_pairwiseRegistrationWeight=0;
 template<class T>  bool GCO_SRSMRFSolver<T>::m_cachePotentials=false;
+template<class T>  double GCO_SRSMRFSolver<T>::m_energyScale=1.0;
+template<class T>  double GCO_SRSMRFSolver<T>::m_energyTolerance=0.0;
+template<class T>  typename GCO_SRSMRFSolver<T>::EnergyType GCO_SRSMRFSolver<T>::m_maxEnergyTerm=GCO_MAX_ENERGYTERM;
+template<class T>  long int GCO_SRSMRFSolver<T>::m_saturatedTerms=0;
 
 }
@@ -0,0 +1,105 @@
+/*
+ * MRF-GridGC.h
+ *
+ * binary segmentation graph cut on the (full resolution) segmentation grid, using the grid specialized max-flow
+ */
+
+#ifndef GRIDGC_SRS_H_
+#define GRIDGC_SRS_H_
+#include "Log.h"
+#include "GridMaxFlow.h"
+#include <time.h>
+
+namespace SRS{
+  /**
+   * @brief drop-in replacement for GC_MRFSolverSeg
+   *
+   * Segmentation nodes are the pixels of the target image, so the graph is represented implicitly by GridMaxFlow.
+   * Only residual capacities per pixel and neighborhood direction are stored, no adjacency lists.
+   */
+template<class TGraphModel>
+class GridGC_MRFSolverSeg {
+public:
+	typedef TGraphModel GraphModelType;
+    typedef typename GraphModelType::SizeType SizeType;
+    typedef GridMaxFlow<float,double> MRFType;
+protected:
+	MRFType* optimizer;
+	double m_unaryWeight,m_pairwiseWeight;
+	bool verbose;
+    GraphModelType * m_graphModel;
+    int nNodes;
+    double m_multiplier;
+public:
+	GridGC_MRFSolverSeg(GraphModelType * graphModel, double unaryWeight=1.0, double pairwiseWeight=1.0, bool verb=false)
+	{
+        m_graphModel= graphModel;
+		verbose=verb;
+		m_unaryWeight=unaryWeight;
+        m_multiplier=1000;
+		m_pairwiseWeight=pairwiseWeight;
+        optimizer=NULL;
+	}
+	~GridGC_MRFSolverSeg()
+	{
+        if (optimizer)
+            delete optimizer;
+	}
+	virtual void createGraph(){
+		LOGV(1)<<"starting grid graph init"<<std::endl;
+		GraphModelType* graph=this->m_graphModel;
+        nNodes=graph->nSegNodes();
+        SizeType size=graph->getImageSize();
+        const unsigned int D=SizeType::Dimension;
+		optimizer = new MRFType(D,size);
+        if (optimizer->nNodes()!=nNodes){
+            LOG<<"Segmentation graph is not a full grid ("<<VAR(nNodes)<<" "<<VAR(optimizer->nNodes())<<"), aborting"<<std::endl;
+            exit(-1);
+        }
+        LOGV(1)<<VAR(nNodes)<<" "<<VAR(graph->nSegEdges())<<endl;
+        int forward[D];
+        long int strides[D];
+        for (unsigned int d=0;d<D;++d){
+            forward[d]=optimizer->direction(d,1);
+            strides[d]=(d==0)?1:strides[d-1]*size[d-1];
+        }
+
+		clock_t start = clock();
+		for (int n=0;n<nNodes;++n){
+            optimizer->add_tweights(n,
+                                    m_multiplier*m_unaryWeight*graph->getUnarySegmentationPotential(n,0),
+                                    m_multiplier*m_unaryWeight*graph->getUnarySegmentationPotential(n,1));
+            for (unsigned int d=0;d<D;++d){
+                long int coordinate=(n/strides[d])%size[d];
+                if (coordinate+1<(long int)size[d]){
+                    int neighbor=n+strides[d];
+                    double lambda1=m_multiplier*m_pairwiseWeight*graph->getPairwiseSegmentationPotential(n,neighbor,1,0);
+                    double lambda2=m_multiplier*m_pairwiseWeight*graph->getPairwiseSegmentationPotential(n,neighbor,0,1);
+                    optimizer->add_grid_edge(n,forward[d],lambda1,lambda2);
+                }
+            }
+		}
+		clock_t finish = clock();
+		float t = (float) ((double)(finish - start) / CLOCKS_PER_SEC);
+		LOGV(1)<<"Finished init after "<<t<<" seconds"<<std::endl;
+	}
+
+	virtual void optimize(int optiter){
+		clock_t start = clock();
+		LOGV(1)<<"starting grid maxFlow"<<std::endl;
+		double flow = optimizer -> maxflow();
+		clock_t finish = clock();
+		float t = (float) ((double)(finish - start) / CLOCKS_PER_SEC);
+		LOG<<"Finished after "<<t<<" , resulting energy is "<<flow<<std::endl;
+	}
+    virtual std::vector<int> getLabels(){
+        std::vector<int> labels(nNodes);
+        for (int i=0;i<nNodes;++i){
+            labels[i]=optimizer->what_segment(i) == MRFType::SOURCE;
+        }
+        return labels;
+    }
+};
+
+}//namespace
+#endif /* GRIDGC_SRS_H_ */
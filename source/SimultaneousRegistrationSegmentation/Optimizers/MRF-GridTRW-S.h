@@ -0,0 +1,382 @@
+/*
+ * MRF-GridTRW-S.h
+ *
+ * multilabel segmentation-only TRW-S on the (full resolution) segmentation grid, red-black parallel
+ */
+
+#ifndef GRIDTRW_S_SRS_H_
+#define GRIDTRW_S_SRS_H_
+#include "Log.h"
+#include "PotentialPrecision.h"
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace SRS{
+  /**
+   * @brief multilabel counterpart of GridGC_MRFSolverSeg
+   *
+   * Segmentation nodes are the pixels of the target image, so the graph is the regular 4/6-neighborhood and is not stored.
+   * The pixels are colored by the parity of their coordinate sum. All edges connect a red and a black pixel,
+   * so TRW-S in the order red before black updates all pixels of one color in parallel (see PTRWS_SRSMRFSolver).
+   * Messages are stored per pixel and neighborhood slot. If all pairwise potentials are Potts potentials with an edge dependent weight,
+   * which is the case for the contrast sensitive smoothness potential, only the weight is stored per edge and messages take O(#labels),
+   * otherwise a table of #labels^2 potentials is stored per edge.
+   */
+template<class TGraphModel>
+class GridTRWS_MRFSolverSeg {
+public:
+	typedef TGraphModel GraphModelType;
+    typedef typename GraphModelType::SizeType SizeType;
+    typedef typename GraphModelType::PotentialTableType PotentialTableType;
+    static const int D=SizeType::Dimension;
+protected:
+	double m_unaryWeight,m_pairwiseWeight;
+	bool verbose;
+    GraphModelType * m_graphModel;
+    int nNodes,nLabels;
+    SizeType m_size;
+    long int m_strides[D];
+    ///unaries [n*nLabels+l]
+    PotentialTableType m_unaries;
+    ///Potts weights [n*D+d] of the edge from n to n+stride[d], or tables [(n*D+d)*nLabels*nLabels+l_n*nLabels+l_neighbor]
+    bool m_potts;
+    PotentialTableType m_edgePotentials;
+    ///incoming messages [(n*2*D+slot)*nLabels], slot 2*d is the message from n-stride[d], slot 2*d+1 the one from n+stride[d]
+    std::vector<float> m_messages;
+    std::vector<int> m_labels;
+    double m_lastLowerBound;
+public:
+	GridTRWS_MRFSolverSeg(GraphModelType * graphModel, double unaryWeight=1.0, double pairwiseWeight=1.0, bool verb=false)
+	{
+        m_graphModel= graphModel;
+		verbose=verb;
+		m_unaryWeight=unaryWeight;
+		m_pairwiseWeight=pairwiseWeight;
+        m_lastLowerBound=0.0;
+	}
+	virtual void createGraph(){
+		LOGV(1)<<"starting grid TRW-S init"<<std::endl;
+		GraphModelType* graph=this->m_graphModel;
+        nNodes=graph->nSegNodes();
+        nLabels=graph->nSegLabels();
+        m_size=graph->getImageSize();
+        long int gridNodes=1;
+        for (int d=0;d<D;++d){
+            m_strides[d]=(d==0)?1:m_strides[d-1]*m_size[d-1];
+            gridNodes*=m_size[d];
+        }
+        if (gridNodes!=nNodes){
+            LOG<<"Segmentation graph is not a full grid ("<<VAR(nNodes)<<" "<<VAR(gridNodes)<<"), aborting"<<std::endl;
+            exit(-1);
+        }
+
+		clock_t start = clock();
+        std::vector<float> unaries((size_t)nNodes*nLabels);
+		for (int n=0;n<nNodes;++n){
+            for (int l=0;l<nLabels;++l){
+                unaries[(size_t)n*nLabels+l]=m_unaryWeight*graph->getUnarySegmentationPotential(n,l);
+            }
+        }
+        m_unaries.assign(unaries);
+        unaries.clear();
+        if (!fillPottsWeights()){
+            LOGV(1)<<"segmentation pairwise potentials are not Potts potentials, tabulating "<<nLabels*nLabels<<" values per edge"<<std::endl;
+            fillEdgeTables();
+        }
+        m_messages.assign((size_t)nNodes*2*D*nLabels,0.0);
+        m_labels.assign(nNodes,0);
+		clock_t finish = clock();
+		float t = (float) ((double)(finish - start) / CLOCKS_PER_SEC);
+		LOGV(1)<<"Finished init after "<<t<<" seconds, "<<VAR(nNodes)<<" "<<VAR(nLabels)<<" "<<VAR(m_potts)<<std::endl;
+        LOGV(1)<<"Approximate size of messages and tables: "<<1.0/(1024*1024)*(m_messages.size()*sizeof(float)+m_unaries.bytes()+m_edgePotentials.bytes())<<" mb ("<<GraphModelType::PrecisionType::name()<<")."<<std::endl;
+	}
+
+	virtual double optimize(int maxIter){
+		clock_t start = clock();
+		LOGV(1)<<"starting grid TRW-S"<<std::endl;
+        double energy=0,lowerBound=0;
+        bool converged=false;
+        for (int i=0;i<maxIter && !converged;++i){
+            for (int color=0;color<2;++color)
+                updateColor(color);
+            lowerBound=computeLowerBound();
+            energy=decode();
+            converged=isConverged(i,energy,lowerBound);
+            LOGV(2)<<VAR(i)<<" "<<VAR(energy)<<" "<<VAR(lowerBound)<<std::endl;
+        }
+		clock_t finish = clock();
+		float t = (float) ((double)(finish - start) / CLOCKS_PER_SEC);
+		LOG<<"Finished after "<<t<<" , resulting energy is "<<energy<<" with lower bound "<<lowerBound<<std::endl;
+        return energy;
+	}
+    virtual std::vector<int> getLabels(){
+        return m_labels;
+    }
+
+protected:
+    ///visits the pixels of one color row by row, rows along axis 0 are distributed over the threads.
+    ///each thread calls its copy of f(n,coordinates) for the pixels n, the returned sum is over f.value() of the copies
+    template<class F>
+    double forColor(int color, const F & f){
+        int S0=m_size[0];
+        int nRows=nNodes/S0;
+        double sum=0.0;
+#pragma omp parallel reduction(+:sum)
+        {
+            F threadF=f;
+            long int c[D];
+#pragma omp for schedule(static)
+            for (int r=0;r<nRows;++r){
+                int parity=0;
+                long int rest=r;
+                for (int d=1;d<D;++d){
+                    c[d]=rest%m_size[d];
+                    rest/=m_size[d];
+                    parity+=c[d];
+                }
+                for (c[0]=(parity+color)%2;c[0]<S0;c[0]+=2){
+                    threadF((long int)r*S0+c[0],c);
+                }
+            }
+            sum+=threadF.value();
+        }
+        return sum;
+    }
+    inline bool hasNeighbor(const long int * c, int d, int sign) const {
+        return sign<0?c[d]>0:c[d]+1<(long int)m_size[d];
+    }
+    inline int degree(const long int * c) const {
+        int deg=0;
+        for (int d=0;d<D;++d) deg+=hasNeighbor(c,d,-1)+hasNeighbor(c,d,1);
+        return deg;
+    }
+    inline float * message(long int n, int slot){return &m_messages[((size_t)n*2*D+slot)*nLabels];}
+    ///potential of the edge from n to n+stride[d] for labels ln and lm
+    inline float edgePotential(long int n, int d, int ln, int lm) const {
+        if (m_potts)
+            return ln==lm?0.0f:m_edgePotentials[(size_t)n*D+d];
+        return m_edgePotentials[((size_t)n*D+d)*nLabels*nLabels+ln*nLabels+lm];
+    }
+    ///unary plus all incoming messages, messages of missing neighbors are zero
+    inline void getTheta(long int n, float * theta){
+        m_unaries.get((size_t)n*nLabels,nLabels,theta);
+        const float * in=&m_messages[(size_t)n*2*D*nLabels];
+        for (int s=0;s<2*D;++s,in+=nLabels)
+            for (int l=0;l<nLabels;++l) theta[l]+=in[l];
+    }
+    ///message out(x_to)=min_{x_from} h(x_from)+V(x_from,x_to) over the edge (owner,owner+stride[d]), normalized to minimum zero
+    inline void sendMessage(long int owner, int d, bool fromOwner, const float * h, float * out) const {
+        if (m_potts){
+            float w=m_edgePotentials[(size_t)owner*D+d];
+            float minH=*std::min_element(h,h+nLabels)+w;
+            for (int l=0;l<nLabels;++l) out[l]=std::min(h[l],minH);
+        }else{
+            for (int lt=0;lt<nLabels;++lt){
+                float best=std::numeric_limits<float>::max();
+                for (int lf=0;lf<nLabels;++lf){
+                    best=std::min(best,h[lf]+(fromOwner?edgePotential(owner,d,lf,lt):edgePotential(owner,d,lt,lf)));
+                }
+                out[lt]=best;
+            }
+        }
+        float minOut=*std::min_element(out,out+nLabels);
+        for (int l=0;l<nLabels;++l) out[l]-=minOut;
+    }
+
+    ///all neighbors of a pixel have the other color, so each pixel sends messages to all of its neighbors with TRW-S weight 1/degree
+    struct UpdateFunctor{
+        GridTRWS_MRFSolverSeg * solver;
+        std::vector<float> theta,h;
+        UpdateFunctor(GridTRWS_MRFSolverSeg * s):solver(s),theta(s->nLabels),h(s->nLabels){}
+        inline void operator()(long int n, const long int * c){
+            int L=solver->nLabels;
+            solver->getTheta(n,&theta[0]);
+            float gamma=1.0/std::max(1,solver->degree(c));
+            for (int d=0;d<D;++d){
+                for (int sign=-1;sign<=1;sign+=2){
+                    if (!solver->hasNeighbor(c,d,sign))
+                        continue;
+                    long int m=n+sign*solver->m_strides[d];
+                    const float * in=solver->message(n,2*d+(sign>0));
+                    for (int l=0;l<L;++l) h[l]=gamma*theta[l]-in[l];
+                    solver->sendMessage(sign>0?n:m,d,sign>0,&h[0],solver->message(m,2*d+(sign<0)));
+                }
+            }
+        }
+        double value() const {return 0.0;}
+    };
+    void updateColor(int color){
+        forColor(color,UpdateFunctor(this));
+    }
+
+    ///sum of the minima of the per-edge subproblems of the reparametrized energy, see PTRWS_SRSMRFSolver::computeLowerBound
+    struct BoundFunctor{
+        GridTRWS_MRFSolverSeg * solver;
+        std::vector<float> thetaN,ha,hb;
+        double bound;
+        BoundFunctor(GridTRWS_MRFSolverSeg * s):solver(s),thetaN(s->nLabels),ha(s->nLabels),hb(s->nLabels),bound(0.0){}
+        inline void operator()(long int n, const long int * c){
+            int L=solver->nLabels;
+            int deg=solver->degree(c);
+            solver->getTheta(n,&thetaN[0]);
+            if (deg==0){
+                bound+=*std::min_element(thetaN.begin(),thetaN.end());
+                return;
+            }
+            //edges to the forward neighbors, the subproblem gets theta/degree of both pixels minus the messages over the edge
+            for (int d=0;d<D;++d){
+                if (!solver->hasNeighbor(c,d,1))
+                    continue;
+                long int m=n+solver->m_strides[d];
+                long int cm[D];
+                for (int k=0;k<D;++k) cm[k]=c[k];
+                ++cm[d];
+                int degM=solver->degree(cm);
+                solver->getTheta(m,&hb[0]);
+                const float * toN=solver->message(n,2*d+1);
+                const float * toM=solver->message(m,2*d);
+                for (int l=0;l<L;++l){
+                    ha[l]=thetaN[l]/deg-toN[l];
+                    hb[l]=hb[l]/degM-toM[l];
+                }
+                float best=std::numeric_limits<float>::max();
+                if (solver->m_potts){
+                    float w=solver->edgePotential(n,d,0,1);
+                    for (int l=0;l<L;++l) best=std::min(best,ha[l]+hb[l]);
+                    best=std::min(best,*std::min_element(ha.begin(),ha.end())+*std::min_element(hb.begin(),hb.end())+w);
+                }else{
+                    for (int la=0;la<L;++la)
+                        for (int lb=0;lb<L;++lb)
+                            best=std::min(best,ha[la]+solver->edgePotential(n,d,la,lb)+hb[lb]);
+                }
+                bound+=best;
+            }
+        }
+        double value() const {return bound;}
+    };
+    double computeLowerBound(){
+        return forColor(0,BoundFunctor(this))+forColor(1,BoundFunctor(this));
+    }
+
+    ///red pixels minimize unary plus messages from their (black) neighbors, black pixels unary plus the potentials to the labelled red neighbors
+    struct DecodeFunctor{
+        GridTRWS_MRFSolverSeg * solver;
+        int color;
+        std::vector<float> cost;
+        double energy;
+        DecodeFunctor(GridTRWS_MRFSolverSeg * s, int col):solver(s),color(col),cost(s->nLabels),energy(0.0){}
+        inline void operator()(long int n, const long int * c){
+            int L=solver->nLabels;
+            if (color==0){
+                solver->getTheta(n,&cost[0]);
+            }else{
+                solver->m_unaries.get((size_t)n*L,L,&cost[0]);
+                for (int d=0;d<D;++d){
+                    if (solver->hasNeighbor(c,d,-1)){
+                        long int m=n-solver->m_strides[d];
+                        for (int l=0;l<L;++l) cost[l]+=solver->edgePotential(m,d,solver->m_labels[m],l);
+                    }
+                    if (solver->hasNeighbor(c,d,1)){
+                        long int m=n+solver->m_strides[d];
+                        for (int l=0;l<L;++l) cost[l]+=solver->edgePotential(n,d,l,solver->m_labels[m]);
+                    }
+                }
+            }
+            int label=std::min_element(cost.begin(),cost.end())-cost.begin();
+            solver->m_labels[n]=label;
+            //energy of the labelling: unaries of all pixels and the edges of the black pixels, which are decoded last
+            energy+=solver->m_unaries[(size_t)n*L+label];
+            if (color==1){
+                for (int d=0;d<D;++d){
+                    if (solver->hasNeighbor(c,d,-1)){
+                        long int m=n-solver->m_strides[d];
+                        energy+=solver->edgePotential(m,d,solver->m_labels[m],label);
+                    }
+                    if (solver->hasNeighbor(c,d,1)){
+                        energy+=solver->edgePotential(n,d,label,solver->m_labels[n+solver->m_strides[d]]);
+                    }
+                }
+            }
+        }
+        double value() const {return energy;}
+    };
+    double decode(){
+        return forColor(0,DecodeFunctor(this,0))+forColor(1,DecodeFunctor(this,1));
+    }
+
+    ///stores one weight per edge if all edges have Potts potentials, returns false otherwise
+    bool fillPottsWeights(){
+        m_potts=true;
+        std::vector<float> weights((size_t)nNodes*D,0.0);
+        long int c[D];
+        for (int n=0;n<nNodes && m_potts;++n){
+            long int rest=n;
+            for (int d=0;d<D;++d){
+                c[d]=rest%m_size[d];
+                rest/=m_size[d];
+            }
+            for (int d=0;d<D && m_potts;++d){
+                if (!hasNeighbor(c,d,1))
+                    continue;
+                int m=n+m_strides[d];
+                double w=m_pairwiseWeight*m_graphModel->getPairwiseSegmentationPotential(n,m,0,1);
+                for (int l1=0;l1<nLabels && m_potts;++l1){
+                    for (int l2=0;l2<nLabels;++l2){
+                        double pot=m_pairwiseWeight*m_graphModel->getPairwiseSegmentationPotential(n,m,l1,l2);
+                        if (pot!=(l1==l2?0.0:w)){
+                            m_potts=false;
+                            break;
+                        }
+                    }
+                }
+                weights[(size_t)n*D+d]=w;
+            }
+        }
+        if (m_potts)
+            m_edgePotentials.assign(weights);
+        return m_potts;
+    }
+    void fillEdgeTables(){
+        size_t L2=nLabels*nLabels;
+        std::vector<float> tables((size_t)nNodes*D*L2,0.0);
+        long int c[D];
+        for (int n=0;n<nNodes;++n){
+            long int rest=n;
+            for (int d=0;d<D;++d){
+                c[d]=rest%m_size[d];
+                rest/=m_size[d];
+            }
+            for (int d=0;d<D;++d){
+                if (!hasNeighbor(c,d,1))
+                    continue;
+                int m=n+m_strides[d];
+                float * V=&tables[((size_t)n*D+d)*L2];
+                for (int l1=0;l1<nLabels;++l1)
+                    for (int l2=0;l2<nLabels;++l2)
+                        V[l1*nLabels+l2]=m_pairwiseWeight*m_graphModel->getPairwiseSegmentationPotential(n,m,l1,l2);
+            }
+        }
+        m_edgePotentials.assign(tables);
+    }
+    ///same criterion as PTRWS_SRSMRFSolver::isConverged
+    bool isConverged(int currentIter, double energy, double lowerBound){
+        bool converged=(energy==lowerBound);
+        if (currentIter>0){
+            converged= (converged || (fabs(lowerBound-m_lastLowerBound) < 1e-6 * fabs(m_lastLowerBound) ));
+        }
+        if ( currentIter>0 && 0.0 < (m_lastLowerBound - lowerBound) )  {
+            LOGV(2)<<"lower bound decreased, "<<VAR(m_lastLowerBound)<<" greater than " << VAR(lowerBound)<< " " <<VAR(m_lastLowerBound - lowerBound )<<std::endl;
+        }
+        m_lastLowerBound=lowerBound;
+        return converged;
+    }
+};
+
+}//namespace
+#endif /* GRIDTRW_S_SRS_H_ */
@@ -0,0 +1,531 @@
+/*
+ * MRF-PTRW-S.h
+ *
+ * built-in parallel TRW-S for the registration/segmentation/coherence graph, no external solver package needed
+ */
+
+#ifndef PTRW_S_SRS_H_
+#define PTRW_S_SRS_H_
+#include "Log.h"
+#include "BaseMRF.h"
+#include "LabelDistanceTransform.h"
+#include "PotentialPrecision.h"
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace SRS{
+  /** \brief
+   * Sequential tree-reweighted message passing (TRW-S) with a red-black node order.
+   *
+   * Registration and segmentation nodes are colored such that no two nodes of the same type and color are neighbours
+   * (two colors on the grid graphs), and the nodes are ordered by phase: registration colors first, then segmentation colors.
+   * Nodes of one phase do not share edges, so TRW-S in this order updates all nodes of a phase in parallel.
+   * Messages are stored per receiving node. Registration pairwise messages use LabelDistanceTransform if the potential
+   * is a distance on the label grid, all other pairwise potentials are tabulated per edge.
+   * The lower bound is the sum of the minima of per-edge subproblems of the reparametrized energy.
+   * Unaries and pairwise tables are stored in the precision of the graph (GraphModel::PrecisionType), messages are floats.
+   */
+  template<class TGraphModel>
+    class PTRWS_SRSMRFSolver : public BaseMRFSolver<TGraphModel> {
+  public:
+    typedef TGraphModel GraphModelType;
+    typedef typename GraphModelType::Pointer GraphModelPointerType;
+    typedef typename GraphModelType::SpacingType SpacingType;
+    typedef typename GraphModelType::PotentialTableType PotentialTableType;
+
+  protected:
+    double m_unarySegmentationWeight,m_pairwiseSegmentationWeight;
+    double m_unaryRegistrationWeight,m_pairwiseRegistrationWeight;
+    double m_pairwiseSegmentationRegistrationWeight;
+    int verbose;
+    GraphModelPointerType m_GraphModel;
+    int nRegNodes,nSegNodes,nNodes,nEdges;
+    int nRegLabels,nSegLabels;
+    bool m_segment,m_register,m_coherence;
+    ///registration nodes are [0,nRegNodes), segmentation nodes follow. unaries of node n start at m_unaryOffset[n]
+    PotentialTableType m_unaries;
+    std::vector<size_t> m_unaryOffset;
+    ///edges (a,b) with their first node a and second node b, the offsets of the messages to a and to b in m_messages,
+    ///and the offset of their pairwise table [la*nLabels(b)+lb] in m_edgePotentials, -1 for the registration distance transform
+    std::vector<int> m_edgeA,m_edgeB;
+    std::vector<size_t> m_messageToA,m_messageToB;
+    std::vector<long int> m_edgeTable;
+    std::vector<float> m_messages;
+    PotentialTableType m_edgePotentials;
+    size_t m_nEdgePotentials;
+    ///incident edges of each node (compressed rows)
+    std::vector<int> m_adjacencyStart,m_adjacentEdges;
+    ///phase of each node and nodes per phase
+    std::vector<int> m_phase;
+    std::vector<std::vector<int> > m_phaseNodes;
+    ///TRW-S weight of each node, 1/max(#neighbours in earlier phases,#neighbours in later phases)
+    std::vector<float> m_gamma;
+    bool m_useDistanceTransform;
+    LabelDistanceTransform m_distanceTransform;
+    std::vector<int> m_labels;
+    double m_lastLowerBound;
+    clock_t m_start;
+
+  public:
+    PTRWS_SRSMRFSolver(GraphModelPointerType  graphModel,
+                       double unaryRegWeight=1.0,
+                       double pairwiseRegWeight=1.0,
+                       double unarySegWeight=1.0,
+                       double pairwiseSegWeight=1.0,
+                       double pairwiseSegRegWeight=1.0,
+                       int vverbose=false)
+      :m_GraphModel(graphModel)
+    {
+      verbose=vverbose;
+      m_unarySegmentationWeight=unarySegWeight;
+      m_pairwiseSegmentationWeight=pairwiseSegWeight;
+      m_unaryRegistrationWeight=unaryRegWeight;
+      m_pairwiseRegistrationWeight=pairwiseRegWeight;
+      m_pairwiseSegmentationRegistrationWeight=pairwiseSegRegWeight;
+      m_lastLowerBound=0.0;
+    }
+
+    virtual void createGraph(){
+      clock_t start = clock();
+      m_start=start;
+      LOGV(1)<<"starting parallel TRW-S graph init"<<std::endl;
+      this->m_GraphModel->Init();
+      clock_t endInit = clock();
+      tUnary+=((double)(endInit - start) / CLOCKS_PER_SEC);
+      nRegLabels=this->m_GraphModel->nRegLabels();
+      nSegLabels=this->m_GraphModel->nSegLabels();
+      m_register=((m_pairwiseSegmentationRegistrationWeight>0 || m_unaryRegistrationWeight>0 || m_pairwiseRegistrationWeight>0) && nRegLabels>1);
+      m_segment=((m_pairwiseSegmentationRegistrationWeight>0 || m_unarySegmentationWeight>0 || m_pairwiseSegmentationWeight>0)  && nSegLabels>1);
+      m_coherence=m_pairwiseSegmentationRegistrationWeight>0;
+      if (m_register && m_segment && m_coherence){
+        TIME(this->m_GraphModel->cacheCoherencePotentials());
+      }
+      nRegNodes=m_register?this->m_GraphModel->nRegNodes():0;
+      nSegNodes=m_segment?this->m_GraphModel->nSegNodes():0;
+      nNodes=nRegNodes+nSegNodes;
+      LOGV(6)<<VAR(m_register)<<" "<<VAR(m_segment)<<" "<<VAR(m_coherence)<<std::endl;
+      logSetStage("Potential functions caching");
+
+      //unaries, coherence is folded into the unaries if only one of registration and segmentation is optimized (see TRWS_SRSMRFSolver)
+      m_unaryOffset.resize(nNodes+1);
+      for (int n=0;n<nNodes;++n)
+        m_unaryOffset[n+1]=m_unaryOffset[n]+nLabels(n);
+      std::vector<float> unaries(m_unaryOffset[nNodes],0.0);
+      if (m_register){
+        if (m_unaryRegistrationWeight>0){
+          std::vector<float> block;
+          this->m_GraphModel->getUnaryRegistrationBlock(block);
+          for (size_t i=0;i<block.size();++i) unaries[i]=m_unaryRegistrationWeight*block[i];
+        }
+        //edges to fixed neighbors outside of the active region are folded into the unaries
+        if (m_pairwiseRegistrationWeight>0){
+          for (int d=0;d<nRegNodes;++d){
+            for (int l1=0;l1<nRegLabels;++l1){
+              unaries[m_unaryOffset[d]+l1]+=m_pairwiseRegistrationWeight*this->m_GraphModel->getFixedNeighborsRegistrationPotential(d,l1);
+            }
+          }
+        }
+        if (m_coherence && !m_segment){
+          for (int d=0;d<nRegNodes;++d){
+            std::vector<int> regSegNeighbors=this->m_GraphModel->getRegSegNeighbors(d);
+            for (int l1=0;l1<nRegLabels;++l1){
+              for (unsigned int i=0;i<regSegNeighbors.size();++i){
+                unaries[m_unaryOffset[d]+l1]+=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(d,regSegNeighbors[i],l1,0);
+              }
+            }
+          }
+        }
+      }
+      if (m_segment){
+        for (int d=0;d<nSegNodes;++d){
+          float * unary=&unaries[m_unaryOffset[nRegNodes+d]];
+          std::vector<int> segRegNeighbors;
+          if (m_coherence && !m_register)
+            segRegNeighbors=this->m_GraphModel->getSegRegNeighbors(d);
+          for (int l1=0;l1<nSegLabels;++l1){
+            unary[l1]=m_unarySegmentationWeight*this->m_GraphModel->getUnarySegmentationPotential(d,l1);
+            unary[l1]+=m_pairwiseSegmentationWeight*this->m_GraphModel->getFixedNeighborsSegmentationPotential(d,l1);
+            for (unsigned int i=0;i<segRegNeighbors.size();++i){
+              unary[l1]+=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(segRegNeighbors[i],d,0,l1);
+            }
+          }
+        }
+      }
+      m_unaries.assign(unaries);
+      clock_t endUnary = clock();
+      double t=((double)(endUnary - endInit) / CLOCKS_PER_SEC);
+      tUnary+=t;
+      LOGV(1)<<"Unaries took "<<t<<" seconds."<<std::endl;
+
+      //edges
+      m_edgeA.clear();
+      m_edgeB.clear();
+      m_edgeTable.clear();
+      m_nEdgePotentials=0;
+      SpacingType labelSpacing;
+      double weight,truncation;
+      int distanceType;
+      m_useDistanceTransform=m_register && this->m_GraphModel->getRegularRegistrationPairwise(distanceType,labelSpacing,weight,truncation);
+      if (m_useDistanceTransform){
+        weight*=m_pairwiseRegistrationWeight;
+        int dim=SpacingType::Dimension;
+        std::vector<double> axisCost(dim);
+        for (int d=0;d<dim;++d){
+          axisCost[d]=weight*labelSpacing[d];
+          if (distanceType==LabelDistanceTransform::SQUAREDL2) axisCost[d]*=labelSpacing[d];
+        }
+        int samplesPerAxis=(int)floor(pow(1.0*nRegLabels,1.0/dim)+0.5)/2;
+        m_distanceTransform.init(dim,samplesPerAxis,axisCost,distanceType,weight*truncation);
+      }
+      for (int d=0;d<nRegNodes;++d){
+        std::vector<int> neighbours= this->m_GraphModel->getForwardRegistrationNeighbours(d);
+        for (unsigned int i=0;i<neighbours.size();++i){
+          addEdge(d,neighbours[i],!m_useDistanceTransform);
+        }
+      }
+      for (int d=0;d<nSegNodes;++d){
+        std::vector<int> neighbours= this->m_GraphModel->getForwardSegmentationNeighbours(d);
+        for (unsigned int i=0;i<neighbours.size();++i){
+          addEdge(nRegNodes+d,nRegNodes+neighbours[i],true);
+        }
+        if (m_register && m_coherence){
+          std::vector<int> segRegNeighbors=this->m_GraphModel->getSegRegNeighbors(d);
+          for (unsigned int i=0;i<segRegNeighbors.size();++i){
+            addEdge(segRegNeighbors[i],nRegNodes+d,true);
+          }
+        }
+      }
+      nEdges=m_edgeA.size();
+      fillEdgePotentials();
+      m_messages.assign(m_messageToB.empty()?0:m_messageToB.back()+nLabels(m_edgeB.back()),0.0);
+
+      //adjacency
+      m_adjacencyStart.assign(nNodes+1,0);
+      for (int e=0;e<nEdges;++e){
+        ++m_adjacencyStart[m_edgeA[e]+1];
+        ++m_adjacencyStart[m_edgeB[e]+1];
+      }
+      for (int n=0;n<nNodes;++n) m_adjacencyStart[n+1]+=m_adjacencyStart[n];
+      m_adjacentEdges.resize(2*nEdges);
+      {
+        std::vector<int> fill(m_adjacencyStart.begin(),m_adjacencyStart.end()-1);
+        for (int e=0;e<nEdges;++e){
+          m_adjacentEdges[fill[m_edgeA[e]]++]=e;
+          m_adjacentEdges[fill[m_edgeB[e]]++]=e;
+        }
+      }
+      computePhases();
+      m_labels.assign(nNodes,0);
+      for (int n=0;n<nRegNodes;++n) m_labels[n]=nRegLabels/2;
+      clock_t endPairwise = clock();
+      t=((double)(endPairwise - endUnary) / CLOCKS_PER_SEC);
+      tPairwise+=t;
+      LOGV(1)<<"Pairwise potentials took "<<t<<" seconds, "<<VAR(nEdges)<<" "<<VAR(m_phaseNodes.size())<<" phases, "<<VAR(m_useDistanceTransform)<<std::endl;
+      LOGV(1)<<"Approximate size of messages and tables: "<<1.0/(1024*1024)*(m_messages.size()*sizeof(float)+m_unaries.bytes()+m_edgePotentials.bytes())<<" mb ("<<GraphModelType::PrecisionType::name()<<", max error "<<std::max(m_unaries.maxError(),m_edgePotentials.maxError())<<")."<<std::endl;
+      logResetStage;
+    }
+
+    virtual double optimize(int maxIter=20){
+      LOGV(5)<<"Total number of MRF edges: " <<nEdges<<std::endl;
+      logSetStage("PTRWSOptimizer");
+      clock_t opt_start=clock();
+      bool converged=false;
+      double energy=0,lowerBound=0;
+      for (int i=0;i<maxIter && !converged;++i){
+        energy=iterate(lowerBound);
+        converged=isConverged(i,energy,lowerBound);
+        LOGV(2)<<VAR(i)<<" "<<VAR(energy)<<" "<<VAR(lowerBound)<<std::endl;
+      }
+      clock_t finish = clock();
+      tOpt+=((double)(finish-opt_start)/CLOCKS_PER_SEC);
+      float t = (float) ((double)(finish - m_start) / CLOCKS_PER_SEC);
+      LOG<<"Finished optimization after "<<t<<" , resulting energy is "<<energy<<" with lower bound "<< lowerBound <<std::endl;
+      logResetStage;
+      return energy;
+    }
+    virtual double optimizeOneStep(int currentIter , bool & converged){
+      logSetStage("Optimizer");
+      clock_t opt_start=clock();
+      double lowerBound;
+      double energy=iterate(lowerBound);
+      clock_t finish = clock();
+      logResetStage;
+      tOpt+=((double)(finish-opt_start)/CLOCKS_PER_SEC);
+      float t = (float) ((double)(finish -  opt_start) / CLOCKS_PER_SEC);
+      LOG<<VAR(currentIter)<<" Finished optimization after "<<t<<" , resulting energy is "<<energy<<" with lower bound "<< lowerBound <<std::endl;
+      converged=isConverged(currentIter,energy,lowerBound);
+      return energy;
+    }
+    virtual bool getLowerBound(double & lowerBound){lowerBound=m_lastLowerBound; return true;}
+    virtual std::vector<int> getDeformationLabels(){
+      std::vector<int> labels(this->m_GraphModel->nRegNodes(),nRegLabels/2);
+      if (m_register) std::copy(m_labels.begin(),m_labels.begin()+nRegNodes,labels.begin());
+      return labels;
+    }
+    virtual std::vector<int> getSegmentationLabels(){
+      std::vector<int> labels(this->m_GraphModel->nSegNodes(),0);
+      if (m_segment) std::copy(m_labels.begin()+nRegNodes,m_labels.end(),labels.begin());
+      return labels;
+    }
+
+  protected:
+    inline int nLabels(int node) const {return node<nRegNodes?nRegLabels:nSegLabels;}
+
+    ///adds edge (a,b), which gets a pairwise table if tabulate
+    void addEdge(int a, int b, bool tabulate){
+      size_t messageOffset=m_messageToB.empty()?0:m_messageToB.back()+nLabels(m_edgeB.back());
+      m_edgeA.push_back(a);
+      m_edgeB.push_back(b);
+      m_messageToA.push_back(messageOffset);
+      m_messageToB.push_back(messageOffset+nLabels(a));
+      if (tabulate){
+        m_edgeTable.push_back(m_nEdgePotentials);
+        m_nEdgePotentials+=nLabels(a)*nLabels(b);
+      }else{
+        m_edgeTable.push_back(-1);
+      }
+    }
+    ///weighted pairwise potentials of the tabulated edges
+    void fillEdgePotentials(){
+      std::vector<float> potentials(m_nEdgePotentials);
+      for (int e=0;e<nEdges;++e){
+        if (m_edgeTable[e]<0)
+          continue;
+        float * V=&potentials[m_edgeTable[e]];
+        int a=m_edgeA[e],b=m_edgeB[e];
+        int La=nLabels(a),Lb=nLabels(b);
+        for (int la=0;la<La;++la){
+          for (int lb=0;lb<Lb;++lb){
+            double pot;
+            if (b<nRegNodes)
+              pot=m_pairwiseRegistrationWeight*this->m_GraphModel->getPairwiseRegistrationPotential(a,b,la,lb);
+            else if (a<nRegNodes)
+              pot=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(a,b-nRegNodes,la,lb);
+            else
+              pot=m_pairwiseSegmentationWeight*this->m_GraphModel->getPairwiseSegmentationPotential(a-nRegNodes,b-nRegNodes,la,lb);
+            V[la*Lb+lb]=pot;
+          }
+        }
+      }
+      m_edgePotentials.assign(potentials);
+    }
+    ///greedy coloring of registration and segmentation nodes over the edges between nodes of the same type, phases are ordered by type and color
+    void computePhases(){
+      std::vector<int> color(nNodes,-1);
+      int nRegColors=0,nColors=0;
+      std::vector<char> used;
+      for (int n=0;n<nNodes;++n){
+        bool isReg=n<nRegNodes;
+        used.assign(used.size(),0);
+        for (int i=m_adjacencyStart[n];i<m_adjacencyStart[n+1];++i){
+          int e=m_adjacentEdges[i];
+          int other=m_edgeA[e]==n?m_edgeB[e]:m_edgeA[e];
+          if ((other<nRegNodes)==isReg && color[other]>=0){
+            if (color[other]>=(int)used.size()) used.resize(color[other]+1,0);
+            used[color[other]]=1;
+          }
+        }
+        int c=0;
+        while (c<(int)used.size() && used[c]) ++c;
+        color[n]=c;
+        if (isReg) nRegColors=std::max(nRegColors,c+1);
+        else nColors=std::max(nColors,c+1);
+      }
+      m_phase.resize(nNodes);
+      m_phaseNodes=std::vector<std::vector<int> >(nRegColors+nColors);
+      for (int n=0;n<nNodes;++n){
+        m_phase[n]=(n<nRegNodes)?color[n]:nRegColors+color[n];
+        m_phaseNodes[m_phase[n]].push_back(n);
+      }
+      m_gamma.resize(nNodes);
+      for (int n=0;n<nNodes;++n){
+        int nBefore=0,nAfter=0;
+        for (int i=m_adjacencyStart[n];i<m_adjacencyStart[n+1];++i){
+          int e=m_adjacentEdges[i];
+          int other=m_edgeA[e]==n?m_edgeB[e]:m_edgeA[e];
+          if (m_phase[other]<m_phase[n]) ++nBefore; else ++nAfter;
+        }
+        m_gamma[n]=1.0/std::max(1,std::max(nBefore,nAfter));
+      }
+    }
+
+    ///message from node to the other node of edge e, out(x_to)=min_{x_from} h(x_from)+V(x_from,x_to), normalized to minimum zero
+    void sendMessage(int e, int node, const float * h, LabelDistanceTransform & distanceTransform){
+      bool fromA=(m_edgeA[e]==node);
+      float * out=&m_messages[fromA?m_messageToB[e]:m_messageToA[e]];
+      int Lfrom=nLabels(node), Lto=nLabels(fromA?m_edgeB[e]:m_edgeA[e]);
+      if (m_edgeTable[e]<0){
+        distanceTransform.transform(h,out);
+      }else{
+        size_t V=m_edgeTable[e];
+        for (int lt=0;lt<Lto;++lt){
+          float best=std::numeric_limits<float>::max();
+          for (int lf=0;lf<Lfrom;++lf){
+            float v=fromA?m_edgePotentials[V+lf*Lto+lt]:m_edgePotentials[V+lt*Lfrom+lf];
+            best=std::min(best,h[lf]+v);
+          }
+          out[lt]=best;
+        }
+      }
+      float minOut=*std::min_element(out,out+Lto);
+      for (int l=0;l<Lto;++l) out[l]-=minOut;
+    }
+    ///reparametrized unary of node, its unary plus all incoming messages
+    inline void getTheta(int node, float * theta){
+      int L=nLabels(node);
+      m_unaries.get(m_unaryOffset[node],L,theta);
+      for (int i=m_adjacencyStart[node];i<m_adjacencyStart[node+1];++i){
+        const float * in=incoming(m_adjacentEdges[i],node);
+        for (int l=0;l<L;++l) theta[l]+=in[l];
+      }
+    }
+    inline const float * incoming(int e, int node) const{
+      return &m_messages[m_edgeA[e]==node?m_messageToA[e]:m_messageToB[e]];
+    }
+    inline double edgePotential(int e, int la, int lb){
+      if (m_edgeTable[e]<0)
+        return m_distanceTransform.cost(la,lb);
+      return m_edgePotentials[m_edgeTable[e]+la*nLabels(m_edgeB[e])+lb];
+    }
+
+    ///forward and backward pass over the phases, then decoding. returns the energy, and the lower bound in lowerBound
+    double iterate(double & lowerBound){
+      int maxLabels=std::max(nRegLabels,nSegLabels);
+      int nPhases=m_phaseNodes.size();
+      for (int pass=0;pass<2;++pass){
+        bool forward=(pass==0);
+        for (int p=0;p<nPhases;++p){
+          int phase=forward?p:nPhases-1-p;
+          const std::vector<int> & nodes=m_phaseNodes[phase];
+          int nPhaseNodes=nodes.size();
+#pragma omp parallel
+          {
+            std::vector<float> theta(maxLabels),h(maxLabels);
+            LabelDistanceTransform distanceTransform=m_distanceTransform;
+#pragma omp for schedule(dynamic,64)
+            for (int k=0;k<nPhaseNodes;++k){
+              int node=nodes[k];
+              int L=nLabels(node);
+              getTheta(node,&theta[0]);
+              for (int i=m_adjacencyStart[node];i<m_adjacencyStart[node+1];++i){
+                int e=m_adjacentEdges[i];
+                int other=m_edgeA[e]==node?m_edgeB[e]:m_edgeA[e];
+                if ((m_phase[other]>phase)!=forward)
+                  continue;
+                const float * in=incoming(e,node);
+                for (int l=0;l<L;++l) h[l]=m_gamma[node]*theta[l]-in[l];
+                sendMessage(e,node,&h[0],distanceTransform);
+              }
+            }
+          }
+        }
+      }
+      lowerBound=computeLowerBound();
+      return decode();
+    }
+    ///the reparametrized energy is split into one subproblem per edge, which gets the pairwise potential minus both messages
+    ///and the reparametrized unaries of its nodes divided by their number of edges. the lower bound is the sum of the subproblem minima
+    double computeLowerBound(){
+      int maxLabels=std::max(nRegLabels,nSegLabels);
+      double bound=0.0;
+      std::vector<float> theta(m_unaries.size());
+#pragma omp parallel
+      {
+        std::vector<float> ha(maxLabels),hb(maxLabels),dt(maxLabels);
+        LabelDistanceTransform distanceTransform=m_distanceTransform;
+#pragma omp for schedule(dynamic,64) reduction(+:bound)
+        for (int n=0;n<nNodes;++n){
+          float * t=&theta[m_unaryOffset[n]];
+          getTheta(n,t);
+          int degree=m_adjacencyStart[n+1]-m_adjacencyStart[n];
+          if (degree==0)
+            bound+=*std::min_element(t,t+nLabels(n));
+          else
+            for (int l=0;l<nLabels(n);++l) t[l]/=degree;
+        }
+#pragma omp for schedule(dynamic,64) reduction(+:bound)
+        for (int e=0;e<nEdges;++e){
+          int a=m_edgeA[e],b=m_edgeB[e];
+          int La=nLabels(a),Lb=nLabels(b);
+          const float * toA=&m_messages[m_messageToA[e]];
+          const float * toB=&m_messages[m_messageToB[e]];
+          for (int l=0;l<La;++l) ha[l]=theta[m_unaryOffset[a]+l]-toA[l];
+          for (int l=0;l<Lb;++l) hb[l]=theta[m_unaryOffset[b]+l]-toB[l];
+          float best=std::numeric_limits<float>::max();
+          if (m_edgeTable[e]<0){
+            distanceTransform.transform(&ha[0],&dt[0]);
+            for (int lb=0;lb<Lb;++lb) best=std::min(best,dt[lb]+hb[lb]);
+          }else{
+            size_t V=m_edgeTable[e];
+            for (int la=0;la<La;++la){
+              for (int lb=0;lb<Lb;++lb){
+                best=std::min(best,ha[la]+m_edgePotentials[V+la*Lb+lb]+hb[lb]);
+              }
+            }
+          }
+          bound+=best;
+        }
+      }
+      return bound;
+    }
+    ///labels in phase order, each node minimizing its unary, the messages from later neighbours and the pairwise potentials
+    ///to the already labelled neighbours of earlier phases. returns the energy of the labelling
+    double decode(){
+      int maxLabels=std::max(nRegLabels,nSegLabels);
+      int nPhases=m_phaseNodes.size();
+      for (int phase=0;phase<nPhases;++phase){
+        const std::vector<int> & nodes=m_phaseNodes[phase];
+        int nPhaseNodes=nodes.size();
+#pragma omp parallel
+        {
+          std::vector<double> cost(maxLabels);
+#pragma omp for schedule(dynamic,64)
+          for (int k=0;k<nPhaseNodes;++k){
+            int node=nodes[k];
+            int L=nLabels(node);
+            for (int l=0;l<L;++l) cost[l]=m_unaries[m_unaryOffset[node]+l];
+            for (int i=m_adjacencyStart[node];i<m_adjacencyStart[node+1];++i){
+              int e=m_adjacentEdges[i];
+              bool isA=(m_edgeA[e]==node);
+              int other=isA?m_edgeB[e]:m_edgeA[e];
+              if (m_phase[other]>phase){
+                const float * in=incoming(e,node);
+                for (int l=0;l<L;++l) cost[l]+=in[l];
+              }else{
+                for (int l=0;l<L;++l) cost[l]+=isA?edgePotential(e,l,m_labels[other]):edgePotential(e,m_labels[other],l);
+              }
+            }
+            m_labels[node]=std::min_element(cost.begin(),cost.begin()+L)-cost.begin();
+          }
+        }
+      }
+      double energy=0.0;
+#pragma omp parallel for reduction(+:energy)
+      for (int n=0;n<nNodes;++n)
+        energy+=m_unaries[m_unaryOffset[n]+m_labels[n]];
+#pragma omp parallel for reduction(+:energy)
+      for (int e=0;e<nEdges;++e)
+        energy+=edgePotential(e,m_labels[m_edgeA[e]],m_labels[m_edgeB[e]]);
+      return energy;
+    }
+    ///same criterion as TRWS_SRSMRFSolver::optimizeOneStep
+    bool isConverged(int currentIter, double energy, double lowerBound){
+      bool converged=(energy==lowerBound);
+      if (currentIter>0){
+        converged= (converged || (fabs(lowerBound-m_lastLowerBound) < 1e-6 * fabs(m_lastLowerBound) ));
+      }
+      if ( currentIter>0 && 0.0 < (m_lastLowerBound - lowerBound) )  {
+        LOGV(2)<<"lower bound decreased, "<<VAR(m_lastLowerBound)<<" greater than " << VAR(lowerBound)<< " " <<VAR(m_lastLowerBound - lowerBound )<<std::endl;
+      }
+      m_lastLowerBound=lowerBound;
+      return converged;
+    }
+  };
+}
+#endif /* PTRW_S_SRS_H_ */
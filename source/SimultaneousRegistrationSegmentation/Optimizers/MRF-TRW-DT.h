@@ -0,0 +1,299 @@
+/*
+ * MRF-TRW-DT.h
+ *
+ * sequential tree-reweighted message passing (TRW-S) for the registration graph,
+ * with messages computed by distance transforms on the displacement label grid
+ */
+
+#ifndef TRW_DT_SRS_H_
+#define TRW_DT_SRS_H_
+#include "Log.h"
+#include "BaseMRF.h"
+#include "LabelDistanceTransform.h"
+#include "PotentialPrecision.h"
+#include <vector>
+#include <limits>
+#include <time.h>
+
+namespace SRS{
+  /** \brief
+   * TRW-S for registration (and coherence folded into the registration unaries), without per edge pairwise tables.
+   *
+   * If the registration pairwise potential is a (truncated) L1, L2 or squared L2 distance of the displacements on the regular label grid
+   * (GraphModel::getRegularRegistrationPairwise), all edges share one LabelDistanceTransform and messages are computed
+   * in O(#labels) per edge (O(#labels^2) without tables for the euclidean distance).
+   * Otherwise the pairwise potentials of each edge are tabulated like in TRWS_SRSMRFSolver.
+   * Segmentation nodes are not supported.
+   */
+  template<class TGraphModel>
+    class TRWDT_SRSMRFSolver : public BaseMRFSolver<TGraphModel> {
+  public:
+    typedef TGraphModel GraphModelType;
+    typedef typename GraphModelType::Pointer GraphModelPointerType;
+    typedef typename GraphModelType::SpacingType SpacingType;
+    typedef typename GraphModelType::PotentialTableType PotentialTableType;
+
+  protected:
+    double m_unarySegmentationWeight,m_pairwiseSegmentationWeight;
+    double m_unaryRegistrationWeight,m_pairwiseRegistrationWeight;
+    double m_pairwiseSegmentationRegistrationWeight;
+    int verbose;
+    GraphModelPointerType m_GraphModel;
+    int nRegNodes,nRegLabels,nEdges;
+    bool m_register,m_coherence;
+    ///weighted registration unaries (including coherence) in node-major order, [node*nRegLabels+label]
+    PotentialTableType m_unaries;
+    ///edges (a,b) with a<b, and for each node the incident edges
+    std::vector<int> m_edgeNodes;
+    std::vector<std::vector<int> > m_nodeEdges;
+    ///messages of edge e, to b at [2*e*nRegLabels] and to a at [(2*e+1)*nRegLabels]
+    std::vector<float> m_messages;
+    ///tabulated pairwise potentials [e*nRegLabels^2+la*nRegLabels+lb], only if there is no distance transform
+    PotentialTableType m_edgePotentials;
+    bool m_useDistanceTransform;
+    LabelDistanceTransform m_distanceTransform;
+    int m_distanceType;
+    std::vector<int> m_labels;
+    double m_lastEnergy;
+    clock_t m_start;
+
+  public:
+    TRWDT_SRSMRFSolver(GraphModelPointerType  graphModel,
+                       double unaryRegWeight=1.0,
+                       double pairwiseRegWeight=1.0,
+                       double unarySegWeight=1.0,
+                       double pairwiseSegWeight=1.0,
+                       double pairwiseSegRegWeight=1.0,
+                       int vverbose=false)
+      :m_GraphModel(graphModel)
+    {
+      verbose=vverbose;
+      m_unarySegmentationWeight=unarySegWeight;
+      m_pairwiseSegmentationWeight=pairwiseSegWeight;
+      m_unaryRegistrationWeight=unaryRegWeight;
+      m_pairwiseRegistrationWeight=pairwiseRegWeight;
+      m_pairwiseSegmentationRegistrationWeight=pairwiseSegRegWeight;
+      m_lastEnergy=std::numeric_limits<double>::max();
+    }
+
+    virtual void createGraph(){
+      clock_t start = clock();
+      m_start=start;
+      LOGV(1)<<"starting distance transform TRW-S graph init"<<std::endl;
+      this->m_GraphModel->Init();
+      nRegNodes=this->m_GraphModel->nRegNodes();
+      nRegLabels=this->m_GraphModel->nRegLabels();
+      int nSegLabels=this->m_GraphModel->nSegLabels();
+      m_register=((m_pairwiseSegmentationRegistrationWeight>0 || m_unaryRegistrationWeight>0 || m_pairwiseRegistrationWeight>0) && nRegLabels>1);
+      m_coherence=m_pairwiseSegmentationRegistrationWeight>0;
+      if ((m_unarySegmentationWeight>0 || m_pairwiseSegmentationWeight>0) && nSegLabels>1){
+        LOG<<"The TRWDT solver only optimizes registration, use TRWS or GCO for segmentation, aborting"<<std::endl;
+        exit(0);
+      }
+      m_labels=std::vector<int>(nRegNodes,nRegLabels/2);
+      if (!m_register)
+        return;
+      logSetStage("Potential functions caching");
+
+      //unaries, coherence is added to the registration unaries as in TRWS_SRSMRFSolver
+      std::vector<float> unaries;
+      if (m_unaryRegistrationWeight>0){
+        this->m_GraphModel->getUnaryRegistrationBlock(unaries);
+        for (size_t i=0;i<unaries.size();++i) unaries[i]*=m_unaryRegistrationWeight;
+      }else{
+        unaries.assign((size_t)nRegNodes*nRegLabels,0.0);
+      }
+      //edges to fixed neighbors outside of the active region are folded into the unaries
+      if (m_pairwiseRegistrationWeight>0){
+        for (int d=0;d<nRegNodes;++d){
+          for (int l1=0;l1<nRegLabels;++l1){
+            unaries[(size_t)d*nRegLabels+l1]+=m_pairwiseRegistrationWeight*this->m_GraphModel->getFixedNeighborsRegistrationPotential(d,l1);
+          }
+        }
+      }
+      if (m_coherence){
+        for (int d=0;d<nRegNodes;++d){
+          std::vector<int> regSegNeighbors=this->m_GraphModel->getRegSegNeighbors(d);
+          for (int l1=0;l1<nRegLabels;++l1){
+            for (unsigned int i=0;i<regSegNeighbors.size();++i){
+              unaries[(size_t)d*nRegLabels+l1]+=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(d,regSegNeighbors[i],l1,0);
+            }
+          }
+        }
+      }
+      m_unaries.assign(unaries);
+      clock_t endUnary = clock();
+      LOGV(1)<<"Registration Unaries took "<<((double)(endUnary-start)/CLOCKS_PER_SEC)<<" seconds."<<std::endl;
+
+      //edges
+      m_edgeNodes.clear();
+      m_nodeEdges=std::vector<std::vector<int> >(nRegNodes);
+      for (int d=0;d<nRegNodes;++d){
+        std::vector<int> neighbours= this->m_GraphModel->getForwardRegistrationNeighbours(d);
+        for (unsigned int i=0;i<neighbours.size();++i){
+          int e=m_edgeNodes.size()/2;
+          m_edgeNodes.push_back(std::min(d,neighbours[i]));
+          m_edgeNodes.push_back(std::max(d,neighbours[i]));
+          m_nodeEdges[d].push_back(e);
+          m_nodeEdges[neighbours[i]].push_back(e);
+        }
+      }
+      nEdges=m_edgeNodes.size()/2;
+      m_messages.assign((size_t)2*nEdges*nRegLabels,0.0);
+
+      SpacingType labelSpacing;
+      double weight,truncation;
+      m_useDistanceTransform=this->m_GraphModel->getRegularRegistrationPairwise(m_distanceType,labelSpacing,weight,truncation);
+      m_edgePotentials.clear();
+      if (m_useDistanceTransform){
+        weight*=m_pairwiseRegistrationWeight;
+        int dim=SpacingType::Dimension;
+        std::vector<double> axisCost(dim);
+        for (int d=0;d<dim;++d){
+          axisCost[d]=weight*labelSpacing[d];
+          if (m_distanceType==LabelDistanceTransform::SQUAREDL2) axisCost[d]*=labelSpacing[d];
+        }
+        truncation*=weight;
+        int samplesPerAxis=(int)floor(pow(1.0*nRegLabels,1.0/dim)+0.5)/2;
+        m_distanceTransform.init(dim,samplesPerAxis,axisCost,m_distanceType,truncation);
+        LOGV(1)<<"Registration pairwise messages by distance transform, "<<VAR(m_distanceType)<<" "<<VAR(labelSpacing)<<" "<<VAR(weight)<<" "<<VAR(truncation)<<std::endl;
+      }else{
+        LOGV(1)<<"Registration pairwise potential is not a distance on the label grid, tabulating "<<nEdges<<" edges"<<std::endl;
+        std::vector<float> potentials((size_t)nEdges*nRegLabels*nRegLabels);
+#pragma omp parallel for
+        for (int e=0;e<nEdges;++e){
+          float * V=&potentials[(size_t)e*nRegLabels*nRegLabels];
+          for (int l1=0;l1<nRegLabels;++l1){
+            for (int l2=0;l2<nRegLabels;++l2){
+              V[l1*nRegLabels+l2]=m_pairwiseRegistrationWeight*this->m_GraphModel->getPairwiseRegistrationPotential(m_edgeNodes[2*e],m_edgeNodes[2*e+1],l1,l2);
+            }
+          }
+        }
+        m_edgePotentials.assign(potentials);
+      }
+      clock_t finish = clock();
+      LOGV(1)<<"Registration pairwise took "<<((double)(finish-endUnary)/CLOCKS_PER_SEC)<<" seconds, tables "<<1.0/(1024*1024)*(m_unaries.bytes()+m_edgePotentials.bytes())<<" mb ("<<GraphModelType::PrecisionType::name()<<", max error "<<std::max(m_unaries.maxError(),m_edgePotentials.maxError())<<")."<<std::endl;
+      logResetStage;
+    }
+
+    virtual double optimize(int maxIter=20){
+      bool converged=false;
+      double energy=0;
+      for (int i=0;i<maxIter && !converged;++i){
+        energy=optimizeOneStep(i,converged);
+      }
+      float t = (float) ((double)(clock() - m_start) / CLOCKS_PER_SEC);
+      LOG<<"Finished optimization after "<<t<<" , resulting energy is "<<energy<<std::endl;
+      return energy;
+    }
+
+    ///one forward and one backward pass of TRW-S, followed by decoding the labels in node order
+    virtual double optimizeOneStep(int currentIter , bool & converged){
+      converged=true;
+      if (!m_register)
+        return 0.0;
+      logSetStage("TRWDTOptimizer");
+      clock_t opt_start=clock();
+      std::vector<float> theta(nRegLabels),h(nRegLabels);
+      for (int pass=0;pass<2;++pass){
+        bool forward=(pass==0);
+        for (int k=0;k<nRegNodes;++k){
+          int node=forward?k:nRegNodes-1-k;
+          //reparametrized unary of the node
+          m_unaries.get((size_t)node*nRegLabels,nRegLabels,&theta[0]);
+          int nBefore=0,nAfter=0;
+          for (unsigned int i=0;i<m_nodeEdges[node].size();++i){
+            int e=m_nodeEdges[node][i];
+            bool isA=(m_edgeNodes[2*e]==node);
+            const float * in=incoming(e,isA);
+            for (int l=0;l<nRegLabels;++l) theta[l]+=in[l];
+            if (isA) ++nAfter; else ++nBefore;
+          }
+          double gamma=1.0/std::max(1,std::max(nBefore,nAfter));
+          //send messages along the edges in pass direction
+          for (unsigned int i=0;i<m_nodeEdges[node].size();++i){
+            int e=m_nodeEdges[node][i];
+            bool isA=(m_edgeNodes[2*e]==node);
+            if (isA!=forward)
+              continue;
+            const float * in=incoming(e,isA);
+            for (int l=0;l<nRegLabels;++l) h[l]=gamma*theta[l]-in[l];
+            sendMessage(e,isA,&h[0]);
+          }
+        }
+      }
+      double energy=decode();
+      logResetStage;
+      float t = (float) ((double)(clock() - opt_start) / CLOCKS_PER_SEC);
+      LOGV(1)<<VAR(currentIter)<<" Finished optimization after "<<t<<" , resulting energy is "<<energy<<std::endl;
+      converged=(currentIter>0) && (fabs(m_lastEnergy-energy) <= 1e-6*fabs(m_lastEnergy));
+      m_lastEnergy=energy;
+      return energy;
+    }
+
+    virtual std::vector<int> getDeformationLabels(){
+      return m_labels;
+    }
+    virtual std::vector<int> getSegmentationLabels(){
+      return std::vector<int>(this->m_GraphModel->nSegNodes(),0);
+    }
+
+  protected:
+    ///message arriving at the node of edge e, which is the edge's first node if toA
+    inline float * incoming(int e, bool toA){
+      return &m_messages[(size_t)(2*e+(toA?1:0))*nRegLabels];
+    }
+    ///message from the first (fromA) or second node of edge e, out(x_to)=min_{x_from} h(x_from)+V(x_from,x_to), normalized to minimum zero
+    void sendMessage(int e, bool fromA, const float * h){
+      float * out=incoming(e,!fromA);
+      if (m_useDistanceTransform){
+        m_distanceTransform.transform(h,out);
+      }else{
+        size_t V=(size_t)e*nRegLabels*nRegLabels;
+        for (int lt=0;lt<nRegLabels;++lt){
+          float best=std::numeric_limits<float>::max();
+          for (int lf=0;lf<nRegLabels;++lf){
+            float v=fromA?m_edgePotentials[V+lf*nRegLabels+lt]:m_edgePotentials[V+lt*nRegLabels+lf];
+            best=std::min(best,h[lf]+v);
+          }
+          out[lt]=best;
+        }
+      }
+      float minOut=*std::min_element(out,out+nRegLabels);
+      for (int l=0;l<nRegLabels;++l) out[l]-=minOut;
+    }
+    ///pairwise potential of edge e for labels la of its first and lb of its second node
+    inline double edgePotential(int e, int la, int lb){
+      if (!m_useDistanceTransform)
+        return m_edgePotentials[(size_t)e*nRegLabels*nRegLabels+la*nRegLabels+lb];
+      return m_distanceTransform.cost(la,lb);
+    }
+    ///labels in node order, each minimizing its unary, the messages from later neighbours and the pairwise potentials
+    ///to the already labelled earlier neighbours. returns the energy of the labelling
+    double decode(){
+      std::vector<double> cost(nRegLabels);
+      for (int node=0;node<nRegNodes;++node){
+        for (int l=0;l<nRegLabels;++l) cost[l]=m_unaries[(size_t)node*nRegLabels+l];
+        for (unsigned int i=0;i<m_nodeEdges[node].size();++i){
+          int e=m_nodeEdges[node][i];
+          bool isA=(m_edgeNodes[2*e]==node);
+          if (isA){
+            const float * in=incoming(e,true);
+            for (int l=0;l<nRegLabels;++l) cost[l]+=in[l];
+          }else{
+            int la=m_labels[m_edgeNodes[2*e]];
+            for (int l=0;l<nRegLabels;++l) cost[l]+=edgePotential(e,la,l);
+          }
+        }
+        m_labels[node]=std::min_element(cost.begin(),cost.end())-cost.begin();
+      }
+      double energy=0.0;
+      for (int node=0;node<nRegNodes;++node)
+        energy+=m_unaries[(size_t)node*nRegLabels+m_labels[node]];
+      for (int e=0;e<nEdges;++e)
+        energy+=edgePotential(e,m_labels[m_edgeNodes[2*e]],m_labels[m_edgeNodes[2*e+1]]);
+      return energy;
+    }
+  };
+}
+#endif /* TRW_DT_SRS_H_ */
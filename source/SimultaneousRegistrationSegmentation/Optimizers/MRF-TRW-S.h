@@ -9,6 +9,7 @@
 #define TRW_S_SRS_H_
 #include "Log.h"
 #include "BaseMRF.h"
+#include "PotentialPrecision.h"
 
 //#include "typeGeneral.h"
 #include "MRFEnergy.h"
@@ -30,6 +31,7 @@ namespace SRS{
 
     typedef TGraphModel GraphModelType;
     typedef typename GraphModelType::Pointer GraphModelPointerType;
+    typedef typename GraphModelType::PotentialTableType PotentialTableType;
 
     typedef TypeGeneral TRWType;
     typedef MRFEnergy<TRWType> MRFType;
@@ -53,6 +55,8 @@ namespace SRS{
     bool m_segment, m_register,m_coherence;
     double m_lastLowerBound;
     std::vector<int> m_labelOrder;
+    ///registration unaries in node-major order, [node*nRegLabels+label]
+    PotentialTableType m_regUnaries;
     
   public:
   TRWS_SRSMRFSolver(GraphModelPointerType  graphModel,
@@ -118,6 +122,9 @@ namespace SRS{
       m_register=((m_pairwiseSegmentationRegistrationWeight>0 || m_unaryRegistrationWeight>0 || m_pairwiseRegistrationWeight>0) && nRegLabels>1);
       m_segment=((m_pairwiseSegmentationRegistrationWeight>0 || m_unarySegmentationWeight>0 || m_pairwiseSegmentationWeight)  && nSegLabels>1);
       m_coherence=m_pairwiseSegmentationRegistrationWeight>0;
+      if (m_register && m_segment && m_coherence){
+        TIME(this->m_GraphModel->cacheCoherencePotentials());
+      }
       LOGV(6)<<VAR(m_register)<<" "<<VAR(m_segment)<<" "<<VAR(m_coherence)<<std::endl;
       logSetStage("Potential functions caching");
       //		traverse grid
@@ -125,50 +132,45 @@ namespace SRS{
 	//RegUnaries
 	clock_t startUnary = clock();
 
-	TRWType::REAL D1[nRegLabels];
-	//
-	for (int l1=0;l1<nRegLabels;++l1) D1[l1]=0;
-	//firstly allocate registration nodes with zero potentials
-	for (int d=0;d<nRegNodes;++d){
-	  regNodes[d] = 
-	    m_optimizer.AddNode(TRWType::LocalSize(nRegLabels), TRWType::NodeData(D1));
+	AlignedArray<Real> D1(nRegLabels);
+	AlignedArray<float> unaries(nRegLabels);
+	//node-major unaries of all labels, each node is added with its complete data term
+	{
+	  std::vector<float> block;
+	  if (m_unaryRegistrationWeight>0){
+	    this->m_GraphModel->getUnaryRegistrationBlock(block);
+	  }else{
+	    block.assign((size_t)nRegNodes*nRegLabels,0.0);
+	  }
+	  m_regUnaries.assign(block);
 	}
-	//now compute&set all potentials
-	for (int l1=0;l1<nRegLabels;++l1)
-	  {
-	    int regLabel=m_labelOrder[l1];
-	    this->m_GraphModel->cacheRegistrationPotentials(regLabel);
-	    for (int d=0;d<nRegNodes;++d){
-	      double pot=this->m_GraphModel->getUnaryRegistrationPotential(d,regLabel);
-	      pot*=m_unaryRegistrationWeight;
-	      //in case of coherence weight, but no direct segmentation optimization, add coherence potential to registration unaries
-	      if (m_coherence && !m_segment){
-		//pretty inefficient as the reg neighbors are recomputed #registrationLabels times for each registration node.
-		std::vector<int> regSegNeighbors=this->m_GraphModel->getRegSegNeighbors(d);
-		int nNeighbours=regSegNeighbors.size();
-		if (nNeighbours==0) {LOG<<"ERROR: node "<<d<<" seems to have no neighbors."<<std::endl;}
-		for (int i=0;i<nNeighbours;++i){
-		  double coherencePot=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(d,regSegNeighbors[i],regLabel,0);
-		  //LOGV(10)<<VAR(d)<<" "<<VAR(regLabel)<<" "<<VAR(pot)<<" "<<VAR(coherencePot)<<std::endl;
-		  pot+=coherencePot;
-                                
-		}
-                          
+	for (int d=0;d<nRegNodes;++d){
+	  m_regUnaries.get((size_t)d*nRegLabels,nRegLabels,unaries.data());
+	  for (int l1=0;l1<nRegLabels;++l1) D1[l1]=m_unaryRegistrationWeight*unaries[l1];
+	  //edges to fixed neighbors outside of the active region are folded into the unaries
+	  if (m_pairwiseRegistrationWeight>0){
+	    for (int l1=0;l1<nRegLabels;++l1) D1[l1]+=m_pairwiseRegistrationWeight*this->m_GraphModel->getFixedNeighborsRegistrationPotential(d,l1);
+	  }
+	  //in case of coherence weight, but no direct segmentation optimization, add coherence potential to registration unaries
+	  if (m_coherence && !m_segment){
+	    std::vector<int> regSegNeighbors=this->m_GraphModel->getRegSegNeighbors(d);
+	    int nNeighbours=regSegNeighbors.size();
+	    if (nNeighbours==0) {LOG<<"ERROR: node "<<d<<" seems to have no neighbors."<<std::endl;}
+	    for (int l1=0;l1<nRegLabels;++l1){
+	      for (int i=0;i<nNeighbours;++i){
+		D1[l1]+=m_pairwiseSegmentationRegistrationWeight*this->m_GraphModel->getPairwiseRegSegPotential(d,regSegNeighbors[i],l1,0);
 	      }
-	      m_optimizer.SetNodeDataPos(regNodes[d],regLabel,pot);
-                        
 	    }
 	  }
-            
-	TRWType::REAL Vreg[nRegLabels*nRegLabels];
-	for (int l1=0;l1<nRegLabels;++l1){
-	  for (int l2=0;l2<nRegLabels;++l2){
-	    Vreg[l1*nRegLabels+l2]=0;
-	  }
+	  regNodes[d] = 
+	    m_optimizer.AddNode(TRWType::LocalSize(nRegLabels), TRWType::NodeData(D1.data()));
 	}
+            
+	AlignedArray<Real> Vreg((size_t)nRegLabels*nRegLabels);
+	Vreg.fill(0);
 	clock_t endUnary = clock();
 	double t = (float) ((double)(endUnary - startUnary) / CLOCKS_PER_SEC);
-	LOGV(1)<<"Registration Unaries took "<<t<<" seconds."<<std::endl;
+	LOGV(1)<<"Registration Unaries took "<<t<<" seconds, "<<1.0/(1024*1024)*m_regUnaries.bytes()<<" mb ("<<GraphModelType::PrecisionType::name()<<", max error "<<m_regUnaries.maxError()<<")."<<std::endl;
 	tUnary+=t;
 	/// Pairwise potentials
 	/// pure Registration
@@ -193,7 +195,7 @@ namespace SRS{
 		}
 	      }
 	      /// add edge with stored potentials to external optimizer object
-	      m_optimizer.AddEdge(regNodes[d], regNodes[neighbours[i]], TRWType::EdgeData(TRWType::GENERAL,Vreg));
+	      m_optimizer.AddEdge(regNodes[d], regNodes[neighbours[i]], TRWType::EdgeData(TRWType::GENERAL,Vreg.data()));
 	      edgeCount++;
 	    }
                 
@@ -209,7 +211,7 @@ namespace SRS{
       if (m_segment){
 	//SegUnaries
 	clock_t startUnary = clock();
-	TRWType::REAL D2[nSegLabels];
+	AlignedArray<Real> D2(nSegLabels);
 
 	for (int d=0;d<nSegNodes;++d){
 	  std::vector<int> segRegNeighbors=this->m_GraphModel->getSegRegNeighbors(d);
@@ -217,6 +219,8 @@ namespace SRS{
 	    {
 	      
 	      D2[l1]=m_unarySegmentationWeight*this->m_GraphModel->getUnarySegmentationPotential(d,l1);
+	      //edges to fixed neighbors outside of the active region are folded into the unaries
+	      D2[l1]+=m_pairwiseSegmentationWeight*this->m_GraphModel->getFixedNeighborsSegmentationPotential(d,l1);
 	      //in case of coherence weight, but no direct registration optimization, add coherence potential to registration unaries
 	      if (m_coherence && !m_register){
 		for (int i=0;i<segRegNeighbors.size();++i){
@@ -225,7 +229,7 @@ namespace SRS{
 	      }
 	    }
 	  segNodes[d] = 
-	    m_optimizer.AddNode(TRWType::LocalSize(nSegLabels), TRWType::NodeData(D2));
+	    m_optimizer.AddNode(TRWType::LocalSize(nSegLabels), TRWType::NodeData(D2.data()));
                 
 	  //  LOG<<" reg and segreg pairwise pots" <<std::endl;
        
@@ -235,10 +239,10 @@ namespace SRS{
 	LOGV(1)<<"Segmentation Unaries took "<<t<<" seconds."<<std::endl;
 	LOGV(1)<<"Approximate size of seg unaries: "<<1.0/(1024*1024)*nSegNodes*nSegLabels*sizeof(double)<<" mb."<<std::endl;
 
-	TRWType::REAL VsrsBack[nRegLabels*nSegLabels];
+	AlignedArray<Real> VsrsBack((size_t)nRegLabels*nSegLabels);
+	AlignedArray<Real> Vseg((size_t)nSegLabels*nSegLabels);
 	int nSegEdges=0,nSegRegEdges=0;
 	for (int d=0;d<nSegNodes;++d){   
-	  TRWType::REAL Vseg[nSegLabels*nSegLabels];
 	  //pure Segmentation
 	  std::vector<int> neighbours= this->m_GraphModel->getForwardSegmentationNeighbours(d);
 	  int nNeighbours=neighbours.size();
@@ -250,7 +254,7 @@ namespace SRS{
 		Vseg[l1+nSegLabels*l2]=lambda;
 	      }
 	    }
-	    m_optimizer.AddEdge(segNodes[d], segNodes[neighbours[i]], TRWType::EdgeData(TRWType::GENERAL,Vseg));
+	    m_optimizer.AddEdge(segNodes[d], segNodes[neighbours[i]], TRWType::EdgeData(TRWType::GENERAL,Vseg.data()));
 	    edgeCount++;
                     
 	  }
@@ -266,7 +270,7 @@ namespace SRS{
 
 		}
 	      }
-	      m_optimizer.AddEdge(regNodes[segRegNeighbors[i]], segNodes[d], TRWType::EdgeData(TRWType::GENERAL,VsrsBack));
+	      m_optimizer.AddEdge(regNodes[segRegNeighbors[i]], segNodes[d], TRWType::EdgeData(TRWType::GENERAL,VsrsBack.data()));
                   
 	      edgeCount++;
 	      nSegRegEdges++;
@@ -308,6 +312,7 @@ namespace SRS{
       tOpt+=((double)(finish-opt_start)/CLOCKS_PER_SEC);
       float t = (float) ((double)(finish - m_start) / CLOCKS_PER_SEC);
       LOG<<"Finished optimization after "<<t<<" , resulting energy is "<<energy<<" with lower bound "<< lowerBound <<std::endl;
+      m_lastLowerBound=lowerBound;
       logResetStage;         
       return energy;
 
@@ -341,6 +346,7 @@ namespace SRS{
       return energy;
 
     }
+    virtual bool getLowerBound(double & lowerBound){lowerBound=m_lastLowerBound; return true;}
     virtual std::vector<int> getDeformationLabels(){
       std::vector<int> labels(nRegNodes,0);
       if (m_register){
@@ -366,14 +372,15 @@ namespace SRS{
         
       clock_t start = clock();
       m_start=start;
-      if (nRegLabels){
+      if (m_register){
 	for (int d=0;d<nRegNodes;++d){
-	  sumUReg+=m_unaryRegistrationWeight*this->m_GraphModel->getUnaryRegistrationPotential(d,m_optimizer.GetSolution(regNodes[d]));
+	  sumUReg+=m_unaryRegistrationWeight*m_regUnaries[(size_t)d*nRegLabels+m_optimizer.GetSolution(regNodes[d])];
 	}
       }
       if (nSegLabels){
 	for (int d=0;d<nSegNodes;++d){
 	  sumUSeg+=m_unarySegmentationWeight*this->m_GraphModel->getUnarySegmentationPotential(d,m_optimizer.GetSolution(segNodes[d]));
+	  sumPSeg+=m_pairwiseSegmentationWeight*this->m_GraphModel->getFixedNeighborsSegmentationPotential(d,m_optimizer.GetSolution(segNodes[d]));
 	  if (nRegLabels){
 	    std::vector<int> neighbours= this->m_GraphModel->getForwardSegmentationNeighbours(d);
 	    int nNeighbours=neighbours.size();
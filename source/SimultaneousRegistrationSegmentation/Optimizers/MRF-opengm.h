@@ -156,6 +156,9 @@ public:
         m_register=((m_pairwiseSegmentationRegistrationWeight>0 || m_unaryRegistrationWeight>0 || m_pairwiseRegistrationWeight>0) && nRegLabels>1);
         m_segment=((m_pairwiseSegmentationRegistrationWeight>0 || m_unarySegmentationWeight>0 || m_pairwiseSegmentationWeight)  && nSegLabels>1);
         m_coherence=m_pairwiseSegmentationRegistrationWeight>0;
+        if (m_register && m_segment && m_coherence){
+          TIME(this->m_GraphModel->cacheCoherencePotentials());
+        }
         GLOBALnRegNodes= m_register*nRegNodes;
         GLOBALnSegNodes= m_segment*nSegNodes;
         GLOBALnRegLabels=m_register*nRegLabels;
@@ -194,7 +197,8 @@ public:
                 this->m_GraphModel->cacheRegistrationPotentials(l1);
                 for (int d=0;d<nRegNodes;++d){
                     //unary factors
-                    f[d](l1)=m_unaryRegistrationWeight*this->m_GraphModel->getUnaryRegistrationPotential(d,l1);
+                    f[d](l1)=m_unaryRegistrationWeight*this->m_GraphModel->getUnaryRegistrationPotential(d,l1)
+                        +m_pairwiseRegistrationWeight*this->m_GraphModel->getFixedNeighborsRegistrationPotential(d,l1);
                 }
             }
             for (int d=0;d<nRegNodes;++d){
@@ -237,7 +241,8 @@ public:
                     FunctionType f(shape, shape + 1);
                     for (int l1=0;l1<nSegLabels;++l1){
                         
-                        f(l1)=m_unarySegmentationWeight*this->m_GraphModel->getUnarySegmentationPotential(d,l1);
+                        f(l1)=m_unarySegmentationWeight*this->m_GraphModel->getUnarySegmentationPotential(d,l1)
+                            +m_pairwiseSegmentationWeight*this->m_GraphModel->getFixedNeighborsSegmentationPotential(d,l1);
                     }
                     FunctionIdentifier fid=m_gm->addFunction(f);
                     size_t vi[]={d+GLOBALnRegNodes};
@@ -104,30 +104,24 @@ namespace SRS{
       matrix<float> data(maxTrain,nFeatures);
       LOGV(5)<<maxTrain<<" matrix allocated"<<std::endl;
       std::vector<int> labelVector(maxTrain);
-      std::vector<ConstImageIteratorType> iterators;
+      //one row per voxel in buffer order (the order of the region iterators), filled directly from the image buffers
+      std::vector<const PixelType *> buffers(nFeatures);
       for (unsigned int s=0;s<nFeatures;++s){
-	iterators.push_back(ConstImageIteratorType(inputImage[s],inputImage[s]->GetLargestPossibleRegion()));
-	iterators[s].GoToBegin();
+	buffers[s]=inputImage[s]->GetBufferPointer();
       }
-      int i=0;
-      for (;!iterators[0].IsAtEnd() ; ++i)
+      const PixelType * labelBuffer=labels?labels->GetBufferPointer():NULL;
+#pragma omp parallel for
+      for (long int i=0;i<maxTrain;++i)
 	{
-	  int label=0;
-	  if (labels)
-	    label=labels->GetPixel(iterators[0].GetIndex())>0;
-	  //LOGV(10)<<i<<" "<<label<<" "<<nFeatures<<std::endl;
 	  for (unsigned int f=0;f<nFeatures;++f){
-	    int intens=(iterators[f].Get());
+	    int intens=buffers[f][i];
 	    data(i,f)=intens;
-	    ++iterators[f];
 	  }
-	  labelVector[i]=label;
-                  
-                  
+	  labelVector[i]=labelBuffer?(labelBuffer[i]>0):0;
 	}
 
    
-      m_nData=i;
+      m_nData=maxTrain;
       LOG<<"done adding data. "<<std::endl;
       LOG<<"stored "<<m_nData<<" samples "<<std::endl;
       m_data.setData(data);
@@ -146,16 +140,11 @@ namespace SRS{
       }
            
           
-      std::vector<FloatIteratorType> iterators;
       for ( int s=0;s<this->m_nSegmentationLabels;++s){
-	iterators.push_back(FloatIteratorType(result[s],result[s]->GetLargestPossibleRegion()));
-	iterators[s].GoToBegin();
-      }
-            
-      for (int i=0;!iterators[0].IsAtEnd() ; ++i){
-	for ( int s=0;s<this->m_nSegmentationLabels;++s){
-	  iterators[s].Set((conf(i,s)));
-	  ++iterators[s];
+	typename FloatImageType::PixelType * probs=result[s]->GetBufferPointer();
+#pragma omp parallel for
+	for (long int i=0;i<m_nData;++i){
+	  probs[i]=conf(i,s);
 	}
       }
       std::string suff;
@@ -225,17 +225,13 @@ namespace SRS{
         void SetTolerance(double t){m_tolerance=t;}
 
 
-        //edge from registration to segmentation
-        inline virtual  double getPotential(IndexType targetIndex1, IndexType targetIndex2,LabelType displacement, int segmentationLabel){
-            double result=0;
-            ContinuousIndexType idx2;//(targetIndex2);
+        ///continuous index in the atlas segmentation of the target index moved by displacement, clamped to the atlas buffer
+        inline void getDeformedAtlasIndex(const IndexType & targetIndex, const LabelType & displacement, ContinuousIndexType & idx2){
             itk::Vector<float,ImageType::ImageDimension> disp=displacement;
-
             typename ImageType::PointType p;
-            this->m_targetImage->TransformIndexToPhysicalPoint(targetIndex1,p);
+            this->m_targetImage->TransformIndexToPhysicalPoint(targetIndex,p);
             p +=disp;//+this->m_baseLabelMap->GetPixel(targetIndex1);
             this->m_atlasSegmentationImage->TransformPhysicalPointToContinuousIndex(p,idx2);
-            int deformedAtlasSegmentation=-1;
             if (!m_atlasSegmentationInterpolator->IsInsideBuffer(idx2)){
                 for (int d=0;d<ImageType::ImageDimension;++d){
                     if (idx2[d]>=this->m_atlasSegmentationInterpolator->GetEndContinuousIndex()[d]){
@@ -246,7 +242,32 @@ namespace SRS{
                     }
                 }
             }
-            deformedAtlasSegmentation=int(m_atlasSegmentationInterpolator->EvaluateAtContinuousIndex(idx2));
+        }
+
+        //edge from registration to segmentation
+        inline virtual  double getPotential(IndexType targetIndex1, IndexType targetIndex2,LabelType displacement, int segmentationLabel){
+            ContinuousIndexType idx2;
+            getDeformedAtlasIndex(targetIndex1,displacement,idx2);
+            int deformedAtlasSegmentation=int(m_atlasSegmentationInterpolator->EvaluateAtContinuousIndex(idx2));
+            return getDeformedPotential(idx2,deformedAtlasSegmentation,segmentationLabel);
+        }
+
+        ///potentials of all segmentation labels for all displacements of one target index, potentials[displacement*nSegmentationLabels+segmentationLabel].
+        ///the deformed atlas index and segmentation are computed once per displacement instead of once per displacement and segmentation label
+        virtual void getPotentials(IndexType targetIndex, const std::vector<LabelType> & displacements, int nSegmentationLabels, float * potentials){
+            ContinuousIndexType idx2;
+            for (unsigned int l=0;l<displacements.size();++l){
+                getDeformedAtlasIndex(targetIndex,displacements[l],idx2);
+                int deformedAtlasSegmentation=int(m_atlasSegmentationInterpolator->EvaluateAtContinuousIndex(idx2));
+                for (int s=0;s<nSegmentationLabels;++s){
+                    potentials[l*nSegmentationLabels+s]=getDeformedPotential(idx2,deformedAtlasSegmentation,s);
+                }
+            }
+        }
+
+        ///potential of segmentationLabel at the (clamped) atlas index idx2, where the deformed atlas segmentation is deformedAtlasSegmentation
+        inline virtual double getDeformedPotential(const ContinuousIndexType & idx2, int deformedAtlasSegmentation, int segmentationLabel){
+            double result=0;
             if (segmentationLabel!=deformedAtlasSegmentation){ 
                 double dist=m_atlasDistanceTransformInterpolators[segmentationLabel]->EvaluateAtContinuousIndex(idx2);       
                 //double dist2=m_atlasDistanceTransformInterpolators[deformedAtlasSegmentation]->EvaluateAtContinuousIndex(idx2);
@@ -323,36 +344,11 @@ namespace SRS{
     public:
         itkNewMacro(Self);
 
-          inline virtual  double getPotential(IndexType targetIndex1, IndexType targetIndex2,LabelType displacement, int segmentationLabel){
+          inline virtual double getDeformedPotential(const ContinuousIndexType & idx2, int deformedAtlasSegmentation, int segmentationLabel){
             double result=0;
-            ContinuousIndexType idx2(targetIndex2);
-            itk::Vector<float,ImageType::ImageDimension> disp=displacement;
-
-            typename ImageType::PointType p;
-            this->m_targetImage->TransformIndexToPhysicalPoint(targetIndex1,p);
-          
-            this->m_atlasSegmentationImage->TransformPhysicalPointToContinuousIndex(p+disp,idx2);
-            int deformedAtlasSegmentation=-1;
-            if (!this->m_atlasSegmentationInterpolator->IsInsideBuffer(idx2)){
-                for (int d=0;d<ImageType::ImageDimension;++d){
-                    if (idx2[d]>=this->m_atlasSegmentationInterpolator->GetEndContinuousIndex()[d]){
-                        idx2[d]=this->m_atlasSegmentationInterpolator->GetEndContinuousIndex()[d]-0.5;
-                    }
-                    else if (idx2[d]<this->m_atlasSegmentationInterpolator->GetStartContinuousIndex()[d]){
-                        idx2[d]=this->m_atlasSegmentationInterpolator->GetStartContinuousIndex()[d]+0.5;
-                    }
-                }
-            }
-            deformedAtlasSegmentation=int(this->m_atlasSegmentationInterpolator->EvaluateAtContinuousIndex(idx2));
             if (segmentationLabel!=deformedAtlasSegmentation){
-#if 1
                 double dist=this->m_atlasDistanceTransformInterpolators[segmentationLabel]->EvaluateAtContinuousIndex(idx2);       
                 result=std::max(0.0,dist);
-#else
-		double dist=this->m_atlasDistanceTransformInterpolators[segmentationLabel]->EvaluateAtContinuousIndex(idx2);       
-		double dist2=this->m_atlasDistanceTransformInterpolators[deformedAtlasSegmentation]->Evaluate(p);
-                result=std::max(dist2,dist);
-#endif
             }
 	    ///do not penalize confusion of background and auxiliary label that strongly?
 	    bool auxiliarySegmentation=(this->m_nSegmentationLabels>2) && ((segmentationLabel == this->m_auxiliaryLabel && deformedAtlasSegmentation == 0 ) || (deformedAtlasSegmentation == this->m_auxiliaryLabel && segmentationLabel == 0));
@@ -404,27 +400,8 @@ namespace SRS{
         itkNewMacro(Self);
 
         //edge from registration to segmentation
-        inline virtual  double getPotential(IndexType targetIndex1, IndexType targetIndex2,LabelType displacement, int segmentationLabel){
+        inline virtual double getDeformedPotential(const ContinuousIndexType & idx2, int deformedAtlasSegmentation, int segmentationLabel){
             double result=0;
-            ContinuousIndexType idx2(targetIndex2);
-            itk::Vector<float,ImageType::ImageDimension> disp=displacement;
-
-            typename ImageType::PointType p;
-            this->m_targetImage->TransformIndexToPhysicalPoint(targetIndex1,p);
-            p +=disp;//+this->m_baseLabelMap->GetPixel(targetIndex1);
-            this->m_atlasSegmentationImage->TransformPhysicalPointToContinuousIndex(p,idx2);
-            int deformedAtlasSegmentation=-1;
-            if (!this->m_atlasSegmentationInterpolator->IsInsideBuffer(idx2)){
-                for (int d=0;d<ImageType::ImageDimension;++d){
-                    if (idx2[d]>=this->m_atlasSegmentationInterpolator->GetEndContinuousIndex()[d]){
-                        idx2[d]=this->m_atlasSegmentationInterpolator->GetEndContinuousIndex()[d]-0.5;
-                    }
-                    else if (idx2[d]<this->m_atlasSegmentationInterpolator->GetStartContinuousIndex()[d]){
-                        idx2[d]=this->m_atlasSegmentationInterpolator->GetStartContinuousIndex()[d]+0.5;
-                    }
-                }
-            }
-            deformedAtlasSegmentation=int(this->m_atlasSegmentationInterpolator->EvaluateAtContinuousIndex(idx2));
             if (segmentationLabel!=deformedAtlasSegmentation){ 
                 double dist=this->m_atlasDistanceTransformInterpolators[segmentationLabel]->EvaluateAtContinuousIndex(idx2);
                 result=dist;//-this->m_minDists[segmentationLabel];
@@ -596,6 +573,14 @@ namespace SRS{
             //LOG<<result<<endl;
             return result;
         }
+        ///the bone coherence deforms with the base label map, so the shared atlas lookup of the base class does not apply
+        virtual void getPotentials(IndexType targetIndex, const std::vector<LabelType> & displacements, int nSegmentationLabels, float * potentials){
+            for (unsigned int l=0;l<displacements.size();++l){
+                for (int s=0;s<nSegmentationLabels;++s){
+                    potentials[l*nSegmentationLabels+s]=getPotential(targetIndex,targetIndex,displacements[l],s);
+                }
+            }
+        }
     };//class
     template<class TImage>
     class PairwisePotentialCoherenceBinary :public PairwisePotentialCoherence<TImage>{
@@ -648,27 +633,8 @@ namespace SRS{
           
             logResetStage;
         }
-        inline virtual  double getPotential(IndexType targetIndex1, IndexType targetIndex2,LabelType displacement, int segmentationLabel){
+        inline virtual double getDeformedPotential(const ContinuousIndexType & idx2, int deformedAtlasSegmentation, int segmentationLabel){
             double result=0;
-            ContinuousIndexType idx2(targetIndex2);
-            itk::Vector<float,ImageType::ImageDimension> disp=displacement;
-
-            typename ImageType::PointType p;
-            this->m_targetImage->TransformIndexToPhysicalPoint(targetIndex1,p);
-            p +=disp;//+this->m_baseLabelMap->GetPixel(targetIndex1);
-            this->m_atlasSegmentationImage->TransformPhysicalPointToContinuousIndex(p,idx2);
-            int deformedAtlasSegmentation=-1;
-            if (!this->m_atlasSegmentationInterpolator->IsInsideBuffer(idx2)){
-                for (int d=0;d<ImageType::ImageDimension;++d){
-                    if (idx2[d]>=this->m_atlasSegmentationInterpolator->GetEndContinuousIndex()[d]){
-                        idx2[d]=this->m_atlasSegmentationInterpolator->GetEndContinuousIndex()[d]-0.5;
-                    }
-                    else if (idx2[d]<this->m_atlasSegmentationInterpolator->GetStartContinuousIndex()[d]){
-                        idx2[d]=this->m_atlasSegmentationInterpolator->GetStartContinuousIndex()[d]+0.5;
-                    }
-                }
-            }
-            deformedAtlasSegmentation=int(this->m_atlasSegmentationInterpolator->EvaluateAtContinuousIndex(idx2));
             if (segmentationLabel!=deformedAtlasSegmentation){ 
                 result=1;
             }
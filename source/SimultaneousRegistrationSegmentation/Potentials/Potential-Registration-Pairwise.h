@@ -76,7 +76,18 @@ namespace SRS{
             //m_maxDist=sqrt(m_maxDist);
         }
         virtual void setFullRegularization(bool b){ m_fullRegPairwise = b; }
-        inline double getPotential(PointType pt1, PointType pt2,DisplacementType displacement1, DisplacementType displacement2){
+
+        ///shape of the potential as a function of the displacement difference displacement1-displacement2.
+        ///DIST_NONE if the potential depends on more than the difference, eg. with full regularization, where the base displacements are added
+        enum DistanceType {DIST_NONE, DIST_L1, DIST_L2, DIST_SQUAREDL2};
+        virtual DistanceType getDistanceType(){return m_fullRegPairwise?DIST_NONE:DIST_L2;}
+        ///potentials are truncated at this value, infinity without threshold
+        double getTruncation(){
+            if (m_threshold<numeric_limits<double>::max())
+                return m_maxDist*m_threshold;
+            return numeric_limits<double>::infinity();
+        }
+        inline virtual double getPotential(PointType pt1, PointType pt2,DisplacementType displacement1, DisplacementType displacement2){
             assert(m_haveDisplacementMap);
             double result=0;
             IndexType targetIndex1, targetIndex2;
@@ -196,6 +207,8 @@ namespace SRS{
         itkNewMacro(Self);
         /** Standard part of every itk Object. */
         itkTypeMacro(RegistrationPairwisePotentialSigmoid, Object);
+        typedef typename PairwisePotentialRegistration<TImage>::DistanceType DistanceType;
+        virtual DistanceType getDistanceType(){return this->DIST_NONE;}
 
    
         
@@ -254,10 +267,12 @@ namespace SRS{
         itkNewMacro(Self);
         /** Standard part of every itk Object. */
         itkTypeMacro(RegistrationPairwisePotentialSigmoid, Object);
+        typedef typename PairwisePotentialRegistration<TImage>::DistanceType DistanceType;
+        virtual DistanceType getDistanceType(){return this->m_fullRegPairwise?this->DIST_NONE:this->DIST_L1;}
 
    
         
-     inline double getPotential(PointType pt1, PointType pt2,DisplacementType displacement1, DisplacementType displacement2){
+     inline virtual double getPotential(PointType pt1, PointType pt2,DisplacementType displacement1, DisplacementType displacement2){
 
             double result=0;
             IndexType targetIndex1, targetIndex2;
@@ -290,6 +305,44 @@ namespace SRS{
         }
     };//class
 
+    template<class TImage>
+    class PairwisePotentialRegistrationSquaredL2 : public PairwisePotentialRegistration<TImage>{
+    public:
+        //itk declarations
+        typedef PairwisePotentialRegistrationSquaredL2            Self;
+        typedef itk::SmartPointer<Self>        Pointer;
+        typedef itk::SmartPointer<const Self>  ConstPointer;
+
+        typedef	TImage ImageType;
+        static const unsigned int D=ImageType::ImageDimension;
+        typedef typename TransfUtils<ImageType>::DisplacementType DisplacementType;
+        typedef typename ImageType::IndexType IndexType;
+        typedef typename ImageType::PointType PointType;
+        typedef typename PairwisePotentialRegistration<TImage>::DistanceType DistanceType;
+
+    public:
+        /** Method for creation through the object factory. */
+        itkNewMacro(Self);
+        /** Standard part of every itk Object. */
+        itkTypeMacro(RegistrationPairwisePotentialSquaredL2, Object);
+        virtual DistanceType getDistanceType(){return this->m_fullRegPairwise?this->DIST_NONE:this->DIST_SQUAREDL2;}
+
+        inline virtual double getPotential(PointType pt1, PointType pt2,DisplacementType displacement1, DisplacementType displacement2){
+            if (this->m_fullRegPairwise){
+                IndexType targetIndex1, targetIndex2;
+                this->m_baseDisplacementMap->TransformPhysicalPointToIndex(pt1,targetIndex1);
+                this->m_baseDisplacementMap->TransformPhysicalPointToIndex(pt2,targetIndex2);
+                displacement1+=this->m_baseDisplacementMap->GetPixel(targetIndex1);
+                displacement2+=this->m_baseDisplacementMap->GetPixel(targetIndex2);
+            }
+            double result=(displacement1-displacement2).GetSquaredNorm();
+            if (this->m_threshold<numeric_limits<double>::max()){
+                result=min(this->m_maxDist*this->m_threshold,(result));
+            }
+            return (result);
+        }
+    };//class
+
     template<class TImage>
     class PairwisePotentialRegistrationACP : public PairwisePotentialRegistration<TImage>{
     public:
@@ -319,10 +372,12 @@ namespace SRS{
         itkNewMacro(Self);
         /** Standard part of every itk Object. */
         itkTypeMacro(RegistrationPairwisePotentialSigmoid, Object);
+        typedef typename PairwisePotentialRegistration<TImage>::DistanceType DistanceType;
+        virtual DistanceType getDistanceType(){return this->DIST_NONE;}
 
    
         
-        inline double getPotential(PointType pt1, PointType pt2,DisplacementType displacement1, DisplacementType displacement2){
+        inline virtual double getPotential(PointType pt1, PointType pt2,DisplacementType displacement1, DisplacementType displacement2){
             assert(this->m_haveDisplacementMap);
             double leftCost=0, rightCost=0;
             double controlPointDistance=0.0;
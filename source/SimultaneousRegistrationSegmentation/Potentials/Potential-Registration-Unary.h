@@ -16,11 +16,13 @@
 #include "itkNearestNeighborInterpolateImageFunction.h"
 #include "itkConstNeighborhoodIterator.h"
 #include <itkVectorLinearInterpolateImageFunction.h>
+#include "itkVectorLinearInterpolateNearestNeighborExtrapolateImageFunction.h"
 #include <itkVectorResampleImageFilter.h>
 #include "itkTranslationTransform.h"
 #include "TransformationUtils.h"
 #include "Log.h"
 #include <limits>
+#include <algorithm>
 #include "itkNormalizedMutualInformationHistogramImageToImageMetric.h"
 #include "itkMattesMutualInformationImageToImageMetric.h"
 #include "itkHistogram.h"
@@ -33,6 +35,7 @@
 #include "itkPointsLocator.h"
 #include "itkSignedMaurerDistanceMapImageFilter.h"
 #include "SegmentationMapper.hxx"
+#include "ImagePyramid.h"
 
 namespace SRS{
 
@@ -85,6 +88,10 @@ namespace SRS{
         bool m_useGradient;
         double m_alpha;
         bool m_normalizeImages;
+        ///pyramids of the caller, used if they were built from the images this potential uses
+        ImagePyramid<ImageType> * m_sharedTargetPyramid, * m_sharedAtlasPyramid;
+        ///own pyramids for derived (normalized, gradient, label) images, kept across levels
+        ImagePyramid<ImageType> m_targetPyramid, m_atlasPyramid, m_atlasMaskPyramid;
     public:
         /** Method for creation through the object factory. */
         itkNewMacro(Self);
@@ -106,6 +113,8 @@ namespace SRS{
             m_useGradient=false;
             m_alpha=0.0;
             m_normalizeImages=0.0;
+            m_sharedTargetPyramid=NULL;
+            m_sharedAtlasPyramid=NULL;
         }
         ~UnaryPotentialRegistrationNCC(){
             //delete nIt;
@@ -115,6 +124,16 @@ namespace SRS{
         virtual void Compute(){}
         virtual void setDisplacements(std::vector<DisplacementType> displacements){}
         virtual void setCoarseImage(ImagePointerType img){}
+        ///restrict potential caching to coarse grid nodes which are nonzero in mask (same geometry as the coarse image)
+        virtual void setActiveCoarseNodes(ImagePointerType mask){}
+        ///node-major potentials of all displacements, block[i*displacements.size()+l] for node coarseIndices[i] and displacement l.
+        ///if nodeScales is not empty, node i is evaluated with the displacements scaled by nodeScales[i] (adaptive label sets).
+        ///returns false if the potential can only be cached displacement by displacement
+        virtual bool computePotentialBlock(const std::vector<IndexType> & coarseIndices, const std::vector<DisplacementType> & displacements, const std::vector<float> & nodeScales, std::vector<float> & block){return false;}
+        ///state carried from one computation of the potentials to the next (average potential used for normalization across levels),
+        ///restored when the potentials are loaded from the persistent cache instead of being computed
+        virtual double getNormalizationState(){return 0.0;}
+        virtual void setNormalizationState(double s){}
         virtual void setThreshold(double t){m_threshold=t;}
         virtual void setLogPotential(bool b){LOGPOTENTIAL=b;}
         virtual void setNoOutsidePolicy(bool b){ m_noOutSidePolicy = b;}
@@ -124,10 +143,10 @@ namespace SRS{
             assert(m_targetImage);
             assert(m_atlasImage);
             if ( m_scale!=1.0){
-                m_scaledTargetImage=FilterUtils<ImageType>::LinearResample(m_targetImage,m_scale,true);
-                m_scaledAtlasImage=FilterUtils<ImageType>::LinearResample(m_atlasImage,m_scale,true);
+                m_scaledTargetImage=getScaledImage(m_sharedTargetPyramid,m_targetPyramid,m_targetImage,false);
+                m_scaledAtlasImage=getScaledImage(m_sharedAtlasPyramid,m_atlasPyramid,m_atlasImage,false);
                 if (m_atlasMaskImage.IsNotNull()){
-                    m_scaledAtlasMaskImage=FilterUtils<ImageType>::NNResample(m_atlasMaskImage,m_scale,false);                }
+                    m_scaledAtlasMaskImage=getScaledImage(NULL,m_atlasMaskPyramid,m_atlasMaskImage,true);                }
             }else{
                 m_scaledTargetImage=m_targetImage;
                 m_scaledAtlasImage=m_atlasImage;
@@ -149,6 +168,21 @@ namespace SRS{
         
         virtual void freeMemory(){
         }
+        ///resample target and atlas from the given pyramids instead of resampling them from the full resolution images at every level
+        void SetImagePyramids(ImagePyramid<ImageType> * targetPyramid, ImagePyramid<ImageType> * atlasPyramid){
+            m_sharedTargetPyramid=targetPyramid;
+            m_sharedAtlasPyramid=atlasPyramid;
+        }
+        ///img at the current scale. taken from the shared pyramid if it holds the same image (and linear resampling is requested),
+        ///otherwise from the own pyramid, so that each level is still only computed once
+        ConstImagePointerType getScaledImage(ImagePyramid<ImageType> * shared, ImagePyramid<ImageType> & own, ConstImagePointerType img, bool nnResample){
+            if (shared && !nnResample && shared->getImage()==img)
+                return shared->getLevel(m_scale);
+            own.setImage(img,nnResample);
+            if (shared)
+                own.setScales(shared->getScales());
+            return own.getLevel(m_scale);
+        }
         void SetScale(double s){
             this->m_scale=s;
             this->m_scaleITK.Fill(s); 
@@ -420,6 +454,8 @@ namespace SRS{
         DisplacementType m_currentActiveDisplacement;
         FloatImagePointerType m_currentCachedPotentials;
         ImagePointerType m_coarseImage,m_deformedAtlasImage,m_deformedMask;
+        ///optional mask of coarse nodes for which potentials are cached, all nodes if NULL
+        ImagePointerType m_activeCoarseNodes;
         double m_averageFixedPotential,m_oldAveragePotential;
         double m_normalizationFactor;
         bool m_normalize;
@@ -435,7 +471,7 @@ namespace SRS{
             m_normalizationFactor=1.0;
             m_normalize=false;
             m_unaryPotentialWeights=NULL;
-            
+            m_activeCoarseNodes=NULL;
         }
         void SetPotentialWeights(FloatImagePointerType img){m_unaryPotentialWeights=img;}
         void SetAtlasLandmarks(PointsContainerPointer p){m_atlasLandmarks=p;}
@@ -514,6 +550,21 @@ namespace SRS{
             m_normalize=false;
             m_normalizationFactor=1.0;
         }
+        virtual double getNormalizationState(){return m_oldAveragePotential;}
+        virtual void setNormalizationState(double s){
+            m_averageFixedPotential=s;
+            m_oldAveragePotential=s;
+        }
+        ///updates the normalization factor from the average potential of the zero displacement, shared by all potentials derived from this one
+        void updateNormalization(double averagePotential){
+            m_averageFixedPotential=averagePotential;
+            m_normalizationFactor=1.0;
+            if (m_normalize && (m_averageFixedPotential<std::numeric_limits<float>::epsilon())){
+                m_normalizationFactor= m_normalizationFactor*m_oldAveragePotential/m_averageFixedPotential;
+            }
+            LOGV(3)<<VAR(m_normalizationFactor)<<endl;
+            m_oldAveragePotential=m_averageFixedPotential;
+        }
 
         //#define PREDEF
         //#define LOCALSIMS
@@ -594,6 +645,11 @@ namespace SRS{
 #ifndef LOCALSIMS
             for (coarseIterator.GoToBegin();!coarseIterator.IsAtEnd();++coarseIterator,++coarseMaskIterator){
                 IndexType coarseIndex=coarseIterator.GetIndex();
+                //nodes outside of the active region are not part of the graph
+                if (m_activeCoarseNodes.IsNotNull() && !m_activeCoarseNodes->GetPixel(coarseIndex)){
+                    coarseIterator.Set(0.0);
+                    continue;
+                }
                 //if the coarse mask is zero, then all mask pixels in the neighborhood are zero and computing the potential does not make sense :)
                 if (true || coarseMaskIterator.Get()){
                     bool validPotential=true;
@@ -690,14 +746,7 @@ namespace SRS{
 #endif
             //LOG<<VAR(c)<<endl;
             if (computeAverage &&c!=0 ){
-                
-                m_averageFixedPotential/= c;
-                m_normalizationFactor=1.0;
-                if (m_normalize && (m_averageFixedPotential<std::numeric_limits<float>::epsilon())){
-                    m_normalizationFactor= m_normalizationFactor*m_oldAveragePotential/m_averageFixedPotential;
-                }
-                LOGV(3)<<VAR(m_normalizationFactor)<<endl;
-                m_oldAveragePotential=m_averageFixedPotential;
+                updateNormalization(m_averageFixedPotential/c);
             }
             m_currentCachedPotentials=pot;
             m_currentActiveDisplacement=displacement;
@@ -709,6 +758,129 @@ namespace SRS{
             m_displacements=displacements;
         }
         void setCoarseImage(ImagePointerType img){m_coarseImage=img;}
+        void setActiveCoarseNodes(ImagePointerType mask){m_activeCoarseNodes=mask;}
+
+        ///same potentials as cachePotentials followed by getPotential, but evaluated node by node for all displacements.
+        ///instead of warping the whole atlas once per displacement, the atlas is sampled only in the patch of each node,
+        ///where the target patch is gathered once and reused for all displacements. nodes are processed in parallel.
+        virtual bool computePotentialBlock(const std::vector<IndexType> & coarseIndices, const std::vector<DisplacementType> & displacements, const std::vector<float> & nodeScales, std::vector<float> & block){
+            //landmark terms need the composed deformation at the landmarks, they are only computed by cachePotentials
+            if (this->m_alpha>0.0 && m_atlasLandmarks.IsNotNull() && m_targetLandmarks.IsNotNull())
+                return false;
+            int nNodes=coarseIndices.size();
+            int nLabels=displacements.size();
+            block.resize((size_t)nNodes*nLabels);
+            //displacement independent parts of cachePotentials: the atlas mask is warped with the base deformation only,
+            //and points outside of the atlas get its minimum
+            ImagePointerType deformedMask=NULL;
+            if (this->m_scaledAtlasMaskImage.IsNotNull())
+                deformedMask=TransfUtils<ImageType>::warpImage(this->m_scaledAtlasMaskImage,this->m_baseDisplacementMap,true);
+            PixelType fillValue=FilterUtils<ImageType>::getMin(this->m_scaledAtlasImage);
+            typedef itk::VectorLinearInterpolateNearestNeighborExtrapolateImageFunction<DisplacementImageType,double> BaseInterpolatorType;
+            typename BaseInterpolatorType::Pointer baseInterpolator=BaseInterpolatorType::New();
+            baseInterpolator->SetInputImage(this->m_baseDisplacementMap);
+            ConstImagePointerType target=this->m_scaledTargetImage;
+            typename ImageType::RegionType targetRegion=target->GetLargestPossibleRegion();
+            RadiusType radius=this->m_scaledRadius;
+            int patchSize=this->nIt.Size();
+            DisplacementType zeroDisp;
+            zeroDisp.Fill(0.0);
+            int zeroLabel=-1;
+            for (int l=0;l<nLabels;++l){
+                if (displacements[l]==zeroDisp)
+                    zeroLabel=l;
+            }
+            double zeroSum=0.0;
+            int zeroCount=0;
+#pragma omp parallel
+            {
+                std::vector<double> f(patchSize);
+                std::vector<PointType> points(patchSize);
+                std::vector<char> inBounds(patchSize),masked(patchSize);
+#pragma omp for schedule(dynamic,16) reduction(+:zeroSum,zeroCount)
+                for (int n=0;n<nNodes;++n){
+                    PointType point;
+                    m_coarseImage->TransformIndexToPhysicalPoint(coarseIndices[n],point);
+                    IndexType targetIndex;
+                    target->TransformPhysicalPointToIndex(point,targetIndex);
+                    double weight=1.0;
+                    if (m_unaryPotentialWeights.IsNotNull()){
+                        IndexType weightIndex;
+                        m_unaryPotentialWeights->TransformPhysicalPointToIndex(point,weightIndex);
+                        weight=m_unaryPotentialWeights->GetPixel(weightIndex);
+                    }
+                    //target patch, in the order of the neighborhood iterator
+                    for (int i=0;i<patchSize;++i){
+                        IndexType neighborIndex;
+                        int rest=i;
+                        for (int d=0;d<D;++d){
+                            int width=2*radius[d]+1;
+                            neighborIndex[d]=targetIndex[d]+rest%width-(int)radius[d];
+                            rest/=width;
+                        }
+                        inBounds[i]=targetRegion.IsInside(neighborIndex);
+                        if (!inBounds[i])
+                            continue;
+                        f[i]=target->GetPixel(neighborIndex);
+                        target->TransformIndexToPhysicalPoint(neighborIndex,points[i]);
+                        masked[i]=deformedMask.IsNotNull() && !deformedMask->GetPixel(neighborIndex);
+                    }
+                    double nodeScale=nodeScales.empty()?1.0:nodeScales[n];
+                    for (int l=0;l<nLabels;++l){
+                        DisplacementType displacement=displacements[l]*nodeScale;
+                        double localPot=0;
+                        if (this->m_alpha<1.0){
+                            double insideCount=0.0;
+                            double count=0;
+                            double sff=0.0,smm=0.0,sfm=0.0,sf=0.0,sm=0.0;
+                            for (int i=0;i<patchSize;++i){
+                                if (!inBounds[i])
+                                    continue;
+                                insideCount+=1;
+                                //atlas warped with the base deformation composed with the displacement, see TransfUtils::composeDeformations
+                                PointType p=points[i];
+                                p+=displacement;
+                                typename BaseInterpolatorType::OutputType base=baseInterpolator->Evaluate(p);
+                                DisplacementType composed;
+                                for (int d=0;d<D;++d)
+                                    composed[d]=base[d]+displacement[d];
+                                p=points[i];
+                                p+=composed;
+                                ContinuousIndexType idx;
+                                this->m_scaledAtlasImage->TransformPhysicalPointToContinuousIndex(p,idx);
+                                bool insideAtlas=this->m_atlasInterpolator->IsInsideBuffer(idx);
+                                double m=insideAtlas?(PixelType)this->m_atlasInterpolator->Evaluate(p):fillValue;
+                                bool inside=deformedMask.IsNotNull()?!masked[i]:insideAtlas;
+                                if (!inside)
+                                    m=0.0;
+                                if (inside || this->m_noOutSidePolicy){
+                                    sff+=f[i]*f[i];
+                                    smm+=m*m;
+                                    sfm+=f[i]*m;
+                                    sf+=f[i];
+                                    sm+=m;
+                                    count+=1;
+                                }
+                            }
+                            localPot=(1.0-this->m_alpha)*weight*potentialFromStatistics(count,insideCount,sff,smm,sfm,sf,sm);
+                        }
+                        block[(size_t)n*nLabels+l]=localPot;
+                        if (l==zeroLabel){
+                            zeroSum+=localPot;
+                            ++zeroCount;
+                        }
+                    }
+                }
+            }
+            if (zeroCount){
+                updateNormalization(zeroSum/zeroCount);
+            }
+            if (m_normalizationFactor!=1.0){
+                for (size_t i=0;i<block.size();++i)
+                    block[i]*=m_normalizationFactor;
+            }
+            return true;
+        }
 
         virtual double getPotential(IndexType coarseIndex, unsigned int displacementDisplacement){
             //LOG<<"DEPRECATED BEHAVIOUR!"<<endl;
@@ -760,6 +932,14 @@ namespace SRS{
 
                 }
             }
+            result=potentialFromStatistics(count,insideCount,sff,smm,sfm,sf,sm);
+            LOGV(15)<<VAR(result)<<" "<< VAR(this->nIt.Size()) << std::endl;
+            return result;
+        }
+
+        ///potential of a patch from its NCC sums over count pixels, scaled by the fraction insideCount of the patch inside the image
+        inline double potentialFromStatistics(double count, double insideCount, double sff, double smm, double sfm, double sf, double sm){
+            double result;
             double NCC=0;
             if (count){
                 sff -= ( sf * sf / count );
@@ -784,7 +964,6 @@ namespace SRS{
                 return 1e10*count/insideCount;
             } 
 #endif     
-            LOGV(15)<<VAR(result*insideCount/this->nIt.Size())<<" "<< VAR(this->nIt.Size()) << std::endl;
             return result*insideCount/this->nIt.Size();
         }
     };//FastUnaryPotentialRegistrationNCC
@@ -827,6 +1006,8 @@ namespace SRS{
         itkNewMacro(Self);
         /** Standard part of every itk Object. */
         itkTypeMacro(FastRegistrationUnaryPotentialSAD, Object);
+        ///the batched evaluation only implements the NCC statistics, potentials are cached displacement by displacement
+        virtual bool computePotentialBlock(const std::vector<IndexType> & coarseIndices, const std::vector<DisplacementType> & displacements, const std::vector<float> & nodeScales, std::vector<float> & block){return false;}
         
         virtual FloatImagePointerType localPotentials(ImagePointerType i1, ImagePointerType i2){
             return Metrics<ImageType,FloatImageType,float>::LSAD(i1,i2,i1->GetSpacing()[0]);
@@ -918,6 +1099,8 @@ namespace SRS{
         itkNewMacro(Self);
         /** Standard part of every itk Object. */
         itkTypeMacro(FastRegistrationUnaryPotentialSSD, Object);
+        ///the batched evaluation only implements the NCC statistics, potentials are cached displacement by displacement
+        virtual bool computePotentialBlock(const std::vector<IndexType> & coarseIndices, const std::vector<DisplacementType> & displacements, const std::vector<float> & nodeScales, std::vector<float> & block){return false;}
         virtual FloatImagePointerType localPotentials(ImagePointerType i1, ImagePointerType i2){
             //return Metrics<ImageType,FloatImageType,float>::LSSD(i1,i2,i1->GetSpacing()[0]);
             return Metrics<ImageType,FloatImageType,float>::integralSSD(i1,i2);
@@ -966,6 +1149,381 @@ namespace SRS{
     };//FastUnaryPotentialRegistrationSSD
 
 
+  /** \brief
+   * Local mutual information registration potential (entropy correlation coefficient of the patch joint histogram).
+   * Target and atlas are quantized once into bin indices, the atlas is sampled with nearest neighbor lookups into its bin image.
+   * cachePotentials slides the joint histogram along the rows of the coarse grid, computePotentialBlock evaluates all displacements
+   * of a node against the target patch marginal, which is computed once per node. Landmark terms are not supported.
+   */
+    template<class TImage>
+    class FastUnaryPotentialRegistrationLocalMI: public FastUnaryPotentialRegistrationNCC<TImage> {
+    public:
+        //itk declarations
+        typedef FastUnaryPotentialRegistrationLocalMI            Self;
+        typedef itk::SmartPointer<Self>        Pointer;
+        typedef itk::SmartPointer<const Self>  ConstPointer;
+        typedef FastUnaryPotentialRegistrationNCC<TImage> Superclass;
+
+        typedef	TImage ImageType;
+        typedef typename ImageType::Pointer ImagePointerType;
+        typedef typename ImageType::ConstPointer ConstImagePointerType;
+        static const int D=ImageType::ImageDimension;
+
+        typedef typename TransfUtils<ImageType>::DisplacementType DisplacementType;
+        typedef typename ImageType::IndexType IndexType;
+        typedef typename ImageType::PointType PointType;
+        typedef typename ImageType::PixelType PixelType;
+        typedef typename ImageType::RegionType RegionType;
+        typedef typename ImageType::SizeType SizeType;
+
+        typedef typename TransfUtils<ImageType>::DeformationFieldType DisplacementImageType;
+        typedef typename TransfUtils<ImageType>::DeformationFieldPointerType DisplacementImagePointerType;
+        typedef typename ImageUtils<ImageType>::FloatImageType FloatImageType;
+        typedef typename FloatImageType::Pointer FloatImagePointerType;
+        typedef typename itk::ImageRegionIteratorWithIndex<FloatImageType> FloatImageIteratorType;
+        typedef itk::VectorLinearInterpolateNearestNeighborExtrapolateImageFunction<DisplacementImageType,double> BaseInterpolatorType;
+
+    protected:
+        int m_numberOfBins;
+        ///bin index of every pixel of the scaled target and atlas images, in buffer order
+        std::vector<unsigned char> m_targetBins, m_atlasBins;
+        ///n*log(n) for all counts up to the patch size
+        std::vector<double> m_nLogN;
+    public:
+        /** Method for creation through the object factory. */
+        itkNewMacro(Self);
+        /** Standard part of every itk Object. */
+        itkTypeMacro(FastRegistrationUnaryPotentialLocalMI, Object);
+
+        FastUnaryPotentialRegistrationLocalMI():Superclass(){
+            m_numberOfBins=32;
+        }
+        ///number of intensity bins per image, at most 256
+        void setNumberOfBins(int b){m_numberOfBins=max(2,min(b,256));}
+
+        virtual void Init(){
+            Superclass::Init();
+            quantize(this->m_scaledTargetImage,m_targetBins);
+            quantize(this->m_scaledAtlasImage,m_atlasBins);
+            int patchSize=this->nIt.Size();
+            m_nLogN.resize(patchSize+1);
+            m_nLogN[0]=0.0;
+            for (int n=1;n<=patchSize;++n)
+                m_nLogN[n]=n*log(1.0*n);
+            LOGV(2)<<"Quantized target and atlas to "<<m_numberOfBins<<" bins for local mutual information"<<endl;
+        }
+
+        ///potentials of all coarse nodes for one displacement. the atlas bin of every target pixel is looked up once,
+        ///then the joint histogram of the patch is updated incrementally from one node to the next along the first axis
+        void cachePotentials(DisplacementType displacement){
+            LOGV(15)<<"Caching local MI registration unary potential for displacement "<<displacement<<endl;
+            DisplacementType zeroDisp;
+            zeroDisp.Fill(0.0);
+            bool computeAverage=(displacement == zeroDisp);
+            ConstImagePointerType target=this->m_scaledTargetImage;
+            RegionType targetRegion=target->GetLargestPossibleRegion();
+            long int nPixels=targetRegion.GetNumberOfPixels();
+
+            DisplacementImagePointerType translation=TransfUtils<ImageType>::createEmpty(this->m_baseDisplacementMap);
+            translation->FillBuffer( displacement);
+            DisplacementImagePointerType composedDeformation=TransfUtils<ImageType>::composeDeformations(translation,this->m_baseDisplacementMap);
+            ImagePointerType deformedMask=NULL;
+            if (this->m_scaledAtlasMaskImage.IsNotNull())
+                deformedMask=TransfUtils<ImageType>::warpImage(this->m_scaledAtlasMaskImage,this->m_baseDisplacementMap,true);
+
+            //atlas bin of each target pixel, -1 outside of the atlas or its mask
+            std::vector<short> warpedBins(nPixels);
+#pragma omp parallel for
+            for (long int i=0;i<nPixels;++i){
+                IndexType idx=target->ComputeIndex(i);
+                PointType p;
+                target->TransformIndexToPhysicalPoint(idx,p);
+                p+=composedDeformation->GetPixel(idx);
+                warpedBins[i]=atlasBin(p);
+                if (deformedMask.IsNotNull() && !deformedMask->GetPixel(idx))
+                    warpedBins[i]=-1;
+            }
+
+            FloatImagePointerType pot=FilterUtils<ImageType,FloatImageType>::createEmpty(this->m_coarseImage);
+            pot->FillBuffer(0.0);
+            RegionType coarseRegion=pot->GetLargestPossibleRegion();
+            int rowLength=coarseRegion.GetSize()[0];
+            int nRows=coarseRegion.GetNumberOfPixels()/rowLength;
+            int B=m_numberOfBins;
+            double sum=0.0;
+            int c=0;
+#pragma omp parallel
+            {
+                std::vector<int> joint(B*B),histX(B),histY(B);
+#pragma omp for schedule(dynamic) reduction(+:sum,c)
+                for (int r=0;r<nRows;++r){
+                    std::fill(joint.begin(),joint.end(),0);
+                    std::fill(histX.begin(),histX.end(),0);
+                    std::fill(histY.begin(),histY.end(),0);
+                    int count=0;
+                    bool havePatch=false;
+                    IndexType lo,hi;
+                    for (int x=0;x<rowLength;++x){
+                        IndexType coarseIndex=pot->ComputeIndex((long int)r*rowLength+x);
+                        if (this->m_activeCoarseNodes.IsNotNull() && !this->m_activeCoarseNodes->GetPixel(coarseIndex))
+                            continue;
+                        PointType point;
+                        this->m_coarseImage->TransformIndexToPhysicalPoint(coarseIndex,point);
+                        IndexType targetIndex;
+                        target->TransformPhysicalPointToIndex(point,targetIndex);
+                        IndexType newLo,newHi;
+                        patchBox(targetIndex,targetRegion,newLo,newHi);
+                        bool slide=havePatch && newLo[0]>=lo[0] && newHi[0]>=hi[0];
+                        for (int d=1;d<D && slide;++d)
+                            slide=(newLo[d]==lo[d] && newHi[d]==hi[d]);
+                        if (slide){
+                            //remove the columns which left the patch, add the ones which entered it
+                            count+=addColumns(lo,hi,lo[0],min(hi[0],newLo[0]-1),-1,warpedBins,joint,histX,histY,target);
+                            count+=addColumns(newLo,newHi,max(hi[0]+1,newLo[0]),newHi[0],1,warpedBins,joint,histX,histY,target);
+                        }else{
+                            std::fill(joint.begin(),joint.end(),0);
+                            std::fill(histX.begin(),histX.end(),0);
+                            std::fill(histY.begin(),histY.end(),0);
+                            count=addColumns(newLo,newHi,newLo[0],newHi[0],1,warpedBins,joint,histX,histY,target);
+                        }
+                        lo=newLo;
+                        hi=newHi;
+                        havePatch=true;
+                        double sJoint=0.0,sX=0.0,sY=0.0;
+                        for (int b=0;b<B*B;++b)
+                            sJoint+=m_nLogN[joint[b]];
+                        for (int b=0;b<B;++b){
+                            sX+=m_nLogN[histX[b]];
+                            sY+=m_nLogN[histY[b]];
+                        }
+                        double localPot=(1.0-this->m_alpha)*nodeWeight(point)*potentialFromEntropies(count,boxVolume(newLo,newHi),sJoint,sX,sY);
+                        pot->SetPixel(coarseIndex,localPot);
+                        if (computeAverage){
+                            sum+=localPot;
+                            ++c;
+                        }
+                    }
+                }
+            }
+            if (computeAverage && c!=0){
+                this->updateNormalization(sum/c);
+            }
+            this->m_currentCachedPotentials=pot;
+            this->m_currentActiveDisplacement=displacement;
+        }
+
+        ///same potentials as cachePotentials, evaluated node by node for all displacements.
+        ///the target bins and marginal of a patch are gathered once per node, only the atlas bins are looked up per displacement
+        virtual bool computePotentialBlock(const std::vector<IndexType> & coarseIndices, const std::vector<DisplacementType> & displacements, const std::vector<float> & nodeScales, std::vector<float> & block){
+            int nNodes=coarseIndices.size();
+            int nLabels=displacements.size();
+            block.resize((size_t)nNodes*nLabels);
+            ImagePointerType deformedMask=NULL;
+            if (this->m_scaledAtlasMaskImage.IsNotNull())
+                deformedMask=TransfUtils<ImageType>::warpImage(this->m_scaledAtlasMaskImage,this->m_baseDisplacementMap,true);
+            typename BaseInterpolatorType::Pointer baseInterpolator=BaseInterpolatorType::New();
+            baseInterpolator->SetInputImage(this->m_baseDisplacementMap);
+            ConstImagePointerType target=this->m_scaledTargetImage;
+            RegionType targetRegion=target->GetLargestPossibleRegion();
+            int patchSize=this->nIt.Size();
+            int B=m_numberOfBins;
+            DisplacementType zeroDisp;
+            zeroDisp.Fill(0.0);
+            int zeroLabel=-1;
+            for (int l=0;l<nLabels;++l){
+                if (displacements[l]==zeroDisp)
+                    zeroLabel=l;
+            }
+            double zeroSum=0.0;
+            int zeroCount=0;
+#pragma omp parallel
+            {
+                std::vector<int> joint(B*B),histX(B),histY(B),nodeHistX(B),targetBins(patchSize),atlasBins(patchSize);
+                std::vector<PointType> points(patchSize);
+#pragma omp for schedule(dynamic,16) reduction(+:zeroSum,zeroCount)
+                for (int n=0;n<nNodes;++n){
+                    PointType point;
+                    this->m_coarseImage->TransformIndexToPhysicalPoint(coarseIndices[n],point);
+                    IndexType targetIndex;
+                    target->TransformPhysicalPointToIndex(point,targetIndex);
+                    double weight=nodeWeight(point);
+                    //target patch and its marginal, independent of the displacement
+                    IndexType lo,hi;
+                    patchBox(targetIndex,targetRegion,lo,hi);
+                    int nPatch=0;
+                    std::fill(nodeHistX.begin(),nodeHistX.end(),0);
+                    for (ImageRegionConstIteratorWithIndexType it(target,RegionType(lo,boxSize(lo,hi)));!it.IsAtEnd();++it){
+                        IndexType idx=it.GetIndex();
+                        target->TransformIndexToPhysicalPoint(idx,points[nPatch]);
+                        targetBins[nPatch]=m_targetBins[target->ComputeOffset(idx)];
+                        if (deformedMask.IsNotNull() && !deformedMask->GetPixel(idx))
+                            targetBins[nPatch]=-1;
+                        else
+                            ++nodeHistX[targetBins[nPatch]];
+                        ++nPatch;
+                    }
+                    double nodeSX=0.0;
+                    for (int b=0;b<B;++b)
+                        nodeSX+=m_nLogN[nodeHistX[b]];
+                    double nodeScale=nodeScales.empty()?1.0:nodeScales[n];
+                    for (int l=0;l<nLabels;++l){
+                        DisplacementType displacement=displacements[l]*nodeScale;
+                        double localPot=0;
+                        if (this->m_alpha<1.0){
+                            int count=0;
+                            bool excluded=false;
+                            for (int i=0;i<nPatch;++i){
+                                atlasBins[i]=-1;
+                                if (targetBins[i]<0)
+                                    continue;
+                                //atlas warped with the base deformation composed with the displacement, see TransfUtils::composeDeformations
+                                PointType p=points[i];
+                                p+=displacement;
+                                typename BaseInterpolatorType::OutputType base=baseInterpolator->Evaluate(p);
+                                p=points[i];
+                                for (int d=0;d<D;++d)
+                                    p[d]+=base[d]+displacement[d];
+                                atlasBins[i]=atlasBin(p);
+                                if (atlasBins[i]<0){
+                                    excluded=true;
+                                    continue;
+                                }
+                                ++joint[targetBins[i]*B+atlasBins[i]];
+                                ++histY[atlasBins[i]];
+                                ++count;
+                            }
+                            //n log n sums over the touched bins, resetting them on the way
+                            double sJoint=0.0,sX=nodeSX,sY=0.0;
+                            if (excluded){
+                                for (int i=0;i<nPatch;++i){
+                                    if (atlasBins[i]>=0)
+                                        ++histX[targetBins[i]];
+                                }
+                                sX=0.0;
+                            }
+                            for (int i=0;i<nPatch;++i){
+                                if (atlasBins[i]<0)
+                                    continue;
+                                int & j=joint[targetBins[i]*B+atlasBins[i]];
+                                sJoint+=m_nLogN[j];
+                                j=0;
+                                sY+=m_nLogN[histY[atlasBins[i]]];
+                                histY[atlasBins[i]]=0;
+                                if (excluded){
+                                    sX+=m_nLogN[histX[targetBins[i]]];
+                                    histX[targetBins[i]]=0;
+                                }
+                            }
+                            localPot=(1.0-this->m_alpha)*weight*potentialFromEntropies(count,nPatch,sJoint,sX,sY);
+                        }
+                        block[(size_t)n*nLabels+l]=localPot;
+                        if (l==zeroLabel){
+                            zeroSum+=localPot;
+                            ++zeroCount;
+                        }
+                    }
+                }
+            }
+            if (zeroCount){
+                this->updateNormalization(zeroSum/zeroCount);
+            }
+            if (this->m_normalizationFactor!=1.0){
+                for (size_t i=0;i<block.size();++i)
+                    block[i]*=this->m_normalizationFactor;
+            }
+            return true;
+        }
+
+    protected:
+        typedef itk::ImageRegionConstIteratorWithIndex<ImageType> ImageRegionConstIteratorWithIndexType;
+
+        ///bin indices of all pixels of img, equally spaced between its minimum and maximum
+        void quantize(ConstImagePointerType img, std::vector<unsigned char> & bins){
+            const PixelType * buffer=img->GetBufferPointer();
+            long int nPixels=img->GetLargestPossibleRegion().GetNumberOfPixels();
+            double minVal=std::numeric_limits<double>::max(),maxVal=-std::numeric_limits<double>::max();
+            for (long int i=0;i<nPixels;++i){
+                minVal=min(minVal,(double)buffer[i]);
+                maxVal=max(maxVal,(double)buffer[i]);
+            }
+            double binScale=maxVal>minVal?(m_numberOfBins-1e-6)/(maxVal-minVal):0.0;
+            bins.resize(nPixels);
+            for (long int i=0;i<nPixels;++i)
+                bins[i]=(unsigned char)((buffer[i]-minVal)*binScale);
+        }
+        ///bin of the atlas pixel nearest to p, -1 if p is outside of the atlas
+        inline short atlasBin(const PointType & p) const{
+            IndexType idx;
+            if (!this->m_scaledAtlasImage->TransformPhysicalPointToIndex(p,idx))
+                return -1;
+            return m_atlasBins[this->m_scaledAtlasImage->ComputeOffset(idx)];
+        }
+        ///corners of the patch around targetIndex, clipped to the target region
+        inline void patchBox(const IndexType & targetIndex, const RegionType & region, IndexType & lo, IndexType & hi) const{
+            for (int d=0;d<D;++d){
+                lo[d]=max(targetIndex[d]-(long int)this->m_scaledRadius[d],region.GetIndex()[d]);
+                hi[d]=min(targetIndex[d]+(long int)this->m_scaledRadius[d],region.GetIndex()[d]+(long int)region.GetSize()[d]-1);
+            }
+        }
+        inline SizeType boxSize(const IndexType & lo, const IndexType & hi) const{
+            SizeType size;
+            for (int d=0;d<D;++d)
+                size[d]=max(hi[d]-lo[d]+1,0L);
+            return size;
+        }
+        inline int boxVolume(const IndexType & lo, const IndexType & hi) const{
+            int v=1;
+            for (int d=0;d<D;++d)
+                v*=max(hi[d]-lo[d]+1,0L);
+            return v;
+        }
+        ///adds sign times the pixels of the box [lo,hi] with first coordinate in [x0,x1] to the histograms, returns the change of the sample count
+        int addColumns(const IndexType & lo, const IndexType & hi, long int x0, long int x1, int sign, const std::vector<short> & warpedBins,
+                       std::vector<int> & joint, std::vector<int> & histX, std::vector<int> & histY, ConstImagePointerType target){
+            if (x1<x0)
+                return 0;
+            IndexType columnsLo=lo,columnsHi=hi;
+            columnsLo[0]=x0;
+            columnsHi[0]=x1;
+            int count=0;
+            for (ImageRegionConstIteratorWithIndexType it(target,RegionType(columnsLo,boxSize(columnsLo,columnsHi)));!it.IsAtEnd();++it){
+                long int offset=target->ComputeOffset(it.GetIndex());
+                short a=warpedBins[offset];
+                if (a<0)
+                    continue;
+                int t=m_targetBins[offset];
+                joint[t*m_numberOfBins+a]+=sign;
+                histX[t]+=sign;
+                histY[a]+=sign;
+                count+=sign;
+            }
+            return count;
+        }
+        inline double nodeWeight(const PointType & point){
+            if (this->m_unaryPotentialWeights.IsNull())
+                return 1.0;
+            IndexType weightIndex;
+            this->m_unaryPotentialWeights->TransformPhysicalPointToIndex(point,weightIndex);
+            return this->m_unaryPotentialWeights->GetPixel(weightIndex);
+        }
+        ///1-ECC of a patch from the n*log(n) sums of its joint and marginal histograms over count samples,
+        ///scaled by the fraction of the patch inside the image like the NCC potential
+        inline double potentialFromEntropies(int count, int insideCount, double sJoint, double sX, double sY){
+            double ECC=0.0;
+            if (count>0){
+                double logN=log(1.0*count);
+                double entropyX=logN-sX/count;
+                double entropyY=logN-sY/count;
+                double jointEntropy=logN-sJoint/count;
+                if (entropyX+entropyY>0.0)
+                    ECC=2.0-2.0*jointEntropy/(entropyX+entropyY);
+            }
+            double result=min(this->m_threshold,1.0-ECC);
+            return result*insideCount/this->nIt.Size();
+        }
+    };//FastUnaryPotentialRegistrationLocalMI
+
+
 #define NMI
     template<class TImage>
     class FastUnaryPotentialRegistrationNMI: public UnaryPotentialRegistrationNCC<TImage> {
@@ -1130,7 +1688,7 @@ namespace SRS{
         }
         inline double getLocalPotential(IndexType targetIndex){
 #if 1
-            //use ITK (SLOW!!!)
+            //use ITK (SLOW!!!), FastUnaryPotentialRegistrationLocalMI computes the same measure natively
             typedef itk::IdentityTransform<double,ImageType::ImageDimension> TransType;
             typename TransType::Pointer t=TransType::New();
             IndexType cornerIndex=targetIndex-this->m_scaledRadius;
@@ -1479,6 +2037,8 @@ namespace SRS{
         itkNewMacro(Self);
         /** Standard part of every itk Object. */
         itkTypeMacro(FastRegistrationUnaryPotentialCategorical, Object);
+        ///the batched evaluation only implements the NCC statistics, potentials are cached displacement by displacement
+        virtual bool computePotentialBlock(const std::vector<IndexType> & coarseIndices, const std::vector<DisplacementType> & displacements, const std::vector<float> & nodeScales, std::vector<float> & block){return false;}
         
      
         virtual void compute(){
@@ -1561,6 +2121,11 @@ namespace SRS{
             int c=0;
             for (coarseIterator.GoToBegin();!coarseIterator.IsAtEnd();++coarseIterator,++coarseMaskIterator){
                 IndexType coarseIndex=coarseIterator.GetIndex();
+                //nodes outside of the active region are not part of the graph
+                if (this->m_activeCoarseNodes.IsNotNull() && !this->m_activeCoarseNodes->GetPixel(coarseIndex)){
+                    coarseIterator.Set(0.0);
+                    continue;
+                }
                 //if the coarse mask is zero, then all mask pixels in the neighborhood are zero and computing the potential does not make sense :)
                 if (coarseMaskIterator.Get()){
                     bool validPotential=true;
@@ -1663,11 +2228,11 @@ namespace SRS{
             assert(this->m_targetImage);
             assert(this->m_atlasImage);
             if ( this->m_scale!=1.0){
-                this->m_scaledTargetImage=FilterUtils<ImageType>::NNResample(this->m_targetImage,this->m_scale,false);
-                this->m_scaledAtlasImage=FilterUtils<ImageType>::NNResample(this->m_atlasImage,this->m_scale,false);
+                this->m_scaledTargetImage=this->getScaledImage(this->m_sharedTargetPyramid,this->m_targetPyramid,this->m_targetImage,true);
+                this->m_scaledAtlasImage=this->getScaledImage(this->m_sharedAtlasPyramid,this->m_atlasPyramid,this->m_atlasImage,true);
               
                 if (this->m_atlasMaskImage.IsNotNull()){
-                    this->m_scaledAtlasMaskImage=FilterUtils<ImageType>::NNResample(this->m_atlasMaskImage,this->m_scale,false);                }
+                    this->m_scaledAtlasMaskImage=this->getScaledImage(NULL,this->m_atlasMaskPyramid,this->m_atlasMaskImage,true);                }
             }else{
                 this->m_scaledTargetImage=this->m_targetImage;
                 this->m_scaledAtlasImage=this->m_atlasImage;
@@ -1798,11 +2363,11 @@ namespace SRS{
             assert(this->m_targetImage);
             assert(this->m_atlasImage);
             if ( this->m_scale!=1.0){
-                this->m_scaledTargetImage=FilterUtils<ImageType>::NNResample(this->m_targetImage,this->m_scale,false);
+                this->m_scaledTargetImage=this->getScaledImage(this->m_sharedTargetPyramid,this->m_targetPyramid,this->m_targetImage,true);
                 
-                this->m_scaledAtlasImage=FilterUtils<ImageType>::NNResample(this->m_atlasImage,this->m_scale,false);
+                this->m_scaledAtlasImage=this->getScaledImage(this->m_sharedAtlasPyramid,this->m_atlasPyramid,this->m_atlasImage,true);
                 if (this->m_atlasMaskImage.IsNotNull()){
-                    this->m_scaledAtlasMaskImage=FilterUtils<ImageType>::NNResample(this->m_atlasMaskImage,this->m_scale,false);                
+                    this->m_scaledAtlasMaskImage=this->getScaledImage(NULL,this->m_atlasMaskPyramid,this->m_atlasMaskImage,true);                
                 }
                
                           
@@ -2191,8 +2756,8 @@ namespace SRS{
             assert(this->m_targetSheetness);
             assert(this->m_atlasSegmentation);
             if (this->m_scale!=1.0){
-                this->m_scaledTargetImage=FilterUtils<ImageType>::LinearResample((this->m_targetImage),this->m_scale,true);
-                this->m_scaledAtlasImage=FilterUtils<ImageType>::LinearResample((this->m_atlasImage),this->m_scale,true);
+                this->m_scaledTargetImage=this->getScaledImage(this->m_sharedTargetPyramid,this->m_targetPyramid,this->m_targetImage,false);
+                this->m_scaledAtlasImage=this->getScaledImage(this->m_sharedAtlasPyramid,this->m_atlasPyramid,this->m_atlasImage,false);
                 this->m_scaledAtlasSegmentation=FilterUtils<ImageType>::NNResample((m_atlasSegmentation),this->m_scale,false);
                 this->m_scaledTargetSheetness=FilterUtils<ImageType>::LinearResample((m_targetSheetness),this->m_scale,true);
             }
@@ -2452,8 +3017,8 @@ namespace SRS{
             assert(this->m_targetSheetness);
             assert(this->m_atlasSegmentation);
             if (this->m_scale!=1.0){
-                this->m_scaledTargetImage=FilterUtils<ImageType>::LinearResample((this->m_targetImage),this->m_scale,true);
-                this->m_scaledAtlasImage=FilterUtils<ImageType>::LinearResample((this->m_atlasImage),this->m_scale,true);
+                this->m_scaledTargetImage=this->getScaledImage(this->m_sharedTargetPyramid,this->m_targetPyramid,this->m_targetImage,false);
+                this->m_scaledAtlasImage=this->getScaledImage(this->m_sharedAtlasPyramid,this->m_atlasPyramid,this->m_atlasImage,false);
                 this->m_scaledAtlasSegmentation=FilterUtils<ImageType>::NNResample((m_atlasSegmentation),this->m_scale);
                 this->m_scaledTargetSheetness=FilterUtils<ImageType>::LinearResample((m_targetSheetness),this->m_scale,true);
             }
@@ -16,6 +16,7 @@
 #include "itkObjectFactory.h"
 #include <utility>
 #include <itkStatisticsImageFilter.h>
+#include "PotentialCache.h"
 
 namespace SRS{
 
@@ -49,6 +50,8 @@ namespace SRS{
     //typedef VariableLengthVector< unsigned char > RGBPixelType;
     typedef typename itk::Image<RGBPixelType,D > RGBImageType;
     typedef typename RGBImageType::Pointer RGBImagePointerType;
+    typedef typename ImageUtils<ImageType>::FloatImageType FloatImageType;
+    typedef typename ImageUtils<ImageType>::FloatImagePointerType FloatImagePointerType;
         
   protected:
     ImageConstPointerType m_targetImage, m_targetGradient,m_atlasImage, m_atlasGradient;
@@ -63,12 +66,16 @@ namespace SRS{
     ImageConstPointerType m_targetAnatomyPrior;
     bool m_useTargetAnatomyPrior;
     int m_nSegmentationLabels;
+    PotentialCache m_probabilityCache;
   public:
         
     /** Method for creation through the object factory. */
     itkNewMacro(Self);
     /** Standard part of every itk Object. */
     itkTypeMacro(UnaryPotentialSegmentation, Object);
+    ///persistent cache of the classifier probability images computed in Init.
+    ///its key has to cover the training and target images and the classifier configuration
+    void SetProbabilityCache(const PotentialCache & cache){m_probabilityCache=cache;}
     void SetTargetAnatomyPrior(ImageConstPointerType img){m_targetAnatomyPrior=img;}
     void SetUseTargetAnatomyPrior(bool b){
       m_useTargetAnatomyPrior=b;
@@ -144,6 +151,61 @@ namespace SRS{
     virtual void SetAtlasImage(ImageConstPointerType im){
       m_atlasImage=im;
     }
+  protected:
+    ///loads the probability images of the cache key, returns false if they are not cached.
+    ///metadata: number of images, then size, spacing, origin and direction of their common geometry
+    bool loadProbabilityImages(std::vector<FloatImagePointerType> & images){
+      std::vector<float> table;
+      std::vector<double> meta;
+      if (!m_probabilityCache.load("classifierProbabilities",m_probabilityCache.getKey(),table,meta) || meta.size()!=1+3*D+D*D)
+        return false;
+      typename FloatImageType::RegionType region;
+      typename FloatImageType::SizeType size;
+      typename FloatImageType::PointType origin;
+      typename FloatImageType::SpacingType spacing;
+      typename FloatImageType::DirectionType direction;
+      size_t nPixels=1;
+      for (unsigned int d=0;d<D;++d){
+        size[d]=(long unsigned int)meta[1+d];
+        spacing[d]=meta[1+D+d];
+        origin[d]=meta[1+2*D+d];
+        for (unsigned int e=0;e<D;++e)
+          direction[d][e]=meta[1+3*D+d*D+e];
+        nPixels*=size[d];
+      }
+      int nImages=(int)meta[0];
+      if (nImages<=0 || table.size()!=(size_t)nImages*nPixels)
+        return false;
+      region.SetSize(size);
+      images=std::vector<FloatImagePointerType>(nImages);
+      for (int i=0;i<nImages;++i){
+        images[i]=ImageUtils<FloatImageType>::createEmpty(region,origin,spacing,direction);
+        memcpy(images[i]->GetBufferPointer(),&table[(size_t)i*nPixels],nPixels*sizeof(float));
+      }
+      LOGV(1)<<"Loaded classifier probabilities from "<<m_probabilityCache.filename("classifierProbabilities",m_probabilityCache.getKey())<<std::endl;
+      return true;
+    }
+    ///stores probability images of a common geometry for the cache key
+    void storeProbabilityImages(const std::vector<FloatImagePointerType> & images){
+      if (!m_probabilityCache.enabled() || !images.size())
+        return;
+      size_t nPixels=images[0]->GetLargestPossibleRegion().GetNumberOfPixels();
+      std::vector<double> meta(1+3*D+D*D);
+      meta[0]=images.size();
+      for (unsigned int d=0;d<D;++d){
+        meta[1+d]=images[0]->GetLargestPossibleRegion().GetSize()[d];
+        meta[1+D+d]=images[0]->GetSpacing()[d];
+        meta[1+2*D+d]=images[0]->GetOrigin()[d];
+        for (unsigned int e=0;e<D;++e)
+          meta[1+3*D+d*D+e]=images[0]->GetDirection()[d][e];
+      }
+      std::vector<float> table(images.size()*nPixels);
+      for (size_t i=0;i<images.size();++i){
+        memcpy(&table[i*nPixels],images[i]->GetBufferPointer(),nPixels*sizeof(float));
+      }
+      m_probabilityCache.store("classifierProbabilities",m_probabilityCache.getKey(),table,meta);
+    }
+  public:
     virtual double getPotential(IndexType targetIndex, int segmentationLabel){
       int s= this->m_targetGradient->GetPixel(targetIndex);
       double imageIntensity=this->m_targetImage->GetPixel(targetIndex);
@@ -585,6 +647,9 @@ namespace SRS{
     virtual void Init(){
       m_trainOnTargetROI=true;
       LOG<<VAR(m_trainOnTargetROI)<<std::endl;
+      //getPotential only reads the probability images, training is not needed if they are cached
+      if (this->loadProbabilityImages(m_probabilityImages))
+        return;
       m_classifier=  ClassifierType::New();
       m_classifier->setNSegmentationLabels(2);
       std::vector<ImageConstPointerType> atlas;
@@ -600,6 +665,7 @@ namespace SRS{
       target.push_back(this->m_targetImage);
       //            target.push_back(this->m_targetGradient);
       m_probabilityImages=m_classifier->evalImage(target);
+      this->storeProbabilityImages(m_probabilityImages);
     }
     virtual void ResamplePotentials(double scale){
       m_resampledProbImages= std::vector<FloatImagePointerType>(m_probabilityImages.size());
@@ -649,6 +715,9 @@ namespace SRS{
     virtual void Init(){
       m_trainOnTargetROI=true;
       LOG<<VAR(m_trainOnTargetROI)<<std::endl;
+      //getPotential only reads the probability images, training is not needed if they are cached
+      if (this->loadProbabilityImages(m_probabilityImages))
+        return;
       m_classifier=ClassifierType::New();
       m_classifier->setNSegmentationLabels(max(2,this->m_nSegmentationLabels));
       if (this->m_atlasImage.IsNotNull()){
@@ -681,6 +750,7 @@ namespace SRS{
 
 
       }
+      this->storeProbabilityImages(m_probabilityImages);
     }
     virtual void ResamplePotentials(double scale){
       m_resampledProbImages= std::vector<FloatImagePointerType>(m_probabilityImages.size());
@@ -742,7 +812,11 @@ namespace SRS{
       std::vector<ImageConstPointerType> target;
       target.push_back(this->m_targetImage);
       //            target.push_back(this->m_targetGradient);
-      LOGI(10,m_probabilityImages=m_classifier->evalImage(target));
+      //getPotential evaluates the trained classifier, only the evaluation of the target is cached
+      if (!this->loadProbabilityImages(m_probabilityImages)){
+        LOGI(10,m_probabilityImages=m_classifier->evalImage(target));
+        this->storeProbabilityImages(m_probabilityImages);
+      }
 
     }
     virtual void ResamplePotentials(double scale){
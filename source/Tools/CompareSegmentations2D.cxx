@@ -17,6 +17,7 @@
 #include <itkLabelOverlapMeasuresImageFilter.h>
 #include "mmalloc.h"
 #include "SegmentationMapper.hxx"
+#include "SegmentationTools.hxx"
 using namespace std;
 
 const unsigned int D=2;
@@ -47,6 +48,7 @@ int main(int argc, char * argv [])
     double threshold=1;
     int evalLabel=1;
     bool connectedComponent=false;
+    bool singlePass=false;
     int labelsToEvaluate=1;
 	as.parameter ("g", groundTruth, "groundtruth image (file name)", true);
 	as.parameter ("s", segmentationFilename, "segmentation image (file name)", true);
@@ -56,6 +58,7 @@ int main(int argc, char * argv [])
 	as.parameter ("labelsToEvaluate", labelsToEvaluate, "labels to evaluate", false);
     as.option ("h", hausdorff, "compute hausdorff distance(0,1)");
 	as.option ("l", connectedComponent, "use largest connected component in segmentation");
+    as.option ("singlePass", singlePass, "evaluate all labels in one pass over the images; Mean/MaxAbs are symmetric surface distances [not with -l]");
 	as.parse();
 	
 
@@ -65,6 +68,27 @@ int main(int argc, char * argv [])
     LabelImage::Pointer segmentedImg =
         ImageUtils<LabelImage>::readImage(segmentationFilename);
 
+    if (singlePass && !connectedComponent){
+        //labels are given as indices into the sorted list of ground truth labels
+        SegmentationMapper<LabelImage> groundTruthMapper;
+        groundTruthMapper.FindMap(groundTruthImg);
+        std::vector<Label> evalLabels;
+        for (int l=0;l<labelsToEvaluate;++l){
+            evalLabels.push_back(groundTruthMapper.GetInverseMappedLabel(evalLabel+l));
+        }
+        std::vector<SegmentationTools<LabelImage>::OverlapScores> scores=SegmentationTools<LabelImage>::evaluateMultilabel(groundTruthImg,segmentedImg,hausdorff,evalLabels).scores;
+        for (unsigned int e=0;e<scores.size();++e){
+            std::cout<<"Label "<<scores[e].labelID ;
+            std::cout<<" Dice " << scores[e].dice ;
+            if (hausdorff){
+                std::cout<<" Mean "<< scores[e].MSD;
+                std::cout<<" MaxAbs "<< scores[e].HD<<" ";
+            }
+            std::cout<<endl;
+        }
+        return EXIT_SUCCESS;
+    }
+
     SegmentationMapper<LabelImage> segmentationMapper;
     groundTruthImg=segmentationMapper.FindMapAndApplyMap(groundTruthImg);
     segmentedImg=segmentationMapper.ApplyMap(segmentedImg);
@@ -17,6 +17,7 @@
 #include <itkLabelOverlapMeasuresImageFilter.h>
 #include "mmalloc.h"
 #include "SegmentationMapper.hxx"
+#include "SegmentationTools.hxx"
 using namespace std;
 
 const unsigned int D=3;
@@ -59,6 +60,7 @@ int main(int argc, char * argv [])
     double threshold=1;
     int evalLabel=-1;
     bool connectedComponent=false;
+    bool singlePass=false;
     int labelsToEvaluate=-1;
     int verbose=0;
     string labelList="";
@@ -78,6 +80,7 @@ int main(int argc, char * argv [])
     as.option ("excludeMissing", excludeMissing, "exclude labels missing from segmentation estimate");
     as.option ("h", hausdorff, "compute hausdorff distance(0,1)");
 	as.option ("l", connectedComponent, "use largest connected component in segmentation");
+    as.option ("singlePass", singlePass, "evaluate all labels in one pass over the images; Mean/MaxAbs are symmetric surface distances [not with -l]");
 	as.option ("r", resampleIfNeeded, "resample input seg to GT seg if necessary");
 	as.parameter ("v", verbose, "verbosity level", false);
 
@@ -126,6 +129,46 @@ int main(int argc, char * argv [])
         return 1;
     }
 
+    if (singlePass && !connectedComponent){
+        std::vector<Label> evalLabels;
+        if (labelList!=""){
+            ifstream ifs(labelList.c_str());
+            int tmp;
+            while (ifs>>tmp){
+                if (tmp!=0) evalLabels.push_back(tmp);
+            }
+            ifs.close();
+        }else if (evalLabel>0){
+            //single labels are given as indices into the sorted list of ground truth labels
+            SegmentationMapper<LabelImage> groundTruthMapper;
+            groundTruthMapper.FindMap(groundTruthImg);
+            evalLabels.push_back(groundTruthMapper.GetInverseMappedLabel(evalLabel));
+        }
+        typedef SegmentationTools<LabelImage>::MultilabelEvaluation EvaluationType;
+        EvaluationType evaluation=SegmentationTools<LabelImage>::evaluateMultilabel(groundTruthImg,segmentedImg,hausdorff,evalLabels);
+        int nLabels=evaluation.labels.size();
+        for (unsigned int e=0;e<evaluation.scores.size();++e){
+            if (excludeMissing){
+                long int segCount=0;
+                for (int l=0;l<nLabels;++l){
+                    if (evaluation.labels[l]==evaluation.scores[e].labelID){
+                        for (int g=0;g<nLabels;++g) segCount+=evaluation.confusion[g*nLabels+l];
+                    }
+                }
+                if (!segCount) continue;
+            }
+            std::cout<<" Label "<< evaluation.scores[e].labelID;
+            std::cout<<" Dice " << evaluation.scores[e].dice ;
+            if (hausdorff){
+                std::cout<<" Mean "<< evaluation.scores[e].MSD;
+                std::cout<<" MaxAbs "<< evaluation.scores[e].HD<<" ";
+            }
+            std::cout<<endl;
+        }
+        std::cout<< std::endl;
+        return EXIT_SUCCESS;
+    }
+
     std::vector<int> listOfLabels;
     SegmentationMapper<LabelImage> segmentationMapper;
         
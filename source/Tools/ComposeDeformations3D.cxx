@@ -7,6 +7,7 @@
 #include <itkWarpImageFilter.h>
 
 #include "TransformationUtils.h"
+#include "TiledImageUtils.h"
 
 
 using namespace std;
@@ -29,6 +30,16 @@ int main(int argc, char ** argv)
     typedef Image<LabelType,D> LabelImageType;
     typedef LabelImageType::Pointer LabelImagePointerType;
     typedef ImageType::IndexType IndexType;
+
+    //optional trailing "-tileMB <budget>" composes the fields slab by slab from and to disk
+    if (argc > 5 && string(argv[argc-2]) == "-tileMB"){
+        double tileMB=atof(argv[argc-1]);
+        argc-=2;
+        std::vector<string> fields(argv+1,argv+argc-1);
+        TiledImageUtils<ImageType>::composeDeformations(fields,argv[argc-1],tileMB);
+        LOG<<"deformed image "<<argv[1]<<endl;
+        return 1;
+    }
     
     LabelImagePointerType deformation1 = ImageUtils<LabelImageType>::readImage(argv[1]);
 
@@ -8,6 +8,7 @@
 #include <itkWarpImageFilter.h>
 #include <fstream>
 #include "Metrics.h"
+#include "TiledImageUtils.h"
 
 #include <itkInverseDisplacementFieldImageFilter.h>
 #include "itkVectorLinearInterpolateImageFunction.h"
@@ -48,6 +49,7 @@ int main(int argc, char ** argv)
     string metricName="NCC";
     enum MetricType {NONE,MAD,NCC,MI,NMI,MSD};
     double m_gamma;
+    double tileMB=0;
     
     as->parameter ("in", inFile, " filename...", true);
     as->parameter ("in2", inFile2, " filename...", true);
@@ -56,6 +58,7 @@ int main(int argc, char ** argv)
     as->parameter ("metric", metricName,"metric to be used for global or local weighting, valid: NONE,SAD,MSD,NCC,MI,NMI",false);
     as->parameter ("gamma", m_gamma,"scaling",false);
     as->parameter ("radius", radius,"patch radius for local metrics",false);
+    as->parameter ("tileMB", tileMB,"memory budget in MB for computing the metric slab by slab from and to disk, 0 computes it in memory",false);
 
 
     as->parse();
@@ -80,6 +83,16 @@ int main(int argc, char ** argv)
             LOG<<"don't understand "<<metricName<<", defaulting to NONE"<<endl;
             metric=NONE;
         }
+    if (tileMB>0){
+        typedef TiledMetrics<ImageType,FloatImageType> TiledMetricsType;
+        TiledMetricsType::LocalMetricType tiledMetric=TiledMetricsType::LNCC;
+        if (metric==MSD)
+            tiledMetric=TiledMetricsType::LSSD;
+        else if (metric==MAD)
+            tiledMetric=TiledMetricsType::LSAD;
+        TiledMetricsType::localSimilarity(inFile,inFile2,defFile,outFile,tiledMetric,radius,m_gamma,tileMB);
+        return 1;
+    }
     ImagePointerType img1 = ImageUtils<ImageType>::readImage(inFile);
     ImagePointerType img2 = ImageUtils<ImageType>::readImage(inFile2);
 
@@ -5,6 +5,7 @@
 #include "ArgumentParser.h"
 #include "ImageUtils.h"
 #include "TransformationUtils.h"
+#include "TiledImageUtils.h"
 #include <itkWarpImageFilter.h>
 
 
@@ -35,13 +36,21 @@ int main(int argc, char ** argv)
     string moving,target="",def,output;
     bool NN=false;
     bool linear = false;
+    double tileMB=0;
     as->parameter ("moving", moving, " filename of moving image", true);
     as->parameter ("target", target, " filename of target image", false);
     as->parameter ("def", def, " filename of deformation", true);
     as->parameter ("out", output, " output filename", true);
     as->option ("NN", NN," use NN interpolation of image");
     as->option ("linear", linear," use linear interpolation of deformation field");
+    as->parameter ("tileMB", tileMB," memory budget in MB for warping the image slab by slab from and to disk, 0 warps the whole image in memory", false);
     as->parse();
+
+    if (tileMB>0){
+        LOG<<"Performing tiled "<<(NN?"NN":"linear")<<" interpolation"<<endl;
+        TiledImageUtils<ImageType,Displacement>::warpImage(moving,def,output,tileMB,NN,target,linear);
+        return 1;
+    }
     
     ImagePointerType image = ImageUtils<ImageType>::readImage(moving);
     LabelImagePointerType deformation = ImageUtils<LabelImageType>::readImage(def);
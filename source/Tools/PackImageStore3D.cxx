@@ -0,0 +1,124 @@
+#include "Log.h"
+
+#include <stdio.h>
+#include <iostream>
+#include <fstream>
+#include "ArgumentParser.h"
+#include "ImageUtils.h"
+#include "ImageStore.h"
+
+
+using namespace std;
+using namespace itk;
+
+
+///pack all files of an image list (<id> <file>) into the store, keyed by filename
+template<class ImageType>
+int packImageList(ImageStoreWriter & writer, string listFilename){
+    ifstream ifs(listFilename.c_str());
+    if (!ifs){
+        LOG<<"could not read "<<listFilename<<endl;
+        exit(0);
+    }
+    int c=0;
+    while (!ifs.eof()){
+        string id,filename;
+        ifs >> id;
+        if (id!=""){
+            ifs >> filename;
+            LOGV(2)<<"Packing image "<<filename<<" with ID "<<id<<endl;
+            if (!writer.add<ImageType>(filename,ImageUtils<ImageType>::readImage(filename)))
+                exit(-1);
+            ++c;
+        }
+    }
+    return c;
+}
+
+///pack all files of a deformation list (<sourceID> <targetID> <file>) into the store, keyed by filename
+template<class DeformationFieldType>
+int packDeformationList(ImageStoreWriter & writer, string listFilename){
+    ifstream ifs(listFilename.c_str());
+    if (!ifs){
+        LOG<<"could not read "<<listFilename<<endl;
+        exit(0);
+    }
+    int c=0;
+    while (!ifs.eof()){
+        string sourceID,targetID,filename;
+        ifs >> sourceID;
+        if (sourceID!=""){
+            ifs >> targetID;
+            ifs >> filename;
+            LOGV(2)<<"Packing deformation "<<filename<<" from "<<sourceID<<" to "<<targetID<<endl;
+            if (!writer.add<DeformationFieldType>(filename,ImageUtils<DeformationFieldType>::readImage(filename)))
+                exit(-1);
+            ++c;
+        }
+    }
+    return c;
+}
+
+///pack image and segmentation lists with the pixel type of the application that will read the store
+template<class PixelType>
+int packImages(ImageStoreWriter & writer, string imageFileList, string segmentationFileList){
+    typedef Image<PixelType,3> ImageType;
+    int c=0;
+    if (imageFileList!="")
+        c+=packImageList<ImageType>(writer,imageFileList);
+    if (segmentationFileList!="")
+        c+=packImageList<ImageType>(writer,segmentationFileList);
+    return c;
+}
+
+int main(int argc, char ** argv)
+{
+	feraiseexcept(FE_INVALID|FE_DIVBYZERO|FE_OVERFLOW);
+    const unsigned int D=3;
+    typedef Image<Vector<float,D>,D> FloatDeformationFieldType;
+    typedef Image<Vector<double,D>,D> DoubleDeformationFieldType;
+
+    ArgumentParser * as=new ArgumentParser(argc,argv);
+    string imageFileList="",segmentationFileList="",deformationFileList="",output,deformationPrecision="float",pixelType="short";
+    int verbose=0;
+    as->parameter ("i", imageFileList, " list of images <id> <file>", false);
+    as->parameter ("A", segmentationFileList, " list of segmentations <id> <file>", false);
+    as->parameter ("T", deformationFileList, " list of deformations <sourceID> <targetID> <file>", false);
+    as->parameter ("pixelType", pixelType, " pixel type the images and segmentations are stored as, has to match the reading application {uchar,short,ushort,float}", false);
+    as->parameter ("deformationPrecision", deformationPrecision, " component type the deformations are stored as, has to match the reading application {float,double}", false);
+    as->parameter ("out", output, " output filename of image store", true);
+    as->parameter ("verbose", verbose,"get verbose output",false);
+    as->parse();
+    logSetVerbosity(verbose);
+
+    if (pixelType!="uchar" && pixelType!="short" && pixelType!="ushort" && pixelType!="float"){
+        LOG<<"unknown pixel type "<<pixelType<<", has to be one of {uchar,short,ushort,float}"<<endl;
+        exit(0);
+    }
+    if (deformationPrecision!="float" && deformationPrecision!="double"){
+        LOG<<"unknown deformation precision "<<deformationPrecision<<", has to be one of {float,double}"<<endl;
+        exit(0);
+    }
+
+    ImageStoreWriter writer(output);
+    if (!writer.isOpen())
+        exit(-1);
+    int nImages=0,nDeformations=0;
+    if (pixelType=="uchar")
+        nImages=packImages<unsigned char>(writer,imageFileList,segmentationFileList);
+    else if (pixelType=="ushort")
+        nImages=packImages<unsigned short>(writer,imageFileList,segmentationFileList);
+    else if (pixelType=="float")
+        nImages=packImages<float>(writer,imageFileList,segmentationFileList);
+    else
+        nImages=packImages<short>(writer,imageFileList,segmentationFileList);
+    if (deformationFileList!=""){
+        if (deformationPrecision=="double")
+            nDeformations=packDeformationList<DoubleDeformationFieldType>(writer,deformationFileList);
+        else
+            nDeformations=packDeformationList<FloatDeformationFieldType>(writer,deformationFileList);
+    }
+    writer.close();
+    LOG<<"Packed "<<nImages<<" "<<pixelType<<" images and "<<nDeformations<<" "<<deformationPrecision<<" deformations into "<<output<<endl;
+	return 1;
+}